@@ -0,0 +1,151 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_admit.h"
+#include "cache_ident.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define ADMIT_ROWS 4
+#define ADMIT_MIN_WIDTH 1024        /* Counters per row */
+#define ADMIT_MAX_WIDTH (1u << 26)
+#define ADMIT_WIDTH_FACTOR 4        /* Counters per row for each fetch between halvings */
+#define COUNTERS_PER_WORD 16        /* 4-bit counters in a 64-bit word */
+#define COUNTER_MAX 15
+
+struct cache_admit {
+    size_t mask;                    /* Counters per row, minus one */
+    size_t row_words;
+    _Atomic uint64_t *table;        /* ADMIT_ROWS rows of row_words words */
+
+    size_t sample;                  /* Fetches recorded between halvings */
+    atomic_size_t additions;
+    pthread_mutex_t reset_lock;
+};
+
+int cache_admit_parse(const char *name, cache_admit_policy_t *policy_out)
+{
+    if (name == NULL) {
+        return -1;
+    }
+    if (strcmp(name, "all") == 0) {
+        *policy_out = CACHE_ADMIT_ALL;
+        return 0;
+    }
+    if (strcmp(name, "tinylfu") == 0) {
+        *policy_out = CACHE_ADMIT_TINYLFU;
+        return 0;
+    }
+    return -1;
+}
+
+cache_admit_t *cache_admit_create(size_t capacity)
+{
+    /* Sparse enough that a block fetched once rarely finds all its
+       counters raised by others: the window is about as many fetches as
+       the cache holds blocks */
+    size_t width = ADMIT_MIN_WIDTH;
+    while (width < capacity * ADMIT_WIDTH_FACTOR && width < ADMIT_MAX_WIDTH) {
+        width *= 2;
+    }
+
+    cache_admit_t *adm = calloc(1, sizeof(cache_admit_t));
+    if (adm == NULL) {
+        return NULL;
+    }
+    adm->mask = width - 1;
+    adm->row_words = width / COUNTERS_PER_WORD;
+    adm->table = calloc(ADMIT_ROWS * adm->row_words, sizeof(uint64_t));
+    if (adm->table == NULL) {
+        free(adm);
+        return NULL;
+    }
+    adm->sample = width / ADMIT_WIDTH_FACTOR;
+    atomic_init(&adm->additions, 0);
+    pthread_mutex_init(&adm->reset_lock, NULL);
+    return adm;
+}
+
+/* Increments a counter unless saturated; returns its new value */
+static unsigned increment(_Atomic uint64_t *word, unsigned shift)
+{
+    uint64_t w = atomic_load_explicit(word, memory_order_relaxed);
+    while (1) {
+        unsigned count = (w >> shift) & COUNTER_MAX;
+        if (count == COUNTER_MAX) {
+            return count;
+        }
+        if (atomic_compare_exchange_weak_explicit(word, &w, w + ((uint64_t)1 << shift),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            return count + 1;
+        }
+    }
+}
+
+/* Halves every counter. Increments racing with this may be lost, which
+   only makes the estimates a little lower. */
+static void halve(cache_admit_t *adm)
+{
+    for (size_t i = 0; i < ADMIT_ROWS * adm->row_words; i++) {
+        uint64_t w = atomic_load_explicit(&adm->table[i], memory_order_relaxed);
+        atomic_store_explicit(&adm->table[i], (w >> 1) & 0x7777777777777777ULL,
+                              memory_order_relaxed);
+    }
+}
+
+unsigned cache_admit_record(cache_admit_t *adm, uint64_t file_key, size_t block_idx)
+{
+    /* One 64-bit hash split in two gives the row indexes by double hashing */
+    uint64_t h = cache_ident_mix(file_key ^ cache_ident_mix((uint64_t)block_idx + 1));
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+
+    unsigned estimate = COUNTER_MAX;
+    for (unsigned r = 0; r < ADMIT_ROWS; r++) {
+        size_t c = (h1 + r * h2) & adm->mask;
+        _Atomic uint64_t *word = &adm->table[r * adm->row_words + c / COUNTERS_PER_WORD];
+        unsigned count = increment(word, (c % COUNTERS_PER_WORD) * 4);
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+
+    size_t n = atomic_fetch_add_explicit(&adm->additions, 1, memory_order_relaxed) + 1;
+    if (n >= adm->sample && pthread_mutex_trylock(&adm->reset_lock) == 0) {
+        if (atomic_load_explicit(&adm->additions, memory_order_relaxed) >= adm->sample) {
+            halve(adm);
+            atomic_fetch_sub_explicit(&adm->additions, adm->sample / 2, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&adm->reset_lock);
+    }
+    return estimate;
+}
+
+void cache_admit_destroy(cache_admit_t *adm)
+{
+    if (adm == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&adm->reset_lock);
+    free(adm->table);
+    free(adm);
+}
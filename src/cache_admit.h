@@ -0,0 +1,81 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_ADMIT_H
+#define CACHE_ADMIT_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * TinyLFU admission filter for the block cache.
+ *
+ * A count-min sketch estimates how often each block was fetched from
+ * the backend recently: four rows of 4-bit saturating counters, each
+ * indexed by its own hash of the block. Every fetch increments the
+ * block's counters and returns the smallest of them, which can only
+ * overestimate. After about as many fetches as the cache holds blocks,
+ * all counters are halved, so the estimate follows a sliding window and
+ * a block read once by last night's backup soon counts for nothing.
+ *
+ * Rows are four times as wide as that window, so a block fetched once
+ * seldom looks popular: the sketch takes 8 to 16 bytes per block the
+ * cache can hold. Updates are lock-free.
+ */
+
+typedef enum {
+    CACHE_ADMIT_ALL,            /* Store every fetched block */
+    CACHE_ADMIT_TINYLFU         /* Store blocks fetched repeatedly */
+} cache_admit_policy_t;
+
+/* Opaque filter handle */
+typedef struct cache_admit cache_admit_t;
+
+/**
+ * Parse an admission policy name: "all" or "tinylfu".
+ * @param name Policy name
+ * @param policy_out Policy
+ * @return 0 on success, -1 if the name is unknown
+ */
+int cache_admit_parse(const char *name, cache_admit_policy_t *policy_out);
+
+/**
+ * Create a filter sized for a cache.
+ * @param capacity Number of blocks the cache can hold
+ * @return Filter handle or NULL on error
+ */
+cache_admit_t *cache_admit_create(size_t capacity);
+
+/**
+ * Record a backend fetch of a block and estimate how often it was
+ * fetched recently, this time included.
+ * @param adm Filter handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @return Estimated fetches, at most 15
+ */
+unsigned cache_admit_record(cache_admit_t *adm, uint64_t file_key, size_t block_idx);
+
+/**
+ * Free a filter.
+ * @param adm Filter handle (can be NULL)
+ */
+void cache_admit_destroy(cache_admit_t *adm);
+
+#endif /* CACHE_ADMIT_H */
@@ -0,0 +1,106 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_BITMAP_H
+#define CACHE_BITMAP_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Per-block validity bitmaps.
+ *
+ * A block is divided into 64 granules and bit i of the bitmap is set when
+ * granule i holds valid file data. A block that ends the file (eof) has a
+ * known length, and its last granule counts as complete even if short.
+ */
+
+#define CACHE_BITMAP_GRANULES 64
+
+/* Granule size for a block size */
+static inline size_t cache_bitmap_granule(size_t block_size)
+{
+    return (block_size + CACHE_BITMAP_GRANULES - 1) / CACHE_BITMAP_GRANULES;
+}
+
+/* Bits for granules [first, end) */
+static inline uint64_t cache_bitmap_bits(size_t first, size_t end)
+{
+    if (end > CACHE_BITMAP_GRANULES) {
+        end = CACHE_BITMAP_GRANULES;
+    }
+    if (first >= end) {
+        return 0;
+    }
+    uint64_t below_end = end >= 64 ? ~0ULL : ((1ULL << end) - 1);
+    return below_end & ~((1ULL << first) - 1);
+}
+
+/* Granules completely covered by bytes [offset, offset + len) of a block */
+static inline uint64_t cache_bitmap_covered(size_t granule, size_t offset, size_t len, bool eof)
+{
+    size_t first = (offset + granule - 1) / granule;
+    size_t end = eof ? (offset + len + granule - 1) / granule : (offset + len) / granule;
+    return cache_bitmap_bits(first, end);
+}
+
+/* Granules touched by bytes [offset, offset + len) of a block */
+static inline uint64_t cache_bitmap_overlap(size_t granule, size_t offset, size_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    return cache_bitmap_bits(offset / granule, (offset + len + granule - 1) / granule);
+}
+
+/**
+ * Clip a read against a block and check that it is fully valid.
+ * @param granule Granule size
+ * @param valid Validity bitmap of the block
+ * @param length Bytes of data in the block (exact if eof)
+ * @param eof true if the block ends the file
+ * @param offset Offset within block
+ * @param size Requested bytes, clipped to the end of file on return
+ * @return true if the (clipped) range can be served from the block
+ */
+static inline bool cache_bitmap_check(size_t granule,
+                                      uint64_t valid,
+                                      size_t length,
+                                      bool eof,
+                                      size_t offset,
+                                      size_t *size)
+{
+    if (eof) {
+        if (offset >= length) {
+            *size = 0;
+            return true;
+        }
+        if (offset + *size > length) {
+            *size = length - offset;
+        }
+    } else if (offset + *size > length) {
+        return false;
+    }
+
+    uint64_t needed = cache_bitmap_overlap(granule, offset, *size);
+    return (needed & ~valid) == 0;
+}
+
+#endif /* CACHE_BITMAP_H */
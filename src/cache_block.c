@@ -18,6 +18,15 @@
 */
 
 #include "cache_block.h"
+#include "cache_index.h"
+#include "cache_mem.h"
+#include "cache_fd.h"
+#include "cache_bitmap.h"
+#include "cache_digest.h"
+#include "cache_compress.h"
+#include "cache_stats.h"
+#include "cache_crc.h"
+#include "cache_share.h"
 #include "debug.h"
 
 #include <stdlib.h>
@@ -30,44 +39,151 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <dirent.h>
-#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Eviction watermarks, in percent of max_cache_size */
+#define EVICT_HIGH_WATERMARK 95  /* Wake the evictor above this */
+#define EVICT_LOW_WATERMARK 90   /* Evict down to this */
+
+#define INDEX_SYNC_INTERVAL 5    /* Seconds between access time write-backs */
+
+#define INVAL_SLOTS 1024         /* Invalidation counters, indexed by file key */
+
+#define FD_CACHE_MAX 1024        /* Upper bound on cached block-file fds */
+
+#define FILL_SHARDS 64           /* Lock shards of the in-flight fill table */
+
+#define DEDUP_KEY_NAME "dedup.key"
+
+#define COMPRESS_MIN_SAVING 8    /* Store raw unless compression saves 1/8 */
+
+#define STORE_LOCKS 256          /* Lock stripes serializing the stores of a block */
+
+#define CHECKPOINT_INTERVAL 60   /* Seconds between syncs recorded as checkpoints */
+
+#define TMP_DIR_NAME "tmp"       /* Under blocks/: files being written, emptied at startup */
+
+#define TAKEOVER_INTERVAL 1      /* Seconds between attempts to take over a shared store */
+
+/* A block being fetched from the backend by one thread */
+struct block_fill {
+    uint64_t file_key;
+    size_t block_idx;
+    bool done;
+    int refs;                   /* Filler plus waiters */
+    struct block_fill *next;
+};
+
+struct fill_shard {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Broadcast when a fill in this shard ends */
+    struct block_fill *head;
+};
+
+/* A shared store a mount is attached to (cache_block_init_shared()) */
+struct block_share {
+    char *dir;
+    char *socket_path;
+    int lock_fd;                /* flock()ed by the mount that owns the store */
+    _Atomic(cache_block_ctx_t *) store;   /* Opened here once this mount owns it */
+    cache_share_server_t *server;
+    cache_share_peer_t *peer;   /* Calls to the owner until then */
+    pthread_mutex_t takeover_lock;
+    time_t next_takeover;
+
+    /* For opening the store */
+    size_t max_cache_size;
+    size_t mem_cache_size;
+    bool dedup;
+    cache_codec_t codec;
+    int codec_level;
+};
 
 /* Block cache context */
 struct cache_block_ctx {
     char *blocks_dir;
+    char *tmp_dir;              /* Block files are written here, then renamed into place */
     size_t block_size;
+    size_t granule;             /* Validity bitmap granule size */
     size_t max_cache_size;
-    size_t current_cache_size;  /* Current total cache size */
+    cache_index_t *index;       /* Block index; owns size accounting */
+    cache_mem_t *mem;           /* Optional RAM tier in front of the disk tier */
+    cache_fd_t *fds;            /* Open block files */
+    cache_fd_t *chunk_fds;      /* Open shared content files, keyed by digest */
+    bool dedup;                 /* Store complete blocks once per content */
+    cache_digest_key_t digest_key;
+    atomic_uint_fast64_t tmp_seq;   /* Names temporary files */
+    cache_codec_t codec;        /* Compression of complete blocks */
+    int codec_level;
     bool debug;
+
+    /* Bumped by invalidations, so a block demoted from RAM after it was
+       invalidated is not written to disk with stale contents. File-wide
+       invalidations bump file_seq, range invalidations bump block_seq. */
+    atomic_uint_fast32_t file_seq[INVAL_SLOTS];
+    atomic_uint_fast32_t block_seq[INVAL_SLOTS];
+
+    /* Misses being fetched, so concurrent readers wait instead of all
+       reading the same block from the backend */
+    struct fill_shard fills[FILL_SHARDS];
+
+    /* Held from reading a block file to indexing its replacement, so two
+       stores merging into one block never lose each other's granules */
+    pthread_mutex_t store_locks[STORE_LOCKS];
+
+    /* Background check of the blocks an unclean shutdown may have left
+       torn. Checkpoints wait for it, so a crash meanwhile checks them again. */
+    pthread_t scrub_thread;
+    bool scrub_started;
+    cache_index_entry_t *scrub_entries;
+    size_t scrub_count;
+    atomic_bool scrub_stop;
+    atomic_bool scrub_done;
+
+    /* Used by the evictor thread only */
+    time_t next_checkpoint;
+    uint64_t checkpointed;      /* Generation of the last checkpoint */
+
+    /* Background evictor */
+    pthread_t evict_thread;
+    pthread_mutex_t evict_lock;
+    pthread_cond_t evict_cond;
+    bool evict_pending;
+    bool evict_stop;
+
+    /* Set in a handle attached to a shared store, which only forwards
+       calls: to its own store if it owns it, else to the owner */
+    struct block_share *share;
 };
 
-/* Hash function for path (simple DJB2) */
-static unsigned long hash_path(const char *path)
+/* Format block file path: blocks/XX/YY/key-blockidx */
+static void format_block_path(cache_block_ctx_t *ctx, uint64_t file_key, size_t block_idx,
+                              char *block_path, size_t len)
 {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *path++)) {
-        hash = ((hash << 5) + hash) + c;
-    }
-    return hash;
+    unsigned char h1 = (file_key >> 8) & 0xFF;
+    unsigned char h2 = file_key & 0xFF;
+
+    snprintf(block_path, len, "%s/%02x/%02x/%016" PRIx64 "-%zu",
+             ctx->blocks_dir, h1, h2, file_key, block_idx);
 }
 
-/* Get block file path: blocks/XX/YY/hash-blockidx */
-static char *get_block_path(cache_block_ctx_t *ctx, const char *path, size_t block_idx)
+/* Format shared content path: blocks/XX/YY/digest */
+static void format_chunk_path(cache_block_ctx_t *ctx, const cache_digest_t *digest,
+                              char *chunk_path, size_t len)
 {
-    unsigned long hash = hash_path(path);
-    char *block_path = malloc(PATH_MAX);
-    if (block_path == NULL) {
-        return NULL;
-    }
+    unsigned char h1 = (digest->hi >> 8) & 0xFF;
+    unsigned char h2 = digest->hi & 0xFF;
 
-    unsigned char h1 = (hash >> 8) & 0xFF;
-    unsigned char h2 = hash & 0xFF;
-    
-    snprintf(block_path, PATH_MAX, "%s/%02x/%02x/%016lx-%zu",
-             ctx->blocks_dir, h1, h2, hash, block_idx);
-    
-    return block_path;
+    snprintf(chunk_path, len, "%s/%02x/%02x/%016" PRIx64 "%016" PRIx64,
+             ctx->blocks_dir, h1, h2, digest->hi, digest->lo);
 }
 
 /* Create directory hierarchy for block */
@@ -102,142 +218,194 @@ static int create_block_dir(const char *block_path)
     return 0;
 }
 
-/* Structure for tracking blocks during LRU scan */
-struct block_info {
-    char *path;
-    time_t atime;
-    off_t size;
-};
+/* Unlink a block file named by its index key */
+static void unlink_block(cache_block_ctx_t *ctx, uint64_t file_key, size_t block_idx)
+{
+    char block_path[PATH_MAX];
+    format_block_path(ctx, file_key, block_idx, block_path, sizeof(block_path));
+    cache_fd_invalidate(ctx->fds, file_key, block_idx);
+    unlink(block_path);
+}
+
+/* Delete the file behind a removed index entry. Shared content goes
+   only with its last reference. */
+static void release_block(cache_block_ctx_t *ctx, const cache_index_entry_t *e, bool content_freed)
+{
+    if (!e->shared) {
+        unlink_block(ctx, e->file_key, e->block_idx);
+    } else if (content_freed) {
+        char chunk_path[PATH_MAX];
+        format_chunk_path(ctx, &e->digest, chunk_path, sizeof(chunk_path));
+        cache_fd_invalidate(ctx->chunk_fds, e->digest.lo, e->digest.hi);
+        unlink(chunk_path);
+    }
+}
 
-/* Comparison function for qsort (oldest first) */
-static int compare_block_atime(const void *a, const void *b)
+/* Remove a block from the index and delete its file. Returns 0 if the
+   block was indexed. */
+static int drop_block(cache_block_ctx_t *ctx, uint64_t file_key, size_t block_idx)
 {
-    const struct block_info *ba = a;
-    const struct block_info *bb = b;
-    if (ba->atime < bb->atime) return -1;
-    if (ba->atime > bb->atime) return 1;
+    cache_index_entry_t e;
+    bool content_freed = false;
+    if (cache_index_remove(ctx->index, file_key, block_idx, &e, &content_freed) != 0) {
+        return -1;
+    }
+    release_block(ctx, &e, content_freed);
     return 0;
 }
 
-/* Calculate current cache size by scanning all blocks */
-static size_t calculate_cache_size(cache_block_ctx_t *ctx)
+static pthread_mutex_t *store_lock(cache_block_ctx_t *ctx, uint64_t file_key, size_t block_idx)
 {
-    size_t total = 0;
-    char path_l1[PATH_MAX], path_l2[PATH_MAX];
-    
-    DIR *dp1 = opendir(ctx->blocks_dir);
-    if (dp1 == NULL) {
-        return 0;
+    uint64_t h = file_key ^ (block_idx * 0x9E3779B97F4A7C15ULL);
+    return &ctx->store_locks[(h ^ (h >> 29)) % STORE_LOCKS];
+}
+
+/* Open the file behind an entry through the fd cache it belongs to */
+static cache_fd_entry_t *open_stored(cache_block_ctx_t *ctx,
+                                     const cache_index_entry_t *e,
+                                     cache_fd_t **fds_out)
+{
+    char path[PATH_MAX];
+    if (e->shared) {
+        *fds_out = ctx->chunk_fds;
+        format_chunk_path(ctx, &e->digest, path, sizeof(path));
+        return cache_fd_get(ctx->chunk_fds, e->digest.lo, e->digest.hi, path, false);
     }
-    
-    struct dirent *de1;
-    while ((de1 = readdir(dp1)) != NULL) {
-        if (de1->d_name[0] == '.') continue;
-        
-        snprintf(path_l1, PATH_MAX, "%s/%s", ctx->blocks_dir, de1->d_name);
-        DIR *dp2 = opendir(path_l1);
-        if (dp2 == NULL) continue;
-        
-        struct dirent *de2;
-        while ((de2 = readdir(dp2)) != NULL) {
-            if (de2->d_name[0] == '.') continue;
-            
-            snprintf(path_l2, PATH_MAX, "%s/%s", path_l1, de2->d_name);
-            DIR *dp3 = opendir(path_l2);
-            if (dp3 == NULL) continue;
-            
-            struct dirent *de3;
-            while ((de3 = readdir(dp3)) != NULL) {
-                if (de3->d_name[0] == '.') continue;
-                
-                char block_path[PATH_MAX];
-                snprintf(block_path, PATH_MAX, "%s/%s", path_l2, de3->d_name);
-                
-                struct stat st;
-                if (stat(block_path, &st) == 0) {
-                    total += st.st_size;
-                }
-            }
-            closedir(dp3);
-        }
-        closedir(dp2);
+    *fds_out = ctx->fds;
+    format_block_path(ctx, e->file_key, e->block_idx, path, sizeof(path));
+    return cache_fd_get(ctx->fds, e->file_key, e->block_idx, path, false);
+}
+
+/* Read the stored bytes of an entry into buf and compare them with its
+   checksum. Returns 0 if they match. */
+static int read_stored(int fd, const cache_index_entry_t *e, char *buf)
+{
+    if (pread(fd, buf, e->stored, 0) != (ssize_t)e->stored) {
+        return -1;
     }
-    closedir(dp1);
-    
-    return total;
+    return cache_crc32c(0, buf, e->stored) == e->crc ? 0 : -1;
 }
 
-/* Evict blocks until cache size is below threshold */
-static int evict_lru_blocks(cache_block_ctx_t *ctx, size_t target_size)
+/* Check the file of an open entry against its checksum, reading it whole
+   the first time it is used through this descriptor. Returns 0 if it
+   matches. */
+static int verify_stored(cache_fd_entry_t *file, const cache_index_entry_t *e)
 {
-    if (ctx->current_cache_size <= target_size) {
+    if (cache_fd_verified(file, e->crc)) {
         return 0;
     }
-    
-    /* Collect all blocks with their access times */
-    struct block_info *blocks = NULL;
-    size_t block_count = 0;
-    size_t block_capacity = 1024;
-    
-    blocks = malloc(block_capacity * sizeof(struct block_info));
-    if (blocks == NULL) {
+    char *buf = malloc(e->stored > 0 ? e->stored : 1);
+    if (buf == NULL) {
         return -1;
     }
-    
+    int ret = read_stored(cache_fd_fileno(file), e, buf);
+    free(buf);
+    if (ret == 0) {
+        cache_fd_set_verified(file, e->crc);
+    }
+    return ret;
+}
+
+/*
+ * The file of an entry did not match its checksum. The block may have been
+ * replaced since the entry was looked up, so check what is indexed now,
+ * with stores of the block held off, and drop it only if that is bad too.
+ */
+static void block_corrupt(cache_block_ctx_t *ctx, const cache_index_entry_t *seen)
+{
+    pthread_mutex_t *lock = store_lock(ctx, seen->file_key, seen->block_idx);
+    pthread_mutex_lock(lock);
+
+    cache_index_entry_t e;
+    if (!cache_index_lookup(ctx->index, seen->file_key, seen->block_idx, &e) ||
+        e.generation != seen->generation) {
+        pthread_mutex_unlock(lock);
+        return;
+    }
+
+    /* Bypass the fd cache, which may hold a replaced file */
+    char path[PATH_MAX];
+    if (e.shared) {
+        format_chunk_path(ctx, &e.digest, path, sizeof(path));
+        cache_fd_invalidate(ctx->chunk_fds, e.digest.lo, e.digest.hi);
+    } else {
+        format_block_path(ctx, e.file_key, e.block_idx, path, sizeof(path));
+        cache_fd_invalidate(ctx->fds, e.file_key, e.block_idx);
+    }
+    bool bad = true;
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        char *buf = malloc(e.stored > 0 ? e.stored : 1);
+        bad = buf != NULL && read_stored(fd, &e, buf) != 0;
+        free(buf);
+        close(fd);
+    }
+
+    if (bad) {
+        drop_block(ctx, e.file_key, e.block_idx);
+        if (e.shared && cache_index_has_content(ctx->index, &e.digest)) {
+            /* Other blocks still refer to it; make them miss as well */
+            unlink(path);
+        }
+        cache_stats_add(CACHE_CTR_CORRUPT_BLOCKS, 1);
+        DPRINTF("cache_block: dropped block %016" PRIx64 "-%zu, it does not match its checksum",
+                e.file_key, e.block_idx);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+/* Keep a quarter of the process fd limit for block files */
+static size_t fd_cache_limit(void)
+{
+    struct rlimit rl;
+    size_t limit = FD_CACHE_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 4 < limit) {
+        limit = rl.rlim_cur / 4;
+    }
+    return limit > 16 ? limit : 16;
+}
+
+/*
+ * Remove block files the index does not know about. They were written by
+ * a version that stored blocks unaligned, so their contents can't be
+ * trusted. This is the only place a full walk of blocks/ happens, and
+ * only when the index starts out empty.
+ */
+static void purge_block_tree(cache_block_ctx_t *ctx)
+{
     char path_l1[PATH_MAX], path_l2[PATH_MAX];
+    size_t purged = 0;
+
     DIR *dp1 = opendir(ctx->blocks_dir);
     if (dp1 == NULL) {
-        free(blocks);
-        return -1;
+        return;
     }
-    
+
     struct dirent *de1;
     while ((de1 = readdir(dp1)) != NULL) {
         if (de1->d_name[0] == '.') continue;
-        
+
         snprintf(path_l1, PATH_MAX, "%s/%s", ctx->blocks_dir, de1->d_name);
         DIR *dp2 = opendir(path_l1);
         if (dp2 == NULL) continue;
-        
+
         struct dirent *de2;
         while ((de2 = readdir(dp2)) != NULL) {
             if (de2->d_name[0] == '.') continue;
-            
+
             snprintf(path_l2, PATH_MAX, "%s/%s", path_l1, de2->d_name);
             DIR *dp3 = opendir(path_l2);
             if (dp3 == NULL) continue;
-            
+
             struct dirent *de3;
             while ((de3 = readdir(dp3)) != NULL) {
                 if (de3->d_name[0] == '.') continue;
-                
+
                 char block_path[PATH_MAX];
                 snprintf(block_path, PATH_MAX, "%s/%s", path_l2, de3->d_name);
-                
-                struct stat st;
-                if (stat(block_path, &st) == 0) {
-                    /* Grow array if needed */
-                    if (block_count >= block_capacity) {
-                        block_capacity *= 2;
-                        struct block_info *new_blocks = realloc(blocks, 
-                            block_capacity * sizeof(struct block_info));
-                        if (new_blocks == NULL) {
-                            for (size_t i = 0; i < block_count; i++) {
-                                free(blocks[i].path);
-                            }
-                            free(blocks);
-                            closedir(dp3);
-                            closedir(dp2);
-                            closedir(dp1);
-                            return -1;
-                        }
-                        blocks = new_blocks;
-                    }
-                    
-                    blocks[block_count].path = strdup(block_path);
-                    blocks[block_count].atime = st.st_atime;
-                    blocks[block_count].size = st.st_size;
-                    block_count++;
+                if (unlink(block_path) == 0) {
+                    purged++;
                 }
             }
             closedir(dp3);
@@ -245,267 +413,1843 @@ static int evict_lru_blocks(cache_block_ctx_t *ctx, size_t target_size)
         closedir(dp2);
     }
     closedir(dp1);
-    
-    if (block_count == 0) {
-        free(blocks);
-        return 0;
+
+    if (ctx->debug && purged > 0) {
+        DPRINTF("cache_block_init: removed %zu unindexed blocks", purged);
     }
-    
-    /* Sort by access time (oldest first) */
-    qsort(blocks, block_count, sizeof(struct block_info), compare_block_atime);
-    
-    /* Evict oldest blocks until below target */
-    size_t evicted_size = 0;
-    size_t evicted_count = 0;
-    
-    for (size_t i = 0; i < block_count && ctx->current_cache_size - evicted_size > target_size; i++) {
-        if (unlink(blocks[i].path) == 0) {
-            evicted_size += blocks[i].size;
-            evicted_count++;
-        }
+}
+
+/* Remove files left in the temporary directory by writes that a crash
+   interrupted */
+static void clear_tmp_dir(cache_block_ctx_t *ctx)
+{
+    DIR *dp = opendir(ctx->tmp_dir);
+    if (dp == NULL) {
+        return;
     }
-    
-    ctx->current_cache_size -= evicted_size;
-    
-    if (ctx->debug && evicted_count > 0) {
-        DPRINTF("evict_lru_blocks: evicted %zu blocks (%zu bytes), cache now %zu bytes",
-                evicted_count, evicted_size, ctx->current_cache_size);
+
+    char path[PATH_MAX];
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        snprintf(path, PATH_MAX, "%s/%s", ctx->tmp_dir, de->d_name);
+        unlink(path);
     }
-    
-    /* Free block info array */
-    for (size_t i = 0; i < block_count; i++) {
-        free(blocks[i].path);
+    closedir(dp);
+}
+
+/* Flush the block files to stable storage. Returns 0 on success. */
+static int sync_blocks(cache_block_ctx_t *ctx)
+{
+#ifdef __NR_syncfs
+    int fd = open(ctx->blocks_dir, O_RDONLY);
+    if (fd == -1) {
+        return -1;
     }
-    free(blocks);
-    
+    int ret = syscall(__NR_syncfs, fd) == 0 ? 0 : -1;
+    close(fd);
+    return ret;
+#else
+    (void)ctx;
+    sync();
     return 0;
+#endif
 }
 
-cache_block_ctx_t *cache_block_init(const char *cache_root,
-                                     size_t block_size,
-                                     size_t max_cache_size,
-                                     bool debug)
+/*
+ * Every CHECKPOINT_INTERVAL, sync the block files and record the
+ * generation reached before the sync, so that after a crash only blocks
+ * stored since then need checking. Not while a scrub still relies on the
+ * previous checkpoint.
+ */
+static void maybe_checkpoint(cache_block_ctx_t *ctx)
 {
-    if (cache_root == NULL) {
-        return NULL;
+    time_t now = time(NULL);
+    if (now < ctx->next_checkpoint || !atomic_load(&ctx->scrub_done)) {
+        return;
     }
+    ctx->next_checkpoint = now + CHECKPOINT_INTERVAL;
 
-    cache_block_ctx_t *ctx = calloc(1, sizeof(cache_block_ctx_t));
-    if (ctx == NULL) {
-        return NULL;
+    uint64_t generation = cache_index_generation(ctx->index);
+    if (generation == ctx->checkpointed || sync_blocks(ctx) != 0) {
+        return;
     }
+    cache_index_checkpoint(ctx->index, generation);
+    ctx->checkpointed = generation;
+}
 
-    ctx->block_size = block_size > 0 ? block_size : DEFAULT_BLOCK_SIZE;
-    ctx->max_cache_size = max_cache_size;
-    ctx->debug = debug;
+/*
+ * Scrub thread. Checks the blocks stored after the last checkpoint of a run
+ * that did not shut down cleanly, dropping those a crash left torn or
+ * missing. The cache serves meanwhile; reads check blocks themselves.
+ */
+static void *scrub_thread_main(void *arg)
+{
+    cache_block_ctx_t *ctx = arg;
+    uint64_t start = cache_stats_now();
+    size_t done = 0;
 
-    /* Create blocks directory path */
-    ctx->blocks_dir = malloc(PATH_MAX);
-    if (ctx->blocks_dir == NULL) {
-        free(ctx);
-        return NULL;
+    for (; done < ctx->scrub_count && !atomic_load(&ctx->scrub_stop); done++) {
+        const cache_index_entry_t *e = &ctx->scrub_entries[done];
+        cache_fd_t *fds;
+        cache_fd_entry_t *file = open_stored(ctx, e, &fds);
+        bool good = file != NULL && verify_stored(file, e) == 0;
+        if (file != NULL) {
+            cache_fd_put(fds, file);
+        }
+        if (!good) {
+            block_corrupt(ctx, e);
+        }
+        cache_stats_add(CACHE_CTR_SCRUBBED_BLOCKS, 1);
     }
-    snprintf(ctx->blocks_dir, PATH_MAX, "%s/blocks", cache_root);
 
-    /* Create blocks directory */
-    mkdir(ctx->blocks_dir, 0700);
+    if (done == ctx->scrub_count) {
+        atomic_store(&ctx->scrub_done, true);
+    }
+    if (ctx->debug) {
+        DPRINTF("cache_block: scrubbed %zu of %zu blocks in %.1f ms", done, ctx->scrub_count,
+                (cache_stats_now() - start) / 1e6);
+    }
+    (void)start;  /* Only logged */
+    return NULL;
+}
+
+/* Evict CLOCK victims until cache size is below target */
+static void evict_blocks(cache_block_ctx_t *ctx, size_t target_size)
+{
+    size_t current_size = 0;
+    size_t evicted_size = 0;
+    size_t evicted_count = 0;
+    cache_index_entry_t victim;
+    bool content_freed;
+    uint64_t start = cache_stats_now();
 
-    /* Calculate current cache size */
-    ctx->current_cache_size = calculate_cache_size(ctx);
+    cache_index_get_totals(ctx->index, &current_size, NULL);
 
-    if (debug) {
-        DPRINTF("cache_block_init: initialized at %s (block_size=%zu, max_size=%zu, current=%zu)",
-                ctx->blocks_dir, ctx->block_size, ctx->max_cache_size, ctx->current_cache_size);
+    /* Shared content only frees space with its last reference */
+    while (current_size > target_size &&
+           cache_index_pop_victim(ctx->index, &victim, &content_freed)) {
+        release_block(ctx, &victim, content_freed);
+        if (!victim.shared || content_freed) {
+            current_size -= victim.stored;
+            evicted_size += victim.stored;
+        }
+        evicted_count++;
     }
 
-    return ctx;
+    if (evicted_count > 0) {
+        cache_stats_since(CACHE_STAGE_EVICTION, start);
+        cache_stats_add(CACHE_CTR_EVICTED_BLOCKS, evicted_count);
+        cache_stats_add(CACHE_CTR_EVICTED_BYTES, evicted_size);
+    }
+    if (ctx->debug && evicted_count > 0) {
+        DPRINTF("evict_blocks: evicted %zu blocks (%zu bytes), cache now %zu bytes",
+                evicted_count, evicted_size, current_size);
+    }
 }
 
-bool cache_block_exists(cache_block_ctx_t *ctx,
-                        const char *path,
-                        size_t block_idx)
+/* Wake the evictor if the cache has grown past the high watermark */
+static void maybe_wake_evictor(cache_block_ctx_t *ctx, size_t current_size)
 {
-    if (ctx == NULL || path == NULL) {
-        return false;
+    if (ctx->max_cache_size == 0 ||
+        current_size <= ctx->max_cache_size / 100 * EVICT_HIGH_WATERMARK) {
+        return;
     }
 
-    char *block_path = get_block_path(ctx, path, block_idx);
-    if (block_path == NULL) {
-        return false;
+    pthread_mutex_lock(&ctx->evict_lock);
+    if (!ctx->evict_pending) {
+        ctx->evict_pending = true;
+        pthread_cond_signal(&ctx->evict_cond);
     }
+    pthread_mutex_unlock(&ctx->evict_lock);
+}
 
-    struct stat st;
-    bool exists = (stat(block_path, &st) == 0);
-    
-    free(block_path);
-    return exists;
+/*
+ * Evictor thread. Sleeps until woken by a fill that crossed the high
+ * watermark, then evicts down to the low watermark. Also writes back
+ * access times periodically so the read path never touches the database.
+ */
+static void *evict_thread_main(void *arg)
+{
+    cache_block_ctx_t *ctx = arg;
+
+    pthread_mutex_lock(&ctx->evict_lock);
+    while (!ctx->evict_stop) {
+        if (!ctx->evict_pending) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += INDEX_SYNC_INTERVAL;
+            pthread_cond_timedwait(&ctx->evict_cond, &ctx->evict_lock, &deadline);
+        }
+        bool pending = ctx->evict_pending;
+        ctx->evict_pending = false;
+        pthread_mutex_unlock(&ctx->evict_lock);
+
+        if (pending && ctx->max_cache_size > 0) {
+            evict_blocks(ctx, ctx->max_cache_size / 100 * EVICT_LOW_WATERMARK);
+        }
+        cache_index_sync(ctx->index);
+        maybe_checkpoint(ctx);
+
+        pthread_mutex_lock(&ctx->evict_lock);
+    }
+    pthread_mutex_unlock(&ctx->evict_lock);
+
+    return NULL;
 }
 
-ssize_t cache_block_read(cache_block_ctx_t *ctx,
-                         const char *path,
-                         size_t block_idx,
-                         char *buf,
-                         size_t size,
-                         size_t offset)
+/* Copy the valid granules of data, which starts data_off bytes into the
+   block, into a block image */
+static void copy_valid_runs(cache_block_ctx_t *ctx,
+                            char *image,
+                            const char *data,
+                            size_t data_off,
+                            size_t len,
+                            uint64_t valid)
 {
-    if (ctx == NULL || path == NULL || buf == NULL) {
-        return -1;
+    size_t end = data_off + len;
+    uint64_t bits = valid;
+
+    while (bits != 0) {
+        size_t first = __builtin_ctzll(bits);
+        size_t last = first;
+        while (last < CACHE_BITMAP_GRANULES && ((bits >> last) & 1)) {
+            last++;
+        }
+        bits &= ~cache_bitmap_bits(first, last);
+
+        size_t run_start = first * ctx->granule;
+        size_t run_end = last * ctx->granule;
+        if (run_start < data_off) run_start = data_off;
+        if (run_end > end) run_end = end;
+        if (run_start < run_end) {
+            memcpy(image + run_start, data + (run_start - data_off), run_end - run_start);
+        }
     }
+}
 
-    char *block_path = get_block_path(ctx, path, block_idx);
-    if (block_path == NULL) {
+/*
+ * Write a whole file aside and rename it into place, so readers never
+ * see part of it and a block file is never modified once written. The
+ * data is not synced: a crash may still leave the file short or stale,
+ * which its checksum catches. Returns 0 on success, -1 with errno set.
+ */
+static int write_file_atomic(cache_block_ctx_t *ctx, const char *path, const char *data, size_t len)
+{
+    if (create_block_dir(path) != 0) {
         return -1;
     }
 
-    int fd = open(block_path, O_RDONLY);
-    free(block_path);
-    
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%" PRIu64, ctx->tmp_dir,
+             (uint64_t)atomic_fetch_add(&ctx->tmp_seq, 1));
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
     if (fd == -1) {
         return -1;
     }
-
-    ssize_t bytes = pread(fd, buf, size, offset);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    int saved_errno = errno;
     close(fd);
-
-    if (ctx->debug && bytes > 0) {
-        DPRINTF("cache_block_read: read %zd bytes from %s block %zu",
-                bytes, path, block_idx);
+    if (done < len || rename(tmp_path, path) != 0) {
+        if (done == len) {
+            saved_errno = errno;
+        }
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
     }
-
-    return bytes;
+    return 0;
 }
 
-int cache_block_write(cache_block_ctx_t *ctx,
-                      const char *path,
-                      size_t block_idx,
-                      const char *buf,
-                      size_t size)
+/* Compress a complete block. Returns the compressed size, or -1 if
+   compression is off or would not save enough to be worth it. */
+static ssize_t pack_block(cache_block_ctx_t *ctx, const char *data, size_t len, char **packed_out)
 {
-    if (ctx == NULL || path == NULL || buf == NULL) {
+    if (ctx->codec == CACHE_CODEC_NONE) {
         return -1;
     }
 
-    char *block_path = get_block_path(ctx, path, block_idx);
-    if (block_path == NULL) {
+    size_t cap = cache_codec_bound(ctx->codec, len);
+    char *packed = cap > 0 ? malloc(cap) : NULL;
+    if (packed == NULL) {
         return -1;
     }
-
-    /* Create directory hierarchy */
-    if (create_block_dir(block_path) != 0) {
-        free(block_path);
+    ssize_t n = cache_codec_compress(ctx->codec, ctx->codec_level, data, len, packed, cap);
+    if (n < 0 || (size_t)n > len - len / COMPRESS_MIN_SAVING) {
+        free(packed);
         return -1;
     }
+    *packed_out = packed;
+    return n;
+}
 
-    int fd = open(block_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd == -1) {
-        free(block_path);
-        return -1;
-    }
+/*
+ * Store a complete block as shared content: written once under its
+ * digest, and only referenced if another block already has the same
+ * bytes. Returns 0 on success.
+ */
+static int store_shared(cache_block_ctx_t *ctx,
+                        uint64_t file_key,
+                        size_t block_idx,
+                        const char *data,
+                        size_t len,
+                        bool eof)
+{
+    cache_digest_t digest;
+    cache_digest(&ctx->digest_key, data, len, &digest);
 
-    ssize_t written = write(fd, buf, size);
-    close(fd);
+    char chunk_path[PATH_MAX];
+    format_chunk_path(ctx, &digest, chunk_path, sizeof(chunk_path));
 
-    if (written != (ssize_t)size) {
-        free(block_path);
-        return -1;
+    size_t current_size = 0;
+    cache_index_get_totals(ctx->index, &current_size, NULL);
+
+    /* The digest is over the uncompressed bytes, so blocks match however
+       their content happens to be stored */
+    bool written = false;
+    size_t stored = len;
+    cache_codec_t codec = CACHE_CODEC_NONE;
+    uint32_t crc = 0;  /* Taken from the content if it is already stored */
+    if (!cache_index_has_content(ctx->index, &digest)) {
+        char *packed = NULL;
+        ssize_t packed_len = pack_block(ctx, data, len, &packed);
+        if (packed_len >= 0) {
+            stored = packed_len;
+            codec = ctx->codec;
+        }
+        if (ctx->max_cache_size > 0 && current_size + stored > ctx->max_cache_size) {
+            maybe_wake_evictor(ctx, current_size + stored);
+            free(packed);
+            return -1;
+        }
+        crc = cache_crc32c(0, packed != NULL ? packed : data, stored);
+        int res = write_file_atomic(ctx, chunk_path, packed != NULL ? packed : data, stored);
+        free(packed);
+        if (res != 0) {
+            return -1;
+        }
+        written = true;
     }
 
-    /* Update cache size and trigger eviction if needed */
-    ctx->current_cache_size += written;
-    
-    if (ctx->max_cache_size > 0 && ctx->current_cache_size > ctx->max_cache_size) {
-        /* Evict until we're at 90% of max */
-        size_t target = (ctx->max_cache_size * 9) / 10;
-        evict_lru_blocks(ctx, target);
+    /* Replace whatever partial copy the block had */
+    if (cache_index_insert_shared(ctx->index, file_key, block_idx, len, eof, &digest, stored, codec, crc) != 0) {
+        drop_block(ctx, file_key, block_idx);
+        if (cache_index_insert_shared(ctx->index, file_key, block_idx, len, eof, &digest,
+                                      stored, codec, crc) != 0) {
+            if (written && !cache_index_has_content(ctx->index, &digest)) {
+                unlink(chunk_path);
+            }
+            return -1;
+        }
     }
 
-    free(block_path);
+    cache_index_get_totals(ctx->index, &current_size, NULL);
+    maybe_wake_evictor(ctx, current_size);
 
     if (ctx->debug) {
-        DPRINTF("cache_block_write: wrote %zu bytes to %s block %zu (cache: %zu/%zu)",
-                size, path, block_idx, ctx->current_cache_size, ctx->max_cache_size);
+        DPRINTF("cache_block: block %016" PRIx64 "-%zu %s content %016" PRIx64 "%016" PRIx64
+                " (cache: %zu/%zu)", file_key, block_idx, written ? "stored as" : "shares",
+                digest.hi, digest.lo, current_size, ctx->max_cache_size);
     }
 
     return 0;
 }
 
-int cache_block_invalidate_range(cache_block_ctx_t *ctx,
-                                  const char *path,
-                                  off_t offset,
-                                  size_t size)
+/*
+ * Store a compressed complete block in its own file, replacing whatever
+ * partial copy the block had. Returns 0 on success.
+ */
+static int store_packed(cache_block_ctx_t *ctx,
+                        uint64_t file_key,
+                        size_t block_idx,
+                        const char *packed,
+                        size_t stored,
+                        size_t len,
+                        bool eof)
 {
-    if (ctx == NULL || path == NULL) {
+    size_t current_size = 0;
+    cache_index_get_totals(ctx->index, &current_size, NULL);
+    if (ctx->max_cache_size > 0 && current_size + stored > ctx->max_cache_size) {
+        maybe_wake_evictor(ctx, current_size + stored);
         return -1;
     }
 
-    size_t start_block = offset / ctx->block_size;
-    size_t end_block = (offset + size) / ctx->block_size;
+    drop_block(ctx, file_key, block_idx);
 
-    for (size_t i = start_block; i <= end_block; i++) {
-        char *block_path = get_block_path(ctx, path, i);
-        if (block_path != NULL) {
-            struct stat st;
-            if (stat(block_path, &st) == 0) {
-                if (unlink(block_path) == 0) {
-                    ctx->current_cache_size -= st.st_size;
-                }
-            }
-            free(block_path);
-        }
+    char block_path[PATH_MAX];
+    format_block_path(ctx, file_key, block_idx, block_path, sizeof(block_path));
+    if (write_file_atomic(ctx, block_path, packed, stored) != 0) {
+        return -1;
     }
-
+    cache_fd_invalidate(ctx->fds, file_key, block_idx);
+    if (cache_index_insert_packed(ctx->index, file_key, block_idx, len, eof, stored, ctx->codec,
+                                  cache_crc32c(0, packed, stored)) != 0) {
+        /* Invalidated meanwhile, or indexed by a clone */
+        drop_block(ctx, file_key, block_idx);
+        unlink_block(ctx, file_key, block_idx);
+        return -1;
+    }
+
+    cache_index_get_totals(ctx->index, &current_size, NULL);
+    maybe_wake_evictor(ctx, current_size);
+
+    if (ctx->debug) {
+        DPRINTF("cache_block: stored block %016" PRIx64 "-%zu as %zu bytes of %s (cache: %zu/%zu)",
+                file_key, block_idx, stored, cache_codec_name(ctx->codec),
+                current_size, ctx->max_cache_size);
+    }
+
+    return 0;
+}
+
+/*
+ * Merge data into the raw file of a block and record it in the index.
+ * The merged block is written as a new file that replaces the old one.
+ * Caller holds the block's store lock.
+ */
+static int store_raw_locked(cache_block_ctx_t *ctx,
+                            uint64_t file_key,
+                            size_t block_idx,
+                            const char *data,
+                            size_t data_off,
+                            size_t len,
+                            uint64_t valid,
+                            bool eof)
+{
+    /* Shared and compressed blocks are complete already */
+    cache_index_entry_t existing;
+    bool found = cache_index_lookup(ctx->index, file_key, block_idx, &existing);
+    if (found && (existing.shared || existing.codec != CACHE_CODEC_NONE)) {
+        return 0;
+    }
+
+    size_t current_size = 0;
+    cache_index_get_totals(ctx->index, &current_size, NULL);
+
+    /* At the hard limit the evictor is behind; skip the fill rather than
+       evict on this thread. */
+    if (ctx->max_cache_size > 0 && current_size + len > ctx->max_cache_size) {
+        maybe_wake_evictor(ctx, current_size + len);
+        return -1;
+    }
+
+    /* Anything but a fresh block starting at its beginning is merged
+       into an image of the whole block first */
+    char *image = NULL;
+    if (found || data_off > 0) {
+        image = malloc(ctx->block_size);
+        if (image == NULL) {
+            return -1;
+        }
+    }
+    if (found) {
+        cache_fd_t *fds;
+        cache_fd_entry_t *file = open_stored(ctx, &existing, &fds);
+        bool good = file != NULL && read_stored(cache_fd_fileno(file), &existing, image) == 0;
+        if (file != NULL) {
+            cache_fd_put(fds, file);
+        }
+        if (!good) {
+            /* Torn or gone: start the block over */
+            if (file != NULL) {
+                cache_stats_add(CACHE_CTR_CORRUPT_BLOCKS, 1);
+            }
+            drop_block(ctx, file_key, block_idx);
+            found = false;
+        }
+    }
+
+    size_t size = data_off + len;
+    uint64_t merged_valid = valid;
+    bool merged_eof = eof;
+    if (found) {
+        merged_valid |= existing.valid;
+        if (existing.size > size) {
+            merged_eof = false;  /* New data ends before existing data */
+            size = existing.size;
+        } else if (existing.eof && existing.size == size) {
+            merged_eof = true;
+        }
+    }
+    if (image != NULL) {
+        size_t known = found ? existing.size : 0;
+        if (size > known) {
+            memset(image + known, 0, size - known);
+        }
+        copy_valid_runs(ctx, image, data, data_off, len, valid);
+    }
+    const char *bytes = image != NULL ? image : data;
+    uint32_t crc = cache_crc32c(0, bytes, size);
+
+    char block_path[PATH_MAX];
+    format_block_path(ctx, file_key, block_idx, block_path, sizeof(block_path));
+
+    int res = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        res = write_file_atomic(ctx, block_path, bytes, size);
+        if (res == 0 || errno != ENOSPC || attempt > 0) {
+            break;
+        }
+
+        /* Cache disk is full: this is the one case where the caller waits
+           for eviction. */
+        cache_index_get_totals(ctx->index, &current_size, NULL);
+        evict_blocks(ctx, current_size / 100 * EVICT_LOW_WATERMARK);
+    }
+    free(image);
+
+    if (res != 0) {
+        return -1;
+    }
+
+    /* Record the block and wake the evictor if needed. If the entry merged
+       with was invalidated meanwhile, the new file is stale too. */
+    cache_fd_invalidate(ctx->fds, file_key, block_idx);
+    size_t old_size = 0;
+    if (cache_index_insert(ctx->index, file_key, block_idx, size, merged_valid, merged_eof, crc,
+                           found ? existing.generation : 0, &old_size) != 0) {
+        unlink_block(ctx, file_key, block_idx);
+        return -1;
+    }
+    size_t new_size = current_size + (size > old_size ? size - old_size : 0);
+    maybe_wake_evictor(ctx, new_size);
+
+    if (ctx->debug) {
+        DPRINTF("cache_block: stored block %016" PRIx64 "-%zu [%zu, %zu) valid=%016llx%s (cache: %zu/%zu)",
+                file_key, block_idx, data_off, data_off + len, (unsigned long long)merged_valid,
+                merged_eof ? " eof" : "", new_size, ctx->max_cache_size);
+    }
+
+    return 0;
+}
+
+/*
+ * Merge data into a block file and record it in the index. data covers
+ * bytes [data_off, data_off + len) of the block; only granules set in
+ * valid are stored. Returns 0 on success.
+ */
+static int store_block_file(cache_block_ctx_t *ctx,
+                            uint64_t file_key,
+                            size_t block_idx,
+                            const char *data,
+                            size_t data_off,
+                            size_t len,
+                            uint64_t valid,
+                            bool eof)
+{
+    valid &= cache_bitmap_overlap(ctx->granule, data_off, len);
+    if (valid == 0) {
+        return -1;
+    }
+
+    pthread_mutex_t *lock = store_lock(ctx, file_key, block_idx);
+    pthread_mutex_lock(lock);
+
+    /* Only whole blocks are deduplicated or compressed; partial ones stay
+       raw so later data can be merged into them */
+    int ret = -1;
+    bool stored = false;
+    bool complete = data_off == 0 && (len == ctx->block_size || eof) &&
+                    valid == cache_bitmap_overlap(ctx->granule, 0, len);
+    if (complete && ctx->dedup) {
+        ret = store_shared(ctx, file_key, block_idx, data, len, eof);
+        stored = true;
+    } else if (complete && ctx->codec != CACHE_CODEC_NONE) {
+        char *packed;
+        ssize_t packed_len = pack_block(ctx, data, len, &packed);
+        if (packed_len >= 0) {
+            ret = store_packed(ctx, file_key, block_idx, packed, packed_len, len, eof);
+            free(packed);
+            stored = true;
+        }
+    }
+    if (!stored) {
+        ret = store_raw_locked(ctx, file_key, block_idx, data, data_off, len, valid, eof);
+    }
+
+    pthread_mutex_unlock(lock);
+    return ret;
+}
+
+static size_t block_seq_slot(uint64_t file_key, size_t block_idx)
+{
+    return (file_key ^ (block_idx * 0x9E3779B97F4A7C15ULL)) % INVAL_SLOTS;
+}
+
+/* Invalidation tag of a block: both of its counters */
+static uint64_t inval_seq_get(cache_block_ctx_t *ctx, uint64_t file_key, size_t block_idx)
+{
+    uint64_t file_part = (uint32_t)atomic_load(&ctx->file_seq[file_key % INVAL_SLOTS]);
+    uint64_t block_part = (uint32_t)atomic_load(&ctx->block_seq[block_seq_slot(file_key, block_idx)]);
+    return (file_part << 32) | block_part;
+}
+
+static void inval_seq_bump_file(cache_block_ctx_t *ctx, uint64_t file_key)
+{
+    atomic_fetch_add(&ctx->file_seq[file_key % INVAL_SLOTS], 1);
+}
+
+static void inval_seq_bump_block(cache_block_ctx_t *ctx, uint64_t file_key, size_t block_idx)
+{
+    atomic_fetch_add(&ctx->block_seq[block_seq_slot(file_key, block_idx)], 1);
+}
+
+/* Demotion callback: blocks leaving the RAM tier land in the disk tier */
+static void demote_block(void *arg,
+                         uint64_t file_key,
+                         size_t block_idx,
+                         const char *data,
+                         size_t size,
+                         uint64_t valid,
+                         bool eof,
+                         uint64_t tag)
+{
+    cache_block_ctx_t *ctx = arg;
+
+    if (inval_seq_get(ctx, file_key, block_idx) != tag) {
+        return;
+    }
+    if (store_block_file(ctx, file_key, block_idx, data, 0, size, valid, eof) != 0) {
+        return;
+    }
+    /* An invalidation that raced with the write may have missed the new
+       file; undo it. */
+    if (inval_seq_get(ctx, file_key, block_idx) != tag) {
+        drop_block(ctx, file_key, block_idx);
+    }
+}
+
+cache_block_ctx_t *cache_block_init(const char *cache_root,
+                                     size_t block_size,
+                                     size_t max_cache_size,
+                                     size_t mem_cache_size,
+                                     bool dedup,
+                                     cache_codec_t codec,
+                                     int codec_level,
+                                     bool debug)
+{
+    if (cache_root == NULL) {
+        return NULL;
+    }
+
+    cache_block_ctx_t *ctx = calloc(1, sizeof(cache_block_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->block_size = block_size > 0 ? block_size : DEFAULT_BLOCK_SIZE;
+    ctx->granule = cache_bitmap_granule(ctx->block_size);
+    ctx->max_cache_size = max_cache_size;
+    ctx->codec = cache_codec_bound(codec, ctx->block_size) > 0 ? codec : CACHE_CODEC_NONE;
+    ctx->codec_level = codec_level;
+    ctx->debug = debug;
+
+    /* Create blocks directory path */
+    ctx->blocks_dir = malloc(PATH_MAX);
+    ctx->tmp_dir = malloc(PATH_MAX);
+    if (ctx->blocks_dir == NULL || ctx->tmp_dir == NULL) {
+        free(ctx->blocks_dir);
+        free(ctx->tmp_dir);
+        free(ctx);
+        return NULL;
+    }
+    snprintf(ctx->blocks_dir, PATH_MAX, "%s/blocks", cache_root);
+    snprintf(ctx->tmp_dir, PATH_MAX, "%s/%s", ctx->blocks_dir, TMP_DIR_NAME);
+
+    /* Create blocks directory */
+    mkdir(ctx->blocks_dir, 0700);
+    mkdir(ctx->tmp_dir, 0700);
+    clear_tmp_dir(ctx);
+
+    if (dedup) {
+        char key_path[PATH_MAX];
+        snprintf(key_path, PATH_MAX, "%s/%s", cache_root, DEDUP_KEY_NAME);
+        if (cache_digest_load_key(key_path, &ctx->digest_key) == 0) {
+            ctx->dedup = true;
+        } else {
+            DPRINTF("cache_block_init: deduplication disabled (no key at %s)", key_path);
+        }
+    }
+
+    /* Shared content from an earlier run stays readable without dedup */
+    size_t fd_limit = fd_cache_limit();
+    ctx->fds = cache_fd_create(ctx->dedup ? fd_limit / 2 : fd_limit);
+    ctx->chunk_fds = cache_fd_create(ctx->dedup ? fd_limit / 2 : 16);
+    if (ctx->fds == NULL || ctx->chunk_fds == NULL) {
+        cache_fd_destroy(ctx->fds);
+        cache_fd_destroy(ctx->chunk_fds);
+        free(ctx->blocks_dir);
+        free(ctx->tmp_dir);
+        free(ctx);
+        return NULL;
+    }
+
+    /* Load the block index; blocks it doesn't know about are stale */
+    ctx->index = cache_index_open(cache_root, debug);
+    if (ctx->index == NULL) {
+        cache_fd_destroy(ctx->fds);
+        cache_fd_destroy(ctx->chunk_fds);
+        free(ctx->blocks_dir);
+        free(ctx->tmp_dir);
+        free(ctx);
+        return NULL;
+    }
+    if (cache_index_is_new(ctx->index)) {
+        purge_block_tree(ctx);
+    }
+
+    for (int i = 0; i < FILL_SHARDS; i++) {
+        pthread_mutex_init(&ctx->fills[i].lock, NULL);
+        pthread_cond_init(&ctx->fills[i].cond, NULL);
+    }
+    for (int i = 0; i < STORE_LOCKS; i++) {
+        pthread_mutex_init(&ctx->store_locks[i], NULL);
+    }
+
+    pthread_mutex_init(&ctx->evict_lock, NULL);
+    pthread_cond_init(&ctx->evict_cond, NULL);
+    if (pthread_create(&ctx->evict_thread, NULL, evict_thread_main, ctx) != 0) {
+        DPRINTF("cache_block_init: failed to start evictor thread");
+        cache_index_close(ctx->index);
+        cache_fd_destroy(ctx->fds);
+        cache_fd_destroy(ctx->chunk_fds);
+        pthread_cond_destroy(&ctx->evict_cond);
+        pthread_mutex_destroy(&ctx->evict_lock);
+        for (int i = 0; i < FILL_SHARDS; i++) {
+            pthread_cond_destroy(&ctx->fills[i].cond);
+            pthread_mutex_destroy(&ctx->fills[i].lock);
+        }
+        for (int i = 0; i < STORE_LOCKS; i++) {
+            pthread_mutex_destroy(&ctx->store_locks[i]);
+        }
+        free(ctx->blocks_dir);
+        free(ctx->tmp_dir);
+        free(ctx);
+        return NULL;
+    }
+
+    /* After an unclean shutdown, check in the background what may not
+       have reached the disk intact */
+    if (cache_index_take_unchecked(ctx->index, &ctx->scrub_entries, &ctx->scrub_count) != 0 ||
+        ctx->scrub_count == 0) {
+        atomic_store(&ctx->scrub_done, true);
+    } else if (pthread_create(&ctx->scrub_thread, NULL, scrub_thread_main, ctx) == 0) {
+        ctx->scrub_started = true;
+    } else {
+        scrub_thread_main(ctx);
+    }
+
+    if (mem_cache_size > 0) {
+        ctx->mem = cache_mem_create(mem_cache_size, ctx->block_size, demote_block, ctx);
+        if (ctx->mem == NULL) {
+            DPRINTF("cache_block_init: memory tier disabled (could not allocate)");
+        }
+    }
+
+    /* A cache left over the limit by a previous run is trimmed in the background */
+    size_t initial_size = 0;
+    cache_index_get_totals(ctx->index, &initial_size, NULL);
+    maybe_wake_evictor(ctx, initial_size);
+
+    if (debug) {
+        size_t current_size = 0;
+        cache_index_get_totals(ctx->index, &current_size, NULL);
+        DPRINTF("cache_block_init: initialized at %s (block_size=%zu, max_size=%zu, mem_size=%zu, compress=%s, current=%zu)",
+                ctx->blocks_dir, ctx->block_size, ctx->max_cache_size, mem_cache_size,
+                cache_codec_name(ctx->codec), current_size);
+    }
+
+    return ctx;
+}
+
+/* Take a shared store over if no other mount holds its lock: open it
+   and serve it to the other mounts. Called with takeover_lock held, or
+   before the handle is handed out. */
+static cache_block_ctx_t *share_take(cache_block_ctx_t *ctx)
+{
+    struct block_share *share = ctx->share;
+    if (flock(share->lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        return NULL;
+    }
+
+    cache_block_ctx_t *store = cache_block_init(share->dir, ctx->block_size, share->max_cache_size,
+                                                share->mem_cache_size, share->dedup, share->codec,
+                                                share->codec_level, ctx->debug);
+    if (store == NULL) {
+        DPRINTF("cache_block: cannot open the shared store at %s", share->dir);
+        flock(share->lock_fd, LOCK_UN);
+        return NULL;
+    }
+    share->server = cache_share_serve(share->socket_path, store, ctx->block_size, ctx->debug);
+    if (share->server == NULL) {
+        DPRINTF("cache_block: other mounts can't reach the shared store at %s: %s",
+                share->dir, strerror(errno));
+    }
+    atomic_store(&share->store, store);
     if (ctx->debug) {
-        DPRINTF("cache_block_invalidate_range: invalidated blocks %zu-%zu for %s",
-                start_block, end_block, path);
+        DPRINTF("cache_block: this mount owns the shared store at %s", share->dir);
+    }
+    return store;
+}
+
+/* The store of a handle attached to a shared store, or NULL if calls go
+   to the mount that owns it. When that mount seems gone, try to take
+   over, at most every TAKEOVER_INTERVAL seconds. */
+static cache_block_ctx_t *shared_store(cache_block_ctx_t *ctx)
+{
+    struct block_share *share = ctx->share;
+    cache_block_ctx_t *store = atomic_load(&share->store);
+    if (store != NULL || !cache_share_peer_orphaned(share->peer)) {
+        return store;
+    }
+
+    pthread_mutex_lock(&share->takeover_lock);
+    store = atomic_load(&share->store);
+    time_t now = time(NULL);
+    if (store == NULL && now >= share->next_takeover) {
+        share->next_takeover = now + TAKEOVER_INTERVAL;
+        store = share_take(ctx);
+    }
+    pthread_mutex_unlock(&share->takeover_lock);
+    return store;
+}
+
+static void share_free(struct block_share *share)
+{
+    cache_share_server_stop(share->server);
+    cache_block_destroy(atomic_load(&share->store));
+    if (share->lock_fd != -1) {
+        close(share->lock_fd);  /* Releases the lock for the next owner */
+    }
+    cache_share_peer_destroy(share->peer);
+    pthread_mutex_destroy(&share->takeover_lock);
+    free(share->dir);
+    free(share->socket_path);
+    free(share);
+}
+
+cache_block_ctx_t *cache_block_init_shared(const char *share_dir,
+                                            size_t block_size,
+                                            size_t max_cache_size,
+                                            size_t mem_cache_size,
+                                            bool dedup,
+                                            cache_codec_t codec,
+                                            int codec_level,
+                                            bool debug)
+{
+    if (share_dir == NULL) {
+        return NULL;
+    }
+
+    /* Peers are trusted with the store, so only our own user may be one */
+    struct stat dir_st;
+    if (stat(share_dir, &dir_st) != 0) {
+        DPRINTF("cache_block_init_shared: cannot stat %s: %s", share_dir, strerror(errno));
+        return NULL;
+    }
+    if (dir_st.st_uid != geteuid() || (dir_st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        DPRINTF("cache_block_init_shared: %s must belong to uid %u and not be writable by others",
+                share_dir, (unsigned)geteuid());
+        errno = EPERM;
+        return NULL;
+    }
+
+    cache_block_ctx_t *ctx = calloc(1, sizeof(cache_block_ctx_t));
+    struct block_share *share = calloc(1, sizeof(struct block_share));
+    if (ctx == NULL || share == NULL) {
+        free(ctx);
+        free(share);
+        return NULL;
+    }
+    ctx->block_size = block_size > 0 ? block_size : DEFAULT_BLOCK_SIZE;
+    ctx->debug = debug;
+    ctx->share = share;
+    share->lock_fd = -1;
+    share->max_cache_size = max_cache_size;
+    share->mem_cache_size = mem_cache_size;
+    share->dedup = dedup;
+    share->codec = codec;
+    share->codec_level = codec_level;
+    pthread_mutex_init(&share->takeover_lock, NULL);
+
+    char lock_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), "%s/%s", share_dir, CACHE_SHARE_LOCK_NAME);
+    share->dir = strdup(share_dir);
+    share->socket_path = malloc(PATH_MAX);
+    if (share->dir == NULL || share->socket_path == NULL) {
+        goto error;
+    }
+    snprintf(share->socket_path, PATH_MAX, "%s/%s", share_dir, CACHE_SHARE_SOCKET_NAME);
+
+    share->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (share->lock_fd == -1) {
+        DPRINTF("cache_block_init_shared: cannot open %s: %s", lock_path, strerror(errno));
+        goto error;
+    }
+    share->peer = cache_share_peer_create(share->socket_path, ctx->block_size, debug);
+    if (share->peer == NULL) {
+        DPRINTF("cache_block_init_shared: cannot use %s: %s", share->socket_path, strerror(errno));
+        goto error;
+    }
+
+    if (share_take(ctx) == NULL) {
+        /* Another mount owns it; make sure it takes blocks of our size */
+        cache_share_get_stats(share->peer, NULL, NULL);
+        if (cache_share_peer_rejected(share->peer)) {
+            goto error;
+        }
+        if (debug) {
+            DPRINTF("cache_block_init_shared: using the store at %s through its owner", share_dir);
+        }
+    }
+    return ctx;
+
+error:
+    share_free(share);
+    free(ctx);
+    return NULL;
+}
+
+bool cache_block_exists(cache_block_ctx_t *ctx,
+                        uint64_t file_key,
+                        size_t block_idx)
+{
+    if (ctx == NULL) {
+        return false;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_exists(ctx->share->peer, file_key, block_idx);
+        }
+        ctx = store;
+    }
+
+    return cache_mem_contains(ctx->mem, file_key, block_idx) ||
+           cache_index_lookup(ctx->index, file_key, block_idx, NULL);
+}
+
+/* Decompress a whole block to serve part of it. With a RAM tier the
+   decompressed copy is kept there, so hot blocks are unpacked once. */
+static ssize_t read_packed(cache_block_ctx_t *ctx,
+                           cache_fd_entry_t *file,
+                           const cache_index_entry_t *entry,
+                           char *buf,
+                           size_t size,
+                           size_t offset,
+                           bool *corrupt_out)
+{
+    char *packed = malloc(entry->stored);
+    char *block = malloc(entry->size);
+    ssize_t bytes = -1;
+    if (packed == NULL || block == NULL) {
+        goto out;
+    }
+
+    uint64_t tag = inval_seq_get(ctx, entry->file_key, entry->block_idx);
+    if (read_stored(cache_fd_fileno(file), entry, packed) != 0) {
+        *corrupt_out = true;
+        goto out;
+    }
+    cache_fd_set_verified(file, entry->crc);
+    if (cache_codec_decompress(entry->codec, packed, entry->stored, block, entry->size) !=
+            (ssize_t)entry->size) {
+        DPRINTF("cache_block_read: failed to decompress block %016" PRIx64 "-%zu",
+                entry->file_key, entry->block_idx);
+        drop_block(ctx, entry->file_key, entry->block_idx);
+        goto out;
+    }
+
+    if (ctx->mem != NULL) {
+        uint64_t valid = cache_bitmap_covered(ctx->granule, 0, entry->size, entry->eof);
+        cache_mem_store(ctx->mem, entry->file_key, entry->block_idx, block, 0, entry->size,
+                        valid, entry->eof, true, tag);
+        if (inval_seq_get(ctx, entry->file_key, entry->block_idx) != tag) {
+            cache_mem_invalidate(ctx->mem, entry->file_key, entry->block_idx);
+        }
+    }
+    memcpy(buf, block + offset, size);
+    bytes = size;
+
+out:
+    free(packed);
+    free(block);
+    return bytes;
+}
+
+ssize_t cache_block_read(cache_block_ctx_t *ctx,
+                         uint64_t file_key,
+                         size_t block_idx,
+                         char *buf,
+                         size_t size,
+                         size_t offset)
+{
+    if (ctx == NULL || buf == NULL) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_read(ctx->share->peer, file_key, block_idx, buf, size, offset);
+        }
+        ctx = store;
+    }
+
+    /* RAM tier hit: one memcpy, no syscalls */
+    ssize_t bytes = cache_mem_read(ctx->mem, file_key, block_idx, buf, size, offset);
+    if (bytes >= 0) {
+        return bytes;
+    }
+
+    cache_index_entry_t entry;
+    if (!cache_index_lookup(ctx->index, file_key, block_idx, &entry)) {
+        return -1;
+    }
+    if (!cache_bitmap_check(ctx->granule, entry.valid, entry.size, entry.eof, offset, &size)) {
+        return -1;
+    }
+    if (size == 0) {
+        return 0;  /* At or past end of file */
+    }
+
+    cache_fd_t *fds;
+    cache_fd_entry_t *file = open_stored(ctx, &entry, &fds);
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            /* Block file removed behind our back; drop the stale entry */
+            drop_block(ctx, file_key, block_idx);
+        }
+        return -1;
+    }
+
+    bool corrupt = false;
+    bytes = -1;
+    if (entry.codec != CACHE_CODEC_NONE) {
+        bytes = read_packed(ctx, file, &entry, buf, size, offset, &corrupt);
+    } else if (ctx->mem != NULL || !cache_fd_verified(file, entry.crc)) {
+        /* Read the whole block: to check it the first time through this
+           descriptor, and to promote it so the next hit is served from
+           memory */
+        char *block = malloc(entry.size > 0 ? entry.size : 1);
+        if (block != NULL) {
+            uint64_t tag = inval_seq_get(ctx, file_key, block_idx);
+            if (read_stored(cache_fd_fileno(file), &entry, block) != 0) {
+                corrupt = true;
+            } else if (offset + size <= entry.size) {
+                cache_fd_set_verified(file, entry.crc);
+                if (ctx->mem != NULL) {
+                    uint64_t valid = entry.valid &
+                        cache_bitmap_covered(ctx->granule, 0, entry.size, entry.eof);
+                    cache_mem_store(ctx->mem, file_key, block_idx, block, 0, entry.size,
+                                    valid, entry.eof, true, tag);
+                    if (inval_seq_get(ctx, file_key, block_idx) != tag) {
+                        cache_mem_invalidate(ctx->mem, file_key, block_idx);
+                    }
+                }
+                memcpy(buf, block + offset, size);
+                bytes = size;
+            }
+            free(block);
+        }
+    } else if (pread(cache_fd_fileno(file), buf, size, offset) == (ssize_t)size) {
+        bytes = size;
+    } else {
+        /* Shorter than the index says: truncated under us */
+        corrupt = true;
+    }
+    cache_fd_put(fds, file);
+
+    if (corrupt) {
+        block_corrupt(ctx, &entry);
+    }
+    if (ctx->debug && bytes > 0) {
+        DPRINTF("cache_block_read: read %zd bytes from block %016" PRIx64 "-%zu",
+                bytes, file_key, block_idx);
+    }
+
+    return bytes;
+}
+
+int cache_block_pin(cache_block_ctx_t *ctx,
+                    uint64_t file_key,
+                    size_t block_idx,
+                    size_t offset,
+                    size_t *size,
+                    cache_block_pin_t *pin)
+{
+    if (ctx == NULL || size == NULL || pin == NULL) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_pin(ctx->share->peer, file_key, block_idx, offset, size, pin);
+        }
+        ctx = store;
+    }
+
+    cache_index_entry_t entry;
+    if (!cache_index_lookup(ctx->index, file_key, block_idx, &entry) ||
+        entry.codec != CACHE_CODEC_NONE) {
+        return -1;
+    }
+    if (!cache_bitmap_check(ctx->granule, entry.valid, entry.size, entry.eof, offset, size)) {
+        return -1;
+    }
+
+    cache_fd_t *fds;
+    cache_fd_entry_t *file = open_stored(ctx, &entry, &fds);
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            drop_block(ctx, file_key, block_idx);
+        }
+        return -1;
+    }
+    if (verify_stored(file, &entry) != 0) {
+        cache_fd_put(fds, file);
+        block_corrupt(ctx, &entry);
+        return -1;
+    }
+
+    pin->fd = cache_fd_fileno(file);
+    pin->pos = offset;
+    pin->entry = file;
+    pin->shared = entry.shared;
+    pin->owned = false;
+    return 0;
+}
+
+void cache_block_unpin(cache_block_ctx_t *ctx, cache_block_pin_t *pin)
+{
+    if (pin != NULL && pin->owned) {
+        cache_share_unpin(pin);
+        return;
+    }
+    if (ctx == NULL || pin == NULL || pin->entry == NULL) {
+        return;
+    }
+    if (ctx->share != NULL && (ctx = atomic_load(&ctx->share->store)) == NULL) {
+        return;
+    }
+
+    cache_fd_put(pin->shared ? ctx->chunk_fds : ctx->fds, pin->entry);
+    pin->entry = NULL;
+}
+
+/* Store the valid granules of file data into the RAM tier if there is
+   one, else to disk */
+static int store_valid(cache_block_ctx_t *ctx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       const char *buf,
+                       size_t size,
+                       size_t offset,
+                       uint64_t valid,
+                       bool eof,
+                       uint64_t tag)
+{
+    /* With a RAM tier, fills go to memory and reach disk on demotion */
+    if (ctx->mem != NULL &&
+        cache_mem_store(ctx->mem, file_key, block_idx, buf, offset, size, valid, eof, false, tag) == 0) {
+        if (ctx->debug) {
+            DPRINTF("cache_block_write: stored %zu bytes at %zu of block %016" PRIx64 "-%zu in memory",
+                    size, offset, file_key, block_idx);
+        }
+        return 0;
+    }
+
+    return store_block_file(ctx, file_key, block_idx, buf, offset, size, valid, eof);
+}
+
+/* Store file data into the RAM tier if there is one, else to disk */
+static int store_block(cache_block_ctx_t *ctx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       const char *buf,
+                       size_t size,
+                       size_t offset,
+                       bool eof,
+                       uint64_t tag)
+{
+    uint64_t valid = cache_bitmap_covered(ctx->granule, offset, size, eof);
+    if (valid == 0) {
+        return -1;  /* Covers no whole granule */
+    }
+    return store_valid(ctx, file_key, block_idx, buf, size, offset, valid, eof, tag);
+}
+
+int cache_block_write(cache_block_ctx_t *ctx,
+                      uint64_t file_key,
+                      size_t block_idx,
+                      const char *buf,
+                      size_t size,
+                      size_t offset,
+                      bool eof)
+{
+    if (ctx == NULL || buf == NULL || offset + size > ctx->block_size) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_write(ctx->share->peer, file_key, block_idx, buf, size, offset, eof);
+        }
+        ctx = store;
+    }
+
+    return store_block(ctx, file_key, block_idx, buf, size, offset, eof,
+                       inval_seq_get(ctx, file_key, block_idx));
+}
+
+/* Claim a block for fetching. If another thread has it, wait for that
+   fill to end if asked to, and return false. */
+static bool fill_claim(cache_block_ctx_t *ctx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       cache_block_fill_t *fill,
+                       bool wait)
+{
+    memset(fill, 0, sizeof(*fill));
+    if (ctx == NULL) {
+        return true;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            if (!cache_share_fill_claim(ctx->share->peer, file_key, block_idx, wait, fill)) {
+                return false;
+            }
+            fill->ctx = ctx;
+            return true;
+        }
+        ctx = store;
+    }
+
+    struct fill_shard *shard = &ctx->fills[(file_key ^ block_idx) % FILL_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    struct block_fill *f;
+    for (f = shard->head; f != NULL; f = f->next) {
+        if (f->file_key == file_key && f->block_idx == block_idx) {
+            break;
+        }
+    }
+
+    if (f != NULL && !wait) {
+        pthread_mutex_unlock(&shard->lock);
+        return false;
+    }
+    if (f != NULL) {
+        /* Someone else is fetching it; wait for them to finish */
+        f->refs++;
+        while (!f->done) {
+            pthread_cond_wait(&shard->cond, &shard->lock);
+        }
+        bool last = (--f->refs == 0);
+        pthread_mutex_unlock(&shard->lock);
+        if (last) {
+            free(f);
+        }
+        return false;
+    }
+
+    f = calloc(1, sizeof(struct block_fill));
+    if (f != NULL) {
+        f->file_key = file_key;
+        f->block_idx = block_idx;
+        f->refs = 1;
+        f->next = shard->head;
+        shard->head = f;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    fill->ctx = ctx;
+    fill->file_key = file_key;
+    fill->block_idx = block_idx;
+    fill->tag = inval_seq_get(ctx, file_key, block_idx);
+    fill->entry = f;
+    return true;
+}
+
+bool cache_block_fill_begin(cache_block_ctx_t *ctx,
+                            uint64_t file_key,
+                            size_t block_idx,
+                            cache_block_fill_t *fill)
+{
+    return fill_claim(ctx, file_key, block_idx, fill, true);
+}
+
+bool cache_block_fill_try(cache_block_ctx_t *ctx,
+                          uint64_t file_key,
+                          size_t block_idx,
+                          cache_block_fill_t *fill)
+{
+    return fill_claim(ctx, file_key, block_idx, fill, false);
+}
+
+int cache_block_fill_end(cache_block_fill_t *fill,
+                         const char *buf,
+                         size_t size,
+                         bool eof)
+{
+    cache_block_ctx_t *ctx = fill->ctx;
+    if (ctx == NULL) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        /* Claimed from the owner; our own fills name our store */
+        fill->ctx = NULL;
+        return cache_share_fill_end(ctx->share->peer, fill, buf, size, eof);
+    }
+
+    int ret = -1;
+    if (buf != NULL && size > 0 && size <= ctx->block_size &&
+        inval_seq_get(ctx, fill->file_key, fill->block_idx) == fill->tag) {
+        ret = store_block(ctx, fill->file_key, fill->block_idx, buf, size, 0, eof, fill->tag);
+        /* A write that raced with the backend read may have invalidated
+           the block before we stored it; drop what we stored. */
+        if (ret == 0 && inval_seq_get(ctx, fill->file_key, fill->block_idx) != fill->tag) {
+            cache_mem_invalidate(ctx->mem, fill->file_key, fill->block_idx);
+            drop_block(ctx, fill->file_key, fill->block_idx);
+            ret = -1;
+        }
+    }
+
+    struct block_fill *f = fill->entry;
+    if (f != NULL) {
+        struct fill_shard *shard = &ctx->fills[(fill->file_key ^ fill->block_idx) % FILL_SHARDS];
+        pthread_mutex_lock(&shard->lock);
+        struct block_fill **pp = &shard->head;
+        while (*pp != f) {
+            pp = &(*pp)->next;
+        }
+        *pp = f->next;
+        f->done = true;
+        bool last = (--f->refs == 0);
+        pthread_cond_broadcast(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+        if (last) {
+            free(f);
+        }
+    }
+
+    fill->ctx = NULL;
+    return ret;
+}
+
+static void invalidate_block(cache_block_ctx_t *ctx, uint64_t file_key, size_t block_idx)
+{
+    inval_seq_bump_block(ctx, file_key, block_idx);
+    cache_mem_invalidate(ctx->mem, file_key, block_idx);
+    drop_block(ctx, file_key, block_idx);
+}
+
+/* A write from start_block on may extend the file, so a cached end of
+   file before it is no longer the end. */
+static void invalidate_tail_before(cache_block_ctx_t *ctx, uint64_t file_key, size_t start_block)
+{
+    size_t tail;
+    if (cache_mem_file_tail(ctx->mem, file_key, &tail) && tail < start_block) {
+        inval_seq_bump_block(ctx, file_key, tail);
+        cache_mem_invalidate(ctx->mem, file_key, tail);
+    }
+    if (cache_index_file_tail(ctx->index, file_key, &tail) == 0 && tail < start_block) {
+        inval_seq_bump_block(ctx, file_key, tail);
+        drop_block(ctx, file_key, tail);
+    }
+}
+
+/*
+ * Copy what is cached of a block into image, which has room for a whole
+ * block, and return the granules copied. *eof_len is set to the length of
+ * the block if it is known to end the file there, else to SIZE_MAX.
+ */
+static uint64_t snapshot_block(cache_block_ctx_t *ctx,
+                               uint64_t file_key,
+                               size_t block_idx,
+                               char *image,
+                               size_t *eof_len)
+{
+    size_t bs = ctx->block_size;
+    size_t g = ctx->granule;
+    *eof_len = SIZE_MAX;
+
+    /* Complete blocks, including compressed ones, in one read */
+    ssize_t n = cache_block_read(ctx, file_key, block_idx, image, bs, 0);
+    if (n >= 0) {
+        if ((size_t)n < bs) {
+            *eof_len = n;
+        }
+        return cache_bitmap_covered(g, 0, n, (size_t)n < bs);
+    }
+    if (!cache_block_exists(ctx, file_key, block_idx)) {
+        return 0;
+    }
+
+    /* Partial blocks are raw, so reading them by granule is cheap */
+    uint64_t valid = 0;
+    bool prev_valid = true;
+    for (size_t i = 0, off = 0; off < bs; i++, off += g) {
+        size_t want = bs - off < g ? bs - off : g;
+        n = cache_block_read(ctx, file_key, block_idx, image + off, want, off);
+        if (n < 0) {
+            prev_valid = false;
+            continue;
+        }
+        if ((size_t)n == want) {
+            valid |= 1ULL << i;
+            prev_valid = true;
+            continue;
+        }
+        /* Short: this granule ends the file. An empty read only says the
+           end is at or before off. */
+        if (n > 0) {
+            valid |= 1ULL << i;
+            *eof_len = off + n;
+        } else if (prev_valid) {
+            *eof_len = off;
+        }
+        break;
+    }
+    return valid;
+}
+
+/*
+ * Merge written bytes [ws, we) of a block into its cached copy and store
+ * the result in place of it. new_len is the length of the block after the
+ * write and eof whether it now ends the file. Returns 0 on success.
+ */
+static int merge_block(cache_block_ctx_t *ctx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       char *image,
+                       const char *data,
+                       size_t ws,
+                       size_t we,
+                       size_t new_len,
+                       bool eof)
+{
+    size_t g = ctx->granule;
+    size_t eof_len;
+    uint64_t valid = snapshot_block(ctx, file_key, block_idx, image, &eof_len);
+    size_t known_start = ws;
+    size_t known_end = we;
+
+    if (eof_len != SIZE_MAX && eof_len > new_len) {
+        valid = 0;  /* Shrunk behind our back; keep only what we wrote */
+    } else if (eof_len != SIZE_MAX && eof_len < new_len) {
+        /* The old end of file is no longer the end: its last granule holds
+           data only up to eof_len, which joins the write if they touch */
+        size_t tail_start = eof_len / g * g;
+        valid &= ~cache_bitmap_bits(tail_start / g, CACHE_BITMAP_GRANULES);
+        if (ws <= eof_len && we >= tail_start) {
+            known_start = ws < tail_start ? ws : tail_start;
+            known_end = we > eof_len ? we : eof_len;
+        }
+    }
+
+    memcpy(image + ws, data, we - ws);
+    valid |= cache_bitmap_covered(g, known_start, known_end - known_start,
+                                  eof && known_end >= new_len);
+    valid &= cache_bitmap_covered(g, 0, new_len, true);
+
+    invalidate_block(ctx, file_key, block_idx);
+    if (valid == 0) {
+        return -1;
+    }
+
+    /* Stop at the last valid granule, so the extent covers no unknown tail */
+    size_t len = (CACHE_BITMAP_GRANULES - __builtin_clzll(valid)) * g;
+    if (len > new_len) {
+        len = new_len;
+    }
+    uint64_t tag = inval_seq_get(ctx, file_key, block_idx);
+    if (store_valid(ctx, file_key, block_idx, image, len, 0, valid, eof && len == new_len, tag) != 0) {
+        return -1;
     }
+    if (inval_seq_get(ctx, file_key, block_idx) != tag) {
+        cache_mem_invalidate(ctx->mem, file_key, block_idx);
+        drop_block(ctx, file_key, block_idx);
+        return -1;
+    }
+    return 0;
+}
+
+int cache_block_update_begin(cache_block_ctx_t *ctx,
+                             uint64_t file_key,
+                             off_t offset,
+                             size_t size,
+                             cache_block_update_t *upd)
+{
+    memset(upd, 0, sizeof(*upd));
+    if (ctx == NULL || size == 0 || offset < 0) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            if (cache_share_update_begin(ctx->share->peer, file_key, offset, size, upd) != 0) {
+                return -1;
+            }
+            upd->ctx = ctx;
+            return 0;
+        }
+        ctx = store;
+    }
+
+    size_t first = offset / ctx->block_size;
+    size_t last = (offset + size - 1) / ctx->block_size;
+    upd->fills = calloc(last - first + 1, sizeof(cache_block_fill_t));
+    if (upd->fills == NULL) {
+        return -1;
+    }
+    upd->ctx = ctx;
+    upd->file_key = file_key;
+    upd->offset = offset;
+    upd->size = size;
+    upd->first_block = first;
+    upd->count = last - first + 1;
 
+    /* In ascending order, so overlapping updates can't deadlock. A claim
+       only fails after waiting for another one, so retry until it holds. */
+    for (size_t i = 0; i < upd->count; i++) {
+        while (!cache_block_fill_begin(ctx, file_key, first + i, &upd->fills[i])) {
+        }
+    }
     return 0;
 }
 
-int cache_block_invalidate_file(cache_block_ctx_t *ctx, const char *path)
+int cache_block_update_end(cache_block_update_t *upd,
+                           const char *buf,
+                           ssize_t written,
+                           off_t file_size)
 {
-    if (ctx == NULL || path == NULL) {
+    cache_block_ctx_t *ctx = upd->ctx;
+    if (ctx == NULL) {
         return -1;
     }
+    if (ctx->share != NULL) {
+        upd->ctx = NULL;
+        return cache_share_update_end(ctx->share->peer, upd, buf, written, file_size);
+    }
 
-    /* Invalidate all blocks by removing entire hash directory */
-    unsigned long hash = hash_path(path);
-    char dir_path[PATH_MAX];
-    unsigned char h1 = (hash >> 8) & 0xFF;
-    unsigned char h2 = hash & 0xFF;
-    
-    snprintf(dir_path, PATH_MAX, "%s/%02x/%02x", ctx->blocks_dir, h1, h2);
-
-    /* Remove all blocks matching this hash prefix */
-    DIR *dp = opendir(dir_path);
-    if (dp != NULL) {
-        struct dirent *de;
-        char block_prefix[32];
-        snprintf(block_prefix, sizeof(block_prefix), "%016lx-", hash);
-        
-        while ((de = readdir(dp)) != NULL) {
-            if (strncmp(de->d_name, block_prefix, strlen(block_prefix)) == 0) {
-                char full_path[PATH_MAX];
-                snprintf(full_path, PATH_MAX, "%s/%s", dir_path, de->d_name);
-                
-                struct stat st;
-                if (stat(full_path, &st) == 0) {
-                    if (unlink(full_path) == 0) {
-                        ctx->current_cache_size -= st.st_size;
-                    }
-                }
+    size_t bs = ctx->block_size;
+    off_t end = upd->offset + (written > 0 ? written : 0);
+    bool merge = written > 0 && file_size >= end && buf != NULL;
+    char *image = merge ? malloc(bs) : NULL;
+    int ret = 0;
+
+    if (written > 0) {
+        invalidate_tail_before(ctx, upd->file_key, upd->first_block);
+    }
+
+    for (size_t i = 0; i < upd->count; i++) {
+        size_t block_idx = upd->first_block + i;
+        off_t base = (off_t)block_idx * bs;
+        if (image == NULL || base >= end) {
+            /* Unchanged by a short write, but a fill may have been waiting */
+            if (written > 0) {
+                invalidate_block(ctx, upd->file_key, block_idx);
+                ret = -1;
             }
+        } else {
+            size_t ws = upd->offset > base ? upd->offset - base : 0;
+            size_t we = end - base < (off_t)bs ? (size_t)(end - base) : bs;
+            size_t new_len = file_size - base < (off_t)bs ? (size_t)(file_size - base) : bs;
+            bool eof = file_size - base < (off_t)bs;
+            if (merge_block(ctx, upd->file_key, block_idx, image, buf + (base + ws - upd->offset),
+                            ws, we, new_len, eof) == 0) {
+                cache_stats_add(CACHE_CTR_POPULATED_BYTES, we - ws);
+            } else {
+                ret = -1;
+            }
+        }
+        cache_block_fill_end(&upd->fills[i], NULL, 0, false);
+    }
+
+    if (ctx->debug && written > 0) {
+        DPRINTF("cache_block_update_end: %s blocks %zu-%zu of %016" PRIx64,
+                ret == 0 ? "updated" : "updated or invalidated", upd->first_block,
+                upd->first_block + upd->count - 1, upd->file_key);
+    }
+
+    free(image);
+    free(upd->fills);
+    upd->fills = NULL;
+    upd->ctx = NULL;
+    return ret;
+}
+
+int cache_block_invalidate_range(cache_block_ctx_t *ctx,
+                                  uint64_t file_key,
+                                  off_t offset,
+                                  size_t size)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_invalidate_range(ctx->share->peer, file_key, offset, size);
+        }
+        ctx = store;
+    }
+
+    size_t start_block = offset / ctx->block_size;
+    size_t end_block = (offset + size) / ctx->block_size;
+
+    invalidate_tail_before(ctx, file_key, start_block);
+    for (size_t i = start_block; i <= end_block; i++) {
+        invalidate_block(ctx, file_key, i);
+    }
+
+    if (ctx->debug) {
+        DPRINTF("cache_block_invalidate_range: invalidated blocks %zu-%zu of %016" PRIx64,
+                start_block, end_block, file_key);
+    }
+
+    return 0;
+}
+
+/* Drop the indexed blocks of one file */
+static int drop_file_blocks(cache_block_ctx_t *ctx, uint64_t file_key, size_t *count_out)
+{
+    size_t *blocks = NULL;
+    size_t count = 0;
+
+    if (cache_index_file_blocks(ctx->index, file_key, &blocks, &count) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        drop_block(ctx, file_key, blocks[i]);
+    }
+    free(blocks);
+
+    *count_out = count;
+    return 0;
+}
+
+int cache_block_invalidate_file(cache_block_ctx_t *ctx, uint64_t file_key)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_invalidate_file(ctx->share->peer, file_key);
         }
-        closedir(dp);
+        ctx = store;
+    }
+
+    inval_seq_bump_file(ctx, file_key);
+    cache_mem_invalidate_file(ctx->mem, file_key);
+
+    size_t count = 0;
+    if (drop_file_blocks(ctx, file_key, &count) != 0) {
+        return -1;
     }
 
     if (ctx->debug) {
-        DPRINTF("cache_block_invalidate_file: invalidated all blocks for %s", path);
+        DPRINTF("cache_block_invalidate_file: invalidated %zu blocks of %016" PRIx64, count, file_key);
     }
 
     return 0;
 }
 
+int cache_block_invalidate_all(cache_block_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_invalidate_all(ctx->share->peer);
+        }
+        ctx = store;
+    }
+
+    /* Fills already under way must not store what they read */
+    for (size_t i = 0; i < INVAL_SLOTS; i++) {
+        atomic_fetch_add(&ctx->file_seq[i], 1);
+    }
+    cache_mem_invalidate_all(ctx->mem);
+
+    uint64_t *keys = NULL;
+    size_t key_count = 0;
+    if (cache_index_file_keys(ctx->index, &keys, &key_count) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < key_count; i++) {
+        size_t dropped = 0;
+        if (drop_file_blocks(ctx, keys[i], &dropped) != 0) {
+            ret = -1;
+        }
+        count += dropped;
+    }
+    free(keys);
+
+    if (ctx->debug) {
+        DPRINTF("cache_block_invalidate_all: invalidated %zu blocks of %zu files", count, key_count);
+    }
+
+    return ret;
+}
+
+/* Clone one complete block. Shared content gains a reference, and a
+   block file, which is only ever replaced whole, is hard linked. */
+static bool clone_block(cache_block_ctx_t *ctx,
+                        uint64_t src_key,
+                        size_t src_idx,
+                        uint64_t dst_key,
+                        size_t dst_idx,
+                        bool dst_eof)
+{
+    cache_index_entry_t e;
+    uint64_t whole;
+    if (!cache_index_lookup(ctx->index, src_key, src_idx, &e) || e.eof != dst_eof ||
+        (!e.eof && e.size != ctx->block_size)) {
+        return false;
+    }
+    whole = cache_bitmap_overlap(ctx->granule, 0, e.size);
+    if ((e.valid & whole) != whole) {
+        return false;
+    }
+
+    if (e.shared) {
+        return cache_index_insert_shared(ctx->index, dst_key, dst_idx, e.size, e.eof,
+                                         &e.digest, e.stored, e.codec, e.crc) == 0;
+    }
+
+    char src_path[PATH_MAX];
+    char dst_path[PATH_MAX];
+    format_block_path(ctx, src_key, src_idx, src_path, sizeof(src_path));
+    format_block_path(ctx, dst_key, dst_idx, dst_path, sizeof(dst_path));
+
+    pthread_mutex_t *lock = store_lock(ctx, dst_key, dst_idx);
+    pthread_mutex_lock(lock);
+    bool ok = false;
+    if (create_block_dir(dst_path) == 0 && link(src_path, dst_path) == 0) {
+        cache_fd_invalidate(ctx->fds, dst_key, dst_idx);
+        if (e.codec != CACHE_CODEC_NONE) {
+            ok = cache_index_insert_packed(ctx->index, dst_key, dst_idx, e.size, e.eof,
+                                           e.stored, e.codec, e.crc) == 0;
+        } else {
+            ok = cache_index_insert(ctx->index, dst_key, dst_idx, e.size, e.valid, e.eof,
+                                    e.crc, 0, NULL) == 0;
+        }
+        if (!ok) {
+            unlink(dst_path);
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return ok;
+}
+
+size_t cache_block_clone_range(cache_block_ctx_t *ctx,
+                               uint64_t src_key,
+                               off_t src_offset,
+                               uint64_t dst_key,
+                               off_t dst_offset,
+                               size_t len,
+                               off_t dst_size)
+{
+    if (ctx == NULL || len == 0) {
+        return 0;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_clone_range(ctx->share->peer, src_key, src_offset, dst_key, dst_offset,
+                                           len, dst_size);
+        }
+        ctx = store;
+    }
+
+    off_t bs = (off_t)ctx->block_size;
+    if (src_offset % bs != dst_offset % bs) {
+        return 0;
+    }
+
+    off_t src_end = src_offset + (off_t)len;
+    off_t first = (src_offset + bs - 1) / bs;   /* First block starting in range */
+    off_t shift = (dst_offset - src_offset) / bs;
+    size_t cloned = 0;
+
+    for (off_t b = first; b * bs < src_end; b++) {
+        /* A block cut short by the range is complete only if it ends
+           both files */
+        bool tail = (b + 1) * bs > src_end;
+        if (tail && dst_offset + (off_t)len != dst_size) {
+            break;
+        }
+        if (clone_block(ctx, src_key, b, dst_key, b + shift, tail)) {
+            cloned++;
+        }
+    }
+
+    if (ctx->debug && cloned > 0) {
+        DPRINTF("cache_block_clone_range: cloned %zu blocks of %016" PRIx64 " to %016" PRIx64,
+                cloned, src_key, dst_key);
+    }
+    return cloned;
+}
+
+int cache_block_set_pinned(cache_block_ctx_t *ctx, uint64_t file_key, bool pinned)
+{
+    if (ctx == NULL) {
+        return -1;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            return cache_share_set_pinned(ctx->share->peer, file_key, pinned);
+        }
+        ctx = store;
+    }
+
+    int ret = cache_index_set_pinned(ctx->index, file_key, pinned);
+    if (ctx->debug && ret == 0) {
+        DPRINTF("cache_block: %s %016" PRIx64, pinned ? "pinned" : "unpinned", file_key);
+    }
+    return ret;
+}
+
+void cache_block_get_pinned(cache_block_ctx_t *ctx,
+                            size_t *pinned_size_out,
+                            size_t *file_count_out)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            cache_share_get_pinned(ctx->share->peer, pinned_size_out, file_count_out);
+            return;
+        }
+        ctx = store;
+    }
+
+    cache_index_get_pinned(ctx->index, pinned_size_out, file_count_out);
+}
+
 void cache_block_get_stats(cache_block_ctx_t *ctx,
                            size_t *current_size_out,
                            size_t *max_size_out)
@@ -513,11 +2257,19 @@ void cache_block_get_stats(cache_block_ctx_t *ctx,
     if (ctx == NULL) {
         return;
     }
-    
+    if (ctx->share != NULL) {
+        cache_block_ctx_t *store = shared_store(ctx);
+        if (store == NULL) {
+            cache_share_get_stats(ctx->share->peer, current_size_out, max_size_out);
+            return;
+        }
+        ctx = store;
+    }
+
     if (current_size_out != NULL) {
-        *current_size_out = ctx->current_cache_size;
+        cache_index_get_totals(ctx->index, current_size_out, NULL);
     }
-    
+
     if (max_size_out != NULL) {
         *max_size_out = ctx->max_cache_size;
     }
@@ -528,8 +2280,47 @@ void cache_block_destroy(cache_block_ctx_t *ctx)
     if (ctx == NULL) {
         return;
     }
+    if (ctx->share != NULL) {
+        share_free(ctx->share);
+        free(ctx);
+        return;
+    }
 
+    if (ctx->scrub_started) {
+        atomic_store(&ctx->scrub_stop, true);
+        pthread_join(ctx->scrub_thread, NULL);
+    }
+
+    /* Flush the RAM tier to disk while the index is still open */
+    cache_mem_destroy(ctx->mem);
+
+    pthread_mutex_lock(&ctx->evict_lock);
+    ctx->evict_stop = true;
+    pthread_cond_signal(&ctx->evict_cond);
+    pthread_mutex_unlock(&ctx->evict_lock);
+    pthread_join(ctx->evict_thread, NULL);
+    pthread_cond_destroy(&ctx->evict_cond);
+    pthread_mutex_destroy(&ctx->evict_lock);
+
+    for (int i = 0; i < FILL_SHARDS; i++) {
+        pthread_cond_destroy(&ctx->fills[i].cond);
+        pthread_mutex_destroy(&ctx->fills[i].lock);
+    }
+    for (int i = 0; i < STORE_LOCKS; i++) {
+        pthread_mutex_destroy(&ctx->store_locks[i]);
+    }
+
+    /* With every block on disk, the next start can trust them all. An
+       unfinished scrub is picked up again by the next start instead. */
+    if (atomic_load(&ctx->scrub_done) && sync_blocks(ctx) == 0) {
+        cache_index_mark_clean(ctx->index);
+    }
+    cache_index_close(ctx->index);
+    cache_fd_destroy(ctx->fds);
+    cache_fd_destroy(ctx->chunk_fds);
+    free(ctx->scrub_entries);
     free(ctx->blocks_dir);
+    free(ctx->tmp_dir);
     free(ctx);
 
     DPRINTF("cache_block_destroy: block cache destroyed");
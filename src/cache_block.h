@@ -22,93 +22,332 @@
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "cache_compress.h"
 
 #define DEFAULT_BLOCK_SIZE (256 * 1024)  /* 256 KiB */
 
 /* Opaque block cache handle */
 typedef struct cache_block_ctx cache_block_ctx_t;
 
+/* A block fill in progress, set up by cache_block_fill_begin() */
+typedef struct cache_block_fill {
+    cache_block_ctx_t *ctx;
+    uint64_t file_key;
+    size_t block_idx;
+    uint64_t tag;               /* Invalidation tag when the fill began */
+    void *entry;                /* In-flight table entry */
+    uint64_t claim;             /* Claim held by the owner of a shared store */
+} cache_block_fill_t;
+
+/* Blocks claimed for a write by cache_block_update_begin() */
+typedef struct cache_block_update {
+    cache_block_ctx_t *ctx;
+    uint64_t file_key;
+    off_t offset;
+    size_t size;
+    size_t first_block;
+    size_t count;
+    cache_block_fill_t *fills;  /* One claim per block */
+    uint64_t claim;             /* Claim held by the owner of a shared store */
+} cache_block_update_t;
+
+/* A cached block file held open so data can be read from its fd */
+typedef struct {
+    int fd;                     /* Descriptor to read from */
+    off_t pos;                  /* Offset of the requested data in fd */
+    void *entry;                /* Fd cache entry */
+    bool shared;                /* Entry belongs to the shared content fds */
+    bool owned;                 /* fd is the pin's own, sent by a shared store's owner */
+} cache_block_pin_t;
+
 /**
  * Initialize block cache.
  * @param cache_root Root directory for cache storage
  * @param block_size Block size in bytes
  * @param max_cache_size Maximum total cache size in bytes (0 = unlimited)
+ * @param mem_cache_size Size of the in-memory tier in bytes (0 = disabled)
+ * @param dedup Store complete blocks once per distinct content
+ * @param codec Compression of complete blocks (CACHE_CODEC_NONE = off)
+ * @param codec_level Compression level (0 = codec default)
  * @param debug Enable debug logging
  * @return Cache context or NULL on error
  */
 cache_block_ctx_t *cache_block_init(const char *cache_root,
                                      size_t block_size,
                                      size_t max_cache_size,
+                                     size_t mem_cache_size,
+                                     bool dedup,
+                                     cache_codec_t codec,
+                                     int codec_level,
                                      bool debug);
 
 /**
- * Check if a block exists in cache.
+ * Attach to a block store shared with other mounts. The mount that
+ * holds the store's lock opens it like cache_block_init() and serves it
+ * to the others on a unix socket in the same directory; the others send
+ * it their calls, and one of them takes the store over when the owner
+ * goes away. The size limits, dedup and compression of the owner apply.
+ * A store serves a single user: share_dir must belong to the effective
+ * user and be writable by no one else, so every mount on it runs as that
+ * user and trusts the others' file keys.
+ * @param share_dir Directory of the shared store
+ * @param block_size Block size in bytes; must match every other mount
+ * @param max_cache_size Maximum store size in bytes, if this mount owns it
+ * @param mem_cache_size Size of the in-memory tier, if this mount owns it
+ * @param dedup Store complete blocks once per distinct content
+ * @param codec Compression of complete blocks (CACHE_CODEC_NONE = off)
+ * @param codec_level Compression level (0 = codec default)
+ * @param debug Enable debug logging
+ * @return Cache context or NULL on error, including when the owner uses
+ *         another block size or share_dir is open to other users
+ */
+cache_block_ctx_t *cache_block_init_shared(const char *share_dir,
+                                            size_t block_size,
+                                            size_t max_cache_size,
+                                            size_t mem_cache_size,
+                                            bool dedup,
+                                            cache_codec_t codec,
+                                            int codec_level,
+                                            bool debug);
+
+/**
+ * Check if any part of a block exists in cache.
  * @param ctx Cache context
- * @param path File path
+ * @param file_key File key from cache_file_key()
  * @param block_idx Block index
  * @return true if block exists, false otherwise
  */
 bool cache_block_exists(cache_block_ctx_t *ctx,
-                        const char *path,
+                        uint64_t file_key,
                         size_t block_idx);
 
 /**
- * Read a block from cache.
+ * Read part of a block from cache. The range must lie within the block.
  * @param ctx Cache context
- * @param path File path
+ * @param file_key File key
  * @param block_idx Block index
  * @param buf Output buffer
  * @param size Number of bytes to read
  * @param offset Offset within block
- * @return Number of bytes read, or -1 on error
+ * @return Number of bytes read (short only at end of file), or -1 if the
+ *         range is not fully cached
  */
 ssize_t cache_block_read(cache_block_ctx_t *ctx,
-                         const char *path,
+                         uint64_t file_key,
                          size_t block_idx,
                          char *buf,
                          size_t size,
                          size_t offset);
 
 /**
- * Write a block to cache.
+ * Hold the file of a cached block open, so part of it can be read from
+ * the fd directly (e.g. spliced) instead of being copied. The fd stays
+ * valid until cache_block_unpin(), even if the block is dropped meanwhile.
+ * Blocks that are only in memory or stored compressed can't be pinned.
  * @param ctx Cache context
- * @param path File path
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param offset Offset within block
+ * @param size Requested bytes, clipped to the end of file on return
+ * @param pin Output pin
+ * @return 0 on success, -1 if the range can't be served from a block file
+ */
+int cache_block_pin(cache_block_ctx_t *ctx,
+                    uint64_t file_key,
+                    size_t block_idx,
+                    size_t offset,
+                    size_t *size,
+                    cache_block_pin_t *pin);
+
+/**
+ * Release a pin taken by cache_block_pin().
+ * @param ctx Cache context
+ * @param pin Pin to release
+ */
+void cache_block_unpin(cache_block_ctx_t *ctx, cache_block_pin_t *pin);
+
+/**
+ * Store file data into a block, merging it with what is already cached.
+ * Only whole granules of the validity bitmap become valid, except that
+ * data ending the file also validates its last partial granule.
+ * With a memory tier the data is kept in RAM and written to disk when
+ * the block is demoted.
+ * @param ctx Cache context
+ * @param file_key File key
  * @param block_idx Block index
  * @param buf Input buffer
  * @param size Number of bytes to write
+ * @param offset Offset within block (offset + size must not exceed the block)
+ * @param eof true if the data ends at the end of the file
  * @return 0 on success, -1 on error
  */
 int cache_block_write(cache_block_ctx_t *ctx,
-                      const char *path,
+                      uint64_t file_key,
                       size_t block_idx,
                       const char *buf,
-                      size_t size);
+                      size_t size,
+                      size_t offset,
+                      bool eof);
+
+/**
+ * Claim a missing block for fetching from the backend. Only one thread
+ * fetches a given block at a time: if another thread is already fetching
+ * it, wait until it is done and return false so the caller can retry its
+ * cache read. Otherwise the caller must fetch the block and hand it to
+ * cache_block_fill_end().
+ * @param ctx Cache context
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param fill Fill state, set up for cache_block_fill_end()
+ * @return true if the caller should fetch the block, false if it waited
+ *         for another thread's fill
+ */
+bool cache_block_fill_begin(cache_block_ctx_t *ctx,
+                            uint64_t file_key,
+                            size_t block_idx,
+                            cache_block_fill_t *fill);
+
+/**
+ * Claim a missing block like cache_block_fill_begin(), but without
+ * waiting: return false at once if another thread is fetching it. For
+ * callers that already hold claims, or that are only prefetching.
+ * @param ctx Cache context
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param fill Fill state, set up for cache_block_fill_end()
+ * @return true if the caller should fetch the block
+ */
+bool cache_block_fill_try(cache_block_ctx_t *ctx,
+                          uint64_t file_key,
+                          size_t block_idx,
+                          cache_block_fill_t *fill);
+
+/**
+ * Finish a fill started by cache_block_fill_begin() and wake its waiters.
+ * The data is stored unless the block was invalidated since the fill began.
+ * @param fill Fill state
+ * @param buf Block contents from the start of the block, or NULL if the
+ *            backend read failed
+ * @param size Number of bytes in buf
+ * @param eof true if the data ends at the end of the file
+ * @return 0 if the data was stored, -1 otherwise
+ */
+int cache_block_fill_end(cache_block_fill_t *fill,
+                         const char *buf,
+                         size_t size,
+                         bool eof);
+
+/**
+ * Claim the blocks a write will change, before sending it to the backend.
+ * Fills and other updates of those blocks wait until the update ends, so
+ * the cache applies writes in the order the backend did.
+ * @param ctx Cache context
+ * @param file_key File key
+ * @param offset File offset of the write
+ * @param size Number of bytes to be written
+ * @param upd Update state, set up for cache_block_update_end()
+ * @return 0 on success, -1 on error (nothing is claimed)
+ */
+int cache_block_update_begin(cache_block_ctx_t *ctx,
+                             uint64_t file_key,
+                             off_t offset,
+                             size_t size,
+                             cache_block_update_t *upd);
+
+/**
+ * Merge the written data into the claimed blocks and release them. Bytes
+ * already cached around the write stay valid, so the blocks need no
+ * backend read afterwards. Blocks that can't be merged are invalidated.
+ * @param upd Update from cache_block_update_begin()
+ * @param buf Data that was written
+ * @param written Bytes the backend accepted (0 or less invalidates the range)
+ * @param file_size Size of the file after the write, or -1 if unknown
+ * @return 0 if every block was updated, -1 if some were invalidated
+ */
+int cache_block_update_end(cache_block_update_t *upd,
+                           const char *buf,
+                           ssize_t written,
+                           off_t file_size);
 
 /**
  * Invalidate a range of blocks.
  * @param ctx Cache context
- * @param path File path
+ * @param file_key File key
  * @param offset File offset where write occurred
  * @param size Number of bytes written
  * @return 0 on success, -1 on error
  */
 int cache_block_invalidate_range(cache_block_ctx_t *ctx,
-                                  const char *path,
+                                  uint64_t file_key,
                                   off_t offset,
                                   size_t size);
 
 /**
  * Invalidate all blocks for a file.
  * @param ctx Cache context
- * @param path File path
+ * @param file_key File key
+ * @return 0 on success, -1 on error
+ */
+int cache_block_invalidate_file(cache_block_ctx_t *ctx, uint64_t file_key);
+
+/**
+ * Invalidate every cached block, for when backend changes may have gone
+ * unnoticed. Pins are kept; pinned files are fetched again as they are read.
+ * @param ctx Cache context
+ * @return 0 on success, -1 on error
+ */
+int cache_block_invalidate_all(cache_block_ctx_t *ctx);
+
+/**
+ * Give the destination of a backend copy_file_range() the cached blocks
+ * of the source it now duplicates. Only complete source blocks lying
+ * wholly inside the copied range are cloned, and only when both offsets
+ * sit at the same position within a block. Call it after invalidating
+ * the destination range.
+ * @param ctx Cache context
+ * @param src_key File key of the source
+ * @param src_offset Source offset of the copy
+ * @param dst_key File key of the destination
+ * @param dst_offset Destination offset of the copy
+ * @param len Number of bytes copied
+ * @param dst_size Size of the destination after the copy
+ * @return Number of blocks cloned
+ */
+size_t cache_block_clone_range(cache_block_ctx_t *ctx,
+                               uint64_t src_key,
+                               off_t src_offset,
+                               uint64_t dst_key,
+                               off_t dst_offset,
+                               size_t len,
+                               off_t dst_size);
+
+/**
+ * Pin or unpin the blocks of a file. Blocks of a pinned file are exempt
+ * from eviction, including ones cached after the pin, until unpinned.
+ * Not to be confused with cache_block_pin(), which holds a block fd.
+ * @param ctx Cache context
+ * @param file_key File key
+ * @param pinned true to pin, false to unpin
  * @return 0 on success, -1 on error
  */
-int cache_block_invalidate_file(cache_block_ctx_t *ctx, const char *path);
+int cache_block_set_pinned(cache_block_ctx_t *ctx, uint64_t file_key, bool pinned);
+
+/**
+ * Get pinning statistics.
+ * @param ctx Cache context
+ * @param pinned_size_out On-disk bytes exempt from eviction (can be NULL)
+ * @param file_count_out Number of pinned files (can be NULL)
+ */
+void cache_block_get_pinned(cache_block_ctx_t *ctx,
+                            size_t *pinned_size_out,
+                            size_t *file_count_out);
 
 /**
  * Get current cache statistics.
  * @param ctx Cache context
- * @param current_size_out Current cache size in bytes (can be NULL)
+ * @param current_size_out Current on-disk cache size in bytes (can be NULL)
  * @param max_size_out Maximum cache size in bytes (can be NULL)
  */
 void cache_block_get_stats(cache_block_ctx_t *ctx,
@@ -64,6 +64,7 @@ bool cache_coherency_validate_dir(const char *path,
 int cache_coherency_check_and_invalidate(cache_meta_ctx_t *meta_ctx,
                                           cache_block_ctx_t *block_ctx,
                                           const char *path,
+                                          uint64_t file_key,
                                           const struct stat *backend_stat)
 {
     if (meta_ctx == NULL || path == NULL || backend_stat == NULL) {
@@ -83,8 +84,8 @@ int cache_coherency_check_and_invalidate(cache_meta_ctx_t *meta_ctx,
             cache_meta_invalidate(meta_ctx, path);
             
             /* Invalidate blocks if block cache available */
-            if (block_ctx != NULL) {
-                cache_block_invalidate_file(block_ctx, path);
+            if (block_ctx != NULL && file_key != 0) {
+                cache_block_invalidate_file(block_ctx, file_key);
             }
         }
     }
@@ -60,12 +60,14 @@ bool cache_coherency_validate_dir(const char *path,
  * @param meta_ctx Metadata cache context
  * @param block_ctx Block cache context
  * @param path File path
+ * @param file_key Block cache key of the file (0 if unknown)
  * @param backend_stat Backend stat structure
  * @return 0 on success, -1 on error
  */
 int cache_coherency_check_and_invalidate(cache_meta_ctx_t *meta_ctx,
                                           cache_block_ctx_t *block_ctx,
                                           const char *path,
+                                          uint64_t file_key,
                                           const struct stat *backend_stat);
 
 #endif /* CACHE_COHERENCY_H */
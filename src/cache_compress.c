@@ -0,0 +1,153 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include "cache_compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+int cache_codec_parse(const char *spec, cache_codec_t *codec_out, int *level_out)
+{
+    if (spec == NULL) {
+        return -1;
+    }
+
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+    int level = 0;
+    if (colon != NULL) {
+        char *end;
+        long l = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || l < 0 || l > 22) {
+            return -1;
+        }
+        level = (int)l;
+    }
+
+    cache_codec_t codec;
+    if (name_len == 3 && strncmp(spec, "lz4", 3) == 0) {
+        codec = CACHE_CODEC_LZ4;
+    } else if (name_len == 4 && strncmp(spec, "zstd", 4) == 0) {
+        codec = CACHE_CODEC_ZSTD;
+    } else {
+        return -1;
+    }
+    if (cache_codec_bound(codec, 1) == 0) {
+        return -1;  /* Not built in */
+    }
+
+    *codec_out = codec;
+    *level_out = level;
+    return 0;
+}
+
+const char *cache_codec_name(cache_codec_t codec)
+{
+    switch (codec) {
+    case CACHE_CODEC_LZ4:
+        return "lz4";
+    case CACHE_CODEC_ZSTD:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+size_t cache_codec_bound(cache_codec_t codec, size_t len)
+{
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case CACHE_CODEC_LZ4:
+        return len <= LZ4_MAX_INPUT_SIZE ? (size_t)LZ4_compressBound((int)len) : 0;
+#endif
+#ifdef HAVE_ZSTD
+    case CACHE_CODEC_ZSTD:
+        return ZSTD_compressBound(len);
+#endif
+    default:
+        (void)len;
+        return 0;
+    }
+}
+
+ssize_t cache_codec_compress(cache_codec_t codec, int level,
+                             const char *src, size_t len,
+                             char *dst, size_t cap)
+{
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case CACHE_CODEC_LZ4: {
+        if (len > LZ4_MAX_INPUT_SIZE) {
+            return -1;
+        }
+        int cap_int = cap > INT_MAX ? INT_MAX : (int)cap;
+        /* A level selects the slower high-compression variant */
+        int n = level > 0 ? LZ4_compress_HC(src, dst, (int)len, cap_int, level)
+                          : LZ4_compress_default(src, dst, (int)len, cap_int);
+        return n > 0 ? n : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CACHE_CODEC_ZSTD: {
+        size_t n = ZSTD_compress(dst, cap, src, len, level);  /* 0 is zstd's default */
+        return ZSTD_isError(n) ? -1 : (ssize_t)n;
+    }
+#endif
+    default:
+        (void)level; (void)src; (void)len; (void)dst; (void)cap;
+        return -1;
+    }
+}
+
+ssize_t cache_codec_decompress(cache_codec_t codec,
+                               const char *src, size_t len,
+                               char *dst, size_t cap)
+{
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case CACHE_CODEC_LZ4: {
+        if (len > LZ4_MAX_INPUT_SIZE || cap > LZ4_MAX_INPUT_SIZE) {
+            return -1;
+        }
+        int n = LZ4_decompress_safe(src, dst, (int)len, (int)cap);
+        return n >= 0 ? n : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CACHE_CODEC_ZSTD: {
+        size_t n = ZSTD_decompress(dst, cap, src, len);
+        return ZSTD_isError(n) ? -1 : (ssize_t)n;
+    }
+#endif
+    default:
+        (void)src; (void)len; (void)dst; (void)cap;
+        return -1;
+    }
+}
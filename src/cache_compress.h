@@ -0,0 +1,93 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_COMPRESS_H
+#define CACHE_COMPRESS_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Block compression codecs.
+ *
+ * Which codecs exist depends on the libraries found by configure (LZ4,
+ * zstd). Codec numbers are stored in blocks.db, so they must never be
+ * renumbered.
+ */
+
+typedef enum {
+    CACHE_CODEC_NONE = 0,
+    CACHE_CODEC_LZ4 = 1,
+    CACHE_CODEC_ZSTD = 2
+} cache_codec_t;
+
+/**
+ * Parse a codec specification of the form NAME[:LEVEL], e.g. "lz4" or
+ * "zstd:9". Level 0 means the codec's default.
+ * @param spec Specification
+ * @param codec_out Codec
+ * @param level_out Compression level
+ * @return 0 on success, -1 if the codec is unknown or not built in
+ */
+int cache_codec_parse(const char *spec, cache_codec_t *codec_out, int *level_out);
+
+/**
+ * Get the name of a codec.
+ * @param codec Codec
+ * @return Codec name
+ */
+const char *cache_codec_name(cache_codec_t codec);
+
+/**
+ * Get the largest compressed size of len bytes.
+ * @param codec Codec
+ * @param len Uncompressed size
+ * @return Output buffer size that always suffices, 0 if the codec is not built in
+ */
+size_t cache_codec_bound(cache_codec_t codec, size_t len);
+
+/**
+ * Compress a buffer.
+ * @param codec Codec
+ * @param level Compression level (0 = default)
+ * @param src Data to compress
+ * @param len Number of bytes in src
+ * @param dst Output buffer
+ * @param cap Size of dst
+ * @return Compressed size, or -1 on error
+ */
+ssize_t cache_codec_compress(cache_codec_t codec, int level,
+                             const char *src, size_t len,
+                             char *dst, size_t cap);
+
+/**
+ * Decompress a buffer.
+ * @param codec Codec
+ * @param src Compressed data
+ * @param len Number of bytes in src
+ * @param dst Output buffer
+ * @param cap Size of dst
+ * @return Decompressed size, or -1 on error or if dst is too small
+ */
+ssize_t cache_codec_decompress(cache_codec_t codec,
+                               const char *src, size_t len,
+                               char *dst, size_t cap);
+
+#endif /* CACHE_COMPRESS_H */
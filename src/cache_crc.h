@@ -0,0 +1,43 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_CRC_H
+#define CACHE_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) checksums of stored blocks.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, the ARMv8 CRC
+ * extension when built for it, and a table otherwise. All give the same
+ * result, so a cache written on one machine checks out on another.
+ */
+
+/**
+ * Extend a CRC32C over more data.
+ * @param crc Checksum of the data so far, 0 to start
+ * @param data Data to add
+ * @param len Bytes of data
+ * @return Checksum of the data so far followed by data
+ */
+uint32_t cache_crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif /* CACHE_CRC_H */
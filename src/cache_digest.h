@@ -0,0 +1,70 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_DIGEST_H
+#define CACHE_DIGEST_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * 128-bit block content digests for deduplication.
+ *
+ * Digests are SipHash-2-4 with 128-bit output, keyed by a random secret
+ * kept in the cache root. Without the key nobody can construct two blocks
+ * with the same digest, so identical digests can be trusted to mean
+ * identical content.
+ */
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} cache_digest_t;
+
+/* Digest key */
+typedef struct {
+    uint64_t k0;
+    uint64_t k1;
+} cache_digest_key_t;
+
+static inline bool cache_digest_equal(const cache_digest_t *a, const cache_digest_t *b)
+{
+    return a->lo == b->lo && a->hi == b->hi;
+}
+
+/**
+ * Load the digest key from a file, creating it with random contents if
+ * it does not exist yet.
+ * @param path Key file
+ * @param key Output key
+ * @return 0 on success, -1 on error
+ */
+int cache_digest_load_key(const char *path, cache_digest_key_t *key);
+
+/**
+ * Compute the digest of a buffer.
+ * @param key Digest key
+ * @param data Data to digest
+ * @param len Number of bytes in data
+ * @param out Output digest
+ */
+void cache_digest(const cache_digest_key_t *key, const void *data, size_t len, cache_digest_t *out);
+
+#endif /* CACHE_DIGEST_H */
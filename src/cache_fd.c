@@ -0,0 +1,259 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_fd.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define FD_VERIFIED (1ULL << 32)    /* Set in entry->verified with the checksum */
+
+/* Cached descriptor */
+struct cache_fd_entry {
+    uint64_t file_key;
+    size_t block_idx;
+    int fd;
+    int refs;
+    bool cached;                    /* Still in the table */
+    atomic_uint_fast64_t verified;  /* FD_VERIFIED | crc once checked, else 0 */
+    struct cache_fd_entry *hash_next;
+    struct cache_fd_entry *lru_prev;    /* Towards the least recently used */
+    struct cache_fd_entry *lru_next;    /* Towards the most recently used */
+};
+
+/* Fd cache */
+struct cache_fd {
+    pthread_mutex_t lock;
+    struct cache_fd_entry **buckets;
+    size_t bucket_count;
+    size_t count;
+    size_t max_open;
+    struct cache_fd_entry *lru_head;    /* Least recently used */
+    struct cache_fd_entry *lru_tail;    /* Most recently used */
+};
+
+static size_t bucket_for(cache_fd_t *fds, uint64_t file_key, size_t block_idx)
+{
+    uint64_t h = file_key ^ (block_idx * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h % fds->bucket_count;
+}
+
+static void lru_unlink(cache_fd_t *fds, struct cache_fd_entry *e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else fds->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else fds->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_append(cache_fd_t *fds, struct cache_fd_entry *e)
+{
+    e->lru_prev = fds->lru_tail;
+    e->lru_next = NULL;
+    if (fds->lru_tail) fds->lru_tail->lru_next = e;
+    else fds->lru_head = e;
+    fds->lru_tail = e;
+}
+
+/* Take an entry out of the table; returns true if it can be closed now */
+static bool remove_locked(cache_fd_t *fds, struct cache_fd_entry *e)
+{
+    struct cache_fd_entry **pp = &fds->buckets[bucket_for(fds, e->file_key, e->block_idx)];
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
+    lru_unlink(fds, e);
+    e->cached = false;
+    fds->count--;
+    return e->refs == 0;
+}
+
+static void close_entry(struct cache_fd_entry *e)
+{
+    close(e->fd);
+    free(e);
+}
+
+cache_fd_t *cache_fd_create(size_t max_open)
+{
+    if (max_open == 0) {
+        return NULL;
+    }
+
+    cache_fd_t *fds = calloc(1, sizeof(cache_fd_t));
+    if (fds == NULL) {
+        return NULL;
+    }
+    fds->max_open = max_open;
+    fds->bucket_count = max_open * 2;
+    fds->buckets = calloc(fds->bucket_count, sizeof(struct cache_fd_entry *));
+    if (fds->buckets == NULL) {
+        free(fds);
+        return NULL;
+    }
+    pthread_mutex_init(&fds->lock, NULL);
+    return fds;
+}
+
+static struct cache_fd_entry *lookup_locked(cache_fd_t *fds, uint64_t file_key, size_t block_idx)
+{
+    struct cache_fd_entry *e = fds->buckets[bucket_for(fds, file_key, block_idx)];
+    while (e != NULL && (e->file_key != file_key || e->block_idx != block_idx)) {
+        e = e->hash_next;
+    }
+    return e;
+}
+
+cache_fd_entry_t *cache_fd_get(cache_fd_t *fds,
+                               uint64_t file_key,
+                               size_t block_idx,
+                               const char *path,
+                               bool create)
+{
+    pthread_mutex_lock(&fds->lock);
+    struct cache_fd_entry *e = lookup_locked(fds, file_key, block_idx);
+    if (e != NULL) {
+        e->refs++;
+        lru_unlink(fds, e);
+        lru_append(fds, e);
+        pthread_mutex_unlock(&fds->lock);
+        return e;
+    }
+    pthread_mutex_unlock(&fds->lock);
+
+    /* Open outside the lock; path lookup is the slow part */
+    int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct cache_fd_entry *victims = NULL;
+    pthread_mutex_lock(&fds->lock);
+    e = lookup_locked(fds, file_key, block_idx);
+    if (e != NULL) {
+        /* Lost a race with another opener; use theirs */
+        e->refs++;
+        pthread_mutex_unlock(&fds->lock);
+        close(fd);
+        return e;
+    }
+
+    e = calloc(1, sizeof(struct cache_fd_entry));
+    if (e == NULL) {
+        pthread_mutex_unlock(&fds->lock);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->file_key = file_key;
+    e->block_idx = block_idx;
+    e->fd = fd;
+    e->refs = 1;
+    e->cached = true;
+    size_t b = bucket_for(fds, file_key, block_idx);
+    e->hash_next = fds->buckets[b];
+    fds->buckets[b] = e;
+    lru_append(fds, e);
+    fds->count++;
+
+    /* Push out the least recently used; busy ones close on their last put */
+    while (fds->count > fds->max_open && fds->lru_head != e) {
+        struct cache_fd_entry *old = fds->lru_head;
+        if (remove_locked(fds, old)) {
+            old->hash_next = victims;
+            victims = old;
+        }
+    }
+    pthread_mutex_unlock(&fds->lock);
+
+    while (victims != NULL) {
+        struct cache_fd_entry *next = victims->hash_next;
+        close_entry(victims);
+        victims = next;
+    }
+    return e;
+}
+
+int cache_fd_fileno(cache_fd_entry_t *entry)
+{
+    return entry->fd;
+}
+
+bool cache_fd_verified(cache_fd_entry_t *entry, uint32_t crc)
+{
+    return atomic_load_explicit(&entry->verified, memory_order_relaxed) == (FD_VERIFIED | crc);
+}
+
+void cache_fd_set_verified(cache_fd_entry_t *entry, uint32_t crc)
+{
+    atomic_store_explicit(&entry->verified, FD_VERIFIED | crc, memory_order_relaxed);
+}
+
+void cache_fd_put(cache_fd_t *fds, cache_fd_entry_t *entry)
+{
+    pthread_mutex_lock(&fds->lock);
+    bool close_now = (--entry->refs == 0 && !entry->cached);
+    pthread_mutex_unlock(&fds->lock);
+
+    if (close_now) {
+        close_entry(entry);
+    }
+}
+
+void cache_fd_invalidate(cache_fd_t *fds, uint64_t file_key, size_t block_idx)
+{
+    if (fds == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fds->lock);
+    struct cache_fd_entry *e = lookup_locked(fds, file_key, block_idx);
+    bool close_now = (e != NULL && remove_locked(fds, e));
+    pthread_mutex_unlock(&fds->lock);
+
+    if (close_now) {
+        close_entry(e);
+    }
+}
+
+void cache_fd_destroy(cache_fd_t *fds)
+{
+    if (fds == NULL) {
+        return;
+    }
+
+    struct cache_fd_entry *e = fds->lru_head;
+    while (e != NULL) {
+        struct cache_fd_entry *next = e->lru_next;
+        close_entry(e);
+        e = next;
+    }
+    pthread_mutex_destroy(&fds->lock);
+    free(fds->buckets);
+    free(fds);
+}
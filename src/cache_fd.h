@@ -0,0 +1,112 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_FD_H
+#define CACHE_FD_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bounded LRU cache of open block-file descriptors.
+ *
+ * Entries are keyed by block identity and reference counted: an fd handed
+ * out by cache_fd_get() stays open until cache_fd_put(), even if the
+ * entry is invalidated or pushed out of the cache in the meantime.
+ * Invalidate an entry before unlinking its block file so the next open
+ * sees the new file.
+ *
+ * Block files are replaced whole rather than written in place, so an
+ * open descriptor always sees one version of a block and its checksum
+ * needs checking only once per open; entries remember that it was.
+ */
+
+/* Opaque fd cache handle */
+typedef struct cache_fd cache_fd_t;
+
+/* Opaque cached descriptor */
+typedef struct cache_fd_entry cache_fd_entry_t;
+
+/**
+ * Create an fd cache.
+ * @param max_open Maximum number of idle descriptors kept open
+ * @return Fd cache handle or NULL on error
+ */
+cache_fd_t *cache_fd_create(size_t max_open);
+
+/**
+ * Get an open descriptor for a block file, opening it if needed.
+ * @param fds Fd cache handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param path Block file path, used when the file has to be opened
+ * @param create Create the file if it doesn't exist
+ * @return Referenced entry, or NULL with errno set if the open failed
+ */
+cache_fd_entry_t *cache_fd_get(cache_fd_t *fds,
+                               uint64_t file_key,
+                               size_t block_idx,
+                               const char *path,
+                               bool create);
+
+/**
+ * Get the descriptor of an entry.
+ * @param entry Entry from cache_fd_get()
+ * @return Open file descriptor (read-write)
+ */
+int cache_fd_fileno(cache_fd_entry_t *entry);
+
+/**
+ * Check whether the file of an entry was found to match a checksum.
+ * @param entry Entry from cache_fd_get()
+ * @param crc Expected checksum of the file
+ * @return true if cache_fd_set_verified() was called with crc since the open
+ */
+bool cache_fd_verified(cache_fd_entry_t *entry, uint32_t crc);
+
+/**
+ * Record that the file of an entry matches a checksum.
+ * @param entry Entry from cache_fd_get()
+ * @param crc Checksum the file was found to have
+ */
+void cache_fd_set_verified(cache_fd_entry_t *entry, uint32_t crc);
+
+/**
+ * Drop a reference taken by cache_fd_get().
+ * @param fds Fd cache handle
+ * @param entry Entry from cache_fd_get()
+ */
+void cache_fd_put(cache_fd_t *fds, cache_fd_entry_t *entry);
+
+/**
+ * Forget the descriptor of a block; it is closed once no longer in use.
+ * @param fds Fd cache handle
+ * @param file_key File key
+ * @param block_idx Block index
+ */
+void cache_fd_invalidate(cache_fd_t *fds, uint64_t file_key, size_t block_idx);
+
+/**
+ * Close all descriptors and free the fd cache. No entry may be in use.
+ * @param fds Fd cache handle
+ */
+void cache_fd_destroy(cache_fd_t *fds);
+
+#endif /* CACHE_FD_H */
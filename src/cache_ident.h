@@ -0,0 +1,67 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_IDENT_H
+#define CACHE_IDENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Stable file identities.
+ *
+ * Cached blocks belong to a backend file, not to a name: a file is
+ * identified by its device, inode number and inode generation, so a
+ * rename keeps its blocks and hard links share them. The generation
+ * tells apart files that reuse a freed inode number; it is 0 where the
+ * backend does not report one.
+ */
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t gen;
+} cache_file_id_t;
+
+static inline bool cache_file_id_equal(const cache_file_id_t *a, const cache_file_id_t *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->gen == b->gen;
+}
+
+/* 64-bit mix of one word (splitmix64 finalizer) */
+static inline uint64_t cache_ident_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/* Block cache key of a file identity. Never 0, which means "no key". */
+static inline uint64_t cache_file_key(const cache_file_id_t *id)
+{
+    uint64_t h = cache_ident_mix(id->ino);
+    h = cache_ident_mix(h ^ id->dev);
+    h = cache_ident_mix(h ^ id->gen);
+    return h != 0 ? h : 1;
+}
+
+#endif /* CACHE_IDENT_H */
@@ -0,0 +1,1339 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_index.h"
+#include "cache_stats.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sqlite3.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#define INDEX_DB_NAME "blocks.db"
+#define INDEX_INITIAL_BUCKETS 1024
+#define CONTENT_INITIAL_BUCKETS 256
+#define PIN_INITIAL_BUCKETS 64
+#define INDEX_SCHEMA_VERSION 5  /* Bump to discard blocks in an older layout */
+
+/* In-memory index node */
+struct index_node {
+    cache_index_entry_t e;
+    bool referenced;                /* CLOCK reference bit, set on hits */
+    bool dirty;                     /* last_access not yet written back */
+    bool pinned;                    /* File is pinned; kept off the CLOCK ring */
+    struct index_node *hash_next;
+    struct index_node *lru_prev;    /* Towards the clock hand */
+    struct index_node *lru_next;    /* Away from the clock hand */
+    struct index_node *dirty_prev;
+    struct index_node *dirty_next;
+};
+
+/* Shared block content, referenced by one or more entries */
+struct content_node {
+    cache_digest_t digest;
+    size_t stored;                  /* Bytes on disk */
+    cache_codec_t codec;
+    uint32_t crc;
+    size_t refs;
+    struct content_node *next;
+};
+
+/* Pinned file key */
+struct pin_node {
+    uint64_t file_key;
+    struct pin_node *next;
+};
+
+/* Block index */
+struct cache_index {
+    sqlite3 *db;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *delete_stmt;
+    sqlite3_stmt *touch_stmt;
+    sqlite3_stmt *file_blocks_stmt;
+    sqlite3_stmt *file_tail_stmt;
+    sqlite3_stmt *pin_stmt;
+    sqlite3_stmt *unpin_stmt;
+    sqlite3_stmt *state_stmt;
+
+    struct index_node **buckets;
+    size_t bucket_count;
+
+    /* Written under lock, read without it by cache_index_get_totals(),
+       which every block store calls */
+    atomic_size_t count;
+    atomic_size_t total_size;       /* Bytes on disk, shared content counted once */
+
+    struct content_node **contents;
+    size_t content_bucket_count;
+    size_t content_count;
+
+    struct pin_node **pins;
+    size_t pin_bucket_count;
+    size_t pin_count;
+    size_t pinned_size;             /* Bytes of pinned entries, per reference */
+
+    /* CLOCK ring, kept as a list: the hand is at the head and entries
+       given a second chance are moved to the tail. */
+    struct index_node *lru_head;
+    struct index_node *lru_tail;
+    struct index_node *dirty_head;  /* Entries with unsynced access times */
+
+    uint64_t generation;
+    uint64_t checkpoint;            /* Last generation recorded as durable */
+    bool was_clean;                 /* Previous run marked the index clean */
+    cache_index_entry_t *unchecked; /* Loaded entries stored after the checkpoint */
+    size_t unchecked_count;
+    size_t unchecked_cap;
+    bool is_new;
+    bool debug;
+    pthread_mutex_t lock;
+};
+
+static size_t node_hash(uint64_t file_key, size_t block_idx)
+{
+    uint64_t h = file_key ^ ((uint64_t)block_idx * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static struct index_node **find_slot(cache_index_t *idx, uint64_t file_key, size_t block_idx)
+{
+    size_t b = node_hash(file_key, block_idx) & (idx->bucket_count - 1);
+    struct index_node **slot = &idx->buckets[b];
+    while (*slot != NULL) {
+        if ((*slot)->e.file_key == file_key && (*slot)->e.block_idx == block_idx) {
+            break;
+        }
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+static void grow_buckets(cache_index_t *idx)
+{
+    size_t new_count = idx->bucket_count * 2;
+    struct index_node **new_buckets = calloc(new_count, sizeof(struct index_node *));
+    if (new_buckets == NULL) {
+        return;  /* Keep the old table; chains just get longer */
+    }
+
+    for (size_t i = 0; i < idx->bucket_count; i++) {
+        struct index_node *n = idx->buckets[i];
+        while (n != NULL) {
+            struct index_node *next = n->hash_next;
+            size_t b = node_hash(n->e.file_key, n->e.block_idx) & (new_count - 1);
+            n->hash_next = new_buckets[b];
+            new_buckets[b] = n;
+            n = next;
+        }
+    }
+
+    free(idx->buckets);
+    idx->buckets = new_buckets;
+    idx->bucket_count = new_count;
+}
+
+static struct content_node **content_slot(cache_index_t *idx, const cache_digest_t *digest)
+{
+    struct content_node **slot = &idx->contents[digest->lo & (idx->content_bucket_count - 1)];
+    while (*slot != NULL && !cache_digest_equal(&(*slot)->digest, digest)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void grow_contents(cache_index_t *idx)
+{
+    size_t new_count = idx->content_bucket_count * 2;
+    struct content_node **new_buckets = calloc(new_count, sizeof(struct content_node *));
+    if (new_buckets == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < idx->content_bucket_count; i++) {
+        struct content_node *c = idx->contents[i];
+        while (c != NULL) {
+            struct content_node *next = c->next;
+            size_t b = c->digest.lo & (new_count - 1);
+            c->next = new_buckets[b];
+            new_buckets[b] = c;
+            c = next;
+        }
+    }
+
+    free(idx->contents);
+    idx->contents = new_buckets;
+    idx->content_bucket_count = new_count;
+}
+
+/* Takes a reference to shared content; only its first reference counts
+   towards the total size, and later ones get the stored form it was
+   first recorded with. */
+static struct content_node *content_ref(cache_index_t *idx, const cache_digest_t *digest,
+                                        size_t stored, cache_codec_t codec, uint32_t crc)
+{
+    struct content_node **slot = content_slot(idx, digest);
+    if (*slot == NULL) {
+        struct content_node *c = calloc(1, sizeof(struct content_node));
+        if (c == NULL) {
+            return NULL;
+        }
+        c->digest = *digest;
+        c->stored = stored;
+        c->codec = codec;
+        c->crc = crc;
+        *slot = c;
+        idx->content_count++;
+        idx->total_size += stored;
+        if (idx->content_count >= idx->content_bucket_count) {
+            grow_contents(idx);
+        }
+        slot = content_slot(idx, digest);
+    }
+    (*slot)->refs++;
+    return *slot;
+}
+
+/* Drops a reference; returns true if it was the last one */
+static bool content_unref(cache_index_t *idx, const cache_digest_t *digest)
+{
+    struct content_node **slot = content_slot(idx, digest);
+    struct content_node *c = *slot;
+    if (c == NULL || --c->refs > 0) {
+        return false;
+    }
+    *slot = c->next;
+    idx->content_count--;
+    idx->total_size -= c->stored;
+    free(c);
+    return true;
+}
+
+static struct pin_node **pin_slot(cache_index_t *idx, uint64_t file_key)
+{
+    size_t b = node_hash(file_key, 0) & (idx->pin_bucket_count - 1);
+    struct pin_node **slot = &idx->pins[b];
+    while (*slot != NULL && (*slot)->file_key != file_key) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void grow_pins(cache_index_t *idx)
+{
+    size_t new_count = idx->pin_bucket_count * 2;
+    struct pin_node **new_buckets = calloc(new_count, sizeof(struct pin_node *));
+    if (new_buckets == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < idx->pin_bucket_count; i++) {
+        struct pin_node *p = idx->pins[i];
+        while (p != NULL) {
+            struct pin_node *next = p->next;
+            size_t b = node_hash(p->file_key, 0) & (new_count - 1);
+            p->next = new_buckets[b];
+            new_buckets[b] = p;
+            p = next;
+        }
+    }
+
+    free(idx->pins);
+    idx->pins = new_buckets;
+    idx->pin_bucket_count = new_count;
+}
+
+/* Adds a key to the pin set; returns false if it was already there */
+static bool pin_add(cache_index_t *idx, uint64_t file_key)
+{
+    struct pin_node **slot = pin_slot(idx, file_key);
+    if (*slot != NULL) {
+        return false;
+    }
+    struct pin_node *p = calloc(1, sizeof(struct pin_node));
+    if (p == NULL) {
+        return false;
+    }
+    p->file_key = file_key;
+    *slot = p;
+    idx->pin_count++;
+    if (idx->pin_count >= idx->pin_bucket_count) {
+        grow_pins(idx);
+    }
+    return true;
+}
+
+/* Removes a key from the pin set; returns false if it was not there */
+static bool pin_remove(cache_index_t *idx, uint64_t file_key)
+{
+    struct pin_node **slot = pin_slot(idx, file_key);
+    struct pin_node *p = *slot;
+    if (p == NULL) {
+        return false;
+    }
+    *slot = p->next;
+    idx->pin_count--;
+    free(p);
+    return true;
+}
+
+static void lru_unlink(cache_index_t *idx, struct index_node *n)
+{
+    if (n->lru_prev != NULL) {
+        n->lru_prev->lru_next = n->lru_next;
+    } else {
+        idx->lru_head = n->lru_next;
+    }
+    if (n->lru_next != NULL) {
+        n->lru_next->lru_prev = n->lru_prev;
+    } else {
+        idx->lru_tail = n->lru_prev;
+    }
+    n->lru_prev = n->lru_next = NULL;
+}
+
+static void lru_append(cache_index_t *idx, struct index_node *n)
+{
+    n->lru_prev = idx->lru_tail;
+    n->lru_next = NULL;
+    if (idx->lru_tail != NULL) {
+        idx->lru_tail->lru_next = n;
+    } else {
+        idx->lru_head = n;
+    }
+    idx->lru_tail = n;
+}
+
+static void dirty_unlink(cache_index_t *idx, struct index_node *n)
+{
+    if (!n->dirty) {
+        return;
+    }
+    if (n->dirty_prev != NULL) {
+        n->dirty_prev->dirty_next = n->dirty_next;
+    } else {
+        idx->dirty_head = n->dirty_next;
+    }
+    if (n->dirty_next != NULL) {
+        n->dirty_next->dirty_prev = n->dirty_prev;
+    }
+    n->dirty_prev = n->dirty_next = NULL;
+    n->dirty = false;
+}
+
+static void dirty_push(cache_index_t *idx, struct index_node *n)
+{
+    if (n->dirty) {
+        return;
+    }
+    n->dirty_prev = NULL;
+    n->dirty_next = idx->dirty_head;
+    if (idx->dirty_head != NULL) {
+        idx->dirty_head->dirty_prev = n;
+    }
+    idx->dirty_head = n;
+    n->dirty = true;
+}
+
+/* Links a node into the hash table and, unless its file is pinned, the
+   recency list (as newest). */
+static void link_node(cache_index_t *idx, struct index_node *n)
+{
+    if (idx->count >= idx->bucket_count) {
+        grow_buckets(idx);
+    }
+    struct index_node **slot = find_slot(idx, n->e.file_key, n->e.block_idx);
+    n->hash_next = NULL;
+    *slot = n;
+    n->pinned = *pin_slot(idx, n->e.file_key) != NULL;
+    if (n->pinned) {
+        idx->pinned_size += n->e.stored;
+    } else {
+        lru_append(idx, n);
+    }
+    idx->count++;
+    if (!n->e.shared) {
+        idx->total_size += n->e.stored;
+    }
+}
+
+/* Unlinks the node found at slot and returns it. For shared content,
+   *freed_out tells whether the node held its last reference. */
+static struct index_node *unlink_node(cache_index_t *idx, struct index_node **slot, bool *freed_out)
+{
+    struct index_node *n = *slot;
+    *slot = n->hash_next;
+    if (n->pinned) {
+        idx->pinned_size -= n->e.stored;
+    } else {
+        lru_unlink(idx, n);
+    }
+    dirty_unlink(idx, n);
+    idx->count--;
+    bool freed = false;
+    if (n->e.shared) {
+        freed = content_unref(idx, &n->e.digest);
+    } else {
+        idx->total_size -= n->e.stored;
+    }
+    if (freed_out != NULL) {
+        *freed_out = freed;
+    }
+    return n;
+}
+
+static void db_delete(cache_index_t *idx, uint64_t file_key, size_t block_idx)
+{
+    sqlite3_reset(idx->delete_stmt);
+    sqlite3_bind_int64(idx->delete_stmt, 1, (sqlite3_int64)file_key);
+    sqlite3_bind_int64(idx->delete_stmt, 2, (sqlite3_int64)block_idx);
+    if (sqlite3_step(idx->delete_stmt) != SQLITE_DONE) {
+        DPRINTF("cache_index: delete failed: %s", sqlite3_errmsg(idx->db));
+    }
+}
+
+/* Writes back dirty access times. Caller holds the lock. */
+static void sync_locked(cache_index_t *idx)
+{
+    if (idx->dirty_head == NULL) {
+        return;
+    }
+
+    uint64_t start = cache_stats_now();
+    sqlite3_exec(idx->db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+    while (idx->dirty_head != NULL) {
+        struct index_node *n = idx->dirty_head;
+        sqlite3_reset(idx->touch_stmt);
+        sqlite3_bind_int64(idx->touch_stmt, 1, n->e.last_access);
+        sqlite3_bind_int64(idx->touch_stmt, 2, (sqlite3_int64)n->e.file_key);
+        sqlite3_bind_int64(idx->touch_stmt, 3, (sqlite3_int64)n->e.block_idx);
+        sqlite3_step(idx->touch_stmt);
+        dirty_unlink(idx, n);
+    }
+
+    sqlite3_exec(idx->db, "COMMIT", NULL, NULL, NULL);
+    cache_stats_since(CACHE_STAGE_SQLITE_COMMIT, start);
+}
+
+static int load_pins(cache_index_t *idx)
+{
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(idx->db, "SELECT file_key FROM pins", -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        pin_add(idx, (uint64_t)sqlite3_column_int64(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static int add_unchecked(cache_index_t *idx, const cache_index_entry_t *e)
+{
+    if (idx->unchecked_count == idx->unchecked_cap) {
+        size_t cap = idx->unchecked_cap > 0 ? idx->unchecked_cap * 2 : 64;
+        cache_index_entry_t *grown = realloc(idx->unchecked, cap * sizeof(cache_index_entry_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        idx->unchecked = grown;
+        idx->unchecked_cap = cap;
+    }
+    idx->unchecked[idx->unchecked_count++] = *e;
+    return 0;
+}
+
+static sqlite3_int64 state_get(cache_index_t *idx, const char *name, sqlite3_int64 missing)
+{
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_int64 value = missing;
+    if (sqlite3_prepare_v2(idx->db, "SELECT value FROM state WHERE name = ?", -1, &stmt, NULL) != SQLITE_OK) {
+        return missing;
+    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static void state_set(cache_index_t *idx, const char *name, sqlite3_int64 value)
+{
+    sqlite3_reset(idx->state_stmt);
+    sqlite3_bind_text(idx->state_stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(idx->state_stmt, 2, value);
+    if (sqlite3_step(idx->state_stmt) != SQLITE_DONE) {
+        DPRINTF("cache_index: state update failed: %s", sqlite3_errmsg(idx->db));
+    }
+}
+
+/* Writes the clean flag durably: a crash must never leave a run's blocks
+   looking like they were shut down cleanly. */
+static void state_set_clean(cache_index_t *idx, bool clean)
+{
+    sqlite3_exec(idx->db, "PRAGMA synchronous=FULL", NULL, NULL, NULL);
+    state_set(idx, "clean", clean ? 1 : 0);
+    sqlite3_exec(idx->db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+}
+
+static int load_entries(cache_index_t *idx)
+{
+    sqlite3_stmt *stmt = NULL;
+    const char *select_sql =
+        "SELECT file_key, block_idx, size, valid, eof, last_access, generation, digest, "
+        "stored, codec, crc "
+        "FROM blocks ORDER BY last_access";
+    if (sqlite3_prepare_v2(idx->db, select_sql, -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        struct index_node *n = calloc(1, sizeof(struct index_node));
+        if (n == NULL) {
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+        n->e.file_key = (uint64_t)sqlite3_column_int64(stmt, 0);
+        n->e.block_idx = (size_t)sqlite3_column_int64(stmt, 1);
+        n->e.size = (size_t)sqlite3_column_int64(stmt, 2);
+        n->e.valid = (uint64_t)sqlite3_column_int64(stmt, 3);
+        n->e.eof = sqlite3_column_int(stmt, 4) != 0;
+        n->e.last_access = (time_t)sqlite3_column_int64(stmt, 5);
+        n->e.generation = (uint64_t)sqlite3_column_int64(stmt, 6);
+        if (n->e.generation > idx->generation) {
+            idx->generation = n->e.generation;
+        }
+        n->e.stored = (size_t)sqlite3_column_int64(stmt, 8);
+        n->e.codec = (cache_codec_t)sqlite3_column_int(stmt, 9);
+        n->e.crc = (uint32_t)sqlite3_column_int64(stmt, 10);
+        if (sqlite3_column_bytes(stmt, 7) == (int)sizeof(cache_digest_t)) {
+            memcpy(&n->e.digest, sqlite3_column_blob(stmt, 7), sizeof(cache_digest_t));
+            n->e.shared = true;
+            if (content_ref(idx, &n->e.digest, n->e.stored, n->e.codec, n->e.crc) == NULL) {
+                free(n);
+                sqlite3_finalize(stmt);
+                return -1;
+            }
+        }
+        link_node(idx, n);
+        if (!idx->was_clean && n->e.generation > idx->checkpoint && add_unchecked(idx, &n->e) != 0) {
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+cache_index_t *cache_index_open(const char *cache_root, bool debug)
+{
+    if (cache_root == NULL) {
+        return NULL;
+    }
+
+    cache_index_t *idx = calloc(1, sizeof(cache_index_t));
+    if (idx == NULL) {
+        return NULL;
+    }
+    idx->debug = debug;
+    pthread_mutex_init(&idx->lock, NULL);
+
+    idx->bucket_count = INDEX_INITIAL_BUCKETS;
+    idx->buckets = calloc(idx->bucket_count, sizeof(struct index_node *));
+    if (idx->buckets == NULL) {
+        goto error;
+    }
+    idx->content_bucket_count = CONTENT_INITIAL_BUCKETS;
+    idx->contents = calloc(idx->content_bucket_count, sizeof(struct content_node *));
+    if (idx->contents == NULL) {
+        goto error;
+    }
+    idx->pin_bucket_count = PIN_INITIAL_BUCKETS;
+    idx->pins = calloc(idx->pin_bucket_count, sizeof(struct pin_node *));
+    if (idx->pins == NULL) {
+        goto error;
+    }
+
+    char db_path[PATH_MAX];
+    snprintf(db_path, PATH_MAX, "%s/%s", cache_root, INDEX_DB_NAME);
+
+    struct stat st;
+    idx->is_new = (stat(db_path, &st) != 0);
+
+    if (sqlite3_open(db_path, &idx->db) != SQLITE_OK) {
+        DPRINTF("cache_index_open: sqlite3_open failed: %s", sqlite3_errmsg(idx->db));
+        goto error;
+    }
+
+    sqlite3_busy_timeout(idx->db, 100);
+    sqlite3_exec(idx->db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    sqlite3_exec(idx->db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+
+    /* Blocks recorded under an older schema were stored in a layout this
+       version cannot trust; start over and let the caller purge them. */
+    int version = 0;
+    sqlite3_stmt *version_stmt = NULL;
+    if (sqlite3_prepare_v2(idx->db, "PRAGMA user_version", -1, &version_stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(version_stmt) == SQLITE_ROW) {
+            version = sqlite3_column_int(version_stmt, 0);
+        }
+        sqlite3_finalize(version_stmt);
+    }
+    if (version < INDEX_SCHEMA_VERSION) {
+        sqlite3_exec(idx->db, "DROP TABLE IF EXISTS blocks", NULL, NULL, NULL);
+        sqlite3_exec(idx->db, "DROP TABLE IF EXISTS state", NULL, NULL, NULL);
+        idx->is_new = true;
+    }
+
+    const char *create_sql =
+        "CREATE TABLE IF NOT EXISTS blocks ("
+        "  file_key INTEGER,"
+        "  block_idx INTEGER,"
+        "  size INTEGER,"
+        "  valid INTEGER,"
+        "  eof INTEGER,"
+        "  last_access INTEGER,"
+        "  generation INTEGER,"
+        "  digest BLOB,"
+        "  stored INTEGER,"
+        "  codec INTEGER,"
+        "  crc INTEGER,"
+        "  PRIMARY KEY (file_key, block_idx)"
+        ") WITHOUT ROWID;"
+        "CREATE INDEX IF NOT EXISTS blocks_eof ON blocks(file_key) WHERE eof = 1;"
+        "CREATE TABLE IF NOT EXISTS pins ("
+        "  file_key INTEGER PRIMARY KEY"
+        ");"
+        "CREATE TABLE IF NOT EXISTS state ("
+        "  name TEXT PRIMARY KEY,"
+        "  value INTEGER"
+        ")";
+
+    char *errmsg = NULL;
+    if (sqlite3_exec(idx->db, create_sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        DPRINTF("cache_index_open: create table failed: %s", errmsg);
+        sqlite3_free(errmsg);
+        goto error;
+    }
+
+    char version_sql[64];
+    snprintf(version_sql, sizeof(version_sql), "PRAGMA user_version = %d", INDEX_SCHEMA_VERSION);
+    sqlite3_exec(idx->db, version_sql, NULL, NULL, NULL);
+
+    sqlite3_prepare_v2(idx->db,
+        "INSERT OR REPLACE INTO blocks VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+        -1, &idx->insert_stmt, NULL);
+    sqlite3_prepare_v2(idx->db,
+        "DELETE FROM blocks WHERE file_key = ? AND block_idx = ?",
+        -1, &idx->delete_stmt, NULL);
+    sqlite3_prepare_v2(idx->db,
+        "UPDATE blocks SET last_access = ? WHERE file_key = ? AND block_idx = ?",
+        -1, &idx->touch_stmt, NULL);
+    sqlite3_prepare_v2(idx->db,
+        "SELECT block_idx FROM blocks WHERE file_key = ?",
+        -1, &idx->file_blocks_stmt, NULL);
+    sqlite3_prepare_v2(idx->db,
+        "SELECT block_idx FROM blocks WHERE file_key = ? AND eof = 1",
+        -1, &idx->file_tail_stmt, NULL);
+    sqlite3_prepare_v2(idx->db,
+        "INSERT OR IGNORE INTO pins VALUES (?)",
+        -1, &idx->pin_stmt, NULL);
+    sqlite3_prepare_v2(idx->db,
+        "DELETE FROM pins WHERE file_key = ?",
+        -1, &idx->unpin_stmt, NULL);
+    sqlite3_prepare_v2(idx->db,
+        "INSERT OR REPLACE INTO state VALUES (?, ?)",
+        -1, &idx->state_stmt, NULL);
+
+    /* A new index has nothing to check. Generations continue past the
+       checkpoint even if the entries that reached it are gone. */
+    idx->was_clean = idx->is_new || state_get(idx, "clean", 0) != 0;
+    idx->checkpoint = (uint64_t)state_get(idx, "checkpoint", 0);
+    idx->generation = idx->checkpoint;
+
+    /* Pins go first so entries of pinned files stay off the CLOCK ring */
+    if (load_pins(idx) != 0 || load_entries(idx) != 0) {
+        DPRINTF("cache_index_open: failed to load entries: %s", sqlite3_errmsg(idx->db));
+        goto error;
+    }
+
+    /* Until cache_index_mark_clean(), a crash leaves this run's blocks
+       to be checked by the next one */
+    state_set_clean(idx, false);
+
+    if (debug) {
+        DPRINTF("cache_index_open: loaded %zu blocks (%zu bytes, %zu pinned in %zu files) from %s, "
+                "%s shutdown, %zu to check",
+                idx->count, idx->total_size, idx->pinned_size, idx->pin_count, db_path,
+                idx->was_clean ? "clean" : "unclean", idx->unchecked_count);
+    }
+
+    return idx;
+
+error:
+    cache_index_close(idx);
+    return NULL;
+}
+
+bool cache_index_is_new(cache_index_t *idx)
+{
+    return idx != NULL && idx->is_new;
+}
+
+/* Writes a node through to the database. Caller holds the lock. */
+static void db_insert(cache_index_t *idx, const struct index_node *n)
+{
+    sqlite3_stmt *stmt = idx->insert_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)n->e.file_key);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)n->e.block_idx);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)n->e.size);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)n->e.valid);
+    sqlite3_bind_int(stmt, 5, n->e.eof ? 1 : 0);
+    sqlite3_bind_int64(stmt, 6, n->e.last_access);
+    sqlite3_bind_int64(stmt, 7, (sqlite3_int64)n->e.generation);
+    if (n->e.shared) {
+        sqlite3_bind_blob(stmt, 8, &n->e.digest, sizeof(cache_digest_t), SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(stmt, 8);
+    }
+    sqlite3_bind_int64(stmt, 9, (sqlite3_int64)n->e.stored);
+    sqlite3_bind_int(stmt, 10, (int)n->e.codec);
+    sqlite3_bind_int64(stmt, 11, (sqlite3_int64)n->e.crc);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        DPRINTF("cache_index_insert: insert failed: %s", sqlite3_errmsg(idx->db));
+    }
+}
+
+int cache_index_insert(cache_index_t *idx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       size_t size,
+                       uint64_t valid,
+                       bool eof,
+                       uint32_t crc,
+                       uint64_t expect_generation,
+                       size_t *old_size_out)
+{
+    if (idx == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    size_t old_size = 0;
+    struct index_node **slot = find_slot(idx, file_key, block_idx);
+    struct index_node *n;
+    uint64_t found_generation = *slot != NULL ? (*slot)->e.generation : 0;
+    if (found_generation != expect_generation ||
+        (*slot != NULL && ((*slot)->e.shared || (*slot)->e.codec != CACHE_CODEC_NONE))) {
+        /* Replaced or removed meanwhile, so the merged file is stale */
+        pthread_mutex_unlock(&idx->lock);
+        return -1;
+    }
+    if (*slot != NULL) {
+        n = unlink_node(idx, slot, NULL);
+        old_size = n->e.size;
+        n->referenced = false;
+    } else {
+        n = calloc(1, sizeof(struct index_node));
+        if (n == NULL) {
+            pthread_mutex_unlock(&idx->lock);
+            return -1;
+        }
+    }
+
+    n->e.file_key = file_key;
+    n->e.block_idx = block_idx;
+    n->e.size = size;
+    n->e.stored = size;
+    n->e.valid = valid;
+    n->e.eof = eof;
+    n->e.crc = crc;
+    n->e.last_access = time(NULL);
+    n->e.generation = ++idx->generation;
+    link_node(idx, n);
+    db_insert(idx, n);
+
+    pthread_mutex_unlock(&idx->lock);
+
+    if (old_size_out != NULL) {
+        *old_size_out = old_size;
+    }
+    return 0;
+}
+
+/* Adds an entry for a complete block. Caller holds the lock. */
+static int insert_complete_locked(cache_index_t *idx,
+                                  uint64_t file_key,
+                                  size_t block_idx,
+                                  size_t size,
+                                  bool eof,
+                                  size_t stored,
+                                  cache_codec_t codec,
+                                  uint32_t crc,
+                                  const cache_digest_t *digest)
+{
+    struct index_node *n = calloc(1, sizeof(struct index_node));
+    if (n == NULL) {
+        return -1;
+    }
+    if (digest != NULL) {
+        struct content_node *c = content_ref(idx, digest, stored, codec, crc);
+        if (c == NULL) {
+            free(n);
+            return -1;
+        }
+        stored = c->stored;
+        codec = c->codec;
+        crc = c->crc;
+        n->e.shared = true;
+        n->e.digest = *digest;
+    }
+    n->e.file_key = file_key;
+    n->e.block_idx = block_idx;
+    n->e.size = size;
+    n->e.stored = stored;
+    n->e.codec = codec;
+    n->e.crc = crc;
+    n->e.valid = ~0ULL;
+    n->e.eof = eof;
+    n->e.last_access = time(NULL);
+    n->e.generation = ++idx->generation;
+    link_node(idx, n);
+    db_insert(idx, n);
+    return 0;
+}
+
+int cache_index_insert_packed(cache_index_t *idx,
+                              uint64_t file_key,
+                              size_t block_idx,
+                              size_t size,
+                              bool eof,
+                              size_t stored,
+                              cache_codec_t codec,
+                              uint32_t crc)
+{
+    if (idx == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    int ret = -1;
+    if (*find_slot(idx, file_key, block_idx) == NULL) {
+        ret = insert_complete_locked(idx, file_key, block_idx, size, eof, stored, codec, crc, NULL);
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return ret;
+}
+
+int cache_index_insert_shared(cache_index_t *idx,
+                              uint64_t file_key,
+                              size_t block_idx,
+                              size_t size,
+                              bool eof,
+                              const cache_digest_t *digest,
+                              size_t stored,
+                              cache_codec_t codec,
+                              uint32_t crc)
+{
+    if (idx == NULL || digest == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    int ret;
+    struct index_node **slot = find_slot(idx, file_key, block_idx);
+    if (*slot != NULL) {
+        ret = ((*slot)->e.shared && cache_digest_equal(&(*slot)->e.digest, digest)) ? 0 : -1;
+    } else {
+        ret = insert_complete_locked(idx, file_key, block_idx, size, eof, stored, codec, crc, digest);
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+    return ret;
+}
+
+bool cache_index_has_content(cache_index_t *idx, const cache_digest_t *digest)
+{
+    if (idx == NULL || digest == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    bool found = *content_slot(idx, digest) != NULL;
+    pthread_mutex_unlock(&idx->lock);
+    return found;
+}
+
+bool cache_index_lookup(cache_index_t *idx,
+                        uint64_t file_key,
+                        size_t block_idx,
+                        cache_index_entry_t *entry_out)
+{
+    if (idx == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    struct index_node *n = *find_slot(idx, file_key, block_idx);
+    if (n == NULL) {
+        pthread_mutex_unlock(&idx->lock);
+        return false;
+    }
+
+    /* Hits only set the reference bit; the list is reordered lazily by
+       the clock hand in cache_index_pop_victim(). */
+    n->referenced = true;
+    n->e.last_access = time(NULL);
+    dirty_push(idx, n);
+
+    if (entry_out != NULL) {
+        *entry_out = n->e;
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+    return true;
+}
+
+int cache_index_remove(cache_index_t *idx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       cache_index_entry_t *entry_out,
+                       bool *content_freed_out)
+{
+    if (idx == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    struct index_node **slot = find_slot(idx, file_key, block_idx);
+    if (*slot == NULL) {
+        pthread_mutex_unlock(&idx->lock);
+        return -1;
+    }
+
+    struct index_node *n = unlink_node(idx, slot, content_freed_out);
+    db_delete(idx, file_key, block_idx);
+
+    pthread_mutex_unlock(&idx->lock);
+
+    if (entry_out != NULL) {
+        *entry_out = n->e;
+    }
+    free(n);
+    return 0;
+}
+
+int cache_index_file_blocks(cache_index_t *idx,
+                            uint64_t file_key,
+                            size_t **blocks_out,
+                            size_t *count_out)
+{
+    if (idx == NULL || blocks_out == NULL || count_out == NULL) {
+        return -1;
+    }
+
+    size_t count = 0;
+    size_t capacity = 16;
+    size_t *blocks = malloc(capacity * sizeof(size_t));
+    if (blocks == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    sqlite3_reset(idx->file_blocks_stmt);
+    sqlite3_bind_int64(idx->file_blocks_stmt, 1, (sqlite3_int64)file_key);
+    while (sqlite3_step(idx->file_blocks_stmt) == SQLITE_ROW) {
+        if (count >= capacity) {
+            capacity *= 2;
+            size_t *new_blocks = realloc(blocks, capacity * sizeof(size_t));
+            if (new_blocks == NULL) {
+                pthread_mutex_unlock(&idx->lock);
+                free(blocks);
+                return -1;
+            }
+            blocks = new_blocks;
+        }
+        blocks[count++] = (size_t)sqlite3_column_int64(idx->file_blocks_stmt, 0);
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+
+    *blocks_out = blocks;
+    *count_out = count;
+    return 0;
+}
+
+int cache_index_file_keys(cache_index_t *idx, uint64_t **keys_out, size_t *count_out)
+{
+    if (idx == NULL || keys_out == NULL || count_out == NULL) {
+        return -1;
+    }
+
+    size_t count = 0;
+    size_t capacity = 16;
+    uint64_t *keys = malloc(capacity * sizeof(uint64_t));
+    if (keys == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(idx->db, "SELECT DISTINCT file_key FROM blocks", -1, &stmt, NULL) != SQLITE_OK) {
+        pthread_mutex_unlock(&idx->lock);
+        free(keys);
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (count >= capacity) {
+            capacity *= 2;
+            uint64_t *new_keys = realloc(keys, capacity * sizeof(uint64_t));
+            if (new_keys == NULL) {
+                sqlite3_finalize(stmt);
+                pthread_mutex_unlock(&idx->lock);
+                free(keys);
+                return -1;
+            }
+            keys = new_keys;
+        }
+        keys[count++] = (uint64_t)sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    pthread_mutex_unlock(&idx->lock);
+
+    *keys_out = keys;
+    *count_out = count;
+    return 0;
+}
+
+int cache_index_file_tail(cache_index_t *idx, uint64_t file_key, size_t *block_out)
+{
+    if (idx == NULL || block_out == NULL) {
+        return -1;
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&idx->lock);
+
+    sqlite3_reset(idx->file_tail_stmt);
+    sqlite3_bind_int64(idx->file_tail_stmt, 1, (sqlite3_int64)file_key);
+    if (sqlite3_step(idx->file_tail_stmt) == SQLITE_ROW) {
+        *block_out = (size_t)sqlite3_column_int64(idx->file_tail_stmt, 0);
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+    return ret;
+}
+
+bool cache_index_pop_victim(cache_index_t *idx,
+                            cache_index_entry_t *entry_out,
+                            bool *content_freed_out)
+{
+    if (idx == NULL || entry_out == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    /* Advance the hand, giving referenced entries a second chance. This
+       terminates within one full turn since every bit it passes is cleared. */
+    struct index_node *victim = idx->lru_head;
+    while (victim != NULL && victim->referenced) {
+        victim->referenced = false;
+        lru_unlink(idx, victim);
+        lru_append(idx, victim);
+        victim = idx->lru_head;
+    }
+
+    if (victim == NULL) {
+        pthread_mutex_unlock(&idx->lock);
+        return false;
+    }
+
+    struct index_node **slot = find_slot(idx, victim->e.file_key, victim->e.block_idx);
+    struct index_node *n = unlink_node(idx, slot, content_freed_out);
+    db_delete(idx, n->e.file_key, n->e.block_idx);
+
+    pthread_mutex_unlock(&idx->lock);
+
+    *entry_out = n->e;
+    free(n);
+    return true;
+}
+
+int cache_index_set_pinned(cache_index_t *idx, uint64_t file_key, bool pinned)
+{
+    if (idx == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+
+    bool changed = pinned ? pin_add(idx, file_key) : pin_remove(idx, file_key);
+    if (pinned && !changed && *pin_slot(idx, file_key) == NULL) {
+        pthread_mutex_unlock(&idx->lock);
+        return -1;  /* Out of memory */
+    }
+    if (!changed) {
+        pthread_mutex_unlock(&idx->lock);
+        return 0;
+    }
+
+    sqlite3_stmt *stmt = pinned ? idx->pin_stmt : idx->unpin_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)file_key);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        DPRINTF("cache_index_set_pinned: update failed: %s", sqlite3_errmsg(idx->db));
+    }
+
+    /* Move the file's entries off or back onto the CLOCK ring. Unpinned
+       entries rejoin as newest, so they are not evicted right away. */
+    sqlite3_reset(idx->file_blocks_stmt);
+    sqlite3_bind_int64(idx->file_blocks_stmt, 1, (sqlite3_int64)file_key);
+    while (sqlite3_step(idx->file_blocks_stmt) == SQLITE_ROW) {
+        size_t block_idx = (size_t)sqlite3_column_int64(idx->file_blocks_stmt, 0);
+        struct index_node *n = *find_slot(idx, file_key, block_idx);
+        if (n == NULL || n->pinned == pinned) {
+            continue;
+        }
+        n->pinned = pinned;
+        if (pinned) {
+            lru_unlink(idx, n);
+            idx->pinned_size += n->e.stored;
+        } else {
+            lru_append(idx, n);
+            idx->pinned_size -= n->e.stored;
+        }
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+    return 0;
+}
+
+bool cache_index_is_pinned(cache_index_t *idx, uint64_t file_key)
+{
+    if (idx == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    bool pinned = *pin_slot(idx, file_key) != NULL;
+    pthread_mutex_unlock(&idx->lock);
+    return pinned;
+}
+
+void cache_index_get_pinned(cache_index_t *idx,
+                            size_t *pinned_size_out,
+                            size_t *file_count_out)
+{
+    if (idx == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    if (pinned_size_out != NULL) {
+        *pinned_size_out = idx->pinned_size;
+    }
+    if (file_count_out != NULL) {
+        *file_count_out = idx->pin_count;
+    }
+    pthread_mutex_unlock(&idx->lock);
+}
+
+void cache_index_get_totals(cache_index_t *idx,
+                            size_t *total_size_out,
+                            size_t *count_out)
+{
+    if (idx == NULL) {
+        return;
+    }
+
+    if (total_size_out != NULL) {
+        *total_size_out = atomic_load_explicit(&idx->total_size, memory_order_relaxed);
+    }
+    if (count_out != NULL) {
+        *count_out = atomic_load_explicit(&idx->count, memory_order_relaxed);
+    }
+}
+
+uint64_t cache_index_generation(cache_index_t *idx)
+{
+    if (idx == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    uint64_t generation = idx->generation;
+    pthread_mutex_unlock(&idx->lock);
+    return generation;
+}
+
+void cache_index_checkpoint(cache_index_t *idx, uint64_t generation)
+{
+    if (idx == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    if (generation > idx->checkpoint) {
+        idx->checkpoint = generation;
+        state_set(idx, "checkpoint", (sqlite3_int64)generation);
+    }
+    pthread_mutex_unlock(&idx->lock);
+}
+
+int cache_index_take_unchecked(cache_index_t *idx,
+                               cache_index_entry_t **entries_out,
+                               size_t *count_out)
+{
+    if (idx == NULL || entries_out == NULL || count_out == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    *entries_out = idx->unchecked;
+    *count_out = idx->unchecked_count;
+    idx->unchecked = NULL;
+    idx->unchecked_count = idx->unchecked_cap = 0;
+    pthread_mutex_unlock(&idx->lock);
+    return 0;
+}
+
+void cache_index_mark_clean(cache_index_t *idx)
+{
+    if (idx == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    sync_locked(idx);
+    idx->checkpoint = idx->generation;
+    state_set(idx, "checkpoint", (sqlite3_int64)idx->generation);
+    state_set_clean(idx, true);
+    pthread_mutex_unlock(&idx->lock);
+}
+
+void cache_index_sync(cache_index_t *idx)
+{
+    if (idx == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&idx->lock);
+    sync_locked(idx);
+    pthread_mutex_unlock(&idx->lock);
+}
+
+void cache_index_close(cache_index_t *idx)
+{
+    if (idx == NULL) {
+        return;
+    }
+
+    if (idx->db != NULL) {
+        cache_index_sync(idx);
+    }
+
+    if (idx->insert_stmt) {
+        sqlite3_finalize(idx->insert_stmt);
+    }
+    if (idx->delete_stmt) {
+        sqlite3_finalize(idx->delete_stmt);
+    }
+    if (idx->touch_stmt) {
+        sqlite3_finalize(idx->touch_stmt);
+    }
+    if (idx->file_blocks_stmt) {
+        sqlite3_finalize(idx->file_blocks_stmt);
+    }
+    if (idx->file_tail_stmt) {
+        sqlite3_finalize(idx->file_tail_stmt);
+    }
+    if (idx->pin_stmt) {
+        sqlite3_finalize(idx->pin_stmt);
+    }
+    if (idx->unpin_stmt) {
+        sqlite3_finalize(idx->unpin_stmt);
+    }
+    if (idx->state_stmt) {
+        sqlite3_finalize(idx->state_stmt);
+    }
+    if (idx->db) {
+        sqlite3_close(idx->db);
+    }
+
+    if (idx->buckets != NULL) {
+        for (size_t i = 0; i < idx->bucket_count; i++) {
+            struct index_node *n = idx->buckets[i];
+            while (n != NULL) {
+                struct index_node *next = n->hash_next;
+                free(n);
+                n = next;
+            }
+        }
+        free(idx->buckets);
+    }
+    if (idx->contents != NULL) {
+        for (size_t i = 0; i < idx->content_bucket_count; i++) {
+            struct content_node *c = idx->contents[i];
+            while (c != NULL) {
+                struct content_node *next = c->next;
+                free(c);
+                c = next;
+            }
+        }
+        free(idx->contents);
+    }
+    if (idx->pins != NULL) {
+        for (size_t i = 0; i < idx->pin_bucket_count; i++) {
+            struct pin_node *p = idx->pins[i];
+            while (p != NULL) {
+                struct pin_node *next = p->next;
+                free(p);
+                p = next;
+            }
+        }
+        free(idx->pins);
+    }
+
+    free(idx->unchecked);
+    pthread_mutex_destroy(&idx->lock);
+    free(idx);
+}
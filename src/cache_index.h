@@ -0,0 +1,339 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_INDEX_H
+#define CACHE_INDEX_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cache_digest.h"
+#include "cache_compress.h"
+
+/*
+ * Persistent index of the blocks stored under <cache_root>/blocks.
+ *
+ * The index lives in <cache_root>/blocks.db and is loaded into memory
+ * once at startup, so size accounting and victim selection never have
+ * to walk the block tree. Inserts and removals are written through to
+ * the database immediately; access times are kept in memory and written
+ * back in batches by cache_index_sync().
+ *
+ * Victims are chosen with CLOCK: a hit only sets the entry's reference
+ * bit, and the hand gives referenced entries a second chance.
+ * Entries of pinned files are kept off the ring and are never chosen.
+ *
+ * Entries for complete blocks may instead refer to shared content named
+ * by its digest. The index counts references to each content, and the
+ * file behind it can go once the last referring entry is removed.
+ *
+ * Complete blocks may also be stored compressed. Sizes are accounted in
+ * bytes on disk, so compressed blocks count with their compressed size.
+ *
+ * Every entry carries the CRC32C of its stored bytes. The database also
+ * records whether the last run shut down cleanly and a checkpoint: the
+ * generation up to which blocks were known to be on stable storage.
+ * After an unclean shutdown only entries stored after the checkpoint
+ * need checking against their files.
+ */
+
+/* Opaque block index handle */
+typedef struct cache_index cache_index_t;
+
+/* Snapshot of one index entry */
+typedef struct {
+    uint64_t file_key;     /* Hash identifying the cached file */
+    size_t block_idx;      /* Block index within the file */
+    size_t size;           /* Extent of data in the block file (exact if eof) */
+    uint64_t valid;        /* Validity bitmap, see cache_bitmap.h */
+    bool eof;              /* Block holds the end of the file */
+    time_t last_access;    /* Last time the block was read or written */
+    uint64_t generation;   /* Index-wide counter value when the block was stored */
+    bool shared;           /* Complete block stored once under its digest */
+    cache_digest_t digest; /* Content digest, if shared */
+    size_t stored;         /* Bytes on disk */
+    cache_codec_t codec;   /* Compression of the stored bytes */
+    uint32_t crc;          /* CRC32C of the stored bytes */
+} cache_index_entry_t;
+
+/**
+ * Open (or create) the block index.
+ * @param cache_root Root directory for cache storage
+ * @param debug Enable debug logging
+ * @return Index handle or NULL on error
+ */
+cache_index_t *cache_index_open(const char *cache_root, bool debug);
+
+/**
+ * Check whether the index database was created (or reset because of an
+ * older schema) by this open. Any block files present are then unknown.
+ * @param idx Index handle
+ * @return true if the index starts out empty
+ */
+bool cache_index_is_new(cache_index_t *idx);
+
+/**
+ * Add or replace the entry of a block stored raw in its own file. The new
+ * entry describes the whole file, which the caller has already merged
+ * with what the block held before.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param size Extent of data in the block file
+ * @param valid Validity bitmap of the block file
+ * @param eof true if the data ends the file
+ * @param crc Checksum of the block file
+ * @param expect_generation Generation of the entry being replaced, or 0
+ *        if the block is not expected to be indexed
+ * @param old_size_out Extent of the entry before, 0 if none (can be NULL)
+ * @return 0 on success, -1 on error or if the block's entry is not the
+ *         one expected
+ */
+int cache_index_insert(cache_index_t *idx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       size_t size,
+                       uint64_t valid,
+                       bool eof,
+                       uint32_t crc,
+                       uint64_t expect_generation,
+                       size_t *old_size_out);
+
+/**
+ * Add an entry for a complete block whose content is stored once, under
+ * its digest, for all entries with that digest. The content counts once
+ * towards the total size however many entries refer to it. If the
+ * content is already referenced, the entry takes its stored size and
+ * codec from there.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param size Length of the content
+ * @param eof true if the content ends the file
+ * @param digest Content digest
+ * @param stored Bytes on disk
+ * @param codec Compression of the stored bytes
+ * @param crc Checksum of the stored bytes
+ * @return 0 on success, -1 on error or if the block is already indexed
+ *         with other content
+ */
+int cache_index_insert_shared(cache_index_t *idx,
+                              uint64_t file_key,
+                              size_t block_idx,
+                              size_t size,
+                              bool eof,
+                              const cache_digest_t *digest,
+                              size_t stored,
+                              cache_codec_t codec,
+                              uint32_t crc);
+
+/**
+ * Add an entry for a complete block stored compressed in its own file.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param size Uncompressed length of the block
+ * @param eof true if the block ends the file
+ * @param stored Bytes on disk
+ * @param codec Compression of the stored bytes
+ * @param crc Checksum of the stored bytes
+ * @return 0 on success, -1 on error or if the block is already indexed
+ */
+int cache_index_insert_packed(cache_index_t *idx,
+                              uint64_t file_key,
+                              size_t block_idx,
+                              size_t size,
+                              bool eof,
+                              size_t stored,
+                              cache_codec_t codec,
+                              uint32_t crc);
+
+/**
+ * Check whether any entry refers to shared content.
+ * @param idx Index handle
+ * @param digest Content digest
+ * @return true if the content is referenced
+ */
+bool cache_index_has_content(cache_index_t *idx, const cache_digest_t *digest);
+
+/**
+ * Look up an entry and mark it as used.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param entry_out Copy of the entry (can be NULL)
+ * @return true if the block is indexed
+ */
+bool cache_index_lookup(cache_index_t *idx,
+                        uint64_t file_key,
+                        size_t block_idx,
+                        cache_index_entry_t *entry_out);
+
+/**
+ * Remove an entry.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param entry_out Copy of the removed entry (can be NULL)
+ * @param content_freed_out Set if the entry held the last reference to
+ *        its shared content (can be NULL)
+ * @return 0 if an entry was removed, -1 if there was none
+ */
+int cache_index_remove(cache_index_t *idx,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       cache_index_entry_t *entry_out,
+                       bool *content_freed_out);
+
+/**
+ * List the indexed blocks of one file.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param blocks_out Array of block indexes (caller must free)
+ * @param count_out Number of blocks
+ * @return 0 on success, -1 on error
+ */
+int cache_index_file_blocks(cache_index_t *idx,
+                            uint64_t file_key,
+                            size_t **blocks_out,
+                            size_t *count_out);
+
+/**
+ * List the files that have indexed blocks.
+ * @param idx Index handle
+ * @param keys_out Array of file keys (caller must free)
+ * @param count_out Number of file keys
+ * @return 0 on success, -1 on error
+ */
+int cache_index_file_keys(cache_index_t *idx, uint64_t **keys_out, size_t *count_out);
+
+/**
+ * Find the block holding the end of a file.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param block_out Index of the tail block
+ * @return 0 if the file has an indexed tail block, -1 otherwise
+ */
+int cache_index_file_tail(cache_index_t *idx, uint64_t file_key, size_t *block_out);
+
+/**
+ * Remove and return the next CLOCK victim.
+ * @param idx Index handle
+ * @param entry_out Removed entry
+ * @param content_freed_out Set if the entry held the last reference to
+ *        its shared content (can be NULL)
+ * @return true if an entry was removed, false if no unpinned entry is left
+ */
+bool cache_index_pop_victim(cache_index_t *idx,
+                            cache_index_entry_t *entry_out,
+                            bool *content_freed_out);
+
+/**
+ * Pin or unpin a file. Entries of a pinned file are never CLOCK victims,
+ * including blocks added after the pin. Pins persist across restarts.
+ * @param idx Index handle
+ * @param file_key File key
+ * @param pinned true to pin, false to unpin
+ * @return 0 on success, -1 on error
+ */
+int cache_index_set_pinned(cache_index_t *idx, uint64_t file_key, bool pinned);
+
+/**
+ * Check if a file is pinned.
+ * @param idx Index handle
+ * @param file_key File key
+ * @return true if the file is pinned
+ */
+bool cache_index_is_pinned(cache_index_t *idx, uint64_t file_key);
+
+/**
+ * Get pinned totals.
+ * @param idx Index handle
+ * @param pinned_size_out Bytes on disk held by pinned entries, shared
+ *        content counted once per pinned reference (can be NULL)
+ * @param file_count_out Number of pinned files (can be NULL)
+ */
+void cache_index_get_pinned(cache_index_t *idx,
+                            size_t *pinned_size_out,
+                            size_t *file_count_out);
+
+/**
+ * Get index totals.
+ * @param idx Index handle
+ * @param total_size_out Bytes on disk of all entries, shared content
+ *        counted once (can be NULL)
+ * @param count_out Number of entries (can be NULL)
+ *
+ * Does not take the index lock; the two totals may be from different
+ * moments while other threads insert or remove.
+ */
+void cache_index_get_totals(cache_index_t *idx,
+                            size_t *total_size_out,
+                            size_t *count_out);
+
+/**
+ * Get the generation the most recently stored entry was given.
+ * @param idx Index handle
+ * @return Current generation
+ */
+uint64_t cache_index_generation(cache_index_t *idx);
+
+/**
+ * Record a checkpoint: every block stored up to a generation is on
+ * stable storage, so it need not be checked after a crash.
+ * @param idx Index handle
+ * @param generation Generation read before the block files were synced
+ */
+void cache_index_checkpoint(cache_index_t *idx, uint64_t generation);
+
+/**
+ * Take the entries that may not have reached stable storage intact: those
+ * stored after the last checkpoint, if the previous run did not shut down
+ * cleanly. Empty after a clean shutdown, and on later calls.
+ * @param idx Index handle
+ * @param entries_out Array of entries as loaded (caller must free)
+ * @param count_out Number of entries
+ * @return 0 on success, -1 on error
+ */
+int cache_index_take_unchecked(cache_index_t *idx,
+                               cache_index_entry_t **entries_out,
+                               size_t *count_out);
+
+/**
+ * Record that the cache is shutting down cleanly, with every block file on
+ * stable storage. The next open then trusts all entries.
+ * @param idx Index handle
+ */
+void cache_index_mark_clean(cache_index_t *idx);
+
+/**
+ * Write pending access times back to the database.
+ * @param idx Index handle
+ */
+void cache_index_sync(cache_index_t *idx);
+
+/**
+ * Sync and close the index.
+ * @param idx Index handle
+ */
+void cache_index_close(cache_index_t *idx);
+
+#endif /* CACHE_INDEX_H */
@@ -0,0 +1,435 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_io.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#define HAVE_IO_URING 1
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+static cache_io_engine_t io_engine = CACHE_IO_SYNC;
+static unsigned io_depth = 1;
+static bool io_debug = false;
+
+int cache_io_parse(const char *spec, cache_io_engine_t *engine_out, unsigned *depth_out)
+{
+    if (spec == NULL) {
+        return -1;
+    }
+
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+    unsigned depth = CACHE_IO_DEFAULT_DEPTH;
+    if (colon != NULL) {
+        char *end;
+        long d = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || d < 1 || d > CACHE_IO_MAX_DEPTH) {
+            return -1;
+        }
+        depth = (unsigned)d;
+    }
+
+    cache_io_engine_t engine;
+    if (name_len == 4 && strncmp(spec, "sync", 4) == 0) {
+        engine = CACHE_IO_SYNC;
+    } else if (name_len == 5 && strncmp(spec, "uring", 5) == 0) {
+#ifdef HAVE_IO_URING
+        engine = CACHE_IO_URING;
+#else
+        return -1;  /* Not built in */
+#endif
+    } else {
+        return -1;
+    }
+
+    *engine_out = engine;
+    *depth_out = depth;
+    return 0;
+}
+
+const char *cache_io_name(cache_io_engine_t engine)
+{
+    switch (engine) {
+    case CACHE_IO_URING:
+        return "uring";
+    default:
+        return "sync";
+    }
+}
+
+/* Finish a request synchronously from where it got to, until it is
+   complete, fails or (for reads) reaches end of file */
+static void finish_sync(cache_io_op_t *op, size_t done)
+{
+    while (done < op->len) {
+        char *p = (char *)op->buf + done;
+        ssize_t n = op->write ? pwrite(op->fd, p, op->len - done, op->offset + done)
+                              : pread(op->fd, p, op->len - done, op->offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            if (done == 0) {
+                op->res = -errno;
+                return;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    op->res = done;
+}
+
+#ifdef HAVE_IO_URING
+
+/* A thread's ring, mapped as the kernel lays it out */
+struct io_ring {
+    int fd;
+    unsigned entries;
+
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    void *cq_ptr;               /* Same as sq_ptr with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct iovec *iovs;         /* One per submission slot */
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static void ring_free(struct io_ring *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->iovs);
+    free(ring);
+}
+
+static void ring_destroy(void *arg)
+{
+    if (arg != NULL) {
+        ring_free(arg);
+    }
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ring_key, ring_destroy);
+}
+
+static struct io_ring *ring_create(unsigned entries)
+{
+    struct io_ring *ring = calloc(1, sizeof(struct io_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        int saved_errno = errno;
+        free(ring);
+        errno = saved_errno;
+        return NULL;
+    }
+    ring->entries = p.sq_entries;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+    ring->iovs = calloc(p.sq_entries, sizeof(struct iovec));
+    if (ring->iovs == NULL) {
+        goto fail;
+    }
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return ring;
+
+fail:
+    ring_free(ring);
+    return NULL;
+}
+
+/* The calling thread's ring, created on first use. NULL if io_uring is
+   off or can't be set up, in which case the caller runs synchronously. */
+static struct io_ring *thread_ring(void)
+{
+    if (io_engine != CACHE_IO_URING) {
+        return NULL;
+    }
+    pthread_once(&ring_once, ring_key_init);
+    struct io_ring *ring = pthread_getspecific(ring_key);
+    if (ring == NULL) {
+        ring = ring_create(io_depth);
+        if (ring == NULL) {
+            DPRINTF("cache_io: io_uring setup failed: %s", strerror(errno));
+            return NULL;
+        }
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+static int ring_enter(struct io_ring *ring, unsigned to_submit, unsigned min_complete)
+{
+    for (;;) {
+        int n = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0 || errno != EINTR) {
+            return n;
+        }
+    }
+}
+
+/* Queue op as submission slot index; the completion carries its index */
+static void ring_prep(struct io_ring *ring, cache_io_op_t *op, size_t index)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    struct iovec *iov = &ring->iovs[slot];
+
+    iov->iov_base = op->buf;
+    iov->iov_len = op->len;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = op->fd;
+    sqe->off = op->offset;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 1;
+    sqe->user_data = index;
+
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Complete what the kernel has finished; returns how many requests that was */
+static size_t ring_reap(struct io_ring *ring, cache_io_op_t *ops)
+{
+    size_t reaped = 0;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        cache_io_op_t *op = &ops[cqe->user_data];
+        if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+            finish_sync(op, 0);
+        } else if (cqe->res > 0 && (size_t)cqe->res < op->len) {
+            finish_sync(op, cqe->res);  /* Short: pick up where it stopped */
+        } else {
+            op->res = cqe->res;
+        }
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/* Give up on a ring that failed to submit; the caller then finishes the
+   requests left synchronously, and this thread gets a new ring next time.
+   Requests the kernel took still point at the ring's iovecs and the
+   callers' buffers, so wait for them before letting go of either. */
+static void ring_abandon(struct io_ring *ring, cache_io_op_t *ops, size_t queued, size_t inflight)
+{
+    /* The kernel only reads the submission queue in io_uring_enter, so
+       requests it hasn't taken yet can be withdrawn */
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail - (unsigned)queued, __ATOMIC_RELEASE);
+    inflight -= queued;
+
+    while (inflight > 0 && ring_enter(ring, 0, 1) >= 0) {
+        inflight -= ring_reap(ring, ops);
+    }
+    pthread_setspecific(ring_key, NULL);
+    if (inflight == 0) {
+        ring_free(ring);
+    } else {
+        /* Can't wait for them: keep the ring mapped rather than let the
+           kernel complete into freed memory */
+        DPRINTF("cache_io: leaking a ring with %zu requests in flight: %s",
+                inflight, strerror(errno));
+    }
+}
+
+static void ring_run(struct io_ring *ring, cache_io_op_t *ops, size_t count)
+{
+    size_t next = 0;            /* First op not yet queued */
+    size_t queued = 0;          /* Queued, not yet taken by the kernel */
+    size_t inflight = 0;        /* Queued or taken, not yet completed */
+
+    for (size_t i = 0; i < count; i++) {
+        ops[i].res = -EINPROGRESS;
+    }
+
+    while (next < count || inflight > 0) {
+        /* A slot's iovec is reused once the tail wraps around, so never
+           have more requests outstanding than there are slots */
+        while (next < count && inflight < ring->entries) {
+            ring_prep(ring, &ops[next], next);
+            next++;
+            queued++;
+            inflight++;
+        }
+
+        int n = ring_enter(ring, queued, 1);
+        if (n < 0 && (errno == EAGAIN || errno == EBUSY) && inflight > queued) {
+            n = ring_enter(ring, 0, 1);  /* Out of resources: reap first */
+        }
+        if (n < 0) {
+            DPRINTF("cache_io: io_uring_enter failed: %s", strerror(errno));
+            ring_abandon(ring, ops, queued, inflight);
+            break;
+        }
+        queued -= (size_t)n < queued ? (size_t)n : queued;
+        inflight -= ring_reap(ring, ops);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].res == -EINPROGRESS) {
+            finish_sync(&ops[i], 0);
+        }
+    }
+}
+
+#endif /* HAVE_IO_URING */
+
+cache_io_engine_t cache_io_init(cache_io_engine_t engine, unsigned depth, bool debug)
+{
+    io_debug = debug;
+    io_engine = CACHE_IO_SYNC;
+    io_depth = 1;
+
+#ifdef HAVE_IO_URING
+    if (engine == CACHE_IO_URING) {
+        /* Probe once, so a kernel without io_uring is reported up front */
+        struct io_ring *probe = ring_create(depth);
+        if (probe != NULL) {
+            ring_free(probe);
+            io_engine = CACHE_IO_URING;
+            io_depth = depth;
+        } else {
+            DPRINTF("cache_io: io_uring unavailable (%s), using synchronous I/O", strerror(errno));
+        }
+    }
+#else
+    (void)engine;
+    (void)depth;
+#endif
+
+    if (io_debug) {
+        DPRINTF("cache_io_init: engine %s, depth %u", cache_io_name(io_engine), io_depth);
+    }
+    return io_engine;
+}
+
+size_t cache_io_batch_size(void)
+{
+    return io_depth;
+}
+
+void cache_io_run(cache_io_op_t *ops, size_t count)
+{
+#ifdef HAVE_IO_URING
+    /* A single request gains nothing from the ring */
+    if (count > 1) {
+        struct io_ring *ring = thread_ring();
+        if (ring != NULL) {
+            ring_run(ring, ops, count);
+            return;
+        }
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        finish_sync(&ops[i], 0);
+    }
+}
@@ -0,0 +1,98 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_IO_H
+#define CACHE_IO_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Backend I/O engine.
+ *
+ * Callers hand over a batch of independent reads or writes and wait for
+ * all of them. The synchronous engine issues them one by one with
+ * pread/pwrite. On Linux the io_uring engine submits a whole batch at
+ * once from a ring of the calling thread's own, so one thread keeps many
+ * requests in flight, which is what high-latency backends (SMB, NFS)
+ * need to reach line rate.
+ */
+
+typedef enum {
+    CACHE_IO_SYNC,
+    CACHE_IO_URING
+} cache_io_engine_t;
+
+#define CACHE_IO_DEFAULT_DEPTH 32   /* Requests in flight per thread */
+#define CACHE_IO_MAX_DEPTH 4096
+
+/* One read or write of a batch */
+typedef struct cache_io_op {
+    int fd;
+    bool write;
+    void *buf;
+    size_t len;
+    off_t offset;
+    ssize_t res;                /* Bytes transferred or -errno, set on completion */
+} cache_io_op_t;
+
+/**
+ * Parse an engine specification of the form NAME[:DEPTH], e.g. "sync"
+ * or "uring:64".
+ * @param spec Specification
+ * @param engine_out Engine
+ * @param depth_out Queue depth (CACHE_IO_DEFAULT_DEPTH if not given)
+ * @return 0 on success, -1 if the engine is unknown or not built in
+ */
+int cache_io_parse(const char *spec, cache_io_engine_t *engine_out, unsigned *depth_out);
+
+/**
+ * Get the name of an engine.
+ * @param engine Engine
+ * @return Engine name
+ */
+const char *cache_io_name(cache_io_engine_t engine);
+
+/**
+ * Select the engine for all threads. io_uring falls back to the
+ * synchronous engine if the kernel doesn't allow it.
+ * @param engine Engine
+ * @param depth Queue depth
+ * @param debug Enable debug logging
+ * @return Engine in use
+ */
+cache_io_engine_t cache_io_init(cache_io_engine_t engine, unsigned depth, bool debug);
+
+/**
+ * Get the number of requests worth batching: the queue depth with
+ * io_uring, 1 with the synchronous engine.
+ * @return Batch size
+ */
+size_t cache_io_batch_size(void);
+
+/**
+ * Run a batch and wait for all of it. Reads and writes are retried until
+ * complete, so a short read means end of file, as with a pread loop.
+ * @param ops Requests; their res fields are set on return
+ * @param count Number of requests
+ */
+void cache_io_run(cache_io_op_t *ops, size_t count);
+
+#endif /* CACHE_IO_H */
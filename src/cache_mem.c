@@ -0,0 +1,489 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_mem.h"
+#include "cache_bitmap.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MEM_SHARDS 16
+#define MEM_INITIAL_BUCKETS 64
+
+/* In-memory block */
+struct mem_block {
+    uint64_t file_key;
+    size_t block_idx;
+    size_t size;                    /* Extent of data from the block start */
+    size_t capacity;
+    uint64_t valid;
+    bool eof;
+    bool on_disk;
+    uint64_t tag;
+    struct mem_block *hash_next;
+    struct mem_block *lru_prev;     /* Towards the least recently used */
+    struct mem_block *lru_next;     /* Towards the most recently used */
+    char data[];
+};
+
+/* One shard of the memory tier */
+struct mem_shard {
+    pthread_mutex_t lock;
+    struct mem_block **buckets;
+    size_t bucket_count;
+    size_t count;
+    size_t size;
+    size_t max_size;
+    struct mem_block *lru_head;     /* Least recently used */
+    struct mem_block *lru_tail;     /* Most recently used */
+};
+
+/* Memory tier */
+struct cache_mem {
+    struct mem_shard shards[MEM_SHARDS];
+    size_t granule;
+    cache_mem_demote_fn demote;
+    void *demote_arg;
+};
+
+static uint64_t mix_key(uint64_t file_key)
+{
+    uint64_t h = file_key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static struct mem_shard *shard_for(cache_mem_t *mem, uint64_t file_key)
+{
+    return &mem->shards[mix_key(file_key) % MEM_SHARDS];
+}
+
+static size_t bucket_for(struct mem_shard *shard, uint64_t file_key, size_t block_idx)
+{
+    uint64_t h = mix_key(file_key ^ ((uint64_t)block_idx * 0x9E3779B97F4A7C15ULL));
+    return (size_t)(h >> 8) & (shard->bucket_count - 1);
+}
+
+static struct mem_block **find_slot(struct mem_shard *shard, uint64_t file_key, size_t block_idx)
+{
+    struct mem_block **slot = &shard->buckets[bucket_for(shard, file_key, block_idx)];
+    while (*slot != NULL) {
+        if ((*slot)->file_key == file_key && (*slot)->block_idx == block_idx) {
+            break;
+        }
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+static void grow_buckets(struct mem_shard *shard)
+{
+    size_t old_count = shard->bucket_count;
+    struct mem_block **old_buckets = shard->buckets;
+    struct mem_block **new_buckets = calloc(old_count * 2, sizeof(struct mem_block *));
+    if (new_buckets == NULL) {
+        return;  /* Keep the old table; chains just get longer */
+    }
+
+    shard->buckets = new_buckets;
+    shard->bucket_count = old_count * 2;
+    for (size_t i = 0; i < old_count; i++) {
+        struct mem_block *b = old_buckets[i];
+        while (b != NULL) {
+            struct mem_block *next = b->hash_next;
+            size_t idx = bucket_for(shard, b->file_key, b->block_idx);
+            b->hash_next = new_buckets[idx];
+            new_buckets[idx] = b;
+            b = next;
+        }
+    }
+    free(old_buckets);
+}
+
+static void lru_unlink(struct mem_shard *shard, struct mem_block *b)
+{
+    if (b->lru_prev != NULL) {
+        b->lru_prev->lru_next = b->lru_next;
+    } else {
+        shard->lru_head = b->lru_next;
+    }
+    if (b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        shard->lru_tail = b->lru_prev;
+    }
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_append(struct mem_shard *shard, struct mem_block *b)
+{
+    b->lru_prev = shard->lru_tail;
+    b->lru_next = NULL;
+    if (shard->lru_tail != NULL) {
+        shard->lru_tail->lru_next = b;
+    } else {
+        shard->lru_head = b;
+    }
+    shard->lru_tail = b;
+}
+
+/* Unlinks the block found at slot and returns it. */
+static struct mem_block *unlink_block(struct mem_shard *shard, struct mem_block **slot)
+{
+    struct mem_block *b = *slot;
+    *slot = b->hash_next;
+    b->hash_next = NULL;
+    lru_unlink(shard, b);
+    shard->count--;
+    shard->size -= b->size;
+    return b;
+}
+
+/* Hands blocks to the demotion callback and frees them. Called unlocked. */
+static void release_blocks(cache_mem_t *mem, struct mem_block *list, bool demote)
+{
+    while (list != NULL) {
+        struct mem_block *next = list->hash_next;
+        if (demote && !list->on_disk && mem->demote != NULL) {
+            mem->demote(mem->demote_arg, list->file_key, list->block_idx,
+                        list->data, list->size, list->valid, list->eof, list->tag);
+        }
+        free(list);
+        list = next;
+    }
+}
+
+cache_mem_t *cache_mem_create(size_t max_size,
+                              size_t block_size,
+                              cache_mem_demote_fn demote,
+                              void *demote_arg)
+{
+    if (max_size == 0 || block_size == 0) {
+        return NULL;
+    }
+
+    cache_mem_t *mem = calloc(1, sizeof(cache_mem_t));
+    if (mem == NULL) {
+        return NULL;
+    }
+    mem->granule = cache_bitmap_granule(block_size);
+    mem->demote = demote;
+    mem->demote_arg = demote_arg;
+
+    for (int i = 0; i < MEM_SHARDS; i++) {
+        struct mem_shard *shard = &mem->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->max_size = max_size / MEM_SHARDS;
+        shard->bucket_count = MEM_INITIAL_BUCKETS;
+        shard->buckets = calloc(shard->bucket_count, sizeof(struct mem_block *));
+        if (shard->buckets == NULL) {
+            cache_mem_destroy(mem);
+            return NULL;
+        }
+    }
+
+    return mem;
+}
+
+bool cache_mem_contains(cache_mem_t *mem, uint64_t file_key, size_t block_idx)
+{
+    if (mem == NULL) {
+        return false;
+    }
+
+    struct mem_shard *shard = shard_for(mem, file_key);
+    pthread_mutex_lock(&shard->lock);
+    bool found = (*find_slot(shard, file_key, block_idx) != NULL);
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+ssize_t cache_mem_read(cache_mem_t *mem,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       char *buf,
+                       size_t size,
+                       size_t offset)
+{
+    if (mem == NULL || buf == NULL) {
+        return -1;
+    }
+
+    struct mem_shard *shard = shard_for(mem, file_key);
+    pthread_mutex_lock(&shard->lock);
+
+    struct mem_block *b = *find_slot(shard, file_key, block_idx);
+    if (b == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    if (!cache_bitmap_check(mem->granule, b->valid, b->size, b->eof, offset, &size)) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    lru_unlink(shard, b);
+    lru_append(shard, b);
+    memcpy(buf, b->data + offset, size);
+
+    pthread_mutex_unlock(&shard->lock);
+    return (ssize_t)size;
+}
+
+int cache_mem_store(cache_mem_t *mem,
+                    uint64_t file_key,
+                    size_t block_idx,
+                    const char *data,
+                    size_t offset,
+                    size_t size,
+                    uint64_t valid,
+                    bool eof,
+                    bool on_disk,
+                    uint64_t tag)
+{
+    if (mem == NULL || data == NULL) {
+        return -1;
+    }
+
+    struct mem_shard *shard = shard_for(mem, file_key);
+    size_t end = offset + size;
+    if (end > shard->max_size) {
+        return -1;
+    }
+
+    struct mem_block *replaced = NULL;
+    struct mem_block *victims = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    struct mem_block **slot = find_slot(shard, file_key, block_idx);
+    struct mem_block *old = *slot;
+    struct mem_block *b = old;
+
+    if (old == NULL || old->capacity < end) {
+        /* Allocate a block big enough for the merged extent */
+        size_t extent = (old != NULL && old->size > end) ? old->size : end;
+        b = malloc(sizeof(struct mem_block) + extent);
+        if (b == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        b->file_key = file_key;
+        b->block_idx = block_idx;
+        b->capacity = extent;
+        if (old != NULL) {
+            memcpy(b->data, old->data, old->size);
+            b->size = old->size;
+            b->valid = old->valid;
+            b->eof = old->eof;
+            b->on_disk = old->on_disk;
+            replaced = unlink_block(shard, slot);
+        } else {
+            b->size = 0;
+            b->valid = 0;
+            b->eof = false;
+            b->on_disk = on_disk;
+            if (shard->count >= shard->bucket_count) {
+                grow_buckets(shard);
+            }
+        }
+        slot = find_slot(shard, file_key, block_idx);
+        b->hash_next = NULL;
+        *slot = b;
+        lru_append(shard, b);
+        shard->count++;
+        shard->size += b->size;
+    } else {
+        lru_unlink(shard, b);
+        lru_append(shard, b);
+    }
+
+    /* Merge the new data */
+    if (offset > b->size) {
+        memset(b->data + b->size, 0, offset - b->size);
+    }
+    memcpy(b->data + offset, data, size);
+    if (end > b->size) {
+        shard->size += end - b->size;
+        b->eof = eof;
+        b->size = end;
+    } else if (end == b->size) {
+        b->eof = b->eof || eof;
+    }
+    b->valid |= valid;
+    b->on_disk = b->on_disk && on_disk;
+    b->tag = tag;
+
+    /* Collect demotion victims; they are written out after unlocking */
+    while (shard->size > shard->max_size && shard->lru_head != b) {
+        struct mem_block *oldest = shard->lru_head;
+        struct mem_block *victim = unlink_block(shard,
+            find_slot(shard, oldest->file_key, oldest->block_idx));
+        victim->hash_next = victims;
+        victims = victim;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    free(replaced);
+    release_blocks(mem, victims, true);
+    return 0;
+}
+
+void cache_mem_invalidate(cache_mem_t *mem, uint64_t file_key, size_t block_idx)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    struct mem_shard *shard = shard_for(mem, file_key);
+    struct mem_block *removed = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    struct mem_block **slot = find_slot(shard, file_key, block_idx);
+    if (*slot != NULL) {
+        removed = unlink_block(shard, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    free(removed);
+}
+
+void cache_mem_invalidate_file(cache_mem_t *mem, uint64_t file_key)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    /* All blocks of a file share a shard, so only that shard is scanned */
+    struct mem_shard *shard = shard_for(mem, file_key);
+    struct mem_block *removed = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    struct mem_block *b = shard->lru_head;
+    while (b != NULL) {
+        struct mem_block *next = b->lru_next;
+        if (b->file_key == file_key) {
+            struct mem_block *victim = unlink_block(shard,
+                find_slot(shard, b->file_key, b->block_idx));
+            victim->hash_next = removed;
+            removed = victim;
+        }
+        b = next;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    release_blocks(mem, removed, false);
+}
+
+void cache_mem_invalidate_all(cache_mem_t *mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < MEM_SHARDS; i++) {
+        struct mem_shard *shard = &mem->shards[i];
+        struct mem_block *removed = NULL;
+
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_head != NULL) {
+            struct mem_block *b = shard->lru_head;
+            struct mem_block *victim = unlink_block(shard,
+                find_slot(shard, b->file_key, b->block_idx));
+            victim->hash_next = removed;
+            removed = victim;
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        release_blocks(mem, removed, false);
+    }
+}
+
+bool cache_mem_file_tail(cache_mem_t *mem, uint64_t file_key, size_t *block_out)
+{
+    if (mem == NULL || block_out == NULL) {
+        return false;
+    }
+
+    struct mem_shard *shard = shard_for(mem, file_key);
+    bool found = false;
+
+    pthread_mutex_lock(&shard->lock);
+    for (struct mem_block *b = shard->lru_head; b != NULL; b = b->lru_next) {
+        if (b->file_key == file_key && b->eof) {
+            *block_out = b->block_idx;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+size_t cache_mem_get_size(cache_mem_t *mem)
+{
+    if (mem == NULL) {
+        return 0;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < MEM_SHARDS; i++) {
+        pthread_mutex_lock(&mem->shards[i].lock);
+        total += mem->shards[i].size;
+        pthread_mutex_unlock(&mem->shards[i].lock);
+    }
+    return total;
+}
+
+void cache_mem_destroy(cache_mem_t *mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < MEM_SHARDS; i++) {
+        struct mem_shard *shard = &mem->shards[i];
+        struct mem_block *all = NULL;
+
+        if (shard->buckets != NULL) {
+            pthread_mutex_lock(&shard->lock);
+            while (shard->lru_head != NULL) {
+                struct mem_block *oldest = shard->lru_head;
+                struct mem_block *b = unlink_block(shard,
+                    find_slot(shard, oldest->file_key, oldest->block_idx));
+                b->hash_next = all;
+                all = b;
+            }
+            pthread_mutex_unlock(&shard->lock);
+            free(shard->buckets);
+        }
+
+        release_blocks(mem, all, true);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(mem);
+}
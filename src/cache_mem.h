@@ -0,0 +1,172 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_MEM_H
+#define CACHE_MEM_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bounded in-memory block tier.
+ *
+ * Blocks are kept in a hash table split into shards by file key, each
+ * with its own lock and LRU list, so all blocks of one file live in the
+ * same shard. When a shard is over its share of the limit, its least
+ * recently used blocks are handed to the demote callback (outside the
+ * shard lock) before being freed.
+ *
+ * Blocks may be partial: each carries a validity bitmap (cache_bitmap.h)
+ * and stores are merged into what is already held.
+ */
+
+/* Opaque memory tier handle */
+typedef struct cache_mem cache_mem_t;
+
+/**
+ * Called for each block leaving the memory tier by demotion.
+ * Not called for invalidated blocks or blocks already on disk.
+ * @param arg Callback argument given to cache_mem_create()
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param data Block contents from the start of the block
+ * @param size Number of bytes in data
+ * @param valid Validity bitmap of data
+ * @param eof true if the block ends the file
+ * @param tag Tag given when the block was last stored
+ */
+typedef void (*cache_mem_demote_fn)(void *arg,
+                                    uint64_t file_key,
+                                    size_t block_idx,
+                                    const char *data,
+                                    size_t size,
+                                    uint64_t valid,
+                                    bool eof,
+                                    uint64_t tag);
+
+/**
+ * Create a memory tier.
+ * @param max_size Maximum bytes of block data held in memory
+ * @param block_size Block size in bytes
+ * @param demote Demotion callback (can be NULL)
+ * @param demote_arg Argument passed to the demotion callback
+ * @return Memory tier handle or NULL on error
+ */
+cache_mem_t *cache_mem_create(size_t max_size,
+                              size_t block_size,
+                              cache_mem_demote_fn demote,
+                              void *demote_arg);
+
+/**
+ * Check if any part of a block is in memory.
+ * @param mem Memory tier handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @return true if the block is in memory
+ */
+bool cache_mem_contains(cache_mem_t *mem, uint64_t file_key, size_t block_idx);
+
+/**
+ * Copy part of a block out of memory and mark it as used.
+ * @param mem Memory tier handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param buf Output buffer
+ * @param size Number of bytes to read
+ * @param offset Offset within block
+ * @return Number of bytes copied (short only at end of file), or -1 if
+ *         the range is not fully valid in memory
+ */
+ssize_t cache_mem_read(cache_mem_t *mem,
+                       uint64_t file_key,
+                       size_t block_idx,
+                       char *buf,
+                       size_t size,
+                       size_t offset);
+
+/**
+ * Store part of a block, merging it into any data already held.
+ * @param mem Memory tier handle
+ * @param file_key File key
+ * @param block_idx Block index
+ * @param data Data to store
+ * @param offset Offset of data within the block
+ * @param size Number of bytes in data
+ * @param valid Granules made valid by data
+ * @param eof true if data ends the file
+ * @param on_disk true if the data is already in the disk tier
+ * @param tag Opaque value handed back to the demotion callback
+ * @return 0 on success, -1 on error
+ */
+int cache_mem_store(cache_mem_t *mem,
+                    uint64_t file_key,
+                    size_t block_idx,
+                    const char *data,
+                    size_t offset,
+                    size_t size,
+                    uint64_t valid,
+                    bool eof,
+                    bool on_disk,
+                    uint64_t tag);
+
+/**
+ * Drop one block without demoting it.
+ * @param mem Memory tier handle
+ * @param file_key File key
+ * @param block_idx Block index
+ */
+void cache_mem_invalidate(cache_mem_t *mem, uint64_t file_key, size_t block_idx);
+
+/**
+ * Drop all blocks of a file without demoting them.
+ * @param mem Memory tier handle
+ * @param file_key File key
+ */
+void cache_mem_invalidate_file(cache_mem_t *mem, uint64_t file_key);
+
+/**
+ * Drop every block without demoting it.
+ * @param mem Memory tier handle
+ */
+void cache_mem_invalidate_all(cache_mem_t *mem);
+
+/**
+ * Find the block in memory that holds the end of a file.
+ * @param mem Memory tier handle
+ * @param file_key File key
+ * @param block_out Index of the tail block
+ * @return true if such a block is in memory
+ */
+bool cache_mem_file_tail(cache_mem_t *mem, uint64_t file_key, size_t *block_out);
+
+/**
+ * Get the number of bytes held in memory.
+ * @param mem Memory tier handle
+ * @return Bytes of block data in memory
+ */
+size_t cache_mem_get_size(cache_mem_t *mem);
+
+/**
+ * Demote every block not yet on disk, then free the memory tier.
+ * @param mem Memory tier handle
+ */
+void cache_mem_destroy(cache_mem_t *mem);
+
+#endif /* CACHE_MEM_H */
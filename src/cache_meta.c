@@ -17,38 +17,697 @@
     along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <config.h>
+
 #include "cache_meta.h"
+#include "cache_meta_store.h"
+#include "cache_stats.h"
 #include "debug.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sqlite3.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+
+#define FRONT_SHARDS 16
+#define FRONT_INITIAL_BUCKETS 256
+#define FRONT_MAX_ENTRIES (128 * 1024)   /* In-memory entries, all shards */
+
+#define NAMES_BUCKETS 4096
+#define NAMES_MAX_DIRS (16 * 1024)      /* Complete directories tracked */
+#define NAMES_BITS_PER_ENTRY 12         /* Bloom filter false positives ~0.3% */
+#define NAMES_HASHES 6
+#define NAMES_MIN_WORDS 2
+
+#define META_FLUSH_INTERVAL_MS 5        /* Longest a mutation waits to be written */
+#define META_BATCH_RECORDS 512          /* Ops that trigger an early flush */
+#define META_MAX_PENDING (64 * 1024)    /* Ops queued before writers block */
+
+/* In-memory metadata entry */
+struct front_node {
+    char *path;
+    uint64_t hash;
+    cache_meta_entry_t entry;
+    struct front_node *hash_next;
+    struct front_node *lru_prev;    /* Towards the least recently used */
+    struct front_node *lru_next;    /* Towards the most recently used */
+};
+
+/* One shard of the in-memory table */
+struct front_shard {
+    pthread_mutex_t lock;
+    struct front_node **buckets;
+    size_t bucket_count;
+    size_t count;
+    struct front_node *lru_head;    /* Least recently used */
+    struct front_node *lru_tail;    /* Most recently used */
+};
 
-#define META_DB_NAME "metadata.db"
+/* Names of a directory whose whole listing is cached, as a Bloom filter.
+   A name missing from the filter is known not to exist. */
+struct dir_names {
+    char *path;
+    uint64_t hash;
+    time_t valid_until;             /* That of the listing */
+    size_t words;                   /* Filter size in 64-bit words, a power of two */
+    uint64_t *bits;
+    struct dir_names *hash_next;
+    struct dir_names *age_prev;     /* Towards the oldest */
+    struct dir_names *age_next;
+};
+
+/* Mutations waiting to be written to the store */
+enum meta_op_kind {
+    OP_META_PUT,
+    OP_META_DEL,
+    OP_META_DEL_TREE,
+    OP_DIR_PUT,
+    OP_DIR_DEL
+};
+
+struct meta_op {
+    enum meta_op_kind kind;
+    char *path;
+    uint64_t hash;
+    cache_meta_entry_t entry;           /* OP_META_PUT */
+    cache_dir_listing_t listing;        /* OP_DIR_PUT */
+    time_t cached_at;
+    time_t valid_until;
+    struct meta_op *next;
+};
 
 /* Cache metadata context */
 struct cache_meta_ctx {
-    sqlite3 *db;
-    sqlite3_stmt *insert_meta_stmt;
-    sqlite3_stmt *select_meta_stmt;
-    sqlite3_stmt *delete_meta_stmt;
-    sqlite3_stmt *insert_dir_stmt;
-    sqlite3_stmt *select_dir_stmt;
-    sqlite3_stmt *delete_dir_stmt;
+    struct front_shard front[FRONT_SHARDS];
+
+    /* Write-behind queue. Changes to the in-memory table are made under
+       queue_lock together with queuing the matching op, so both agree on
+       the order of stores and invalidations. */
+    pthread_mutex_t queue_lock;
+    pthread_cond_t wake;                /* Flusher has work */
+    pthread_cond_t space;               /* Queue drained below the limit */
+    struct meta_op *head;
+    struct meta_op *tail;
+    struct meta_op *flushing;           /* Batch being written, still visible */
+    size_t pending;                     /* Ops queued */
+    uint64_t meta_seq;                  /* Metadata ops ever queued */
+    uint64_t dir_seq;                   /* Listing ops ever queued */
+    bool stop;
+    bool flusher_started;
+    pthread_t flusher;
+
+    /* Complete directories. Changed with queue_lock held too, so they
+       follow the order of listing stores and invalidations. */
+    pthread_mutex_t names_lock;
+    struct dir_names *names[NAMES_BUCKETS];
+    struct dir_names *names_oldest;
+    struct dir_names *names_newest;
+    size_t names_count;
+
+    /* Persistent copy (cache_meta_store.h) */
+    cache_meta_store_t *store;
     char *cache_root;
     int meta_ttl;
     int dir_ttl;
     bool debug;
 };
 
+/* FNV-1a */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static struct front_shard *front_shard_for(cache_meta_ctx_t *ctx, uint64_t hash)
+{
+    return &ctx->front[(hash >> 32) % FRONT_SHARDS];
+}
+
+static void lru_unlink(struct front_shard *shard, struct front_node *n)
+{
+    if (n->lru_prev) n->lru_prev->lru_next = n->lru_next;
+    else shard->lru_head = n->lru_next;
+    if (n->lru_next) n->lru_next->lru_prev = n->lru_prev;
+    else shard->lru_tail = n->lru_prev;
+    n->lru_prev = n->lru_next = NULL;
+}
+
+static void lru_append(struct front_shard *shard, struct front_node *n)
+{
+    n->lru_prev = shard->lru_tail;
+    n->lru_next = NULL;
+    if (shard->lru_tail) shard->lru_tail->lru_next = n;
+    else shard->lru_head = n;
+    shard->lru_tail = n;
+}
+
+static struct front_node **front_find(struct front_shard *shard, const char *path, uint64_t hash)
+{
+    struct front_node **pp = &shard->buckets[hash % shard->bucket_count];
+    while (*pp != NULL && ((*pp)->hash != hash || strcmp((*pp)->path, path) != 0)) {
+        pp = &(*pp)->hash_next;
+    }
+    return pp;
+}
+
+static void front_unlink(struct front_shard *shard, struct front_node **pp)
+{
+    struct front_node *n = *pp;
+    *pp = n->hash_next;
+    lru_unlink(shard, n);
+    shard->count--;
+    free(n->path);
+    free(n);
+}
+
+static void front_grow(struct front_shard *shard)
+{
+    size_t new_count = shard->bucket_count * 2;
+    struct front_node **buckets = calloc(new_count, sizeof(struct front_node *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        struct front_node *n = shard->buckets[i];
+        while (n != NULL) {
+            struct front_node *next = n->hash_next;
+            n->hash_next = buckets[n->hash % new_count];
+            buckets[n->hash % new_count] = n;
+            n = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = new_count;
+}
+
+static bool front_lookup(cache_meta_ctx_t *ctx, const char *path, uint64_t hash,
+                         cache_meta_entry_t *entry)
+{
+    struct front_shard *shard = front_shard_for(ctx, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct front_node *n = *front_find(shard, path, hash);
+    if (n != NULL) {
+        *entry = n->entry;
+        lru_unlink(shard, n);
+        lru_append(shard, n);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return n != NULL;
+}
+
+/* Insert or replace */
+static void front_insert(cache_meta_ctx_t *ctx, const char *path, uint64_t hash,
+                         const cache_meta_entry_t *entry)
+{
+    struct front_shard *shard = front_shard_for(ctx, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct front_node **pp = front_find(shard, path, hash);
+    struct front_node *n = *pp;
+    if (n != NULL) {
+        n->entry = *entry;
+        lru_unlink(shard, n);
+        lru_append(shard, n);
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    n = calloc(1, sizeof(struct front_node));
+    if (n == NULL || (n->path = strdup(path)) == NULL) {
+        free(n);
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    n->hash = hash;
+    n->entry = *entry;
+    n->hash_next = *pp;
+    *pp = n;
+    lru_append(shard, n);
+    shard->count++;
+
+    while (shard->count > FRONT_MAX_ENTRIES / FRONT_SHARDS) {
+        struct front_node *old = shard->lru_head;
+        front_unlink(shard, front_find(shard, old->path, old->hash));
+    }
+    if (shard->count > shard->bucket_count) {
+        front_grow(shard);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void front_remove(cache_meta_ctx_t *ctx, const char *path, uint64_t hash)
+{
+    struct front_shard *shard = front_shard_for(ctx, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct front_node **pp = front_find(shard, path, hash);
+    if (*pp != NULL) {
+        front_unlink(shard, pp);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Is p the path top or below it? The root covers every path. */
+static bool path_in_tree(const char *p, const char *top, size_t len)
+{
+    if (strcmp(top, "/") == 0) {
+        return true;
+    }
+    return strncmp(p, top, len) == 0 && (p[len] == '\0' || p[len] == '/');
+}
+
+/* Remove path and every path below it from all shards */
+static void front_remove_tree(cache_meta_ctx_t *ctx, const char *path)
+{
+    size_t len = strlen(path);
+    for (int i = 0; i < FRONT_SHARDS; i++) {
+        struct front_shard *shard = &ctx->front[i];
+        pthread_mutex_lock(&shard->lock);
+        for (size_t b = 0; b < shard->bucket_count; b++) {
+            struct front_node **pp = &shard->buckets[b];
+            while (*pp != NULL) {
+                if (path_in_tree((*pp)->path, path, len)) {
+                    front_unlink(shard, pp);
+                } else {
+                    pp = &(*pp)->hash_next;
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static uint64_t hash_name(const char *name, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Bit i of the filter for a name hash, by double hashing */
+static size_t names_bit(const struct dir_names *d, uint64_t h, int i)
+{
+    uint64_t step = (h >> 32) | 1;
+    return (size_t)((h + i * step) & (d->words * 64 - 1));
+}
+
+static struct dir_names **names_find_locked(cache_meta_ctx_t *ctx, const char *path, uint64_t hash)
+{
+    struct dir_names **pp = &ctx->names[hash % NAMES_BUCKETS];
+    while (*pp != NULL && ((*pp)->hash != hash || strcmp((*pp)->path, path) != 0)) {
+        pp = &(*pp)->hash_next;
+    }
+    return pp;
+}
+
+static void names_free(struct dir_names *d)
+{
+    if (d != NULL) {
+        free(d->bits);
+        free(d->path);
+        free(d);
+    }
+}
+
+static void names_unlink_locked(cache_meta_ctx_t *ctx, struct dir_names **pp)
+{
+    struct dir_names *d = *pp;
+    *pp = d->hash_next;
+    if (d->age_prev) d->age_prev->age_next = d->age_next;
+    else ctx->names_oldest = d->age_next;
+    if (d->age_next) d->age_next->age_prev = d->age_prev;
+    else ctx->names_newest = d->age_prev;
+    ctx->names_count--;
+    names_free(d);
+}
+
+/* Build the filter of a listing, leaving out "." and ".." */
+static struct dir_names *names_build(const char *path, const cache_dir_listing_t *listing,
+                                     time_t valid_until)
+{
+    size_t words = NAMES_MIN_WORDS;
+    while (words * 64 < listing->count * NAMES_BITS_PER_ENTRY) {
+        words *= 2;
+    }
+
+    struct dir_names *d = calloc(1, sizeof(struct dir_names));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->path = strdup(path);
+    d->bits = calloc(words, sizeof(uint64_t));
+    if (d->path == NULL || d->bits == NULL) {
+        free(d->bits);
+        free(d->path);
+        free(d);
+        return NULL;
+    }
+    d->hash = hash_path(path);
+    d->valid_until = valid_until;
+    d->words = words;
+
+    size_t pos = 0;
+    cache_dir_item_t item;
+    while (cache_dir_unpack(listing, &pos, &item)) {
+        if (strcmp(item.name, ".") == 0 || strcmp(item.name, "..") == 0) {
+            continue;
+        }
+        uint64_t h = hash_name(item.name, strlen(item.name));
+        for (int i = 0; i < NAMES_HASHES; i++) {
+            size_t bit = names_bit(d, h, i);
+            d->bits[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+    return d;
+}
+
+/* Record a complete directory, replacing what was known of it */
+static void names_insert(cache_meta_ctx_t *ctx, struct dir_names *d)
+{
+    pthread_mutex_lock(&ctx->names_lock);
+    struct dir_names **pp = names_find_locked(ctx, d->path, d->hash);
+    if (*pp != NULL) {
+        names_unlink_locked(ctx, pp);
+    }
+    if (ctx->names_count >= NAMES_MAX_DIRS) {
+        struct dir_names *old = ctx->names_oldest;
+        names_unlink_locked(ctx, names_find_locked(ctx, old->path, old->hash));
+    }
+    d->hash_next = ctx->names[d->hash % NAMES_BUCKETS];
+    ctx->names[d->hash % NAMES_BUCKETS] = d;
+    d->age_prev = ctx->names_newest;
+    d->age_next = NULL;
+    if (ctx->names_newest) ctx->names_newest->age_next = d;
+    else ctx->names_oldest = d;
+    ctx->names_newest = d;
+    ctx->names_count++;
+    pthread_mutex_unlock(&ctx->names_lock);
+}
+
+static bool names_known(cache_meta_ctx_t *ctx, const char *path)
+{
+    pthread_mutex_lock(&ctx->names_lock);
+    bool known = (*names_find_locked(ctx, path, hash_path(path)) != NULL);
+    pthread_mutex_unlock(&ctx->names_lock);
+    return known;
+}
+
+static void names_remove(cache_meta_ctx_t *ctx, const char *path)
+{
+    pthread_mutex_lock(&ctx->names_lock);
+    struct dir_names **pp = names_find_locked(ctx, path, hash_path(path));
+    if (*pp != NULL) {
+        names_unlink_locked(ctx, pp);
+    }
+    pthread_mutex_unlock(&ctx->names_lock);
+}
+
+static void names_remove_tree(cache_meta_ctx_t *ctx, const char *path)
+{
+    size_t len = strlen(path);
+    pthread_mutex_lock(&ctx->names_lock);
+    for (size_t b = 0; b < NAMES_BUCKETS; b++) {
+        struct dir_names **pp = &ctx->names[b];
+        while (*pp != NULL) {
+            if (path_in_tree((*pp)->path, path, len)) {
+                names_unlink_locked(ctx, pp);
+            } else {
+                pp = &(*pp)->hash_next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->names_lock);
+}
+
+static void names_destroy(cache_meta_ctx_t *ctx)
+{
+    struct dir_names *d = ctx->names_oldest;
+    while (d != NULL) {
+        struct dir_names *next = d->age_next;
+        names_free(d);
+        d = next;
+    }
+    pthread_mutex_destroy(&ctx->names_lock);
+}
+
+static void front_destroy(cache_meta_ctx_t *ctx)
+{
+    names_destroy(ctx);
+    for (int i = 0; i < FRONT_SHARDS; i++) {
+        struct front_shard *shard = &ctx->front[i];
+        struct front_node *n = shard->lru_head;
+        while (n != NULL) {
+            struct front_node *next = n->lru_next;
+            free(n->path);
+            free(n);
+            n = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+static int front_init(cache_meta_ctx_t *ctx)
+{
+    pthread_mutex_init(&ctx->names_lock, NULL);
+    for (int i = 0; i < FRONT_SHARDS; i++) {
+        struct front_shard *shard = &ctx->front[i];
+        shard->bucket_count = FRONT_INITIAL_BUCKETS;
+        shard->buckets = calloc(shard->bucket_count, sizeof(struct front_node *));
+        pthread_mutex_init(&shard->lock, NULL);
+        if (shard->buckets == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Wait until the queue has room for op. Called with queue_lock held,
+   before the in-memory table is touched, so that table changes and
+   queued ops stay in the same order. */
+static void wait_for_space_locked(cache_meta_ctx_t *ctx)
+{
+    while (ctx->pending >= META_MAX_PENDING && !ctx->stop) {
+        pthread_cond_wait(&ctx->space, &ctx->queue_lock);
+    }
+}
+
+/* Append an op and wake the flusher. Called with queue_lock held. */
+static void enqueue_locked(cache_meta_ctx_t *ctx, struct meta_op *op)
+{
+    if (ctx->tail != NULL) {
+        ctx->tail->next = op;
+    } else {
+        ctx->head = op;
+    }
+    ctx->tail = op;
+    if (op->kind != OP_DIR_PUT && op->kind != OP_DIR_DEL) {
+        ctx->meta_seq++;
+    }
+    if (op->kind != OP_META_PUT && op->kind != OP_META_DEL) {
+        ctx->dir_seq++;
+    }
+
+    bool was_empty = (ctx->pending == 0);
+    ctx->pending++;
+    if (was_empty || ctx->pending >= META_BATCH_RECORDS) {
+        pthread_cond_signal(&ctx->wake);
+    }
+}
+
+static struct meta_op *op_new(enum meta_op_kind kind, const char *path)
+{
+    struct meta_op *op = calloc(1, sizeof(struct meta_op));
+    if (op == NULL || (op->path = strdup(path)) == NULL) {
+        free(op);
+        return NULL;
+    }
+    op->kind = kind;
+    op->hash = hash_path(path);
+    return op;
+}
+
+static void op_free(struct meta_op *op)
+{
+    free(op->listing.data);
+    free(op->path);
+    free(op);
+}
+
+/* Does a queued metadata op decide the entry for path? */
+static bool op_matches_meta(const struct meta_op *op, const char *path, uint64_t hash)
+{
+    switch (op->kind) {
+    case OP_META_PUT:
+    case OP_META_DEL:
+        return op->hash == hash && strcmp(op->path, path) == 0;
+    case OP_META_DEL_TREE:
+        return path_in_tree(path, op->path, strlen(op->path));
+    default:
+        return false;
+    }
+}
+
+/* Most recent queued op for path, oldest batch first. Called with queue_lock held. */
+static const struct meta_op *pending_meta_locked(cache_meta_ctx_t *ctx,
+                                                 const char *path,
+                                                 uint64_t hash)
+{
+    const struct meta_op *found = NULL;
+    for (const struct meta_op *op = ctx->flushing; op != NULL; op = op->next) {
+        if (op_matches_meta(op, path, hash)) {
+            found = op;
+        }
+    }
+    for (const struct meta_op *op = ctx->head; op != NULL; op = op->next) {
+        if (op_matches_meta(op, path, hash)) {
+            found = op;
+        }
+    }
+    return found;
+}
+
+static const struct meta_op *pending_dir_locked(cache_meta_ctx_t *ctx, const char *path)
+{
+    const struct meta_op *found = NULL;
+    const struct meta_op *lists[2] = { ctx->flushing, ctx->head };
+    for (int i = 0; i < 2; i++) {
+        for (const struct meta_op *op = lists[i]; op != NULL; op = op->next) {
+            if ((op->kind == OP_DIR_PUT || op->kind == OP_DIR_DEL) && strcmp(op->path, path) == 0) {
+                found = op;
+            } else if (op->kind == OP_META_DEL_TREE && strcmp(op->path, "/") == 0) {
+                found = op;  /* Drops every listing too */
+            }
+        }
+    }
+    return found;
+}
+
+/* Write one batch in a single transaction of the store */
+static void apply_batch(cache_meta_ctx_t *ctx, struct meta_op *ops)
+{
+    cache_meta_store_t *store = ctx->store;
+    store->ops->begin(store);
+    for (struct meta_op *op = ops; op != NULL; op = op->next) {
+        switch (op->kind) {
+        case OP_META_PUT:
+            store->ops->put_meta(store, op->path, &op->entry);
+            break;
+        case OP_META_DEL:
+            store->ops->del_meta(store, op->path);
+            break;
+        case OP_META_DEL_TREE:
+            store->ops->del_meta_tree(store, op->path);
+            break;
+        case OP_DIR_PUT:
+            store->ops->put_dir(store, op->path, &op->listing, op->cached_at, op->valid_until);
+            break;
+        case OP_DIR_DEL:
+            store->ops->del_dir(store, op->path);
+            break;
+        }
+    }
+    store->ops->commit(store);
+}
+
+/* Take the whole queue as the next batch. Called with queue_lock held. */
+static struct meta_op *detach_locked(cache_meta_ctx_t *ctx)
+{
+    struct meta_op *ops = ctx->head;
+    ctx->flushing = ops;
+    ctx->head = ctx->tail = NULL;
+    ctx->pending = 0;
+    pthread_cond_broadcast(&ctx->space);
+    return ops;
+}
+
+/* The batch is in the store; stop serving it from the queue. */
+static void retire_batch(cache_meta_ctx_t *ctx, struct meta_op *ops)
+{
+    pthread_mutex_lock(&ctx->queue_lock);
+    ctx->flushing = NULL;
+    pthread_mutex_unlock(&ctx->queue_lock);
+
+    while (ops != NULL) {
+        struct meta_op *next = ops->next;
+        op_free(ops);
+        ops = next;
+    }
+}
+
+static void *flusher_main(void *arg)
+{
+    cache_meta_ctx_t *ctx = arg;
+
+    pthread_mutex_lock(&ctx->queue_lock);
+    while (!ctx->stop) {
+        if (ctx->head == NULL) {
+            pthread_cond_wait(&ctx->wake, &ctx->queue_lock);
+            continue;
+        }
+        if (ctx->pending < META_BATCH_RECORDS) {
+            /* Give more mutations the chance to join this batch */
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += META_FLUSH_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ctx->wake, &ctx->queue_lock, &deadline);
+        }
+
+        struct meta_op *ops = detach_locked(ctx);
+        pthread_mutex_unlock(&ctx->queue_lock);
+        apply_batch(ctx, ops);
+        retire_batch(ctx, ops);
+        pthread_mutex_lock(&ctx->queue_lock);
+    }
+
+    /* Write out whatever is left before shutdown */
+    struct meta_op *ops = detach_locked(ctx);
+    pthread_mutex_unlock(&ctx->queue_lock);
+    if (ops != NULL) {
+        apply_batch(ctx, ops);
+        retire_batch(ctx, ops);
+    }
+    return NULL;
+}
+
+int cache_meta_backend_parse(const char *name, cache_meta_backend_t *backend_out)
+{
+    if (name == NULL) {
+        return -1;
+    }
+    if (strcmp(name, "sqlite") == 0) {
+        *backend_out = CACHE_META_SQLITE;
+        return 0;
+    }
+#ifdef HAVE_LMDB
+    if (strcmp(name, "lmdb") == 0) {
+        *backend_out = CACHE_META_LMDB;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
 cache_meta_ctx_t *cache_meta_init(const char *cache_root,
                                    int meta_ttl,
                                    int dir_ttl,
+                                   cache_meta_backend_t backend,
                                    bool debug)
 {
     fprintf(stderr, "[cache_meta_init] START\n");
@@ -70,113 +729,74 @@ cache_meta_ctx_t *cache_meta_init(const char *cache_root,
     ctx->meta_ttl = meta_ttl;
     ctx->dir_ttl = dir_ttl;
     ctx->debug = debug;
+    pthread_mutex_init(&ctx->queue_lock, NULL);
+    pthread_cond_init(&ctx->wake, NULL);
+    pthread_cond_init(&ctx->space, NULL);
+    if (front_init(ctx) != 0) {
+        cache_meta_destroy(ctx);
+        return NULL;
+    }
 
     /* Create cache directory if it doesn't exist */
     fprintf(stderr, "[cache_meta_init] Creating cache directory...\n");
     int mkdir_result = mkdir(cache_root, 0700);
     fprintf(stderr, "[cache_meta_init] mkdir result=%d, errno=%d (%s)\n", mkdir_result, errno, strerror(errno));
-    
-    /* Open SQLite database */
-    char db_path[PATH_MAX];
-    snprintf(db_path, PATH_MAX, "%s/%s", cache_root, META_DB_NAME);
-    fprintf(stderr, "[cache_meta_init] Opening SQLite at: %s\n", db_path);
-    
-    int rc = sqlite3_open(db_path, &ctx->db);
-    fprintf(stderr, "[cache_meta_init] sqlite3_open result=%d\n", rc);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "[cache_meta_init] ERROR: sqlite3_open failed: %s\n", sqlite3_errmsg(ctx->db));
-        DPRINTF("cache_meta_init: sqlite3_open failed: %s", sqlite3_errmsg(ctx->db));
-        free(ctx->cache_root);
-        free(ctx);
-        return NULL;
-    }
-    fprintf(stderr, "[cache_meta_init] SQLite opened successfully\n");
-
-    /* Enable WAL mode for better concurrency, don't wait on locks */
-    sqlite3_busy_timeout(ctx->db, 100);  /* 100ms timeout */
-    sqlite3_exec(ctx->db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
-    sqlite3_exec(ctx->db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
-    sqlite3_exec(ctx->db, "PRAGMA temp_store=MEMORY", NULL, NULL, NULL);
-
-    /* Create metadata table */
-    const char *create_sql = 
-        "CREATE TABLE IF NOT EXISTS metadata ("
-        "  path TEXT PRIMARY KEY,"
-        "  type INTEGER,"
-        "  size INTEGER,"
-        "  mtime INTEGER,"
-        "  ctime INTEGER,"
-        "  mode INTEGER,"
-        "  uid INTEGER,"
-        "  gid INTEGER,"
-        "  ino INTEGER,"
-        "  cached_at INTEGER,"
-        "  valid_until INTEGER"
-        ")";
-    
-    char *errmsg = NULL;
-    rc = sqlite3_exec(ctx->db, create_sql, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        DPRINTF("cache_meta_init: create table failed: %s", errmsg);
-        sqlite3_free(errmsg);
-        sqlite3_close(ctx->db);
-        free(ctx->cache_root);
-        free(ctx);
+
+    ctx->store = backend == CACHE_META_LMDB ? cache_meta_lmdb_open(cache_root, debug)
+                                            : cache_meta_sqlite_open(cache_root, debug);
+    if (ctx->store == NULL) {
+        DPRINTF("cache_meta_init: failed to open the %s store",
+                backend == CACHE_META_LMDB ? "lmdb" : "sqlite");
+        cache_meta_destroy(ctx);
         return NULL;
     }
 
-    /* Create directory entries table */
-    const char *create_dir_sql =
-        "CREATE TABLE IF NOT EXISTS dir_entries ("
-        "  dir_path TEXT,"
-        "  entry_name TEXT,"
-        "  entry_type INTEGER,"
-        "  dir_mtime INTEGER,"
-        "  cached_at INTEGER,"
-        "  valid_until INTEGER,"
-        "  PRIMARY KEY (dir_path, entry_name)"
-        ")";
-    
-    rc = sqlite3_exec(ctx->db, create_dir_sql, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        DPRINTF("cache_meta_init: create dir_entries table failed: %s", errmsg);
-        sqlite3_free(errmsg);
-        sqlite3_close(ctx->db);
-        free(ctx->cache_root);
-        free(ctx);
+    if (pthread_create(&ctx->flusher, NULL, flusher_main, ctx) != 0) {
+        DPRINTF("cache_meta_init: failed to start flusher thread");
+        cache_meta_destroy(ctx);
         return NULL;
     }
+    ctx->flusher_started = true;
 
-    /* Prepare statements */
-    const char *insert_sql = 
-        "INSERT OR REPLACE INTO metadata VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
-    sqlite3_prepare_v2(ctx->db, insert_sql, -1, &ctx->insert_meta_stmt, NULL);
-
-    const char *select_sql = "SELECT * FROM metadata WHERE path = ?";
-    sqlite3_prepare_v2(ctx->db, select_sql, -1, &ctx->select_meta_stmt, NULL);
-
-    const char *delete_sql = "DELETE FROM metadata WHERE path = ?";
-    sqlite3_prepare_v2(ctx->db, delete_sql, -1, &ctx->delete_meta_stmt, NULL);
-
-    /* Directory cache statements */
-    const char *insert_dir_sql =
-        "INSERT OR REPLACE INTO dir_entries VALUES (?, ?, ?, ?, ?, ?)";
-    sqlite3_prepare_v2(ctx->db, insert_dir_sql, -1, &ctx->insert_dir_stmt, NULL);
+    if (debug) {
+        DPRINTF("cache_meta_init: initialized %s store at %s (meta_ttl=%d, dir_ttl=%d)",
+                ctx->store->ops->name, cache_root, meta_ttl, dir_ttl);
+    }
 
-    const char *select_dir_sql =
-        "SELECT entry_name, entry_type, dir_mtime, cached_at, valid_until "
-        "FROM dir_entries WHERE dir_path = ? ORDER BY entry_name";
-    sqlite3_prepare_v2(ctx->db, select_dir_sql, -1, &ctx->select_dir_stmt, NULL);
+    return ctx;
+}
 
-    const char *delete_dir_sql = "DELETE FROM dir_entries WHERE dir_path = ?";
-    sqlite3_prepare_v2(ctx->db, delete_dir_sql, -1, &ctx->delete_dir_stmt, NULL);
+/* Lookup past the in-memory table: queued ops first, then the store */
+static int lookup_slow(cache_meta_ctx_t *ctx, const char *path, uint64_t hash,
+                       cache_meta_entry_t *entry)
+{
+    /* Evicted from memory but not written out yet */
+    pthread_mutex_lock(&ctx->queue_lock);
+    const struct meta_op *op = pending_meta_locked(ctx, path, hash);
+    if (op != NULL) {
+        int ret = -1;
+        if (op->kind == OP_META_PUT) {
+            *entry = op->entry;
+            ret = 0;
+        }
+        pthread_mutex_unlock(&ctx->queue_lock);
+        return ret;
+    }
+    uint64_t seq = ctx->meta_seq;
+    pthread_mutex_unlock(&ctx->queue_lock);
 
-    if (debug) {
-        DPRINTF("cache_meta_init: initialized at %s (meta_ttl=%d, dir_ttl=%d)",
-                cache_root, meta_ttl, dir_ttl);
+    /* Fall back to the persistent copy, e.g. after a restart */
+    if (ctx->store->ops->get_meta(ctx->store, path, entry) != 0) {
+        return -1;  /* Not found */
     }
 
-    return ctx;
+    /* Only keep the row if no store or invalidation got in between */
+    pthread_mutex_lock(&ctx->queue_lock);
+    if (ctx->meta_seq == seq) {
+        front_insert(ctx, path, hash, entry);
+    }
+    pthread_mutex_unlock(&ctx->queue_lock);
+    return 0;
 }
 
 int cache_meta_lookup(cache_meta_ctx_t *ctx,
@@ -188,25 +808,12 @@ int cache_meta_lookup(cache_meta_ctx_t *ctx,
         return -1;
     }
 
-    sqlite3_reset(ctx->select_meta_stmt);
-    sqlite3_bind_text(ctx->select_meta_stmt, 1, path, -1, SQLITE_STATIC);
-
-    int rc = sqlite3_step(ctx->select_meta_stmt);
-    if (rc != SQLITE_ROW) {
-        return -1;  /* Not found */
+    uint64_t hash = hash_path(path);
+    if (!front_lookup(ctx, path, hash, entry) &&
+        lookup_slow(ctx, path, hash, entry) != 0) {
+        return -1;
     }
 
-    entry->type = sqlite3_column_int(ctx->select_meta_stmt, 1);
-    entry->size = sqlite3_column_int64(ctx->select_meta_stmt, 2);
-    entry->mtime = sqlite3_column_int64(ctx->select_meta_stmt, 3);
-    entry->ctime = sqlite3_column_int64(ctx->select_meta_stmt, 4);
-    entry->mode = sqlite3_column_int(ctx->select_meta_stmt, 5);
-    entry->uid = sqlite3_column_int(ctx->select_meta_stmt, 6);
-    entry->gid = sqlite3_column_int(ctx->select_meta_stmt, 7);
-    entry->ino = sqlite3_column_int64(ctx->select_meta_stmt, 8);
-    entry->cached_at = sqlite3_column_int64(ctx->select_meta_stmt, 9);
-    entry->valid_until = sqlite3_column_int64(ctx->select_meta_stmt, 10);
-
     if (valid != NULL) {
         time_t now = time(NULL);
         *valid = (now < entry->valid_until);
@@ -215,6 +822,47 @@ int cache_meta_lookup(cache_meta_ctx_t *ctx,
     return 0;
 }
 
+void cache_meta_entry_to_stat(const cache_meta_entry_t *entry, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_dev = entry->dev;
+    stbuf->st_ino = entry->ino;
+    stbuf->st_mode = entry->mode;
+    stbuf->st_nlink = entry->nlink;
+    stbuf->st_uid = entry->uid;
+    stbuf->st_gid = entry->gid;
+    stbuf->st_rdev = entry->rdev;
+    stbuf->st_size = entry->size;
+    stbuf->st_blksize = entry->blksize;
+    stbuf->st_blocks = entry->blocks;
+    stbuf->st_atime = entry->atime;
+    stbuf->st_mtime = entry->mtime;
+    stbuf->st_ctime = entry->ctime;
+#ifdef HAVE_STAT_NANOSEC
+    stbuf->st_atim.tv_nsec = entry->atime_nsec;
+    stbuf->st_mtim.tv_nsec = entry->mtime_nsec;
+    stbuf->st_ctim.tv_nsec = entry->ctime_nsec;
+#endif
+}
+
+/* Put an entry in the in-memory table and queue it for the store */
+static int store_entry(cache_meta_ctx_t *ctx, const char *path, const cache_meta_entry_t *entry)
+{
+    struct meta_op *op = op_new(OP_META_PUT, path);
+    if (op == NULL) {
+        return -1;
+    }
+    op->entry = *entry;
+
+    pthread_mutex_lock(&ctx->queue_lock);
+    wait_for_space_locked(ctx);
+    front_insert(ctx, path, op->hash, entry);
+    enqueue_locked(ctx, op);
+    pthread_mutex_unlock(&ctx->queue_lock);
+
+    return 0;
+}
+
 int cache_meta_store(cache_meta_ctx_t *ctx,
                      const char *path,
                      const struct stat *stbuf)
@@ -224,173 +872,240 @@ int cache_meta_store(cache_meta_ctx_t *ctx,
     }
 
     time_t now = time(NULL);
-    
-    sqlite3_reset(ctx->insert_meta_stmt);
-    sqlite3_bind_text(ctx->insert_meta_stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 2, CACHE_ENTRY_FILE);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 3, stbuf->st_size);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 4, stbuf->st_mtime);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 5, stbuf->st_ctime);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 6, stbuf->st_mode);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 7, stbuf->st_uid);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 8, stbuf->st_gid);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 9, stbuf->st_ino);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 10, now);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 11, now + ctx->meta_ttl);
-
-    int rc = sqlite3_step(ctx->insert_meta_stmt);
-    if (rc != SQLITE_DONE) {
-        DPRINTF("cache_meta_store: insert failed: %s", sqlite3_errmsg(ctx->db));
+    cache_meta_entry_t entry = {
+        .type = S_ISDIR(stbuf->st_mode) ? CACHE_ENTRY_DIR : CACHE_ENTRY_FILE,
+        .size = stbuf->st_size,
+        .mtime = stbuf->st_mtime,
+        .ctime = stbuf->st_ctime,
+        .mode = stbuf->st_mode,
+        .uid = stbuf->st_uid,
+        .gid = stbuf->st_gid,
+        .ino = stbuf->st_ino,
+        .cached_at = now,
+        .valid_until = now + ctx->meta_ttl,
+        .dev = stbuf->st_dev,
+        .nlink = stbuf->st_nlink,
+        .rdev = stbuf->st_rdev,
+        .blksize = stbuf->st_blksize,
+        .blocks = stbuf->st_blocks,
+        .atime = stbuf->st_atime,
+#ifdef HAVE_STAT_NANOSEC
+        .atime_nsec = stbuf->st_atim.tv_nsec,
+        .mtime_nsec = stbuf->st_mtim.tv_nsec,
+        .ctime_nsec = stbuf->st_ctim.tv_nsec,
+#endif
+    };
+
+    return store_entry(ctx, path, &entry);
+}
+
+int cache_meta_store_negative(cache_meta_ctx_t *ctx, const char *path)
+{
+    if (ctx == NULL || path == NULL) {
         return -1;
     }
 
-    return 0;
+    time_t now = time(NULL);
+    cache_meta_entry_t entry = {
+        .type = CACHE_ENTRY_NEG,
+        .cached_at = now,
+        .valid_until = now + ctx->meta_ttl,
+    };
+
+    return store_entry(ctx, path, &entry);
 }
 
-int cache_meta_store_negative(cache_meta_ctx_t *ctx, const char *path)
+int cache_meta_invalidate(cache_meta_ctx_t *ctx, const char *path)
 {
     if (ctx == NULL || path == NULL) {
         return -1;
     }
 
-    time_t now = time(NULL);
-    
-    sqlite3_reset(ctx->insert_meta_stmt);
-    sqlite3_bind_text(ctx->insert_meta_stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 2, CACHE_ENTRY_NEG);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 3, 0);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 4, 0);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 5, 0);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 6, 0);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 7, 0);
-    sqlite3_bind_int(ctx->insert_meta_stmt, 8, 0);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 9, 0);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 10, now);
-    sqlite3_bind_int64(ctx->insert_meta_stmt, 11, now + ctx->meta_ttl);
-
-    int rc = sqlite3_step(ctx->insert_meta_stmt);
-    if (rc != SQLITE_DONE) {
+    struct meta_op *op = op_new(OP_META_DEL, path);
+    if (op == NULL) {
         return -1;
     }
 
+    pthread_mutex_lock(&ctx->queue_lock);
+    wait_for_space_locked(ctx);
+    front_remove(ctx, path, op->hash);
+    enqueue_locked(ctx, op);
+    pthread_mutex_unlock(&ctx->queue_lock);
+
     return 0;
 }
 
-int cache_meta_invalidate(cache_meta_ctx_t *ctx, const char *path)
+int cache_meta_invalidate_tree(cache_meta_ctx_t *ctx, const char *path)
 {
     if (ctx == NULL || path == NULL) {
         return -1;
     }
 
-    sqlite3_reset(ctx->delete_meta_stmt);
-    sqlite3_bind_text(ctx->delete_meta_stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_step(ctx->delete_meta_stmt);
+    struct meta_op *op = op_new(OP_META_DEL_TREE, path);
+    if (op == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->queue_lock);
+    wait_for_space_locked(ctx);
+    front_remove_tree(ctx, path);
+    names_remove_tree(ctx, path);
+    enqueue_locked(ctx, op);
+    pthread_mutex_unlock(&ctx->queue_lock);
 
     return 0;
 }
 
-/* Directory cache functions */
-int cache_dir_lookup(cache_meta_ctx_t *ctx,
-                     const char *path,
-                     cache_dir_entry_t **entries,
-                     size_t *count,
-                     time_t *dir_mtime,
-                     bool *valid)
+/* Header of each packed directory entry, followed by the NUL-terminated
+   name and, with DIR_REC_STAT, a struct stat. */
+struct dir_record {
+    uint16_t name_len;      /* Without the NUL */
+    uint8_t type;
+    uint8_t flags;
+};
+
+#define DIR_REC_STAT 0x01
+
+void cache_dir_pack(struct memory_block *buf,
+                    const char *name,
+                    cache_entry_type_t type,
+                    const struct stat *st)
 {
-    if (ctx == NULL || path == NULL || entries == NULL || count == NULL) {
-        return -1;
+    size_t len = strlen(name);
+    struct dir_record rec = {
+        .name_len = (uint16_t)len,
+        .type = (uint8_t)type,
+        .flags = st != NULL ? DIR_REC_STAT : 0,
+    };
+    append_to_memory_block(buf, &rec, sizeof(rec));
+    append_to_memory_block(buf, name, len + 1);
+    if (st != NULL) {
+        append_to_memory_block(buf, st, sizeof(struct stat));
     }
+}
 
-    sqlite3_reset(ctx->select_dir_stmt);
-    sqlite3_bind_text(ctx->select_dir_stmt, 1, path, -1, SQLITE_STATIC);
+bool cache_dir_unpack(const cache_dir_listing_t *listing, size_t *pos, cache_dir_item_t *item)
+{
+    const char *p = listing->data + *pos;
+    size_t left = listing->size - *pos;
 
-    /* Count entries first */
-    size_t entry_count = 0;
-    while (sqlite3_step(ctx->select_dir_stmt) == SQLITE_ROW) {
-        entry_count++;
+    struct dir_record rec;
+    if (left < sizeof(rec)) {
+        return false;
+    }
+    memcpy(&rec, p, sizeof(rec));
+    size_t need = sizeof(rec) + rec.name_len + 1;
+    if (rec.flags & DIR_REC_STAT) {
+        need += sizeof(struct stat);
+    }
+    if (left < need || p[sizeof(rec) + rec.name_len] != '\0') {
+        return false;   /* Truncated or corrupt */
     }
 
-    if (entry_count == 0) {
-        return -1;  /* No cached entries */
+    item->name = p + sizeof(rec);
+    item->type = rec.type;
+    item->has_stat = (rec.flags & DIR_REC_STAT) != 0;
+    if (item->has_stat) {
+        memcpy(&item->st, p + sizeof(rec) + rec.name_len + 1, sizeof(struct stat));
     }
+    *pos += need;
+    return true;
+}
 
-    /* Allocate array */
-    *entries = calloc(entry_count, sizeof(cache_dir_entry_t));
-    if (*entries == NULL) {
+/* Directory cache functions */
+int cache_dir_lookup(cache_meta_ctx_t *ctx,
+                     const char *path,
+                     struct arena *arena,
+                     cache_dir_listing_t *listing,
+                     bool *valid)
+{
+    if (ctx == NULL || path == NULL || arena == NULL || listing == NULL) {
         return -1;
     }
 
-    /* Reset and read entries */
-    sqlite3_reset(ctx->select_dir_stmt);
-    sqlite3_bind_text(ctx->select_dir_stmt, 1, path, -1, SQLITE_STATIC);
-
-    size_t i = 0;
-    time_t first_valid_until = 0;
-    time_t first_mtime = 0;
-    while (sqlite3_step(ctx->select_dir_stmt) == SQLITE_ROW && i < entry_count) {
-        const char *name = (const char *)sqlite3_column_text(ctx->select_dir_stmt, 0);
-        (*entries)[i].name = strdup(name);
-        (*entries)[i].type = sqlite3_column_int(ctx->select_dir_stmt, 1);
-        
-        if (i == 0) {
-            first_mtime = sqlite3_column_int64(ctx->select_dir_stmt, 2);
-            first_valid_until = sqlite3_column_int64(ctx->select_dir_stmt, 4);
+    /* A listing stored or invalidated since the last flush wins */
+    pthread_mutex_lock(&ctx->queue_lock);
+    uint64_t seq = ctx->dir_seq;
+    const struct meta_op *op = pending_dir_locked(ctx, path);
+    if (op != NULL) {
+        int ret = -1;
+        if (op->kind == OP_DIR_PUT && op->listing.count > 0) {
+            *listing = op->listing;
+            listing->data = arena_malloc(arena, op->listing.size);
+            memcpy(listing->data, op->listing.data, op->listing.size);
+            if (valid != NULL) {
+                *valid = (time(NULL) < op->valid_until);
+            }
+            ret = 0;
         }
-        i++;
+        pthread_mutex_unlock(&ctx->queue_lock);
+        return ret;
     }
+    pthread_mutex_unlock(&ctx->queue_lock);
 
-    *count = entry_count;
-    if (dir_mtime != NULL) {
-        *dir_mtime = first_mtime;
+    time_t valid_until;
+    if (ctx->store->ops->get_dir(ctx->store, path, arena, listing, &valid_until) != 0) {
+        return -1;  /* Not cached */
     }
-    
+
+    time_t now = time(NULL);
     if (valid != NULL) {
-        time_t now = time(NULL);
-        *valid = (now < first_valid_until);
+        *valid = (now < valid_until);
+    }
+
+    /* Listings from an earlier mount know their names too; unless one
+       was stored or dropped meanwhile */
+    if (now < valid_until && !names_known(ctx, path)) {
+        struct dir_names *d = names_build(path, listing, valid_until);
+        if (d != NULL) {
+            pthread_mutex_lock(&ctx->queue_lock);
+            if (ctx->dir_seq == seq) {
+                names_insert(ctx, d);
+                d = NULL;
+            }
+            pthread_mutex_unlock(&ctx->queue_lock);
+            names_free(d);
+        }
     }
 
     return 0;
 }
 
 int cache_dir_store(cache_meta_ctx_t *ctx, const char *path,
-                    const cache_dir_entry_t *entries, size_t count,
-                    time_t dir_mtime)
+                    const cache_dir_listing_t *listing)
 {
-    if (ctx == NULL || path == NULL || entries == NULL) {
+    if (ctx == NULL || path == NULL || listing == NULL || listing->data == NULL) {
         return -1;
     }
 
-    /* Begin transaction for bulk inserts */
-    sqlite3_exec(ctx->db, "BEGIN TRANSACTION", NULL, NULL, NULL);
-
-    /* Delete old entries for this directory */
-    sqlite3_reset(ctx->delete_dir_stmt);
-    sqlite3_bind_text(ctx->delete_dir_stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_step(ctx->delete_dir_stmt);
-
-    /* Insert new entries */
-    time_t now = time(NULL);
-    time_t valid_until = now + ctx->dir_ttl;
-
-    for (size_t i = 0; i < count; i++) {
-        sqlite3_reset(ctx->insert_dir_stmt);
-        sqlite3_bind_text(ctx->insert_dir_stmt, 1, path, -1, SQLITE_STATIC);
-        sqlite3_bind_text(ctx->insert_dir_stmt, 2, entries[i].name, -1, SQLITE_STATIC);
-        sqlite3_bind_int(ctx->insert_dir_stmt, 3, entries[i].type);
-        sqlite3_bind_int64(ctx->insert_dir_stmt, 4, dir_mtime);
-        sqlite3_bind_int64(ctx->insert_dir_stmt, 5, now);
-        sqlite3_bind_int64(ctx->insert_dir_stmt, 6, valid_until);
-
-        int rc = sqlite3_step(ctx->insert_dir_stmt);
-        if (rc != SQLITE_DONE) {
-            DPRINTF("cache_dir_store: insert failed: %s", sqlite3_errmsg(ctx->db));
-            sqlite3_exec(ctx->db, "ROLLBACK", NULL, NULL, NULL);
-            return -1;
-        }
+    struct meta_op *op = op_new(OP_DIR_PUT, path);
+    if (op == NULL) {
+        return -1;
     }
-
-    /* Commit transaction */
-    sqlite3_exec(ctx->db, "COMMIT", NULL, NULL, NULL);
+    op->listing = *listing;
+    op->listing.data = malloc(listing->size);
+    if (op->listing.data == NULL) {
+        op_free(op);
+        return -1;
+    }
+    memcpy(op->listing.data, listing->data, listing->size);
+    op->cached_at = time(NULL);
+    int ttl = ctx->dir_ttl;
+    if (listing->with_stats && ctx->meta_ttl < ttl) {
+        ttl = ctx->meta_ttl;
+    }
+    op->valid_until = op->cached_at + ttl;
+    struct dir_names *names = names_build(path, listing, op->valid_until);
+
+    pthread_mutex_lock(&ctx->queue_lock);
+    wait_for_space_locked(ctx);
+    if (names != NULL) {
+        names_insert(ctx, names);
+    } else {
+        names_remove(ctx, path);
+    }
+    enqueue_locked(ctx, op);
+    pthread_mutex_unlock(&ctx->queue_lock);
 
     return 0;
 }
@@ -401,53 +1116,124 @@ int cache_dir_invalidate(cache_meta_ctx_t *ctx, const char *path)
         return -1;
     }
 
-    sqlite3_reset(ctx->delete_dir_stmt);
-    sqlite3_bind_text(ctx->delete_dir_stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_step(ctx->delete_dir_stmt);
+    struct meta_op *op = op_new(OP_DIR_DEL, path);
+    if (op == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctx->queue_lock);
+    wait_for_space_locked(ctx);
+    names_remove(ctx, path);
+    enqueue_locked(ctx, op);
+    pthread_mutex_unlock(&ctx->queue_lock);
 
     return 0;
 }
 
-void cache_dir_entries_free(cache_dir_entry_t *entries, size_t count)
+bool cache_dir_absent(cache_meta_ctx_t *ctx, const char *path)
 {
-    if (entries == NULL) {
-        return;
+    const char *last_slash = path != NULL ? strrchr(path, '/') : NULL;
+    if (ctx == NULL || last_slash == NULL || last_slash[1] == '\0') {
+        return false;
     }
-    
-    for (size_t i = 0; i < count; i++) {
-        free(entries[i].name);
+
+    /* The root's children have "/" as parent */
+    char parent[PATH_MAX];
+    size_t parent_len = last_slash == path ? 1 : (size_t)(last_slash - path);
+    if (parent_len >= sizeof(parent)) {
+        return false;
+    }
+    memcpy(parent, path, parent_len);
+    parent[parent_len] = '\0';
+
+    const char *name = last_slash + 1;
+    uint64_t h = hash_name(name, strlen(name));
+    uint64_t parent_hash = hash_path(parent);
+    bool absent = false;
+
+    pthread_mutex_lock(&ctx->names_lock);
+    struct dir_names **pp = names_find_locked(ctx, parent, parent_hash);
+    if (*pp != NULL) {
+        struct dir_names *d = *pp;
+        if (time(NULL) >= d->valid_until) {
+            names_unlink_locked(ctx, pp);
+        } else {
+            for (int i = 0; i < NAMES_HASHES && !absent; i++) {
+                size_t bit = names_bit(d, h, i);
+                absent = (d->bits[bit / 64] & (1ULL << (bit % 64))) == 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->names_lock);
+
+    if (absent && ctx->debug) {
+        DPRINTF("cache_dir_absent: %s is not in the listing of %s", name, parent);
     }
-    free(entries);
+    return absent;
 }
 
-void cache_meta_destroy(cache_meta_ctx_t *ctx)
+int cache_ident_lookup(cache_meta_ctx_t *ctx, const char *path, cache_file_id_t *id)
 {
-    if (ctx == NULL) {
-        return;
+    if (ctx == NULL || path == NULL || id == NULL) {
+        return -1;
     }
+    return ctx->store->ops->get_ident(ctx->store, path, id);
+}
 
-    if (ctx->insert_meta_stmt) {
-        sqlite3_finalize(ctx->insert_meta_stmt);
+int cache_ident_store(cache_meta_ctx_t *ctx, const char *path, const cache_file_id_t *id)
+{
+    if (ctx == NULL || path == NULL || id == NULL) {
+        return -1;
     }
-    if (ctx->select_meta_stmt) {
-        sqlite3_finalize(ctx->select_meta_stmt);
+
+    /* Usually already recorded by an earlier open; skip the write then */
+    cache_file_id_t known;
+    if (cache_ident_lookup(ctx, path, &known) == 0 && cache_file_id_equal(&known, id)) {
+        return 0;
     }
-    if (ctx->delete_meta_stmt) {
-        sqlite3_finalize(ctx->delete_meta_stmt);
+    return ctx->store->ops->put_ident(ctx->store, path, id);
+}
+
+int cache_ident_rename(cache_meta_ctx_t *ctx, const char *from, const char *to)
+{
+    if (ctx == NULL || from == NULL || to == NULL) {
+        return -1;
     }
-    if (ctx->insert_dir_stmt) {
-        sqlite3_finalize(ctx->insert_dir_stmt);
+    return ctx->store->ops->rename_ident(ctx->store, from, to);
+}
+
+int cache_ident_forget(cache_meta_ctx_t *ctx, const char *path)
+{
+    if (ctx == NULL || path == NULL) {
+        return -1;
     }
-    if (ctx->select_dir_stmt) {
-        sqlite3_finalize(ctx->select_dir_stmt);
+    return ctx->store->ops->forget_ident(ctx->store, path);
+}
+
+void cache_meta_destroy(cache_meta_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return;
     }
-    if (ctx->delete_dir_stmt) {
-        sqlite3_finalize(ctx->delete_dir_stmt);
+
+    /* The flusher writes out what is still queued before exiting */
+    if (ctx->flusher_started) {
+        pthread_mutex_lock(&ctx->queue_lock);
+        ctx->stop = true;
+        pthread_cond_signal(&ctx->wake);
+        pthread_cond_broadcast(&ctx->space);
+        pthread_mutex_unlock(&ctx->queue_lock);
+        pthread_join(ctx->flusher, NULL);
     }
-    if (ctx->db) {
-        sqlite3_close(ctx->db);
+
+    if (ctx->store != NULL) {
+        ctx->store->ops->close(ctx->store);
     }
-    
+
+    front_destroy(ctx);
+    pthread_cond_destroy(&ctx->space);
+    pthread_cond_destroy(&ctx->wake);
+    pthread_mutex_destroy(&ctx->queue_lock);
     free(ctx->cache_root);
     free(ctx);
 
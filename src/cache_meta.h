@@ -25,6 +25,9 @@
 #include <time.h>
 #include <stdbool.h>
 
+#include "misc.h"
+#include "cache_ident.h"
+
 /* Cache entry types */
 typedef enum {
     CACHE_ENTRY_FILE = 1,
@@ -44,30 +47,83 @@ typedef struct {
     ino_t ino;  /* Cached inode number */
     time_t cached_at;
     time_t valid_until;
+
+    /* Rest of struct stat, so hits can be served without the backend */
+    dev_t dev;
+    nlink_t nlink;
+    dev_t rdev;
+    blksize_t blksize;
+    blkcnt_t blocks;
+    time_t atime;
+    long atime_nsec;
+    long mtime_nsec;
+    long ctime_nsec;
 } cache_meta_entry_t;
 
-/* Directory entry structure */
+/*
+ * Directory listings are kept packed: one buffer per directory holding
+ * every entry back to back, built with cache_dir_pack() and walked with
+ * cache_dir_unpack(). A listing is stored and looked up as a whole.
+ */
 typedef struct {
-    char *name;
+    char *data;         /* Packed entries */
+    size_t size;        /* Bytes in data */
+    size_t count;       /* Number of entries */
+    time_t dir_mtime;   /* Directory mtime when listed */
+    bool with_stats;    /* Every entry carries its attributes */
+} cache_dir_listing_t;
+
+/* One unpacked directory entry */
+typedef struct {
+    const char *name;   /* Points into the listing */
     cache_entry_type_t type;
-} cache_dir_entry_t;
+    bool has_stat;
+    struct stat st;     /* Valid if has_stat */
+} cache_dir_item_t;
 
 /* Opaque cache metadata handle */
 typedef struct cache_meta_ctx cache_meta_ctx_t;
 
+/* Engine holding the persistent copy of the metadata cache */
+typedef enum {
+    CACHE_META_SQLITE = 0,  /* metadata.db */
+    CACHE_META_LMDB = 1     /* metadata.mdb, if built with LMDB */
+} cache_meta_backend_t;
+
+/**
+ * Parse a metadata backend name ("sqlite" or "lmdb").
+ * @param name Backend name
+ * @param backend_out Backend
+ * @return 0 on success, -1 if the backend is unknown or not built in
+ */
+int cache_meta_backend_parse(const char *name, cache_meta_backend_t *backend_out);
+
 /**
  * Initialize metadata cache.
  * @param cache_root Root directory for cache storage
  * @param meta_ttl Metadata TTL in seconds
  * @param dir_ttl Directory listing TTL in seconds
+ * @param backend Engine for the persistent copy
  * @param debug Enable debug logging
  * @return Cache context or NULL on error
  */
 cache_meta_ctx_t *cache_meta_init(const char *cache_root, 
                                    int meta_ttl, 
                                    int dir_ttl,
+                                   cache_meta_backend_t backend,
                                    bool debug);
 
+/*
+ * Metadata lookups are served from a sharded in-memory table. The
+ * backend (SQLite or LMDB) holds the same entries so a restarted mount
+ * starts warm; it is only read when the in-memory table misses.
+ *
+ * Stores and invalidations are not written to the backend by the caller.
+ * They are queued and a flusher thread writes them in one transaction
+ * every few milliseconds, or sooner once a batch has built up. Lookups
+ * see queued changes. cache_meta_destroy() writes out the queue.
+ */
+
 /**
  * Lookup metadata entry in cache.
  * @param ctx Cache context
@@ -81,6 +137,13 @@ int cache_meta_lookup(cache_meta_ctx_t *ctx,
                       cache_meta_entry_t *entry,
                       bool *valid);
 
+/**
+ * Rebuild a struct stat from a cached entry.
+ * @param entry Positive metadata entry
+ * @param stbuf Output stat buffer
+ */
+void cache_meta_entry_to_stat(const cache_meta_entry_t *entry, struct stat *stbuf);
+
 /**
  * Store metadata entry in cache.
  * @param ctx Cache context
@@ -108,37 +171,62 @@ int cache_meta_store_negative(cache_meta_ctx_t *ctx, const char *path);
  */
 int cache_meta_invalidate(cache_meta_ctx_t *ctx, const char *path);
 
+/**
+ * Invalidate metadata entries for a path and everything below it.
+ * For "/" every entry, listing and listing name set is dropped.
+ * @param ctx Cache context
+ * @param path File or directory path
+ * @return 0 on success, -1 on error
+ */
+int cache_meta_invalidate_tree(cache_meta_ctx_t *ctx, const char *path);
+
+/**
+ * Append an entry to a packed directory listing.
+ * @param buf Listing buffer
+ * @param name Entry name
+ * @param type Entry type
+ * @param st Entry attributes (can be NULL)
+ */
+void cache_dir_pack(struct memory_block *buf,
+                    const char *name,
+                    cache_entry_type_t type,
+                    const struct stat *st);
+
+/**
+ * Read the next entry of a packed directory listing.
+ * @param listing Directory listing
+ * @param pos Read position, 0 for the first entry
+ * @param item Output entry
+ * @return true if an entry was read, false at the end of the listing
+ */
+bool cache_dir_unpack(const cache_dir_listing_t *listing, size_t *pos, cache_dir_item_t *item);
+
 /**
  * Lookup directory listing in cache.
  * @param ctx Cache context
  * @param path Directory path
- * @param entries Output array of directory entries (caller must free)
- * @param count Output count of entries
- * @param dir_mtime Output directory mtime
+ * @param arena Arena the listing data is allocated from
+ * @param listing Output directory listing
  * @param valid Output validity flag
  * @return 0 on success (cache hit), -1 on miss or error
  */
 int cache_dir_lookup(cache_meta_ctx_t *ctx,
                      const char *path,
-                     cache_dir_entry_t **entries,
-                     size_t *count,
-                     time_t *dir_mtime,
+                     struct arena *arena,
+                     cache_dir_listing_t *listing,
                      bool *valid);
 
 /**
- * Store directory listing in cache.
+ * Store directory listing in cache. A listing with attributes stays
+ * valid no longer than the metadata TTL.
  * @param ctx Cache context
  * @param path Directory path
- * @param entries Array of directory entries
- * @param count Number of entries
- * @param dir_mtime Directory mtime
+ * @param listing Packed directory listing (copied)
  * @return 0 on success, -1 on error
  */
 int cache_dir_store(cache_meta_ctx_t *ctx,
                     const char *path,
-                    const cache_dir_entry_t *entries,
-                    size_t count,
-                    time_t dir_mtime);
+                    const cache_dir_listing_t *listing);
 
 /**
  * Invalidate directory listing.
@@ -149,11 +237,52 @@ int cache_dir_store(cache_meta_ctx_t *ctx,
 int cache_dir_invalidate(cache_meta_ctx_t *ctx, const char *path);
 
 /**
- * Free directory entry array.
- * @param entries Array of directory entries
- * @param count Number of entries
+ * Check if a path is known not to exist because the complete listing of
+ * its directory is cached, still valid and lacks the name. Checked
+ * against a Bloom filter of the names, so a miss in the filter is
+ * certain while a match only means the name may exist.
+ * @param ctx Cache context
+ * @param path Path to look up
+ * @return true if the path does not exist
+ */
+bool cache_dir_absent(cache_meta_ctx_t *ctx, const char *path);
+
+/**
+ * Look up the identity of the file last seen at a path.
+ * @param ctx Cache context
+ * @param path File path
+ * @param id Output identity
+ * @return 0 if recorded, -1 if not
+ */
+int cache_ident_lookup(cache_meta_ctx_t *ctx, const char *path, cache_file_id_t *id);
+
+/**
+ * Record the identity of the file at a path. Written synchronously, but
+ * only when it differs from what is already recorded.
+ * @param ctx Cache context
+ * @param path File path
+ * @param id File identity
+ * @return 0 on success, -1 on error
+ */
+int cache_ident_store(cache_meta_ctx_t *ctx, const char *path, const cache_file_id_t *id);
+
+/**
+ * Move the identities recorded at and below one path to another,
+ * replacing any recorded at and below the target.
+ * @param ctx Cache context
+ * @param from Old path
+ * @param to New path
+ * @return 0 on success, -1 on error
+ */
+int cache_ident_rename(cache_meta_ctx_t *ctx, const char *from, const char *to);
+
+/**
+ * Forget the identities recorded at and below a path.
+ * @param ctx Cache context
+ * @param path Removed path
+ * @return 0 on success, -1 on error
  */
-void cache_dir_entries_free(cache_dir_entry_t *entries, size_t count);
+int cache_ident_forget(cache_meta_ctx_t *ctx, const char *path);
 
 /**
  * Shutdown metadata cache.
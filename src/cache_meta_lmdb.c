@@ -17,408 +17,777 @@
     along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include "cache_meta.h"
+#include <config.h>
+
+#include "cache_meta_store.h"
 #include "debug.h"
 
+#ifdef HAVE_LMDB
+
+#include "cache_stats.h"
+
 #include <stdlib.h>
 #include <string.h>
-#include <errno.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sqlite3.h>
-#include <unistd.h>
+#include <stdint.h>
 #include <limits.h>
+#include <pthread.h>
+#include <lmdb.h>
 
-#define META_DB_NAME "metadata.db"
-
-/* Cache metadata context */
-struct cache_meta_ctx {
-    sqlite3 *db;
-    sqlite3_stmt *insert_meta_stmt;
-    sqlite3_stmt *select_meta_stmt;
-    sqlite3_stmt *delete_meta_stmt;
-    char *cache_root;
-    int meta_ttl;
-    int dir_ttl;
-    bool debug;
-};
-
-/* Serialized metadata entry for LMDB storage */
-typedef struct {
-    uint8_t type;
-    int64_t size;
-    int64_t mtime;
-    int64_t ctime;
+/*
+ * LMDB metadata store.
+ *
+ * Lookups read the records straight out of the memory map. Every thread
+ * keeps one read-only transaction, reset between lookups and renewed for
+ * the next, so readers take no locks and never wait for the flusher.
+ *
+ * Keys are paths, which sort every path below a directory right after
+ * "dir/", so tree operations are range scans. Paths longer than LMDB's
+ * key limit (511 bytes by default) are not stored and simply miss.
+ *
+ * The map is reserved address space, not disk space. Should it fill up
+ * anyway, the cached metadata and listings are dropped and kept anew.
+ */
+
+#define META_MDB_NAME "metadata.mdb"
+#define META_MDB_VERSION 1      /* Bump when a record layout changes */
+#define META_MDB_READERS 1024   /* Threads with a read transaction */
+#if SIZE_MAX > 0xffffffffu
+#define META_MDB_MAP_SIZE (16ULL << 30)
+#else
+#define META_MDB_MAP_SIZE (512UL << 20)
+#endif
+
+/* Stored metadata entry, with fixed-width fields */
+struct mdb_meta_rec {
+    uint32_t type;
     uint32_t mode;
     uint32_t uid;
     uint32_t gid;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    int64_t atime;
+    int64_t mtime_nsec;
+    int64_t ctime_nsec;
+    int64_t atime_nsec;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t rdev;
+    uint64_t nlink;
+    int64_t blksize;
+    int64_t blocks;
     int64_t cached_at;
     int64_t valid_until;
-} __attribute__((packed)) meta_entry_serialized_t;
+};
+
+/* Header of a stored listing, followed by the packed entries */
+struct mdb_dir_rec {
+    int64_t dir_mtime;
+    int64_t cached_at;
+    int64_t valid_until;
+    uint64_t count;
+    uint32_t with_stats;
+    uint32_t reserved;
+};
+
+struct mdb_id_rec {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t gen;
+};
+
+struct meta_lmdb;
+
+/* Read transaction of one thread */
+struct lmdb_reader {
+    MDB_txn *txn;
+    struct meta_lmdb *store;
+    struct lmdb_reader *next;
+};
+
+struct meta_lmdb {
+    cache_meta_store_t base;
+    MDB_env *env;
+    MDB_dbi meta_dbi;
+    MDB_dbi dir_dbi;
+    MDB_dbi id_dbi;
+    size_t max_key;
+
+    pthread_key_t reader_key;
+    bool reader_key_created;
+    pthread_mutex_t readers_lock;
+    struct lmdb_reader *readers;
+
+    /* Flusher batch */
+    MDB_txn *batch;
+    int batch_error;
+    uint64_t batch_start;
+    size_t batch_ops;
+
+    bool debug;
+};
 
-cache_meta_ctx_t *cache_meta_init(const char *cache_root,
-                                   int meta_ttl,
-                                   int dir_ttl,
-                                   bool debug)
+static void reader_destroy(void *arg)
 {
-    if (cache_root == NULL) {
-        DPRINTF("cache_meta_init: cache_root is NULL");
-        return NULL;
-    }
+    struct lmdb_reader *r = arg;
+    struct meta_lmdb *m = r->store;
 
-    cache_meta_ctx_t *ctx = calloc(1, sizeof(cache_meta_ctx_t));
-    if (ctx == NULL) {
-        DPRINTF("cache_meta_init: failed to allocate context");
-        return NULL;
+    pthread_mutex_lock(&m->readers_lock);
+    struct lmdb_reader **pp = &m->readers;
+    while (*pp != NULL && *pp != r) {
+        pp = &(*pp)->next;
     }
+    if (*pp != NULL) {
+        *pp = r->next;
+    }
+    pthread_mutex_unlock(&m->readers_lock);
 
-    ctx->cache_root = strdup(cache_root);
-    ctx->meta_ttl = meta_ttl;
-    ctx->dir_ttl = dir_ttl;
-    ctx->debug = debug;
+    mdb_txn_abort(r->txn);
+    free(r);
+}
 
-    /* Create cache directory if it doesn't exist */
-    mkdir(cache_root, 0700);
-    
-    /* Put LMDB in /tmp to ensure it's completely outside any mounted filesystem
-     * This avoids any potential conflicts with FUSE operations */
-    char lmdb_path[PATH_MAX];
-    unsigned long cache_hash = 5381;
-    for (const char *p = cache_root; *p; p++) {
-        cache_hash = ((cache_hash << 5) + cache_hash) + *p;
+/* This thread's read transaction, renewed; NULL on error */
+static MDB_txn *reader_begin(struct meta_lmdb *m)
+{
+    struct lmdb_reader *r = pthread_getspecific(m->reader_key);
+    if (r != NULL) {
+        int rc = mdb_txn_renew(r->txn);
+        if (rc != 0) {
+            DPRINTF("cache_meta_lmdb: mdb_txn_renew failed: %s", mdb_strerror(rc));
+            return NULL;
+        }
+        return r->txn;
     }
-    snprintf(lmdb_path, PATH_MAX, "/tmp/cachefs-lmdb-%08lx", cache_hash & 0xFFFFFFFF);
-    mkdir(lmdb_path, 0700);
 
-    /* Initialize LMDB environment in /tmp */
-    int rc = mdb_env_create(&ctx->env);
+    r = calloc(1, sizeof(struct lmdb_reader));
+    if (r == NULL) {
+        return NULL;
+    }
+    int rc = mdb_txn_begin(m->env, NULL, MDB_RDONLY, &r->txn);
     if (rc != 0) {
-        DPRINTF("cache_meta_init: mdb_env_create failed: %s", mdb_strerror(rc));
-        free(ctx->cache_root);
-        free(ctx);
+        DPRINTF("cache_meta_lmdb: mdb_txn_begin failed: %s", mdb_strerror(rc));
+        free(r);
         return NULL;
     }
+    r->store = m;
+    pthread_mutex_lock(&m->readers_lock);
+    r->next = m->readers;
+    m->readers = r;
+    pthread_mutex_unlock(&m->readers_lock);
+    pthread_setspecific(m->reader_key, r);
+    return r->txn;
+}
 
-    mdb_env_set_maxdbs(ctx->env, 2);  /* metadata + directories */
-    mdb_env_set_mapsize(ctx->env, META_DB_SIZE);
+/* Done with the records read; the map pointers go stale here */
+static void reader_end(MDB_txn *txn)
+{
+    mdb_txn_reset(txn);
+}
 
-    /* Open LMDB with flags optimized for FUSE:
-     * MDB_NOSYNC - Don't force sync on commit (faster, risk on crash)
-     * MDB_WRITEMAP - Use writable memory map (better for multi-threaded)
-     * MDB_MAPASYNC - Async flush for MDB_WRITEMAP
-     */
-    rc = mdb_env_open(ctx->env, lmdb_path, MDB_NOSYNC | MDB_WRITEMAP | MDB_MAPASYNC, 0600);
-    if (rc != 0) {
-        DPRINTF("cache_meta_init: mdb_env_open failed: %s", mdb_strerror(rc));
-        mdb_env_close(ctx->env);
-        free(ctx->cache_root);
-        free(ctx);
-        return NULL;
+static bool make_key(struct meta_lmdb *m, const char *path, MDB_val *key)
+{
+    key->mv_size = strlen(path);
+    key->mv_data = (void *)path;
+    return key->mv_size > 0 && key->mv_size <= m->max_key;
+}
+
+static int lmdb_get_meta(cache_meta_store_t *store, const char *path, cache_meta_entry_t *entry)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key, val;
+    if (!make_key(m, path, &key)) {
+        return -1;
+    }
+    MDB_txn *txn = reader_begin(m);
+    if (txn == NULL) {
+        return -1;
     }
 
-    /* Open metadata database */
-    MDB_txn *txn;
-    rc = mdb_txn_begin(ctx->env, NULL, 0, &txn);
-    if (rc != 0) {
-        DPRINTF("cache_meta_init: mdb_txn_begin failed: %s", mdb_strerror(rc));
-        mdb_env_close(ctx->env);
-        free(ctx->cache_root);
-        free(ctx);
-        return NULL;
+    int ret = -1;
+    if (mdb_get(txn, m->meta_dbi, &key, &val) == 0 && val.mv_size == sizeof(struct mdb_meta_rec)) {
+        /* LMDB only aligns values to 2 bytes */
+        struct mdb_meta_rec rec;
+        memcpy(&rec, val.mv_data, sizeof(rec));
+        entry->type = rec.type;
+        entry->size = rec.size;
+        entry->mtime = rec.mtime;
+        entry->ctime = rec.ctime;
+        entry->mode = rec.mode;
+        entry->uid = rec.uid;
+        entry->gid = rec.gid;
+        entry->ino = rec.ino;
+        entry->cached_at = rec.cached_at;
+        entry->valid_until = rec.valid_until;
+        entry->dev = rec.dev;
+        entry->nlink = rec.nlink;
+        entry->rdev = rec.rdev;
+        entry->blksize = rec.blksize;
+        entry->blocks = rec.blocks;
+        entry->atime = rec.atime;
+        entry->atime_nsec = rec.atime_nsec;
+        entry->mtime_nsec = rec.mtime_nsec;
+        entry->ctime_nsec = rec.ctime_nsec;
+        ret = 0;
+    }
+    reader_end(txn);
+    return ret;
+}
+
+static int lmdb_get_dir(cache_meta_store_t *store, const char *path, struct arena *arena,
+                        cache_dir_listing_t *listing, time_t *valid_until)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key, val;
+    if (!make_key(m, path, &key)) {
+        return -1;
+    }
+    MDB_txn *txn = reader_begin(m);
+    if (txn == NULL) {
+        return -1;
     }
 
-    rc = mdb_dbi_open(txn, META_DB_NAME, MDB_CREATE, &ctx->meta_dbi);
-    if (rc != 0) {
-        DPRINTF("cache_meta_init: mdb_dbi_open(meta) failed: %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        mdb_env_close(ctx->env);
-        free(ctx->cache_root);
-        free(ctx);
-        return NULL;
+    int ret = -1;
+    struct mdb_dir_rec rec;
+    if (mdb_get(txn, m->dir_dbi, &key, &val) == 0 && val.mv_size > sizeof(rec)) {
+        memcpy(&rec, val.mv_data, sizeof(rec));
+        if (rec.count > 0) {
+            listing->dir_mtime = rec.dir_mtime;
+            listing->count = rec.count;
+            listing->with_stats = rec.with_stats != 0;
+            listing->size = val.mv_size - sizeof(rec);
+            listing->data = arena_malloc(arena, listing->size);
+            memcpy(listing->data, (const char *)val.mv_data + sizeof(rec), listing->size);
+            *valid_until = rec.valid_until;
+            ret = 0;
+        }
     }
+    reader_end(txn);
+    return ret;
+}
 
-    rc = mdb_dbi_open(txn, DIR_DB_NAME, MDB_CREATE, &ctx->dir_dbi);
-    if (rc != 0) {
-        DPRINTF("cache_meta_init: mdb_dbi_open(dir) failed: %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        mdb_env_close(ctx->env);
-        free(ctx->cache_root);
-        free(ctx);
-        return NULL;
+/* Record the first error of a batch; commit() then drops the batch */
+static void batch_check(struct meta_lmdb *m, int rc, const char *what)
+{
+    (void)what;  /* Only logged */
+    if (rc != 0 && rc != MDB_NOTFOUND && m->batch_error == 0) {
+        DPRINTF("cache_meta_lmdb: %s failed: %s", what, mdb_strerror(rc));
+        m->batch_error = rc;
     }
+    m->batch_ops++;
+}
 
-    rc = mdb_txn_commit(txn);
-    if (rc != 0) {
-        DPRINTF("cache_meta_init: mdb_txn_commit failed: %s", mdb_strerror(rc));
-        mdb_env_close(ctx->env);
-        free(ctx->cache_root);
-        free(ctx);
-        return NULL;
+static void lmdb_begin(cache_meta_store_t *store)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    m->batch_start = cache_stats_now();
+    m->batch_ops = 0;
+    m->batch_error = mdb_txn_begin(m->env, NULL, 0, &m->batch);
+    if (m->batch_error != 0) {
+        DPRINTF("cache_meta_lmdb: mdb_txn_begin failed: %s", mdb_strerror(m->batch_error));
+        m->batch = NULL;
     }
+}
 
-    if (debug) {
-        DPRINTF("cache_meta_init: initialized cache at %s (meta_ttl=%d, dir_ttl=%d)",
-                cache_root, meta_ttl, dir_ttl);
+static void lmdb_put_meta(cache_meta_store_t *store, const char *path, const cache_meta_entry_t *entry)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key;
+    if (m->batch_error != 0 || !make_key(m, path, &key)) {
+        return;
     }
 
-    return ctx;
+    struct mdb_meta_rec rec = {
+        .type = entry->type,
+        .mode = entry->mode,
+        .uid = entry->uid,
+        .gid = entry->gid,
+        .size = entry->size,
+        .mtime = entry->mtime,
+        .ctime = entry->ctime,
+        .atime = entry->atime,
+        .mtime_nsec = entry->mtime_nsec,
+        .ctime_nsec = entry->ctime_nsec,
+        .atime_nsec = entry->atime_nsec,
+        .ino = entry->ino,
+        .dev = entry->dev,
+        .rdev = entry->rdev,
+        .nlink = entry->nlink,
+        .blksize = entry->blksize,
+        .blocks = entry->blocks,
+        .cached_at = entry->cached_at,
+        .valid_until = entry->valid_until,
+    };
+    MDB_val val = { sizeof(rec), &rec };
+    batch_check(m, mdb_put(m->batch, m->meta_dbi, &key, &val, 0), "put");
 }
 
-int cache_meta_lookup(cache_meta_ctx_t *ctx,
-                      const char *path,
-                      cache_meta_entry_t *entry,
-                      bool *valid)
+/* Delete path and every key below it */
+static int delete_tree(struct meta_lmdb *m, MDB_txn *txn, MDB_dbi dbi, const char *path)
 {
-    if (ctx == NULL || path == NULL || entry == NULL) {
-        return -1;
+    if (strcmp(path, "/") == 0) {
+        return mdb_drop(txn, dbi, 0);  /* Every key is below the root */
     }
 
-    MDB_txn *txn;
-    int rc = mdb_txn_begin(ctx->env, NULL, MDB_RDONLY, &txn);
-    if (rc != 0) {
-        DPRINTF("cache_meta_lookup: mdb_txn_begin failed: %s", mdb_strerror(rc));
-        return -1;
+    MDB_val key, val;
+    if (!make_key(m, path, &key)) {
+        return 0;
+    }
+    int rc = mdb_del(txn, dbi, &key, NULL);
+    if (rc != 0 && rc != MDB_NOTFOUND) {
+        return rc;
     }
 
-    MDB_val key = { .mv_size = strlen(path), .mv_data = (void*)path };
-    MDB_val data;
+    size_t len = key.mv_size;
+    char prefix[PATH_MAX + 1];
+    if (len + 1 > m->max_key || len + 1 > sizeof(prefix)) {
+        return 0;   /* Nothing below can be stored */
+    }
+    memcpy(prefix, path, len);
+    prefix[len] = '/';
 
-    rc = mdb_get(txn, ctx->meta_dbi, &key, &data);
-    if (rc == MDB_NOTFOUND) {
-        mdb_txn_abort(txn);
-        if (ctx->debug) {
-            DPRINTF("cache_meta_lookup: cache miss for %s", path);
+    MDB_cursor *cursor;
+    rc = mdb_cursor_open(txn, dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    key.mv_size = len + 1;
+    key.mv_data = prefix;
+    rc = mdb_cursor_get(cursor, &key, &val, MDB_SET_RANGE);
+    while (rc == 0 && key.mv_size > len && memcmp(key.mv_data, prefix, len + 1) == 0) {
+        rc = mdb_cursor_del(cursor, 0);
+        if (rc == 0) {
+            /* After a delete the cursor already sits on the next key */
+            rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
         }
-        return -1;
-    } else if (rc != 0) {
-        DPRINTF("cache_meta_lookup: mdb_get failed: %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return -1;
     }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND || rc == 0 ? 0 : rc;
+}
 
-    if (data.mv_size != sizeof(meta_entry_serialized_t)) {
-        DPRINTF("cache_meta_lookup: corrupt entry size for %s", path);
-        mdb_txn_abort(txn);
-        return -1;
+static void lmdb_del_meta(cache_meta_store_t *store, const char *path)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key;
+    if (m->batch_error != 0 || !make_key(m, path, &key)) {
+        return;
+    }
+    batch_check(m, mdb_del(m->batch, m->meta_dbi, &key, NULL), "delete");
+}
+
+static void lmdb_del_meta_tree(cache_meta_store_t *store, const char *path)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    if (m->batch_error != 0) {
+        return;
     }
+    batch_check(m, delete_tree(m, m->batch, m->meta_dbi, path), "tree delete");
+    if (strcmp(path, "/") == 0) {
+        /* Everything may have changed, so listings go as well */
+        batch_check(m, mdb_drop(m->batch, m->dir_dbi, 0), "listing drop");
+    }
+}
 
-    meta_entry_serialized_t *stored = (meta_entry_serialized_t*)data.mv_data;
-    entry->type = stored->type;
-    entry->size = stored->size;
-    entry->mtime = stored->mtime;
-    entry->ctime = stored->ctime;
-    entry->mode = stored->mode;
-    entry->uid = stored->uid;
-    entry->gid = stored->gid;
-    entry->cached_at = stored->cached_at;
-    entry->valid_until = stored->valid_until;
+static void lmdb_put_dir(cache_meta_store_t *store, const char *path, const cache_dir_listing_t *listing,
+                         time_t cached_at, time_t valid_until)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key;
+    if (m->batch_error != 0 || !make_key(m, path, &key)) {
+        return;
+    }
 
-    mdb_txn_abort(txn);
+    struct mdb_dir_rec rec = {
+        .dir_mtime = listing->dir_mtime,
+        .cached_at = cached_at,
+        .valid_until = valid_until,
+        .count = listing->count,
+        .with_stats = listing->with_stats,
+    };
 
-    /* Check validity */
-    time_t now = time(NULL);
-    if (valid != NULL) {
-        *valid = (now < entry->valid_until);
+    /* Reserve the value and build it in place in the map */
+    MDB_val val = { sizeof(rec) + listing->size, NULL };
+    int rc = mdb_put(m->batch, m->dir_dbi, &key, &val, MDB_RESERVE);
+    if (rc == 0) {
+        memcpy(val.mv_data, &rec, sizeof(rec));
+        memcpy((char *)val.mv_data + sizeof(rec), listing->data, listing->size);
     }
+    batch_check(m, rc, "listing put");
+}
 
-    if (ctx->debug) {
-        DPRINTF("cache_meta_lookup: cache hit for %s (valid=%d)", 
-                path, valid ? *valid : -1);
+static void lmdb_del_dir(cache_meta_store_t *store, const char *path)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key;
+    if (m->batch_error != 0 || !make_key(m, path, &key)) {
+        return;
     }
+    batch_check(m, mdb_del(m->batch, m->dir_dbi, &key, NULL), "listing delete");
+}
 
-    return 0;
+/* Start over with empty metadata and listings; identities are kept */
+static void drop_cached(struct meta_lmdb *m)
+{
+    MDB_txn *txn;
+    if (mdb_txn_begin(m->env, NULL, 0, &txn) != 0) {
+        return;
+    }
+    if (mdb_drop(txn, m->meta_dbi, 0) != 0 || mdb_drop(txn, m->dir_dbi, 0) != 0) {
+        mdb_txn_abort(txn);
+        return;
+    }
+    if (mdb_txn_commit(txn) == 0) {
+        DPRINTF("cache_meta_lmdb: map full, dropped cached metadata");
+    }
 }
 
-int cache_meta_store(cache_meta_ctx_t *ctx,
-                     const char *path,
-                     const struct stat *stbuf)
+static int lmdb_commit(cache_meta_store_t *store)
 {
-    if (ctx == NULL || path == NULL || stbuf == NULL) {
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    if (m->batch == NULL) {
         return -1;
     }
 
-    time_t now = time(NULL);
-    meta_entry_serialized_t entry = {
-        .type = S_ISDIR(stbuf->st_mode) ? CACHE_ENTRY_DIR : CACHE_ENTRY_FILE,
-        .size = stbuf->st_size,
-        .mtime = stbuf->st_mtime,
-        .ctime = stbuf->st_ctime,
-        .mode = stbuf->st_mode,
-        .uid = stbuf->st_uid,
-        .gid = stbuf->st_gid,
-        .cached_at = now,
-        .valid_until = now + ctx->meta_ttl
-    };
+    int rc = m->batch_error;
+    if (rc == 0) {
+        rc = mdb_txn_commit(m->batch);
+        if (rc != 0) {
+            DPRINTF("cache_meta_lmdb: commit of %zu ops failed: %s", m->batch_ops, mdb_strerror(rc));
+        }
+    } else {
+        mdb_txn_abort(m->batch);
+    }
+    m->batch = NULL;
 
-    MDB_txn *txn;
-    int rc = mdb_txn_begin(ctx->env, NULL, 0, &txn);
-    if (rc != 0) {
-        DPRINTF("cache_meta_store: mdb_txn_begin failed: %s", mdb_strerror(rc));
+    if (rc == MDB_MAP_FULL) {
+        drop_cached(m);
+    } else if (rc == 0 && m->debug) {
+        DPRINTF("cache_meta_lmdb: committed %zu ops", m->batch_ops);
+    }
+    cache_stats_since(CACHE_STAGE_LMDB_COMMIT, m->batch_start);
+    return rc == 0 ? 0 : -1;
+}
+
+static int lmdb_get_ident(cache_meta_store_t *store, const char *path, cache_file_id_t *id)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key, val;
+    if (!make_key(m, path, &key)) {
+        return -1;
+    }
+    MDB_txn *txn = reader_begin(m);
+    if (txn == NULL) {
         return -1;
     }
 
-    MDB_val key = { .mv_size = strlen(path), .mv_data = (void*)path };
-    MDB_val data = { .mv_size = sizeof(entry), .mv_data = &entry };
+    int ret = -1;
+    if (mdb_get(txn, m->id_dbi, &key, &val) == 0 && val.mv_size == sizeof(struct mdb_id_rec)) {
+        struct mdb_id_rec rec;
+        memcpy(&rec, val.mv_data, sizeof(rec));
+        id->dev = rec.dev;
+        id->ino = rec.ino;
+        id->gen = rec.gen;
+        ret = 0;
+    }
+    reader_end(txn);
+    return ret;
+}
 
-    rc = mdb_put(txn, ctx->meta_dbi, &key, &data, 0);
-    if (rc != 0) {
-        DPRINTF("cache_meta_store: mdb_put failed: %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
+static int lmdb_put_ident(cache_meta_store_t *store, const char *path, const cache_file_id_t *id)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_val key;
+    if (!make_key(m, path, &key)) {
         return -1;
     }
 
-    rc = mdb_txn_commit(txn);
+    struct mdb_id_rec rec = { id->dev, id->ino, id->gen };
+    MDB_val val = { sizeof(rec), &rec };
+    MDB_txn *txn;
+    int rc = mdb_txn_begin(m->env, NULL, 0, &txn);
+    if (rc == 0) {
+        rc = mdb_put(txn, m->id_dbi, &key, &val, 0);
+        if (rc == 0) {
+            rc = mdb_txn_commit(txn);
+        } else {
+            mdb_txn_abort(txn);
+        }
+    }
     if (rc != 0) {
-        DPRINTF("cache_meta_store: mdb_txn_commit failed: %s", mdb_strerror(rc));
+        DPRINTF("cache_ident_store: put failed for %s: %s", path, mdb_strerror(rc));
         return -1;
     }
+    return 0;
+}
 
-    if (ctx->debug) {
-        DPRINTF("cache_meta_store: stored entry for %s", path);
-    }
+/* One identity being moved by a rename */
+struct moved_id {
+    char *suffix;       /* Part of the path after the renamed one */
+    struct mdb_id_rec rec;
+    struct moved_id *next;
+};
 
-    return 0;
+static void free_moved(struct moved_id *list)
+{
+    while (list != NULL) {
+        struct moved_id *next = list->next;
+        free(list->suffix);
+        free(list);
+        list = next;
+    }
 }
 
-int cache_meta_store_negative(cache_meta_ctx_t *ctx, const char *path)
+/* Collect the identities at and below from, then delete them */
+static int take_tree(struct meta_lmdb *m, MDB_txn *txn, const char *from, struct moved_id **out)
 {
-    if (ctx == NULL || path == NULL) {
-        return -1;
+    MDB_val key, val;
+    if (!make_key(m, from, &key)) {
+        return 0;
+    }
+    size_t len = key.mv_size;
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, m->id_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
     }
 
-    time_t now = time(NULL);
-    meta_entry_serialized_t entry = {
-        .type = CACHE_ENTRY_NEG,
-        .cached_at = now,
-        .valid_until = now + 2  /* Short TTL for negative entries */
-    };
+    rc = mdb_cursor_get(cursor, &key, &val, MDB_SET_RANGE);
+    while (rc == 0 && key.mv_size >= len && memcmp(key.mv_data, from, len) == 0) {
+        const char *k = key.mv_data;
+        if (key.mv_size > len && k[len] != '/') {
+            /* A sibling such as "from.bak", sorting before "from/" */
+            rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
+            continue;
+        }
+        struct moved_id *id = calloc(1, sizeof(struct moved_id));
+        if (id == NULL || (id->suffix = strndup(k + len, key.mv_size - len)) == NULL
+            || val.mv_size != sizeof(id->rec)) {
+            free(id);
+            rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
+            continue;
+        }
+        memcpy(&id->rec, val.mv_data, sizeof(id->rec));
+        id->next = *out;
+        *out = id;
+        rc = mdb_cursor_del(cursor, 0);
+        if (rc == 0) {
+            rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
+        }
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND || rc == 0 ? 0 : rc;
+}
 
+static int lmdb_rename_ident(cache_meta_store_t *store, const char *from, const char *to)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
     MDB_txn *txn;
-    int rc = mdb_txn_begin(ctx->env, NULL, 0, &txn);
+    int rc = mdb_txn_begin(m->env, NULL, 0, &txn);
     if (rc != 0) {
+        DPRINTF("cache_ident_rename: mdb_txn_begin failed: %s", mdb_strerror(rc));
         return -1;
     }
 
-    MDB_val key = { .mv_size = strlen(path), .mv_data = (void*)path };
-    MDB_val data = { .mv_size = sizeof(entry), .mv_data = &entry };
+    /* Whatever the target name referred to has been replaced */
+    struct moved_id *moved = NULL;
+    rc = delete_tree(m, txn, m->id_dbi, to);
+    if (rc == 0) {
+        rc = take_tree(m, txn, from, &moved);
+    }
 
-    rc = mdb_put(txn, ctx->meta_dbi, &key, &data, 0);
-    if (rc != 0) {
+    size_t to_len = strlen(to);
+    for (struct moved_id *id = moved; id != NULL && rc == 0; id = id->next) {
+        char path[PATH_MAX];
+        size_t len = to_len + strlen(id->suffix);
+        if (len >= sizeof(path)) {
+            continue;
+        }
+        memcpy(path, to, to_len);
+        strcpy(path + to_len, id->suffix);
+        MDB_val key, val = { sizeof(id->rec), &id->rec };
+        if (make_key(m, path, &key)) {
+            rc = mdb_put(txn, m->id_dbi, &key, &val, 0);
+        }
+    }
+    free_moved(moved);
+
+    if (rc == 0) {
+        rc = mdb_txn_commit(txn);
+    } else {
         mdb_txn_abort(txn);
+    }
+    if (rc != 0) {
+        DPRINTF("cache_ident_rename: %s -> %s failed: %s", from, to, mdb_strerror(rc));
         return -1;
     }
+    return 0;
+}
 
-    rc = mdb_txn_commit(txn);
+static int lmdb_forget_ident(cache_meta_store_t *store, const char *path)
+{
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    MDB_txn *txn;
+    int rc = mdb_txn_begin(m->env, NULL, 0, &txn);
     if (rc != 0) {
         return -1;
     }
-
-    if (ctx->debug) {
-        DPRINTF("cache_meta_store_negative: stored negative entry for %s", path);
+    rc = delete_tree(m, txn, m->id_dbi, path);
+    if (rc == 0) {
+        rc = mdb_txn_commit(txn);
+    } else {
+        mdb_txn_abort(txn);
     }
-
-    return 0;
+    return rc == 0 ? 0 : -1;
 }
 
-int cache_meta_invalidate(cache_meta_ctx_t *ctx, const char *path)
+static void lmdb_close(cache_meta_store_t *store)
 {
-    if (ctx == NULL || path == NULL) {
-        return -1;
+    struct meta_lmdb *m = (struct meta_lmdb *)store;
+    if (m == NULL) {
+        return;
     }
 
+    /* Every other thread is done with the store by now */
+    if (m->reader_key_created) {
+        pthread_key_delete(m->reader_key);
+    }
+    struct lmdb_reader *r = m->readers;
+    while (r != NULL) {
+        struct lmdb_reader *next = r->next;
+        mdb_txn_abort(r->txn);
+        free(r);
+        r = next;
+    }
+    if (m->env != NULL) {
+        mdb_env_sync(m->env, 1);
+        mdb_env_close(m->env);
+    }
+    pthread_mutex_destroy(&m->readers_lock);
+    free(m);
+}
+
+static const cache_meta_store_ops_t lmdb_ops = {
+    .name = "lmdb",
+    .get_meta = lmdb_get_meta,
+    .get_dir = lmdb_get_dir,
+    .begin = lmdb_begin,
+    .put_meta = lmdb_put_meta,
+    .del_meta = lmdb_del_meta,
+    .del_meta_tree = lmdb_del_meta_tree,
+    .put_dir = lmdb_put_dir,
+    .del_dir = lmdb_del_dir,
+    .commit = lmdb_commit,
+    .get_ident = lmdb_get_ident,
+    .put_ident = lmdb_put_ident,
+    .rename_ident = lmdb_rename_ident,
+    .forget_ident = lmdb_forget_ident,
+    .close = lmdb_close,
+};
+
+/* Open the databases, emptying them if written with another layout */
+static int open_databases(struct meta_lmdb *m)
+{
     MDB_txn *txn;
-    int rc = mdb_txn_begin(ctx->env, NULL, 0, &txn);
+    MDB_dbi info_dbi;
+    int rc = mdb_txn_begin(m->env, NULL, 0, &txn);
     if (rc != 0) {
+        DPRINTF("cache_meta_lmdb: mdb_txn_begin failed: %s", mdb_strerror(rc));
         return -1;
     }
-
-    MDB_val key = { .mv_size = strlen(path), .mv_data = (void*)path };
-
-    rc = mdb_del(txn, ctx->meta_dbi, &key, NULL);
-    if (rc == MDB_NOTFOUND) {
-        mdb_txn_abort(txn);
-        return 0;  /* Already invalidated */
-    } else if (rc != 0) {
+    if ((rc = mdb_dbi_open(txn, "info", MDB_CREATE, &info_dbi)) != 0 ||
+        (rc = mdb_dbi_open(txn, "metadata", MDB_CREATE, &m->meta_dbi)) != 0 ||
+        (rc = mdb_dbi_open(txn, "dir_listings", MDB_CREATE, &m->dir_dbi)) != 0 ||
+        (rc = mdb_dbi_open(txn, "file_ids", MDB_CREATE, &m->id_dbi)) != 0) {
+        DPRINTF("cache_meta_lmdb: mdb_dbi_open failed: %s", mdb_strerror(rc));
         mdb_txn_abort(txn);
         return -1;
     }
 
+    uint32_t version = 0;
+    MDB_val key = { 7, "version" }, val;
+    if (mdb_get(txn, info_dbi, &key, &val) == 0 && val.mv_size == sizeof(version)) {
+        memcpy(&version, val.mv_data, sizeof(version));
+    }
+    if (version != META_MDB_VERSION) {
+        version = META_MDB_VERSION;
+        val.mv_size = sizeof(version);
+        val.mv_data = &version;
+        if ((rc = mdb_drop(txn, m->meta_dbi, 0)) != 0 ||
+            (rc = mdb_drop(txn, m->dir_dbi, 0)) != 0 ||
+            (rc = mdb_drop(txn, m->id_dbi, 0)) != 0 ||
+            (rc = mdb_put(txn, info_dbi, &key, &val, 0)) != 0) {
+            DPRINTF("cache_meta_lmdb: reset failed: %s", mdb_strerror(rc));
+            mdb_txn_abort(txn);
+            return -1;
+        }
+    }
+
     rc = mdb_txn_commit(txn);
     if (rc != 0) {
+        DPRINTF("cache_meta_lmdb: mdb_txn_commit failed: %s", mdb_strerror(rc));
         return -1;
     }
-
-    if (ctx->debug) {
-        DPRINTF("cache_meta_invalidate: invalidated entry for %s", path);
-    }
-
     return 0;
 }
 
-int cache_dir_lookup(cache_meta_ctx_t *ctx,
-                     const char *path,
-                     cache_dir_entry_t **entries,
-                     size_t *count,
-                     time_t *dir_mtime,
-                     bool *valid)
+cache_meta_store_t *cache_meta_lmdb_open(const char *cache_root, bool debug)
 {
-    /* TODO: Implement directory cache lookup */
-    (void)ctx;
-    (void)path;
-    (void)entries;
-    (void)count;
-    (void)dir_mtime;
-    (void)valid;
-    return -1;  /* Not implemented yet */
-}
-
-int cache_dir_store(cache_meta_ctx_t *ctx,
-                    const char *path,
-                    const cache_dir_entry_t *entries,
-                    size_t count,
-                    time_t dir_mtime)
-{
-    /* TODO: Implement directory cache store */
-    (void)ctx;
-    (void)path;
-    (void)entries;
-    (void)count;
-    (void)dir_mtime;
-    return -1;  /* Not implemented yet */
-}
+    struct meta_lmdb *m = calloc(1, sizeof(struct meta_lmdb));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->base.ops = &lmdb_ops;
+    m->debug = debug;
+    pthread_mutex_init(&m->readers_lock, NULL);
+    if (pthread_key_create(&m->reader_key, reader_destroy) != 0) {
+        lmdb_close(&m->base);
+        return NULL;
+    }
+    m->reader_key_created = true;
 
-int cache_dir_invalidate(cache_meta_ctx_t *ctx, const char *path)
-{
-    /* TODO: Implement directory cache invalidation */
-    (void)ctx;
-    (void)path;
-    return -1;  /* Not implemented yet */
-}
+    char db_path[PATH_MAX];
+    snprintf(db_path, PATH_MAX, "%s/%s", cache_root, META_MDB_NAME);
 
-void cache_dir_entries_free(cache_dir_entry_t *entries, size_t count)
-{
-    if (entries == NULL) {
-        return;
+    int rc = mdb_env_create(&m->env);
+    if (rc != 0) {
+        DPRINTF("cache_meta_lmdb: mdb_env_create failed: %s", mdb_strerror(rc));
+        m->env = NULL;
+        lmdb_close(&m->base);
+        return NULL;
     }
+    mdb_env_set_maxdbs(m->env, 4);
+    mdb_env_set_maxreaders(m->env, META_MDB_READERS);
+    mdb_env_set_mapsize(m->env, META_MDB_MAP_SIZE);
 
-    for (size_t i = 0; i < count; i++) {
-        free(entries[i].name);
+    /* A single file; read transactions belong to their txn handle rather
+       than the thread; a crash may lose the last batch but never leaves
+       the file inconsistent. */
+    rc = mdb_env_open(m->env, db_path, MDB_NOSUBDIR | MDB_NOTLS | MDB_NOMETASYNC | MDB_NORDAHEAD, 0600);
+    if (rc != 0) {
+        DPRINTF("cache_meta_lmdb: mdb_env_open %s failed: %s", db_path, mdb_strerror(rc));
+        lmdb_close(&m->base);
+        return NULL;
     }
-    free(entries);
-}
+    m->max_key = (size_t)mdb_env_get_maxkeysize(m->env);
 
-void cache_meta_destroy(cache_meta_ctx_t *ctx)
-{
-    if (ctx == NULL) {
-        return;
+    if (open_databases(m) != 0) {
+        lmdb_close(&m->base);
+        return NULL;
     }
 
-    if (ctx->env != NULL) {
-        mdb_env_close(ctx->env);
+    if (debug) {
+        DPRINTF("cache_meta_lmdb: opened %s (keys up to %zu bytes)", db_path, m->max_key);
     }
+    return &m->base;
+}
 
-    free(ctx->cache_root);
-    free(ctx);
+#else /* !HAVE_LMDB */
 
-    DPRINTF("cache_meta_destroy: cache destroyed");
+cache_meta_store_t *cache_meta_lmdb_open(const char *cache_root, bool debug)
+{
+    (void)cache_root;
+    (void)debug;
+    DPRINTF("cache_meta_lmdb: built without LMDB");
+    return NULL;
 }
+
+#endif /* HAVE_LMDB */
@@ -0,0 +1,641 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include "cache_meta_store.h"
+#include "cache_stats.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sqlite3.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define META_DB_NAME "metadata.db"
+#define META_SCHEMA_VERSION 3    /* Bump when a table changes */
+
+#define READER_BUSY_TIMEOUT_MS 1000
+
+static const char *select_meta_sql = "SELECT * FROM metadata WHERE path = ?";
+static const char *select_dir_sql =
+    "SELECT dir_mtime, valid_until, entry_count, with_stats, entries "
+    "FROM dir_listings WHERE dir_path = ?";
+static const char *select_id_sql = "SELECT dev, ino, gen FROM file_ids WHERE path = ?";
+
+struct meta_sqlite;
+
+/*
+ * Read-only connection of one thread, with its own statements. In WAL
+ * mode readers see the last commit while the flusher writes the next one,
+ * so lookups neither take db_lock nor wait for a batch.
+ */
+struct sqlite_reader {
+    sqlite3 *db;
+    sqlite3_stmt *select_meta_stmt;
+    sqlite3_stmt *select_dir_stmt;
+    sqlite3_stmt *select_id_stmt;
+    struct meta_sqlite *store;
+    struct sqlite_reader *next;
+};
+
+/* SQLite metadata store */
+struct meta_sqlite {
+    cache_meta_store_t base;
+    char db_path[PATH_MAX];
+
+    /* Writer connection. db_lock serializes it and its statements: the
+       flusher holds it from begin to commit, identity writes per call. */
+    pthread_mutex_t db_lock;
+    sqlite3 *db;
+    sqlite3_stmt *insert_meta_stmt;
+    sqlite3_stmt *delete_meta_stmt;
+    sqlite3_stmt *delete_tree_stmt;
+    sqlite3_stmt *insert_dir_stmt;
+    sqlite3_stmt *delete_dir_stmt;
+    sqlite3_stmt *insert_id_stmt;
+    sqlite3_stmt *delete_id_tree_stmt;
+    sqlite3_stmt *move_id_tree_stmt;
+    uint64_t batch_start;
+    size_t batch_ops;
+
+    /* Reader connections, one per thread that looked something up */
+    pthread_key_t reader_key;
+    bool reader_key_created;
+    pthread_mutex_t readers_lock;   /* Guards the list only */
+    struct sqlite_reader *readers;
+
+    bool debug;
+};
+
+static void reader_close(struct sqlite_reader *r)
+{
+    sqlite3_finalize(r->select_meta_stmt);
+    sqlite3_finalize(r->select_dir_stmt);
+    sqlite3_finalize(r->select_id_stmt);
+    sqlite3_close(r->db);
+    free(r);
+}
+
+/* Thread exit */
+static void reader_destroy(void *arg)
+{
+    struct sqlite_reader *r = arg;
+    struct meta_sqlite *s = r->store;
+
+    pthread_mutex_lock(&s->readers_lock);
+    struct sqlite_reader **pp = &s->readers;
+    while (*pp != NULL && *pp != r) {
+        pp = &(*pp)->next;
+    }
+    if (*pp != NULL) {
+        *pp = r->next;
+    }
+    pthread_mutex_unlock(&s->readers_lock);
+    reader_close(r);
+}
+
+/* This thread's reader, opened on first use; NULL on error */
+static struct sqlite_reader *reader_get(struct meta_sqlite *s)
+{
+    struct sqlite_reader *r = pthread_getspecific(s->reader_key);
+    if (r != NULL) {
+        return r;
+    }
+
+    r = calloc(1, sizeof(struct sqlite_reader));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->store = s;
+
+    /* Only this thread uses the connection, so SQLite need not lock it */
+    int rc = sqlite3_open_v2(s->db_path, &r->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_busy_timeout(r->db, READER_BUSY_TIMEOUT_MS);
+        rc = sqlite3_prepare_v3(r->db, select_meta_sql, -1, SQLITE_PREPARE_PERSISTENT, &r->select_meta_stmt, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v3(r->db, select_dir_sql, -1, SQLITE_PREPARE_PERSISTENT, &r->select_dir_stmt, NULL);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v3(r->db, select_id_sql, -1, SQLITE_PREPARE_PERSISTENT, &r->select_id_stmt, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        DPRINTF("cache_meta: opening reader failed: %s", r->db ? sqlite3_errmsg(r->db) : sqlite3_errstr(rc));
+        reader_close(r);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s->readers_lock);
+    r->next = s->readers;
+    s->readers = r;
+    pthread_mutex_unlock(&s->readers_lock);
+    pthread_setspecific(s->reader_key, r);
+    return r;
+}
+
+static int sqlite_get_meta(cache_meta_store_t *store, const char *path, cache_meta_entry_t *entry)
+{
+    struct sqlite_reader *r = reader_get((struct meta_sqlite *)store);
+    if (r == NULL) {
+        return -1;
+    }
+
+    sqlite3_stmt *stmt = r->select_meta_stmt;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        sqlite3_reset(stmt);
+        return -1;  /* Not found */
+    }
+
+    entry->type = sqlite3_column_int(stmt, 1);
+    entry->size = sqlite3_column_int64(stmt, 2);
+    entry->mtime = sqlite3_column_int64(stmt, 3);
+    entry->ctime = sqlite3_column_int64(stmt, 4);
+    entry->mode = sqlite3_column_int(stmt, 5);
+    entry->uid = sqlite3_column_int(stmt, 6);
+    entry->gid = sqlite3_column_int(stmt, 7);
+    entry->ino = sqlite3_column_int64(stmt, 8);
+    entry->cached_at = sqlite3_column_int64(stmt, 9);
+    entry->valid_until = sqlite3_column_int64(stmt, 10);
+    entry->dev = sqlite3_column_int64(stmt, 11);
+    entry->nlink = sqlite3_column_int64(stmt, 12);
+    entry->rdev = sqlite3_column_int64(stmt, 13);
+    entry->blksize = sqlite3_column_int64(stmt, 14);
+    entry->blocks = sqlite3_column_int64(stmt, 15);
+    entry->atime = sqlite3_column_int64(stmt, 16);
+    entry->atime_nsec = sqlite3_column_int64(stmt, 17);
+    entry->mtime_nsec = sqlite3_column_int64(stmt, 18);
+    entry->ctime_nsec = sqlite3_column_int64(stmt, 19);
+    sqlite3_reset(stmt);
+    return 0;
+}
+
+static int sqlite_get_dir(cache_meta_store_t *store, const char *path, struct arena *arena,
+                          cache_dir_listing_t *listing, time_t *valid_until)
+{
+    struct sqlite_reader *r = reader_get((struct meta_sqlite *)store);
+    if (r == NULL) {
+        return -1;
+    }
+
+    sqlite3_stmt *stmt = r->select_dir_stmt;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        sqlite3_reset(stmt);
+        return -1;  /* Not cached */
+    }
+
+    listing->dir_mtime = sqlite3_column_int64(stmt, 0);
+    *valid_until = sqlite3_column_int64(stmt, 1);
+    listing->count = sqlite3_column_int64(stmt, 2);
+    listing->with_stats = sqlite3_column_int(stmt, 3) != 0;
+    const void *blob = sqlite3_column_blob(stmt, 4);
+    listing->size = sqlite3_column_bytes(stmt, 4);
+    if (blob == NULL || listing->count == 0) {
+        sqlite3_reset(stmt);
+        return -1;
+    }
+    listing->data = arena_malloc(arena, listing->size);
+    memcpy(listing->data, blob, listing->size);
+    sqlite3_reset(stmt);
+    return 0;
+}
+
+/* The flusher holds db_lock from begin to commit */
+static void sqlite_begin(cache_meta_store_t *store)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    pthread_mutex_lock(&s->db_lock);
+    s->batch_start = cache_stats_now();
+    s->batch_ops = 0;
+    sqlite3_exec(s->db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+}
+
+static void sqlite_put_meta(cache_meta_store_t *store, const char *path, const cache_meta_entry_t *entry)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    sqlite3_stmt *stmt = s->insert_meta_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, entry->type);
+    sqlite3_bind_int64(stmt, 3, entry->size);
+    sqlite3_bind_int64(stmt, 4, entry->mtime);
+    sqlite3_bind_int64(stmt, 5, entry->ctime);
+    sqlite3_bind_int(stmt, 6, entry->mode);
+    sqlite3_bind_int(stmt, 7, entry->uid);
+    sqlite3_bind_int(stmt, 8, entry->gid);
+    sqlite3_bind_int64(stmt, 9, entry->ino);
+    sqlite3_bind_int64(stmt, 10, entry->cached_at);
+    sqlite3_bind_int64(stmt, 11, entry->valid_until);
+    sqlite3_bind_int64(stmt, 12, entry->dev);
+    sqlite3_bind_int64(stmt, 13, entry->nlink);
+    sqlite3_bind_int64(stmt, 14, entry->rdev);
+    sqlite3_bind_int64(stmt, 15, entry->blksize);
+    sqlite3_bind_int64(stmt, 16, entry->blocks);
+    sqlite3_bind_int64(stmt, 17, entry->atime);
+    sqlite3_bind_int64(stmt, 18, entry->atime_nsec);
+    sqlite3_bind_int64(stmt, 19, entry->mtime_nsec);
+    sqlite3_bind_int64(stmt, 20, entry->ctime_nsec);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        DPRINTF("cache_meta_store: insert failed: %s", sqlite3_errmsg(s->db));
+    }
+    sqlite3_reset(stmt);
+    s->batch_ops++;
+}
+
+static void apply_delete(sqlite3_stmt *stmt, const char *path)
+{
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+}
+
+static void sqlite_del_meta(cache_meta_store_t *store, const char *path)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    apply_delete(s->delete_meta_stmt, path);
+    s->batch_ops++;
+}
+
+static void sqlite_del_meta_tree(cache_meta_store_t *store, const char *path)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    apply_delete(s->delete_tree_stmt, path);
+    if (strcmp(path, "/") == 0) {
+        /* Everything may have changed, so listings go as well */
+        sqlite3_exec(s->db, "DELETE FROM dir_listings", NULL, NULL, NULL);
+    }
+    s->batch_ops++;
+}
+
+static void sqlite_put_dir(cache_meta_store_t *store, const char *path, const cache_dir_listing_t *listing,
+                           time_t cached_at, time_t valid_until)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    sqlite3_stmt *stmt = s->insert_dir_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, listing->dir_mtime);
+    sqlite3_bind_int64(stmt, 3, cached_at);
+    sqlite3_bind_int64(stmt, 4, valid_until);
+    sqlite3_bind_int64(stmt, 5, listing->count);
+    sqlite3_bind_int(stmt, 6, listing->with_stats);
+    sqlite3_bind_blob64(stmt, 7, listing->data, listing->size, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        DPRINTF("cache_dir_store: insert failed: %s", sqlite3_errmsg(s->db));
+    }
+    sqlite3_reset(stmt);
+    s->batch_ops++;
+}
+
+static void sqlite_del_dir(cache_meta_store_t *store, const char *path)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    apply_delete(s->delete_dir_stmt, path);
+    s->batch_ops++;
+}
+
+static int sqlite_commit(cache_meta_store_t *store)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    int ret = 0;
+    if (sqlite3_exec(s->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        DPRINTF("cache_meta: commit of %zu ops failed: %s", s->batch_ops, sqlite3_errmsg(s->db));
+        sqlite3_exec(s->db, "ROLLBACK", NULL, NULL, NULL);
+        ret = -1;
+    } else if (s->debug) {
+        DPRINTF("cache_meta: committed %zu ops", s->batch_ops);
+    }
+    cache_stats_since(CACHE_STAGE_SQLITE_COMMIT, s->batch_start);
+    pthread_mutex_unlock(&s->db_lock);
+    return ret;
+}
+
+static int sqlite_get_ident(cache_meta_store_t *store, const char *path, cache_file_id_t *id)
+{
+    struct sqlite_reader *r = reader_get((struct meta_sqlite *)store);
+    if (r == NULL) {
+        return -1;
+    }
+
+    sqlite3_stmt *stmt = r->select_id_stmt;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+    int ret = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        id->dev = (uint64_t)sqlite3_column_int64(stmt, 0);
+        id->ino = (uint64_t)sqlite3_column_int64(stmt, 1);
+        id->gen = (uint64_t)sqlite3_column_int64(stmt, 2);
+        ret = 0;
+    }
+    sqlite3_reset(stmt);
+    return ret;
+}
+
+static int sqlite_put_ident(cache_meta_store_t *store, const char *path, const cache_file_id_t *id)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+
+    pthread_mutex_lock(&s->db_lock);
+    sqlite3_stmt *stmt = s->insert_id_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)id->dev);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)id->ino);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)id->gen);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    pthread_mutex_unlock(&s->db_lock);
+
+    if (rc != SQLITE_DONE) {
+        DPRINTF("cache_ident_store: insert failed for %s: %s", path, sqlite3_errstr(rc));
+        return -1;
+    }
+    return 0;
+}
+
+static int sqlite_rename_ident(cache_meta_store_t *store, const char *from, const char *to)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+
+    pthread_mutex_lock(&s->db_lock);
+    sqlite3_exec(s->db, "BEGIN", NULL, NULL, NULL);
+
+    /* Whatever the target name referred to has been replaced */
+    apply_delete(s->delete_id_tree_stmt, to);
+
+    sqlite3_stmt *stmt = s->move_id_tree_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, from, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, to, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    sqlite3_exec(s->db, "COMMIT", NULL, NULL, NULL);
+    pthread_mutex_unlock(&s->db_lock);
+
+    if (rc != SQLITE_DONE) {
+        DPRINTF("cache_ident_rename: %s -> %s failed: %s", from, to, sqlite3_errstr(rc));
+        return -1;
+    }
+    return 0;
+}
+
+static int sqlite_forget_ident(cache_meta_store_t *store, const char *path)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+
+    pthread_mutex_lock(&s->db_lock);
+    apply_delete(s->delete_id_tree_stmt, path);
+    pthread_mutex_unlock(&s->db_lock);
+    return 0;
+}
+
+static void sqlite_close(cache_meta_store_t *store)
+{
+    struct meta_sqlite *s = (struct meta_sqlite *)store;
+    if (s == NULL) {
+        return;
+    }
+
+    /* Every other thread is done with the store by now */
+    if (s->reader_key_created) {
+        pthread_key_delete(s->reader_key);
+    }
+    while (s->readers != NULL) {
+        struct sqlite_reader *next = s->readers->next;
+        reader_close(s->readers);
+        s->readers = next;
+    }
+
+    sqlite3_stmt *stmts[] = {
+        s->insert_meta_stmt, s->delete_meta_stmt, s->delete_tree_stmt,
+        s->insert_dir_stmt, s->delete_dir_stmt,
+        s->insert_id_stmt, s->delete_id_tree_stmt, s->move_id_tree_stmt,
+    };
+    for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]); i++) {
+        if (stmts[i]) {
+            sqlite3_finalize(stmts[i]);
+        }
+    }
+    if (s->db) {
+        sqlite3_close(s->db);
+    }
+    pthread_mutex_destroy(&s->readers_lock);
+    pthread_mutex_destroy(&s->db_lock);
+    free(s);
+}
+
+static const cache_meta_store_ops_t sqlite_ops = {
+    .name = "sqlite",
+    .get_meta = sqlite_get_meta,
+    .get_dir = sqlite_get_dir,
+    .begin = sqlite_begin,
+    .put_meta = sqlite_put_meta,
+    .del_meta = sqlite_del_meta,
+    .del_meta_tree = sqlite_del_meta_tree,
+    .put_dir = sqlite_put_dir,
+    .del_dir = sqlite_del_dir,
+    .commit = sqlite_commit,
+    .get_ident = sqlite_get_ident,
+    .put_ident = sqlite_put_ident,
+    .rename_ident = sqlite_rename_ident,
+    .forget_ident = sqlite_forget_ident,
+    .close = sqlite_close,
+};
+
+static int create_table(struct meta_sqlite *s, const char *name, const char *sql)
+{
+    (void)name;  /* Only logged */
+    char *errmsg = NULL;
+    if (sqlite3_exec(s->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        DPRINTF("cache_meta_init: create %s table failed: %s", name, errmsg);
+        sqlite3_free(errmsg);
+        return -1;
+    }
+    return 0;
+}
+
+cache_meta_store_t *cache_meta_sqlite_open(const char *cache_root, bool debug)
+{
+    struct meta_sqlite *s = calloc(1, sizeof(struct meta_sqlite));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->base.ops = &sqlite_ops;
+    s->debug = debug;
+    pthread_mutex_init(&s->db_lock, NULL);
+    pthread_mutex_init(&s->readers_lock, NULL);
+    if (pthread_key_create(&s->reader_key, reader_destroy) != 0) {
+        sqlite_close(&s->base);
+        return NULL;
+    }
+    s->reader_key_created = true;
+
+    /* Open SQLite database */
+    char *db_path = s->db_path;
+    snprintf(db_path, PATH_MAX, "%s/%s", cache_root, META_DB_NAME);
+    fprintf(stderr, "[cache_meta_init] Opening SQLite at: %s\n", db_path);
+
+    int rc = sqlite3_open_v2(db_path, &s->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+    fprintf(stderr, "[cache_meta_init] sqlite3_open result=%d\n", rc);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "[cache_meta_init] ERROR: sqlite3_open failed: %s\n", sqlite3_errmsg(s->db));
+        DPRINTF("cache_meta_init: sqlite3_open failed: %s", sqlite3_errmsg(s->db));
+        sqlite_close(&s->base);
+        return NULL;
+    }
+    fprintf(stderr, "[cache_meta_init] SQLite opened successfully\n");
+
+    /* Enable WAL mode for better concurrency, don't wait on locks */
+    sqlite3_busy_timeout(s->db, 100);  /* 100ms timeout */
+    sqlite3_exec(s->db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    sqlite3_exec(s->db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+    sqlite3_exec(s->db, "PRAGMA temp_store=MEMORY", NULL, NULL, NULL);
+
+    /* Tables from an older schema are only a cache, so drop them:
+       version 0 metadata rows lack most of struct stat, version 1 stored
+       directory listings one row per entry and version 2 listings had no
+       attributes flag. */
+    int version = 0;
+    sqlite3_stmt *version_stmt = NULL;
+    if (sqlite3_prepare_v2(s->db, "PRAGMA user_version", -1, &version_stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(version_stmt) == SQLITE_ROW) {
+            version = sqlite3_column_int(version_stmt, 0);
+        }
+        sqlite3_finalize(version_stmt);
+    }
+    if (version < 1) {
+        sqlite3_exec(s->db, "DROP TABLE IF EXISTS metadata", NULL, NULL, NULL);
+    }
+    if (version < 2) {
+        sqlite3_exec(s->db, "DROP TABLE IF EXISTS dir_entries", NULL, NULL, NULL);
+    }
+    if (version < 3) {
+        sqlite3_exec(s->db, "DROP TABLE IF EXISTS dir_listings", NULL, NULL, NULL);
+    }
+
+    /* Create metadata table */
+    const char *create_sql =
+        "CREATE TABLE IF NOT EXISTS metadata ("
+        "  path TEXT PRIMARY KEY,"
+        "  type INTEGER,"
+        "  size INTEGER,"
+        "  mtime INTEGER,"
+        "  ctime INTEGER,"
+        "  mode INTEGER,"
+        "  uid INTEGER,"
+        "  gid INTEGER,"
+        "  ino INTEGER,"
+        "  cached_at INTEGER,"
+        "  valid_until INTEGER,"
+        "  dev INTEGER,"
+        "  nlink INTEGER,"
+        "  rdev INTEGER,"
+        "  blksize INTEGER,"
+        "  blocks INTEGER,"
+        "  atime INTEGER,"
+        "  atime_nsec INTEGER,"
+        "  mtime_nsec INTEGER,"
+        "  ctime_nsec INTEGER"
+        ")";
+
+    /* Create directory listings table, one packed row per directory */
+    const char *create_dir_sql =
+        "CREATE TABLE IF NOT EXISTS dir_listings ("
+        "  dir_path TEXT PRIMARY KEY,"
+        "  dir_mtime INTEGER,"
+        "  cached_at INTEGER,"
+        "  valid_until INTEGER,"
+        "  entry_count INTEGER,"
+        "  with_stats INTEGER,"
+        "  entries BLOB"
+        ")";
+
+    /* Path to file identity mapping. Not a cache of the backend but a
+       record of where block keys came from, so it has no TTL. */
+    const char *create_id_sql =
+        "CREATE TABLE IF NOT EXISTS file_ids ("
+        "  path TEXT PRIMARY KEY,"
+        "  dev INTEGER,"
+        "  ino INTEGER,"
+        "  gen INTEGER"
+        ")";
+
+    if (create_table(s, "metadata", create_sql) != 0 ||
+        create_table(s, "dir_listings", create_dir_sql) != 0 ||
+        create_table(s, "file_ids", create_id_sql) != 0) {
+        sqlite_close(&s->base);
+        return NULL;
+    }
+
+    if (version < META_SCHEMA_VERSION) {
+        char pragma[64];
+        snprintf(pragma, sizeof(pragma), "PRAGMA user_version=%d", META_SCHEMA_VERSION);
+        sqlite3_exec(s->db, pragma, NULL, NULL, NULL);
+    }
+
+    /* Prepare statements */
+    const char *insert_sql =
+        "INSERT OR REPLACE INTO metadata VALUES "
+        "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    sqlite3_prepare_v2(s->db, insert_sql, -1, &s->insert_meta_stmt, NULL);
+
+    const char *delete_sql = "DELETE FROM metadata WHERE path = ?";
+    sqlite3_prepare_v2(s->db, delete_sql, -1, &s->delete_meta_stmt, NULL);
+
+    /* Bounds are path + "/" and path + "0", the character after '/'.
+       The root has every path below it. */
+    const char *delete_tree_sql =
+        "DELETE FROM metadata WHERE ?1 = '/' OR path = ?1 OR (path >= ?1 || '/' AND path < ?1 || '0')";
+    sqlite3_prepare_v2(s->db, delete_tree_sql, -1, &s->delete_tree_stmt, NULL);
+
+    /* Directory cache statements */
+    const char *insert_dir_sql =
+        "INSERT OR REPLACE INTO dir_listings VALUES (?, ?, ?, ?, ?, ?, ?)";
+    sqlite3_prepare_v2(s->db, insert_dir_sql, -1, &s->insert_dir_stmt, NULL);
+
+    const char *delete_dir_sql = "DELETE FROM dir_listings WHERE dir_path = ?";
+    sqlite3_prepare_v2(s->db, delete_dir_sql, -1, &s->delete_dir_stmt, NULL);
+
+    /* File identity statements */
+    const char *insert_id_sql = "INSERT OR REPLACE INTO file_ids VALUES (?, ?, ?, ?)";
+    sqlite3_prepare_v2(s->db, insert_id_sql, -1, &s->insert_id_stmt, NULL);
+
+    const char *delete_id_tree_sql =
+        "DELETE FROM file_ids WHERE ?1 = '/' OR path = ?1 OR (path >= ?1 || '/' AND path < ?1 || '0')";
+    sqlite3_prepare_v2(s->db, delete_id_tree_sql, -1, &s->delete_id_tree_stmt, NULL);
+
+    const char *move_id_tree_sql =
+        "UPDATE file_ids SET path = ?2 || substr(path, length(?1) + 1) "
+        "WHERE path = ?1 OR (path >= ?1 || '/' AND path < ?1 || '0')";
+    sqlite3_prepare_v2(s->db, move_id_tree_sql, -1, &s->move_id_tree_stmt, NULL);
+
+    return &s->base;
+}
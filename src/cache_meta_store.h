@@ -0,0 +1,101 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_META_STORE_H
+#define CACHE_META_STORE_H
+
+#include <time.h>
+#include <stdbool.h>
+
+#include "arena.h"
+#include "cache_meta.h"
+
+/*
+ * Persistent metadata stores behind cache_meta.c.
+ *
+ * cache_meta.c keeps the in-memory table, the Bloom filters of complete
+ * directories and the write-behind queue. A store only holds the copy
+ * that survives a restart: it is read when the in-memory table misses and
+ * written in batches by the flusher thread. Each engine fills in a
+ * cache_meta_store_ops_t and embeds cache_meta_store_t as the first
+ * member of its own handle.
+ *
+ * Lookups may run in any thread at the same time as the flusher. Batch
+ * calls (begin ... commit) come from the flusher only. Identity calls may
+ * come from any thread.
+ */
+
+typedef struct cache_meta_store cache_meta_store_t;
+
+typedef struct {
+    const char *name;
+
+    /**
+     * Read a metadata entry.
+     * @return 0 if found, -1 if not
+     */
+    int (*get_meta)(cache_meta_store_t *store, const char *path, cache_meta_entry_t *entry);
+
+    /**
+     * Read a directory listing, copying its data into arena.
+     * @return 0 if found, -1 if not
+     */
+    int (*get_dir)(cache_meta_store_t *store, const char *path, struct arena *arena,
+                   cache_dir_listing_t *listing, time_t *valid_until);
+
+    /* Batch of mutations, applied atomically by commit() */
+    void (*begin)(cache_meta_store_t *store);
+    void (*put_meta)(cache_meta_store_t *store, const char *path, const cache_meta_entry_t *entry);
+    void (*del_meta)(cache_meta_store_t *store, const char *path);
+    void (*del_meta_tree)(cache_meta_store_t *store, const char *path);  /* "/" drops listings too */
+    void (*put_dir)(cache_meta_store_t *store, const char *path, const cache_dir_listing_t *listing,
+                    time_t cached_at, time_t valid_until);
+    void (*del_dir)(cache_meta_store_t *store, const char *path);
+    int (*commit)(cache_meta_store_t *store);
+
+    /* File identities, written synchronously; see cache_ident_*() */
+    int (*get_ident)(cache_meta_store_t *store, const char *path, cache_file_id_t *id);
+    int (*put_ident)(cache_meta_store_t *store, const char *path, const cache_file_id_t *id);
+    int (*rename_ident)(cache_meta_store_t *store, const char *from, const char *to);
+    int (*forget_ident)(cache_meta_store_t *store, const char *path);
+
+    void (*close)(cache_meta_store_t *store);
+} cache_meta_store_ops_t;
+
+struct cache_meta_store {
+    const cache_meta_store_ops_t *ops;
+};
+
+/**
+ * Open the SQLite store, <cache_root>/metadata.db.
+ * @param cache_root Cache directory
+ * @param debug Enable debug logging
+ * @return Store or NULL on error
+ */
+cache_meta_store_t *cache_meta_sqlite_open(const char *cache_root, bool debug);
+
+/**
+ * Open the LMDB store, <cache_root>/metadata.mdb.
+ * @param cache_root Cache directory
+ * @param debug Enable debug logging
+ * @return Store or NULL on error (also when built without LMDB)
+ */
+cache_meta_store_t *cache_meta_lmdb_open(const char *cache_root, bool debug);
+
+#endif /* CACHE_META_STORE_H */
@@ -0,0 +1,163 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_notify.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NOTIFY_MAX_QUEUED 1024
+
+struct notify_item {
+    char *path;
+    struct notify_item *next;
+};
+
+struct cache_notify {
+    cache_notify_fn fn;
+    void *arg;
+    bool debug;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct notify_item *head;
+    struct notify_item *tail;
+    size_t queued;
+    bool stop;
+    pthread_t thread;
+};
+
+static void *notify_main(void *arg)
+{
+    cache_notify_t *notify = arg;
+
+    pthread_mutex_lock(&notify->lock);
+    while (!notify->stop) {
+        struct notify_item *item = notify->head;
+        if (item == NULL) {
+            pthread_cond_wait(&notify->cond, &notify->lock);
+            continue;
+        }
+        notify->head = item->next;
+        if (notify->head == NULL) {
+            notify->tail = NULL;
+        }
+        notify->queued--;
+        pthread_mutex_unlock(&notify->lock);
+
+        if (notify->debug) {
+            DPRINTF("cache_notify: invalidating %s", item->path);
+        }
+        notify->fn(notify->arg, item->path);
+        free(item->path);
+        free(item);
+
+        pthread_mutex_lock(&notify->lock);
+    }
+    pthread_mutex_unlock(&notify->lock);
+    return NULL;
+}
+
+cache_notify_t *cache_notify_create(cache_notify_fn fn, void *arg, bool debug)
+{
+    if (fn == NULL) {
+        return NULL;
+    }
+
+    cache_notify_t *notify = calloc(1, sizeof(cache_notify_t));
+    if (notify == NULL) {
+        return NULL;
+    }
+    notify->fn = fn;
+    notify->arg = arg;
+    notify->debug = debug;
+    pthread_mutex_init(&notify->lock, NULL);
+    pthread_cond_init(&notify->cond, NULL);
+
+    if (pthread_create(&notify->thread, NULL, notify_main, notify) != 0) {
+        pthread_cond_destroy(&notify->cond);
+        pthread_mutex_destroy(&notify->lock);
+        free(notify);
+        return NULL;
+    }
+    return notify;
+}
+
+void cache_notify_push(cache_notify_t *notify, const char *path)
+{
+    if (notify == NULL || path == NULL) {
+        return;
+    }
+
+    struct notify_item *item = malloc(sizeof(struct notify_item));
+    if (item == NULL) {
+        return;
+    }
+    item->path = strdup(path);
+    item->next = NULL;
+    if (item->path == NULL) {
+        free(item);
+        return;
+    }
+
+    pthread_mutex_lock(&notify->lock);
+    /* Skip repeats of the path queued last, and drop when full */
+    if (notify->stop || notify->queued >= NOTIFY_MAX_QUEUED ||
+        (notify->tail != NULL && strcmp(notify->tail->path, path) == 0)) {
+        pthread_mutex_unlock(&notify->lock);
+        free(item->path);
+        free(item);
+        return;
+    }
+    if (notify->tail != NULL) {
+        notify->tail->next = item;
+    } else {
+        notify->head = item;
+    }
+    notify->tail = item;
+    notify->queued++;
+    pthread_cond_signal(&notify->cond);
+    pthread_mutex_unlock(&notify->lock);
+}
+
+void cache_notify_destroy(cache_notify_t *notify)
+{
+    if (notify == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&notify->lock);
+    notify->stop = true;
+    pthread_cond_signal(&notify->cond);
+    pthread_mutex_unlock(&notify->lock);
+    pthread_join(notify->thread, NULL);
+
+    while (notify->head != NULL) {
+        struct notify_item *item = notify->head;
+        notify->head = item->next;
+        free(item->path);
+        free(item);
+    }
+
+    pthread_cond_destroy(&notify->cond);
+    pthread_mutex_destroy(&notify->lock);
+    free(notify);
+}
@@ -0,0 +1,68 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_NOTIFY_H
+#define CACHE_NOTIFY_H
+
+#include <stdbool.h>
+
+/*
+ * Asynchronous kernel invalidation.
+ *
+ * Telling the kernel to drop a cached inode or entry must not happen on
+ * a thread serving a request for the same file, or the two can deadlock
+ * on kernel locks. Paths are queued here instead and a single thread
+ * hands them to the invalidation callback. If the queue is full, new
+ * paths are dropped; the kernel timeouts still bound how stale its
+ * caches can get.
+ */
+
+/* Opaque notifier handle */
+typedef struct cache_notify cache_notify_t;
+
+/**
+ * Called on the notifier thread for each queued path.
+ * @param arg Callback argument given to cache_notify_create()
+ * @param path FUSE path to invalidate
+ */
+typedef void (*cache_notify_fn)(void *arg, const char *path);
+
+/**
+ * Start the notifier thread.
+ * @param fn Invalidation callback
+ * @param arg Argument passed to the callback
+ * @param debug Enable debug logging
+ * @return Notifier handle or NULL on error
+ */
+cache_notify_t *cache_notify_create(cache_notify_fn fn, void *arg, bool debug);
+
+/**
+ * Queue a path for invalidation.
+ * @param notify Notifier handle (can be NULL)
+ * @param path FUSE path
+ */
+void cache_notify_push(cache_notify_t *notify, const char *path);
+
+/**
+ * Stop the notifier thread. Paths still queued are discarded.
+ * @param notify Notifier handle
+ */
+void cache_notify_destroy(cache_notify_t *notify);
+
+#endif /* CACHE_NOTIFY_H */
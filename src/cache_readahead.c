@@ -0,0 +1,479 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_readahead.h"
+#include "cache_io.h"
+#include "cache_stats.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define RA_MAX_QUEUED 256       /* Jobs beyond this are dropped */
+#define RA_SEQ_THRESHOLD 2      /* Sequential reads seen before readahead starts */
+#define RA_INITIAL_WINDOW 2     /* Blocks */
+#define RA_MAX_BATCH 64         /* Jobs a worker takes from the queue at once */
+
+/* Per-open-file state */
+struct cache_ra_file {
+    cache_readahead_t *ra;
+    int fd;
+    uint64_t file_key;
+    RateLimiter *limiter;       /* Of the user who opened the file */
+
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        /* Signalled when busy drops to zero */
+    int refs;                   /* Caller plus one per queued job */
+    int busy;                   /* Workers currently reading from fd */
+    bool closed;
+    uint64_t generation;        /* Bumped on seek and close to cancel jobs */
+
+    off_t last_end;             /* End of the previous read */
+    unsigned seq_count;         /* Consecutive sequential reads */
+    size_t window;              /* Current readahead window in blocks */
+    size_t next_block;          /* First block not yet scheduled */
+    size_t eof_block;           /* Block known to hold end of file */
+};
+
+/* Queued readahead of one block */
+struct ra_job {
+    cache_ra_file_t *file;
+    size_t block_idx;
+    uint64_t generation;
+    struct ra_job *next;
+};
+
+/* Worker pool */
+struct cache_readahead {
+    cache_block_ctx_t *blocks;
+    size_t block_size;
+    size_t max_window;
+    size_t batch;               /* Jobs per worker pass, as many as one I/O batch */
+    bool debug;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ra_job *head;
+    struct ra_job *tail;
+    size_t queued;
+    bool stop;
+
+    int worker_count;
+    pthread_t *workers;
+};
+
+static void file_unref(cache_ra_file_t *file)
+{
+    pthread_mutex_lock(&file->lock);
+    bool last = (--file->refs == 0);
+    pthread_mutex_unlock(&file->lock);
+
+    if (last) {
+        pthread_cond_destroy(&file->idle);
+        pthread_mutex_destroy(&file->lock);
+        free(file);
+    }
+}
+
+static bool job_cancelled_locked(struct ra_job *job)
+{
+    return job->file->closed || job->file->generation != job->generation;
+}
+
+/* Claim the fd for a job; fails if the job has been cancelled */
+static bool job_begin(struct ra_job *job)
+{
+    cache_ra_file_t *file = job->file;
+    pthread_mutex_lock(&file->lock);
+    bool ok = !job_cancelled_locked(job);
+    if (ok) {
+        file->busy++;
+    }
+    pthread_mutex_unlock(&file->lock);
+    return ok;
+}
+
+/* Release the fd; returns false if the job was cancelled meanwhile */
+static bool job_end(struct ra_job *job, bool eof)
+{
+    cache_ra_file_t *file = job->file;
+    pthread_mutex_lock(&file->lock);
+    if (eof && job->block_idx < file->eof_block) {
+        file->eof_block = job->block_idx;
+    }
+    bool ok = !job_cancelled_locked(job);
+    if (--file->busy == 0) {
+        pthread_cond_broadcast(&file->idle);
+    }
+    pthread_mutex_unlock(&file->lock);
+    return ok;
+}
+
+/* A claimed job of a worker pass */
+struct ra_fetch {
+    struct ra_job *job;
+    cache_block_fill_t fill;
+};
+
+/* Fetch the blocks of a batch of jobs with one I/O batch */
+static void run_jobs(cache_readahead_t *ra, struct ra_job **jobs, size_t count,
+                     char *bufs, struct ra_fetch *fetches, cache_io_op_t *ops)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct ra_job *job = jobs[i];
+        cache_ra_file_t *file = job->file;
+        if (cache_block_exists(ra->blocks, file->file_key, job->block_idx)) {
+            continue;
+        }
+        /* Skip blocks a reader is fetching already; waiting here while
+           holding claims on the others could only delay them */
+        if (!cache_block_fill_try(ra->blocks, file->file_key, job->block_idx, &fetches[n].fill)) {
+            continue;
+        }
+        fetches[n].job = job;
+        n++;
+    }
+
+    size_t claimed = 0;
+    for (size_t i = 0; i < n; i++) {
+        cache_ra_file_t *file = fetches[i].job->file;
+        if (!job_begin(fetches[i].job)) {
+            cache_block_fill_end(&fetches[i].fill, NULL, 0, false);
+            continue;
+        }
+        fetches[claimed] = fetches[i];
+        ops[claimed] = (cache_io_op_t){
+            .fd = file->fd,
+            .write = false,
+            .buf = bufs + claimed * ra->block_size,
+            .len = ra->block_size,
+            .offset = (off_t)fetches[i].job->block_idx * ra->block_size,
+        };
+        claimed++;
+    }
+    if (claimed == 0) {
+        return;
+    }
+
+    uint64_t start = cache_stats_now();
+    cache_io_run(ops, claimed);
+    cache_stats_since(CACHE_STAGE_BACKEND_READ, start);
+
+    for (size_t i = 0; i < claimed; i++) {
+        struct ra_job *job = fetches[i].job;
+        ssize_t got = ops[i].res;
+        if (got > 0) {
+            cache_stats_add(CACHE_CTR_BACKEND_READ_BYTES, got);
+        }
+        bool eof = (got >= 0 && (size_t)got < ra->block_size);
+        if (!job_end(job, eof) || got <= 0) {
+            cache_block_fill_end(&fetches[i].fill, NULL, 0, false);
+            continue;
+        }
+
+        cache_block_fill_end(&fetches[i].fill, ops[i].buf, got, eof);
+        if (ra->debug) {
+            DPRINTF("readahead: fetched block %016" PRIx64 "-%zu (%zd bytes)",
+                    job->file->file_key, job->block_idx, got);
+        }
+    }
+
+    /* Charged for what the backend returned, once the jobs are ended so
+       that closing a file doesn't wait out the throttling. Jobs keep a
+       reference to their file. */
+    for (size_t i = 0; i < claimed; i++) {
+        RateLimiter *limiter = fetches[i].job->file->limiter;
+        if (limiter != NULL && ops[i].res > 0) {
+            rate_limiter_wait(limiter, ops[i].res);
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    cache_readahead_t *ra = arg;
+    char *bufs = malloc(ra->batch * ra->block_size);
+    struct ra_job **jobs = calloc(ra->batch, sizeof(struct ra_job *));
+    struct ra_fetch *fetches = calloc(ra->batch, sizeof(struct ra_fetch));
+    cache_io_op_t *ops = calloc(ra->batch, sizeof(cache_io_op_t));
+    if (bufs == NULL || jobs == NULL || fetches == NULL || ops == NULL) {
+        goto out;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop) {
+        if (ra->head == NULL) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        size_t count = 0;
+        while (ra->head != NULL && count < ra->batch) {
+            jobs[count++] = ra->head;
+            ra->head = ra->head->next;
+            ra->queued--;
+        }
+        if (ra->head == NULL) {
+            ra->tail = NULL;
+        }
+        pthread_mutex_unlock(&ra->lock);
+
+        run_jobs(ra, jobs, count, bufs, fetches, ops);
+        for (size_t i = 0; i < count; i++) {
+            file_unref(jobs[i]->file);
+            free(jobs[i]);
+        }
+
+        pthread_mutex_lock(&ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+out:
+    free(bufs);
+    free(jobs);
+    free(fetches);
+    free(ops);
+    return NULL;
+}
+
+cache_readahead_t *cache_readahead_create(cache_block_ctx_t *blocks,
+                                          size_t block_size,
+                                          int workers,
+                                          size_t max_window,
+                                          bool debug)
+{
+    if (blocks == NULL || block_size == 0 || workers <= 0 || max_window == 0) {
+        return NULL;
+    }
+
+    cache_readahead_t *ra = calloc(1, sizeof(cache_readahead_t));
+    if (ra == NULL) {
+        return NULL;
+    }
+    ra->blocks = blocks;
+    ra->block_size = block_size;
+    ra->max_window = max_window;
+    /* A worker with io_uring keeps a whole window in flight */
+    ra->batch = cache_io_batch_size();
+    if (ra->batch > max_window) {
+        ra->batch = max_window;
+    }
+    if (ra->batch > RA_MAX_BATCH) {
+        ra->batch = RA_MAX_BATCH;
+    }
+    if (ra->batch == 0) {
+        ra->batch = 1;
+    }
+    ra->debug = debug;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    ra->workers = calloc(workers, sizeof(pthread_t));
+    if (ra->workers == NULL) {
+        cache_readahead_destroy(ra);
+        return NULL;
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&ra->workers[i], NULL, worker_main, ra) != 0) {
+            break;
+        }
+        ra->worker_count++;
+    }
+    if (ra->worker_count == 0) {
+        cache_readahead_destroy(ra);
+        return NULL;
+    }
+
+    if (debug) {
+        DPRINTF("cache_readahead_create: %d workers, window up to %zu blocks",
+                ra->worker_count, max_window);
+    }
+    return ra;
+}
+
+cache_ra_file_t *cache_ra_file_open(cache_readahead_t *ra, int fd, uint64_t file_key,
+                                    RateLimiter *limiter)
+{
+    if (ra == NULL || file_key == 0) {
+        return NULL;
+    }
+
+    cache_ra_file_t *file = calloc(1, sizeof(cache_ra_file_t));
+    if (file == NULL) {
+        return NULL;
+    }
+    file->ra = ra;
+    file->fd = fd;
+    file->file_key = file_key;
+    file->limiter = limiter;
+    file->refs = 1;
+    file->last_end = -1;
+    file->eof_block = SIZE_MAX;
+    pthread_mutex_init(&file->lock, NULL);
+    pthread_cond_init(&file->idle, NULL);
+    return file;
+}
+
+void cache_ra_file_access(cache_ra_file_t *file, off_t offset, size_t size)
+{
+    if (file == NULL || size == 0) {
+        return;
+    }
+
+    cache_readahead_t *ra = file->ra;
+    off_t bs = (off_t)ra->block_size;
+    struct ra_job *jobs = NULL;
+    struct ra_job *last_job = NULL;
+    size_t job_count = 0;
+
+    pthread_mutex_lock(&file->lock);
+
+    /* Concurrent kernel reads may arrive slightly out of order, so reads
+       within a block of the previous end still count as sequential. */
+    if (file->last_end >= 0 && offset >= file->last_end - bs && offset <= file->last_end + bs) {
+        file->seq_count++;
+        if (offset + (off_t)size > file->last_end) {
+            file->last_end = offset + size;
+        }
+    } else {
+        /* Seek: cancel what was queued and start over */
+        file->generation++;
+        file->seq_count = 0;
+        file->window = 0;
+        file->next_block = 0;
+        file->last_end = offset + size;
+    }
+
+    if (!file->closed && file->seq_count >= RA_SEQ_THRESHOLD) {
+        size_t cur = (offset + size - 1) / bs;
+
+        /* Ramp up once the stream has consumed half of the window */
+        if (file->next_block <= cur + file->window / 2 + 1) {
+            if (file->window == 0) {
+                file->window = RA_INITIAL_WINDOW;
+            } else if (file->window * 2 <= ra->max_window) {
+                file->window *= 2;
+            } else {
+                file->window = ra->max_window;
+            }
+        }
+
+        size_t start = file->next_block > cur + 1 ? file->next_block : cur + 1;
+        size_t end = cur + file->window;
+        if (end > file->eof_block) {
+            end = file->eof_block;
+        }
+
+        for (size_t b = start; b <= end; b++) {
+            struct ra_job *job = malloc(sizeof(struct ra_job));
+            if (job == NULL) {
+                break;
+            }
+            job->file = file;
+            job->block_idx = b;
+            job->generation = file->generation;
+            job->next = NULL;
+            if (last_job != NULL) {
+                last_job->next = job;
+            } else {
+                jobs = job;
+            }
+            last_job = job;
+            file->refs++;
+            file->next_block = b + 1;
+            job_count++;
+        }
+    }
+
+    pthread_mutex_unlock(&file->lock);
+
+    if (jobs == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    if (ra->stop || ra->queued + job_count > RA_MAX_QUEUED) {
+        pthread_mutex_unlock(&ra->lock);
+        /* Queue full: drop these and let them be fetched on demand */
+        while (jobs != NULL) {
+            struct ra_job *next = jobs->next;
+            file_unref(jobs->file);
+            free(jobs);
+            jobs = next;
+        }
+        return;
+    }
+    if (ra->tail != NULL) {
+        ra->tail->next = jobs;
+    } else {
+        ra->head = jobs;
+    }
+    ra->tail = last_job;
+    ra->queued += job_count;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void cache_ra_file_release(cache_ra_file_t *file)
+{
+    if (file == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    file->closed = true;
+    file->generation++;
+    while (file->busy > 0) {
+        pthread_cond_wait(&file->idle, &file->lock);
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    file_unref(file);
+}
+
+void cache_readahead_destroy(cache_readahead_t *ra)
+{
+    if (ra == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    for (int i = 0; i < ra->worker_count; i++) {
+        pthread_join(ra->workers[i], NULL);
+    }
+    free(ra->workers);
+
+    while (ra->head != NULL) {
+        struct ra_job *job = ra->head;
+        ra->head = job->next;
+        file_unref(job->file);
+        free(job);
+    }
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
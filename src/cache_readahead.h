@@ -0,0 +1,96 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_READAHEAD_H
+#define CACHE_READAHEAD_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cache_block.h"
+#include "rate_limiter.h"
+
+/*
+ * Sequential-access detection and asynchronous readahead.
+ *
+ * Every open file gets a cache_ra_file_t that tracks where the previous
+ * read ended. Once reads are seen to follow each other, a pool of worker
+ * threads fetches the next blocks from the backend into the block cache.
+ * The window starts small and doubles while the stream stays sequential.
+ * A seek or close cancels everything still queued for the file.
+ *
+ * Workers read through the caller's backend fd. Releasing a file waits
+ * for any read in progress, after which the caller may close the fd.
+ */
+
+/* Opaque readahead pool handle */
+typedef struct cache_readahead cache_readahead_t;
+
+/* Opaque per-open-file readahead state */
+typedef struct cache_ra_file cache_ra_file_t;
+
+/**
+ * Start the readahead worker pool.
+ * @param blocks Block cache to fill
+ * @param block_size Block size in bytes
+ * @param workers Number of worker threads
+ * @param max_window Maximum number of blocks to read ahead of a stream
+ * @param debug Enable debug logging
+ * @return Pool handle or NULL on error
+ */
+cache_readahead_t *cache_readahead_create(cache_block_ctx_t *blocks,
+                                          size_t block_size,
+                                          int workers,
+                                          size_t max_window,
+                                          bool debug);
+
+/**
+ * Start tracking an open file.
+ * @param ra Pool handle
+ * @param fd Backend file descriptor, kept open until the file is released
+ * @param file_key Block cache key of the file
+ * @param limiter Rate limiter charged for blocks fetched from the backend (can be NULL)
+ * @return Readahead file or NULL on error
+ */
+cache_ra_file_t *cache_ra_file_open(cache_readahead_t *ra, int fd, uint64_t file_key,
+                                    RateLimiter *limiter);
+
+/**
+ * Record a read and schedule readahead if the file is read sequentially.
+ * @param file Readahead file
+ * @param offset File offset of the read
+ * @param size Number of bytes read
+ */
+void cache_ra_file_access(cache_ra_file_t *file, off_t offset, size_t size);
+
+/**
+ * Cancel outstanding readahead and drop the caller's reference. Returns
+ * once no worker is using the fd any more.
+ * @param file Readahead file
+ */
+void cache_ra_file_release(cache_ra_file_t *file);
+
+/**
+ * Stop the worker pool. Queued readahead is discarded.
+ * @param ra Pool handle
+ */
+void cache_readahead_destroy(cache_readahead_t *ra);
+
+#endif /* CACHE_READAHEAD_H */
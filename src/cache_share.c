@@ -0,0 +1,1132 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_share.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SHARE_MAX_DATA (64 * 1024 * 1024)   /* Largest payload of one message */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  /* libfuse ignores SIGPIPE anyway */
+#endif
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+enum share_op {
+    SHARE_HELLO = 1,            /* arg0 = block size */
+    SHARE_EXISTS,               /* arg0 = block */
+    SHARE_READ,                 /* arg0 = block, arg1 = size, arg2 = offset */
+    SHARE_PIN,                  /* arg0 = block, arg1 = size, arg2 = offset */
+    SHARE_WRITE,                /* arg0 = block, arg1 = offset, arg2 = eof; data */
+    SHARE_FILL,                 /* arg0 = block, arg1 = wait */
+    SHARE_FILL_END,             /* arg0 = claim, arg1 = have data, arg2 = eof; data */
+    SHARE_UPDATE,               /* arg0 = offset, arg1 = size */
+    SHARE_UPDATE_END,           /* arg0 = claim, arg1 = written, arg2 = file size,
+                                   arg3 = have data; data */
+    SHARE_INVALIDATE_RANGE,     /* arg0 = offset, arg1 = size */
+    SHARE_INVALIDATE_FILE,
+    SHARE_INVALIDATE_ALL,
+    SHARE_CLONE,                /* key = source, arg0 = source offset, arg1 = destination
+                                   key, arg2 = destination offset, arg3 = length,
+                                   arg4 = destination size */
+    SHARE_SET_PINNED,           /* arg0 = pinned */
+    SHARE_GET_PINNED,
+    SHARE_STATS
+};
+
+/* Request, or reply with the result in arg[0] and outputs after it,
+   followed by len bytes of data */
+struct share_msg {
+    uint32_t op;
+    uint32_t len;
+    uint64_t key;
+    int64_t arg[5];
+};
+
+/* Send a message and its data, with fd passed along unless it is -1 */
+static int send_msg(int sock, const struct share_msg *msg, const void *data, int fd)
+{
+    struct iovec iov[2] = {
+        { (void *)msg, sizeof(*msg) },
+        { (void *)data, data != NULL ? msg->len : 0 },
+    };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    if (fd != -1) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    /* The descriptor goes with the first bytes; the rest may take more sends */
+    while (mh.msg_iovlen > 0) {
+        ssize_t n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        mh.msg_control = NULL;
+        mh.msg_controllen = 0;
+        while (mh.msg_iovlen > 0 && (size_t)n >= mh.msg_iov[0].iov_len) {
+            n -= mh.msg_iov[0].iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0) {
+            mh.msg_iov[0].iov_base = (char *)mh.msg_iov[0].iov_base + n;
+            mh.msg_iov[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Receive a message header, and the descriptor sent with it if fd_out
+   is not NULL (else -1 there) */
+static int recv_msg(int sock, struct share_msg *msg, int *fd_out)
+{
+    if (fd_out == NULL) {
+        return recv_all(sock, msg, sizeof(*msg));
+    }
+
+    *fd_out = -1;
+    struct iovec iov = { msg, sizeof(*msg) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd_out, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+    if (recv_all(sock, (char *)msg + n, sizeof(*msg) - n) != 0) {
+        if (*fd_out != -1) {
+            close(*fd_out);
+            *fd_out = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* ---- Owner side ---- */
+
+/* A fill or update the owner holds for a peer connection */
+struct share_claim {
+    bool used;
+    bool update;
+    cache_block_fill_t fill;
+    cache_block_update_t upd;
+};
+
+struct share_conn {
+    cache_share_server_t *server;
+    int fd;
+    pthread_t thread;
+    atomic_bool done;
+    struct share_claim *claims;
+    size_t claim_count;
+    char *buf;                  /* Request and reply data */
+    size_t buf_size;
+    struct share_conn *next;
+};
+
+struct cache_share_server {
+    char *path;
+    cache_block_ctx_t *blocks;
+    size_t block_size;
+    bool debug;
+    int listen_fd;
+    int stop_pipe[2];
+    pthread_t thread;
+    pthread_mutex_t lock;       /* Guards conns */
+    struct share_conn *conns;
+};
+
+static char *conn_buf(struct share_conn *conn, size_t size)
+{
+    if (size > conn->buf_size) {
+        char *buf = realloc(conn->buf, size);
+        if (buf == NULL) {
+            return NULL;
+        }
+        conn->buf = buf;
+        conn->buf_size = size;
+    }
+    return conn->buf;
+}
+
+static struct share_claim *claim_alloc(struct share_conn *conn, size_t *slot_out)
+{
+    size_t slot;
+    for (slot = 0; slot < conn->claim_count; slot++) {
+        if (!conn->claims[slot].used) {
+            break;
+        }
+    }
+    if (slot == conn->claim_count) {
+        size_t count = conn->claim_count > 0 ? conn->claim_count * 2 : 8;
+        struct share_claim *claims = realloc(conn->claims, count * sizeof(*claims));
+        if (claims == NULL) {
+            return NULL;
+        }
+        memset(claims + conn->claim_count, 0, (count - conn->claim_count) * sizeof(*claims));
+        conn->claims = claims;
+        conn->claim_count = count;
+    }
+    *slot_out = slot;
+    return &conn->claims[slot];
+}
+
+static struct share_claim *claim_get(struct share_conn *conn, int64_t slot, bool update)
+{
+    if (slot < 0 || (size_t)slot >= conn->claim_count || !conn->claims[slot].used ||
+        conn->claims[slot].update != update) {
+        return NULL;
+    }
+    return &conn->claims[slot];
+}
+
+/* The peer went away: what it was fetching is given up, and what it may
+   have written is invalidated */
+static void release_claims(struct share_conn *conn)
+{
+    for (size_t i = 0; i < conn->claim_count; i++) {
+        struct share_claim *c = &conn->claims[i];
+        if (!c->used) {
+            continue;
+        }
+        if (c->update) {
+            cache_block_update_end(&c->upd, NULL, c->upd.size, -1);
+        } else {
+            cache_block_fill_end(&c->fill, NULL, 0, false);
+        }
+        c->used = false;
+    }
+}
+
+/* Handle one request; returns -1 if the connection should be dropped */
+static int serve_request(struct share_conn *conn, struct share_msg *req)
+{
+    cache_share_server_t *server = conn->server;
+    cache_block_ctx_t *blocks = server->blocks;
+    size_t bs = server->block_size;
+    struct share_msg reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.op = req->op;
+
+    if (req->len > SHARE_MAX_DATA) {
+        return -1;
+    }
+    char *data = conn_buf(conn, req->len > bs ? req->len : bs);
+    if (data == NULL || recv_all(conn->fd, data, req->len) != 0) {
+        return -1;
+    }
+
+    int64_t *a = req->arg;
+    const char *out = NULL;
+    int out_fd = -1;
+    cache_block_pin_t pin;
+    bool pinned = false;
+
+    switch (req->op) {
+    case SHARE_HELLO:
+        reply.arg[0] = (size_t)a[0] == bs ? 0 : -1;
+        reply.arg[1] = bs;
+        break;
+    case SHARE_EXISTS:
+        reply.arg[0] = cache_block_exists(blocks, req->key, a[0]);
+        break;
+    case SHARE_READ:
+        if (a[1] < 0 || (size_t)a[1] > bs || a[2] < 0) {
+            reply.arg[0] = -1;
+            break;
+        }
+        reply.arg[0] = cache_block_read(blocks, req->key, a[0], data, a[1], a[2]);
+        if (reply.arg[0] > 0) {
+            reply.len = reply.arg[0];
+            out = data;
+        }
+        break;
+    case SHARE_PIN: {
+        size_t size = a[1];
+        reply.arg[0] = -1;
+        if (a[1] >= 0 && a[2] >= 0 &&
+            cache_block_pin(blocks, req->key, a[0], a[2], &size, &pin) == 0) {
+            pinned = true;
+            out_fd = pin.fd;
+            reply.arg[0] = 0;
+            reply.arg[1] = size;
+            reply.arg[2] = pin.pos;
+        }
+        break;
+    }
+    case SHARE_WRITE:
+        reply.arg[0] = a[1] < 0 ? -1 :
+            cache_block_write(blocks, req->key, a[0], data, req->len, a[1], a[2] != 0);
+        break;
+    case SHARE_FILL: {
+        size_t slot;
+        struct share_claim *c = claim_alloc(conn, &slot);
+        if (c == NULL) {
+            reply.arg[0] = -1;
+        } else if (a[1] ? cache_block_fill_begin(blocks, req->key, a[0], &c->fill) :
+                          cache_block_fill_try(blocks, req->key, a[0], &c->fill)) {
+            c->used = true;
+            c->update = false;
+            reply.arg[0] = 1;
+            reply.arg[1] = slot;
+        }
+        break;
+    }
+    case SHARE_FILL_END: {
+        struct share_claim *c = claim_get(conn, a[0], false);
+        if (c == NULL) {
+            reply.arg[0] = -1;
+            break;
+        }
+        reply.arg[0] = cache_block_fill_end(&c->fill, a[1] ? data : NULL, req->len, a[2] != 0);
+        c->used = false;
+        break;
+    }
+    case SHARE_UPDATE: {
+        size_t slot;
+        struct share_claim *c = claim_alloc(conn, &slot);
+        if (c == NULL || a[1] <= 0 ||
+            cache_block_update_begin(blocks, req->key, a[0], a[1], &c->upd) != 0) {
+            reply.arg[0] = -1;
+            break;
+        }
+        c->used = true;
+        c->update = true;
+        reply.arg[1] = slot;
+        break;
+    }
+    case SHARE_UPDATE_END: {
+        struct share_claim *c = claim_get(conn, a[0], true);
+        if (c == NULL) {
+            reply.arg[0] = -1;
+            break;
+        }
+        /* The data can't be shorter than what the backend took */
+        bool have_data = a[3] != 0 && a[1] > 0 && (uint64_t)a[1] <= req->len;
+        reply.arg[0] = cache_block_update_end(&c->upd, have_data ? data : NULL, a[1], a[2]);
+        c->used = false;
+        break;
+    }
+    case SHARE_INVALIDATE_RANGE:
+        reply.arg[0] = a[1] < 0 ? -1 : cache_block_invalidate_range(blocks, req->key, a[0], a[1]);
+        break;
+    case SHARE_INVALIDATE_FILE:
+        reply.arg[0] = cache_block_invalidate_file(blocks, req->key);
+        break;
+    case SHARE_INVALIDATE_ALL:
+        reply.arg[0] = cache_block_invalidate_all(blocks);
+        break;
+    case SHARE_CLONE:
+        reply.arg[0] = a[3] < 0 ? 0 :
+            cache_block_clone_range(blocks, req->key, a[0], a[1], a[2], a[3], a[4]);
+        break;
+    case SHARE_SET_PINNED:
+        reply.arg[0] = cache_block_set_pinned(blocks, req->key, a[0] != 0);
+        break;
+    case SHARE_GET_PINNED: {
+        size_t pinned_size = 0, files = 0;
+        cache_block_get_pinned(blocks, &pinned_size, &files);
+        reply.arg[1] = pinned_size;
+        reply.arg[2] = files;
+        break;
+    }
+    case SHARE_STATS: {
+        size_t current = 0, max = 0;
+        cache_block_get_stats(blocks, &current, &max);
+        reply.arg[1] = current;
+        reply.arg[2] = max;
+        break;
+    }
+    default:
+        DPRINTF("cache_share: unknown request %" PRIu32 " from a peer", req->op);
+        return -1;
+    }
+
+    int ret = send_msg(conn->fd, &reply, out, out_fd);
+    if (pinned) {
+        /* The peer holds the file open through its copy of the fd */
+        cache_block_unpin(blocks, &pin);
+    }
+    return ret;
+}
+
+static void *conn_main(void *arg)
+{
+    struct share_conn *conn = arg;
+    struct share_msg req;
+
+    while (recv_msg(conn->fd, &req, NULL) == 0) {
+        if (serve_request(conn, &req) != 0) {
+            break;
+        }
+    }
+
+    release_claims(conn);
+    if (conn->server->debug) {
+        DPRINTF("cache_share: peer connection %d closed", conn->fd);
+    }
+    atomic_store(&conn->done, true);
+    return NULL;
+}
+
+static void conn_free(struct share_conn *conn)
+{
+    pthread_join(conn->thread, NULL);
+    close(conn->fd);
+    free(conn->claims);
+    free(conn->buf);
+    free(conn);
+}
+
+/* Join the threads of connections that peers have closed */
+static void reap_conns(cache_share_server_t *server)
+{
+    pthread_mutex_lock(&server->lock);
+    struct share_conn **pp = &server->conns;
+    while (*pp != NULL) {
+        struct share_conn *conn = *pp;
+        if (atomic_load(&conn->done)) {
+            *pp = conn->next;
+            conn_free(conn);
+        } else {
+            pp = &conn->next;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void *server_main(void *arg)
+{
+    cache_share_server_t *server = arg;
+    struct pollfd fds[2] = {
+        { server->listen_fd, POLLIN, 0 },
+        { server->stop_pipe[0], POLLIN, 0 },
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        reap_conns(server);
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct share_conn *conn = calloc(1, sizeof(struct share_conn));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->server = server;
+        conn->fd = fd;
+        if (pthread_create(&conn->thread, NULL, conn_main, conn) != 0) {
+            DPRINTF("cache_share: cannot start a thread for a peer connection");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_mutex_lock(&server->lock);
+        conn->next = server->conns;
+        server->conns = conn;
+        pthread_mutex_unlock(&server->lock);
+    }
+    return NULL;
+}
+
+cache_share_server_t *cache_share_serve(const char *socket_path,
+                                        cache_block_ctx_t *blocks,
+                                        size_t block_size,
+                                        bool debug)
+{
+    struct sockaddr_un addr;
+    if (socket_path == NULL || blocks == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    cache_share_server_t *server = calloc(1, sizeof(cache_share_server_t));
+    if (server == NULL) {
+        return NULL;
+    }
+    server->blocks = blocks;
+    server->block_size = block_size;
+    server->debug = debug;
+    server->listen_fd = -1;
+    server->stop_pipe[0] = server->stop_pipe[1] = -1;
+    pthread_mutex_init(&server->lock, NULL);
+    server->path = strdup(socket_path);
+    if (server->path == NULL) {
+        goto error;
+    }
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd == -1) {
+        goto error;
+    }
+    fcntl(server->listen_fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);  /* Left by an owner that crashed; we hold the lock now */
+    if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        chmod(socket_path, 0600) == -1 ||
+        listen(server->listen_fd, 64) == -1) {
+        DPRINTF("cache_share_serve: cannot listen on %s: %s", socket_path, strerror(errno));
+        goto error;
+    }
+
+    if (pipe(server->stop_pipe) == -1) {
+        goto error;
+    }
+    if (pthread_create(&server->thread, NULL, server_main, server) != 0) {
+        goto error;
+    }
+
+    if (debug) {
+        DPRINTF("cache_share_serve: serving the block store on %s", socket_path);
+    }
+    return server;
+
+error:
+    if (server->listen_fd != -1) {
+        close(server->listen_fd);
+        unlink(socket_path);
+    }
+    if (server->stop_pipe[0] != -1) {
+        close(server->stop_pipe[0]);
+        close(server->stop_pipe[1]);
+    }
+    pthread_mutex_destroy(&server->lock);
+    free(server->path);
+    free(server);
+    return NULL;
+}
+
+void cache_share_server_stop(cache_share_server_t *server)
+{
+    if (server == NULL) {
+        return;
+    }
+
+    if (write(server->stop_pipe[1], "x", 1) != 1) {
+        DPRINTF("cache_share_server_stop: %s", strerror(errno));
+    }
+    pthread_join(server->thread, NULL);
+    close(server->stop_pipe[0]);
+    close(server->stop_pipe[1]);
+    close(server->listen_fd);
+    unlink(server->path);
+
+    /* Wake every connection thread; each releases its claims on the way out */
+    pthread_mutex_lock(&server->lock);
+    for (struct share_conn *conn = server->conns; conn != NULL; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    while (server->conns != NULL) {
+        struct share_conn *conn = server->conns;
+        server->conns = conn->next;
+        conn_free(conn);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_mutex_destroy(&server->lock);
+    free(server->path);
+    free(server);
+}
+
+/* ---- Peer side ---- */
+
+/* A thread's connection to the owner */
+struct peer_conn {
+    cache_share_peer_t *peer;
+    int fd;
+    uint32_t serial;            /* Tells claims of earlier connections apart */
+    struct peer_conn *prev;
+    struct peer_conn *next;
+};
+
+struct cache_share_peer {
+    char *path;
+    size_t block_size;
+    bool debug;
+    pthread_key_t conn_key;     /* Connection of the calling thread */
+    pthread_mutex_t lock;       /* Guards conns */
+    struct peer_conn *conns;
+    atomic_uint_fast32_t serial;
+    atomic_bool orphaned;
+    atomic_bool rejected;
+};
+
+static void peer_conn_close(struct peer_conn *conn)
+{
+    cache_share_peer_t *peer = conn->peer;
+    pthread_mutex_lock(&peer->lock);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        peer->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&peer->lock);
+    close(conn->fd);
+    free(conn);
+}
+
+/* Thread exit */
+static void peer_conn_release(void *arg)
+{
+    peer_conn_close(arg);
+}
+
+/* The connection of the calling thread, made if it has none */
+static struct peer_conn *peer_conn_get(cache_share_peer_t *peer)
+{
+    struct peer_conn *conn = pthread_getspecific(peer->conn_key);
+    if (conn != NULL) {
+        return conn;
+    }
+    if (atomic_load(&peer->rejected)) {
+        return NULL;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, peer->path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (!atomic_exchange(&peer->orphaned, true) && peer->debug) {
+            DPRINTF("cache_share: cannot reach the owner at %s: %s", peer->path, strerror(errno));
+        }
+        close(fd);
+        return NULL;
+    }
+
+    struct share_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = SHARE_HELLO;
+    msg.arg[0] = peer->block_size;
+    if (send_msg(fd, &msg, NULL, -1) != 0 || recv_msg(fd, &msg, NULL) != 0) {
+        atomic_store(&peer->orphaned, true);
+        close(fd);
+        return NULL;
+    }
+    if (msg.arg[0] != 0) {
+        if (!atomic_exchange(&peer->rejected, true)) {
+            DPRINTF("cache_share: the owner at %s uses blocks of %" PRId64 " bytes, not %zu; "
+                    "not sharing its store", peer->path, msg.arg[1], peer->block_size);
+        }
+        close(fd);
+        return NULL;
+    }
+
+    conn = calloc(1, sizeof(struct peer_conn));
+    if (conn == NULL) {
+        close(fd);
+        return NULL;
+    }
+    conn->peer = peer;
+    conn->fd = fd;
+    conn->serial = atomic_fetch_add(&peer->serial, 1) + 1;
+    pthread_mutex_lock(&peer->lock);
+    conn->next = peer->conns;
+    if (peer->conns != NULL) {
+        peer->conns->prev = conn;
+    }
+    peer->conns = conn;
+    pthread_mutex_unlock(&peer->lock);
+    pthread_setspecific(peer->conn_key, conn);
+    atomic_store(&peer->orphaned, false);
+    return conn;
+}
+
+/* Give up on the calling thread's connection; the owner releases its claims */
+static void peer_conn_drop(cache_share_peer_t *peer, struct peer_conn *conn)
+{
+    pthread_setspecific(peer->conn_key, NULL);
+    peer_conn_close(conn);
+    atomic_store(&peer->orphaned, true);
+}
+
+/* Send a request and wait for its reply. Reply data goes to out, which
+   must hold out_size bytes; a passed descriptor to fd_out. Returns -1
+   if the owner could not be reached. */
+static int peer_call(cache_share_peer_t *peer,
+                     struct peer_conn **conn_out,
+                     struct share_msg *msg,
+                     const void *data,
+                     char *out,
+                     size_t out_size,
+                     int *fd_out)
+{
+    struct peer_conn *conn = peer_conn_get(peer);
+    if (conn_out != NULL) {
+        *conn_out = conn;
+    }
+    if (conn == NULL) {
+        return -1;
+    }
+
+    uint32_t op = msg->op;
+    if (data == NULL) {
+        msg->len = 0;
+    }
+    if (send_msg(conn->fd, msg, data, -1) != 0 || recv_msg(conn->fd, msg, fd_out) != 0 ||
+        msg->op != op || msg->len > out_size || recv_all(conn->fd, out, msg->len) != 0) {
+        if (fd_out != NULL && *fd_out != -1) {
+            close(*fd_out);
+            *fd_out = -1;
+        }
+        if (peer->debug) {
+            DPRINTF("cache_share: lost the connection to the owner at %s", peer->path);
+        }
+        peer_conn_drop(peer, conn);
+        if (conn_out != NULL) {
+            *conn_out = NULL;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void share_msg_init(struct share_msg *msg, uint32_t op, uint64_t key)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->op = op;
+    msg->key = key;
+}
+
+cache_share_peer_t *cache_share_peer_create(const char *socket_path,
+                                            size_t block_size,
+                                            bool debug)
+{
+    struct sockaddr_un addr;
+    if (socket_path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    cache_share_peer_t *peer = calloc(1, sizeof(cache_share_peer_t));
+    if (peer == NULL) {
+        return NULL;
+    }
+    peer->path = strdup(socket_path);
+    if (peer->path == NULL || pthread_key_create(&peer->conn_key, peer_conn_release) != 0) {
+        free(peer->path);
+        free(peer);
+        return NULL;
+    }
+    peer->block_size = block_size;
+    peer->debug = debug;
+    pthread_mutex_init(&peer->lock, NULL);
+    return peer;
+}
+
+void cache_share_peer_destroy(cache_share_peer_t *peer)
+{
+    if (peer == NULL) {
+        return;
+    }
+
+    /* Other threads' connections go with them; no destructor runs after this */
+    pthread_key_delete(peer->conn_key);
+    pthread_mutex_lock(&peer->lock);
+    while (peer->conns != NULL) {
+        struct peer_conn *conn = peer->conns;
+        peer->conns = conn->next;
+        close(conn->fd);
+        free(conn);
+    }
+    pthread_mutex_unlock(&peer->lock);
+    pthread_mutex_destroy(&peer->lock);
+    free(peer->path);
+    free(peer);
+}
+
+bool cache_share_peer_orphaned(cache_share_peer_t *peer)
+{
+    return peer != NULL && atomic_load(&peer->orphaned);
+}
+
+bool cache_share_peer_rejected(cache_share_peer_t *peer)
+{
+    return peer != NULL && atomic_load(&peer->rejected);
+}
+
+bool cache_share_exists(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_EXISTS, file_key);
+    msg.arg[0] = block_idx;
+    return peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) == 0 && msg.arg[0] > 0;
+}
+
+ssize_t cache_share_read(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                         char *buf, size_t size, size_t offset)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_READ, file_key);
+    msg.arg[0] = block_idx;
+    msg.arg[1] = size;
+    msg.arg[2] = offset;
+    if (peer_call(peer, NULL, &msg, NULL, buf, size, NULL) != 0 || msg.arg[0] < 0 ||
+        (uint64_t)msg.arg[0] != msg.len) {
+        return -1;
+    }
+    return msg.arg[0];
+}
+
+int cache_share_pin(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                    size_t offset, size_t *size, cache_block_pin_t *pin)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_PIN, file_key);
+    msg.arg[0] = block_idx;
+    msg.arg[1] = *size;
+    msg.arg[2] = offset;
+    int fd = -1;
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, &fd) != 0) {
+        return -1;
+    }
+    if (msg.arg[0] != 0 || fd == -1 || msg.arg[1] < 0 || (uint64_t)msg.arg[1] > *size) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    *size = msg.arg[1];
+    pin->fd = fd;
+    pin->pos = msg.arg[2];
+    pin->entry = NULL;
+    pin->shared = false;
+    pin->owned = true;
+    return 0;
+}
+
+void cache_share_unpin(cache_block_pin_t *pin)
+{
+    if (pin->owned) {
+        close(pin->fd);
+        pin->fd = -1;
+        pin->owned = false;
+    }
+}
+
+int cache_share_write(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                      const char *buf, size_t size, size_t offset, bool eof)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_WRITE, file_key);
+    msg.len = size;
+    msg.arg[0] = block_idx;
+    msg.arg[1] = offset;
+    msg.arg[2] = eof;
+    if (peer_call(peer, NULL, &msg, buf, NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    return msg.arg[0] == 0 ? 0 : -1;
+}
+
+/* Claims name the connection that holds them, which the owner drops
+   along with the claims if the connection breaks */
+static uint64_t claim_encode(const struct peer_conn *conn, int64_t slot)
+{
+    return ((uint64_t)conn->serial << 32) | (uint64_t)(slot + 1);
+}
+
+/* The slot of a claim, if the calling thread still has the connection
+   that holds it */
+static int64_t claim_slot(cache_share_peer_t *peer, uint64_t claim)
+{
+    struct peer_conn *conn = pthread_getspecific(peer->conn_key);
+    if (claim == 0 || conn == NULL || conn->serial != (uint32_t)(claim >> 32)) {
+        return -1;
+    }
+    return (int64_t)(claim & 0xFFFFFFFFu) - 1;
+}
+
+bool cache_share_fill_claim(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                            bool wait, cache_block_fill_t *fill)
+{
+    memset(fill, 0, sizeof(*fill));
+    fill->file_key = file_key;
+    fill->block_idx = block_idx;
+
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_FILL, file_key);
+    msg.arg[0] = block_idx;
+    msg.arg[1] = wait;
+    struct peer_conn *conn;
+    if (peer_call(peer, &conn, &msg, NULL, NULL, 0, NULL) != 0 || msg.arg[0] < 0) {
+        return true;  /* Fetch it anyway; the result just isn't stored */
+    }
+    if (msg.arg[0] == 0) {
+        return false;
+    }
+    fill->claim = claim_encode(conn, msg.arg[1]);
+    return true;
+}
+
+int cache_share_fill_end(cache_share_peer_t *peer, cache_block_fill_t *fill,
+                         const char *buf, size_t size, bool eof)
+{
+    int64_t slot = claim_slot(peer, fill->claim);
+    fill->claim = 0;
+    if (slot < 0) {
+        return -1;
+    }
+
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_FILL_END, fill->file_key);
+    msg.len = buf != NULL ? size : 0;
+    msg.arg[0] = slot;
+    msg.arg[1] = buf != NULL;
+    msg.arg[2] = eof;
+    if (peer_call(peer, NULL, &msg, buf, NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    return msg.arg[0] == 0 ? 0 : -1;
+}
+
+int cache_share_update_begin(cache_share_peer_t *peer, uint64_t file_key,
+                             off_t offset, size_t size, cache_block_update_t *upd)
+{
+    memset(upd, 0, sizeof(*upd));
+    upd->file_key = file_key;
+    upd->offset = offset;
+    upd->size = size;
+
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_UPDATE, file_key);
+    msg.arg[0] = offset;
+    msg.arg[1] = size;
+    struct peer_conn *conn;
+    if (peer_call(peer, &conn, &msg, NULL, NULL, 0, NULL) != 0 || msg.arg[0] != 0) {
+        return -1;
+    }
+    upd->claim = claim_encode(conn, msg.arg[1]);
+    return 0;
+}
+
+int cache_share_update_end(cache_share_peer_t *peer, cache_block_update_t *upd,
+                           const char *buf, ssize_t written, off_t file_size)
+{
+    int64_t slot = claim_slot(peer, upd->claim);
+    upd->claim = 0;
+    if (slot < 0) {
+        /* The owner released the claim and invalidated the range already */
+        return -1;
+    }
+
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_UPDATE_END, upd->file_key);
+    msg.len = buf != NULL && written > 0 ? written : 0;
+    msg.arg[0] = slot;
+    msg.arg[1] = written;
+    msg.arg[2] = file_size;
+    msg.arg[3] = msg.len > 0;
+    if (peer_call(peer, NULL, &msg, msg.len > 0 ? buf : NULL, NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    return msg.arg[0] == 0 ? 0 : -1;
+}
+
+int cache_share_invalidate_range(cache_share_peer_t *peer, uint64_t file_key,
+                                 off_t offset, size_t size)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_INVALIDATE_RANGE, file_key);
+    msg.arg[0] = offset;
+    msg.arg[1] = size;
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    return msg.arg[0] == 0 ? 0 : -1;
+}
+
+int cache_share_invalidate_file(cache_share_peer_t *peer, uint64_t file_key)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_INVALIDATE_FILE, file_key);
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    return msg.arg[0] == 0 ? 0 : -1;
+}
+
+int cache_share_invalidate_all(cache_share_peer_t *peer)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_INVALIDATE_ALL, 0);
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    return msg.arg[0] == 0 ? 0 : -1;
+}
+
+size_t cache_share_clone_range(cache_share_peer_t *peer, uint64_t src_key, off_t src_offset,
+                               uint64_t dst_key, off_t dst_offset, size_t len, off_t dst_size)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_CLONE, src_key);
+    msg.arg[0] = src_offset;
+    msg.arg[1] = (int64_t)dst_key;
+    msg.arg[2] = dst_offset;
+    msg.arg[3] = len;
+    msg.arg[4] = dst_size;
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) != 0 || msg.arg[0] < 0) {
+        return 0;
+    }
+    return msg.arg[0];
+}
+
+int cache_share_set_pinned(cache_share_peer_t *peer, uint64_t file_key, bool pinned)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_SET_PINNED, file_key);
+    msg.arg[0] = pinned;
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    return msg.arg[0] == 0 ? 0 : -1;
+}
+
+void cache_share_get_pinned(cache_share_peer_t *peer, size_t *pinned_size_out,
+                            size_t *file_count_out)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_GET_PINNED, 0);
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) != 0) {
+        memset(msg.arg, 0, sizeof(msg.arg));
+    }
+    if (pinned_size_out != NULL) {
+        *pinned_size_out = msg.arg[1];
+    }
+    if (file_count_out != NULL) {
+        *file_count_out = msg.arg[2];
+    }
+}
+
+void cache_share_get_stats(cache_share_peer_t *peer, size_t *current_size_out,
+                           size_t *max_size_out)
+{
+    struct share_msg msg;
+    share_msg_init(&msg, SHARE_STATS, 0);
+    if (peer_call(peer, NULL, &msg, NULL, NULL, 0, NULL) != 0) {
+        memset(msg.arg, 0, sizeof(msg.arg));
+    }
+    if (current_size_out != NULL) {
+        *current_size_out = msg.arg[1];
+    }
+    if (max_size_out != NULL) {
+        *max_size_out = msg.arg[2];
+    }
+}
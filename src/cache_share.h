@@ -0,0 +1,158 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_SHARE_H
+#define CACHE_SHARE_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cache_block.h"
+
+/*
+ * Block store shared between mounts.
+ *
+ * One cachefs process owns a shared store: it opens it as its own block
+ * cache and serves the block calls of the other mounts through a unix
+ * socket in the store directory. The others are peers that send each
+ * call there instead of touching the store. A peer thread keeps one
+ * connection, set up on first use and closed with the thread, and the
+ * owner runs a thread per connection, so fills and updates a peer claims
+ * are held by its connection and released if the connection goes away.
+ *
+ * Only block data is shared. Each mount keeps its own metadata cache and
+ * applies its own ownership and permission mapping on top. All mounts of
+ * a store run as one user: the owner takes peers' file keys and block
+ * contents on trust.
+ */
+
+#define CACHE_SHARE_SOCKET_NAME "store.sock"
+#define CACHE_SHARE_LOCK_NAME "store.lock"
+
+typedef struct cache_share_server cache_share_server_t;
+typedef struct cache_share_peer cache_share_peer_t;
+
+/**
+ * Serve a block cache to peers on a unix socket.
+ * @param socket_path Path of the socket, replaced if it exists
+ * @param blocks Block cache to serve, which must outlive the server
+ * @param block_size Block size of the cache; peers must use the same
+ * @param debug Enable debug logging
+ * @return Server handle, or NULL on error
+ */
+cache_share_server_t *cache_share_serve(const char *socket_path,
+                                        cache_block_ctx_t *blocks,
+                                        size_t block_size,
+                                        bool debug);
+
+/**
+ * Stop serving: disconnect every peer, releasing what they had claimed,
+ * and remove the socket.
+ * @param server Server handle
+ */
+void cache_share_server_stop(cache_share_server_t *server);
+
+/**
+ * Set up a peer of the store served on a socket. Connections are made
+ * when threads first need them, so the owner need not be up yet.
+ * @param socket_path Path of the owner's socket
+ * @param block_size Block size of this mount
+ * @param debug Enable debug logging
+ * @return Peer handle, or NULL on error
+ */
+cache_share_peer_t *cache_share_peer_create(const char *socket_path,
+                                            size_t block_size,
+                                            bool debug);
+
+/**
+ * Close every connection of a peer and free it.
+ * @param peer Peer handle
+ */
+void cache_share_peer_destroy(cache_share_peer_t *peer);
+
+/**
+ * Check whether the owner has refused a connection or dropped one since
+ * the last successful connect, i.e. whether it may have gone away.
+ * @param peer Peer handle
+ * @return true if no owner is known to be serving
+ */
+bool cache_share_peer_orphaned(cache_share_peer_t *peer);
+
+/**
+ * Check whether the owner rejected this mount, because its block size
+ * differs.
+ * @param peer Peer handle
+ * @return true if the owner rejected this mount
+ */
+bool cache_share_peer_rejected(cache_share_peer_t *peer);
+
+/*
+ * Calls forwarded to the owner. Each behaves like the cache_block_*
+ * function of the same name; if the owner can't be reached, reads miss,
+ * claims are granted without being shared and stores are dropped.
+ */
+
+bool cache_share_exists(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx);
+
+ssize_t cache_share_read(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                         char *buf, size_t size, size_t offset);
+
+/* The pin carries a descriptor of its own, closed by cache_share_unpin() */
+int cache_share_pin(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                    size_t offset, size_t *size, cache_block_pin_t *pin);
+
+void cache_share_unpin(cache_block_pin_t *pin);
+
+int cache_share_write(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                      const char *buf, size_t size, size_t offset, bool eof);
+
+/* Fill the claim into fill; fill->ctx is left for the caller to set */
+bool cache_share_fill_claim(cache_share_peer_t *peer, uint64_t file_key, size_t block_idx,
+                            bool wait, cache_block_fill_t *fill);
+
+int cache_share_fill_end(cache_share_peer_t *peer, cache_block_fill_t *fill,
+                         const char *buf, size_t size, bool eof);
+
+/* Fill the claim into upd; upd->ctx is left for the caller to set */
+int cache_share_update_begin(cache_share_peer_t *peer, uint64_t file_key,
+                             off_t offset, size_t size, cache_block_update_t *upd);
+
+int cache_share_update_end(cache_share_peer_t *peer, cache_block_update_t *upd,
+                           const char *buf, ssize_t written, off_t file_size);
+
+int cache_share_invalidate_range(cache_share_peer_t *peer, uint64_t file_key,
+                                 off_t offset, size_t size);
+
+int cache_share_invalidate_file(cache_share_peer_t *peer, uint64_t file_key);
+
+int cache_share_invalidate_all(cache_share_peer_t *peer);
+
+size_t cache_share_clone_range(cache_share_peer_t *peer, uint64_t src_key, off_t src_offset,
+                               uint64_t dst_key, off_t dst_offset, size_t len, off_t dst_size);
+
+int cache_share_set_pinned(cache_share_peer_t *peer, uint64_t file_key, bool pinned);
+
+void cache_share_get_pinned(cache_share_peer_t *peer, size_t *pinned_size_out,
+                            size_t *file_count_out);
+
+void cache_share_get_stats(cache_share_peer_t *peer, size_t *current_size_out,
+                           size_t *max_size_out);
+
+#endif /* CACHE_SHARE_H */
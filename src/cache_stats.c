@@ -0,0 +1,527 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_stats.h"
+#include "misc.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)   /* Sub-buckets per power of two */
+#define HIST_MAX_BITS 40                /* Longer durations (~18 min) are clamped */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Exported histogram bounds: powers of four from 1024 ns to ~17 s */
+#define EXPORT_FIRST_BIT 10
+#define EXPORT_LAST_BIT 34
+
+/* One thread's share of everything */
+struct stats_slab {
+    uint64_t counters[CACHE_COUNTER_COUNT];
+    uint64_t sum_ns[CACHE_TIMER_COUNT];
+    uint64_t buckets[CACHE_TIMER_COUNT][HIST_BUCKETS];
+    bool in_use;                /* Owned by a live thread */
+    struct stats_slab *next;
+};
+
+static const char *timer_names[CACHE_TIMER_COUNT] = {
+    "getattr", "readlink", "readdir", "mknod", "mkdir", "symlink", "unlink",
+    "rmdir", "rename", "link", "chmod", "chown", "truncate", "utimens",
+    "create", "open", "read", "write", "lock", "flock", "fallocate",
+    "copy_file_range", "lseek", "ioctl", "statfs", "release", "fsync",
+    "setxattr", "getxattr", "listxattr", "removexattr",
+    "meta_lookup", "dir_lookup", "block_hit", "block_miss", "backend_read",
+    "eviction", "sqlite_commit", "lmdb_commit",
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[CACHE_COUNTER_COUNT] = {
+    { "getattr_hits", "getattr calls answered from the cache" },
+    { "getattr_misses", "getattr calls that went to the backend" },
+    { "readdir_hits", "readdir calls answered from the cache" },
+    { "readdir_misses", "readdir calls that went to the backend" },
+    { "block_hits", "Block reads served from the block cache" },
+    { "block_misses", "Block reads fetched from the backend" },
+    { "cache_read_bytes", "Bytes served from cached blocks" },
+    { "backend_read_bytes", "Bytes read from the backend to fill blocks" },
+    { "evicted_blocks", "Blocks evicted from the block cache" },
+    { "evicted_bytes", "Bytes freed by eviction" },
+    { "populated_bytes", "Written bytes merged into cached blocks" },
+    { "bypassed_bytes", "Backend bytes read for readers without being stored" },
+    { "corrupt_blocks", "Cached blocks dropped because they failed their checksum" },
+    { "scrubbed_blocks", "Cached blocks checked after an unclean shutdown" },
+};
+
+static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_slab *slabs = NULL;
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static void slab_release(void *arg)
+{
+    struct stats_slab *slab = arg;
+    __atomic_store_n(&slab->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void slab_key_init(void)
+{
+    pthread_key_create(&slab_key, slab_release);
+}
+
+/* This thread's slab, taken over from an exited thread if possible */
+static struct stats_slab *thread_slab(void)
+{
+    pthread_once(&slab_once, slab_key_init);
+    struct stats_slab *slab = pthread_getspecific(slab_key);
+    if (slab != NULL) {
+        return slab;
+    }
+
+    pthread_mutex_lock(&slabs_lock);
+    for (slab = slabs; slab != NULL; slab = slab->next) {
+        if (!__atomic_load_n(&slab->in_use, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    if (slab == NULL) {
+        slab = calloc(1, sizeof(struct stats_slab));
+        if (slab != NULL) {
+            slab->next = slabs;
+            slabs = slab;
+        }
+    }
+    if (slab != NULL) {
+        slab->in_use = true;
+        pthread_setspecific(slab_key, slab);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return slab;
+}
+
+/* Only the owning thread writes, so no read-modify-write is needed */
+static inline void slab_bump(uint64_t *p, uint64_t n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static size_t hist_bucket(uint64_t v)
+{
+    if (v < HIST_SUB) {
+        return v;
+    }
+    unsigned msb = 63 - __builtin_clzll(v);
+    if (msb >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value that falls past a bucket */
+static uint64_t hist_bucket_end(size_t b)
+{
+    if (b < HIST_SUB) {
+        return b + 1;
+    }
+    size_t group = b / HIST_SUB;
+    uint64_t sub = b % HIST_SUB;
+    return (HIST_SUB + sub + 1) << (group - 1);
+}
+
+uint64_t cache_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void cache_stats_add(cache_stats_counter_t counter, uint64_t n)
+{
+    struct stats_slab *slab = thread_slab();
+    if (slab != NULL) {
+        slab_bump(&slab->counters[counter], n);
+    }
+}
+
+void cache_stats_since(cache_stats_timer_t timer, uint64_t start)
+{
+    uint64_t now = cache_stats_now();
+    uint64_t ns = now > start ? now - start : 0;
+    struct stats_slab *slab = thread_slab();
+    if (slab != NULL) {
+        slab_bump(&slab->buckets[timer][hist_bucket(ns)], 1);
+        slab_bump(&slab->sum_ns[timer], ns);
+    }
+}
+
+uint64_t cache_stats_total(cache_stats_counter_t counter)
+{
+    uint64_t total = 0;
+    pthread_mutex_lock(&slabs_lock);
+    for (struct stats_slab *slab = slabs; slab != NULL; slab = slab->next) {
+        total += __atomic_load_n(&slab->counters[counter], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return total;
+}
+
+static void appendf(struct memory_block *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void appendf(struct memory_block *out, const char *fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len > 0) {
+        append_to_memory_block(out, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+    }
+}
+
+/* Upper bound, in seconds, of the bucket holding quantile q */
+static double hist_quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+    uint64_t rank = (uint64_t)(q * (double)count);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            return (double)hist_bucket_end(b) / 1e9;
+        }
+    }
+    return (double)hist_bucket_end(HIST_BUCKETS - 1) / 1e9;
+}
+
+static void format_histograms(struct memory_block *out, const struct stats_slab *sum,
+                              const char *family, const char *label, const char *help,
+                              size_t first, size_t end)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    appendf(out, "# HELP cachefs_%s_duration_seconds %s\n", family, help);
+    appendf(out, "# TYPE cachefs_%s_duration_seconds histogram\n", family);
+    for (size_t t = first; t < end; t++) {
+        uint64_t count = 0;
+        for (size_t b = 0; b < HIST_BUCKETS; b++) {
+            count += sum->buckets[t][b];
+        }
+        if (count == 0) {
+            continue;
+        }
+        /* Bucket bounds are powers of two, so they line up exactly */
+        uint64_t cumulative = 0;
+        size_t b = 0;
+        for (unsigned bit = EXPORT_FIRST_BIT; bit <= EXPORT_LAST_BIT; bit += 2) {
+            while (b < HIST_BUCKETS && hist_bucket_end(b) <= (1ULL << bit)) {
+                cumulative += sum->buckets[t][b++];
+            }
+            appendf(out, "cachefs_%s_duration_seconds_bucket{%s=\"%s\",le=\"%.12g\"} %llu\n",
+                    family, label, timer_names[t], (double)(1ULL << bit) / 1e9,
+                    (unsigned long long)cumulative);
+        }
+        appendf(out, "cachefs_%s_duration_seconds_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n",
+                family, label, timer_names[t], (unsigned long long)count);
+        appendf(out, "cachefs_%s_duration_seconds_sum{%s=\"%s\"} %.9f\n",
+                family, label, timer_names[t], (double)sum->sum_ns[t] / 1e9);
+        appendf(out, "cachefs_%s_duration_seconds_count{%s=\"%s\"} %llu\n",
+                family, label, timer_names[t], (unsigned long long)count);
+    }
+
+    appendf(out, "# HELP cachefs_%s_duration_quantile_seconds %s, by quantile\n", family, help);
+    appendf(out, "# TYPE cachefs_%s_duration_quantile_seconds gauge\n", family);
+    for (size_t t = first; t < end; t++) {
+        uint64_t count = 0;
+        for (size_t b = 0; b < HIST_BUCKETS; b++) {
+            count += sum->buckets[t][b];
+        }
+        if (count == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            appendf(out, "cachefs_%s_duration_quantile_seconds{%s=\"%s\",quantile=\"%g\"} %.9g\n",
+                    family, label, timer_names[t], quantiles[i],
+                    hist_quantile(sum->buckets[t], count, quantiles[i]));
+        }
+    }
+}
+
+ssize_t cache_stats_format(const cache_stats_gauges_t *gauges, char **out)
+{
+    if (out == NULL) {
+        return -1;
+    }
+
+    struct stats_slab *sum = calloc(1, sizeof(struct stats_slab));
+    if (sum == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&slabs_lock);
+    for (struct stats_slab *slab = slabs; slab != NULL; slab = slab->next) {
+        for (size_t c = 0; c < CACHE_COUNTER_COUNT; c++) {
+            sum->counters[c] += __atomic_load_n(&slab->counters[c], __ATOMIC_RELAXED);
+        }
+        for (size_t t = 0; t < CACHE_TIMER_COUNT; t++) {
+            sum->sum_ns[t] += __atomic_load_n(&slab->sum_ns[t], __ATOMIC_RELAXED);
+            for (size_t b = 0; b < HIST_BUCKETS; b++) {
+                sum->buckets[t][b] += __atomic_load_n(&slab->buckets[t][b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&slabs_lock);
+
+    struct memory_block buf = MEMORY_BLOCK_INITIALIZER;
+    for (size_t c = 0; c < CACHE_COUNTER_COUNT; c++) {
+        appendf(&buf, "# HELP cachefs_%s_total %s\n", counter_info[c].name, counter_info[c].help);
+        appendf(&buf, "# TYPE cachefs_%s_total counter\n", counter_info[c].name);
+        appendf(&buf, "cachefs_%s_total %llu\n", counter_info[c].name,
+                (unsigned long long)sum->counters[c]);
+    }
+
+    if (gauges != NULL) {
+        const struct { const char *name; const char *help; size_t value; } g[] = {
+            { "block_cache_bytes", "Block cache bytes on disk", gauges->cache_bytes },
+            { "block_cache_max_bytes", "Block cache size limit (0 = unlimited)", gauges->max_bytes },
+            { "pinned_bytes", "Block cache bytes exempt from eviction", gauges->pinned_bytes },
+            { "pinned_files", "Files pinned in the block cache", gauges->pinned_files },
+        };
+        for (size_t i = 0; i < sizeof(g) / sizeof(g[0]); i++) {
+            appendf(&buf, "# HELP cachefs_%s %s\n", g[i].name, g[i].help);
+            appendf(&buf, "# TYPE cachefs_%s gauge\n", g[i].name);
+            appendf(&buf, "cachefs_%s %zu\n", g[i].name, g[i].value);
+        }
+    }
+
+    format_histograms(&buf, sum, "op", "op", "Latency of FUSE operations",
+                      0, CACHE_STAGE_META_LOOKUP);
+    format_histograms(&buf, sum, "stage", "stage", "Latency of cache stages",
+                      CACHE_STAGE_META_LOOKUP, CACHE_TIMER_COUNT);
+    free(sum);
+
+    append_to_memory_block(&buf, "", 1);
+    if (buf.ptr == NULL) {
+        return -1;
+    }
+    *out = buf.ptr;
+    return (ssize_t)buf.size - 1;
+}
+
+struct cache_stats_server {
+    char *path;
+    int listen_fd;
+    int stop_pipe[2];
+    pthread_t thread;
+    cache_stats_gauge_fn gauges;
+    void *arg;
+};
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  /* libfuse ignores SIGPIPE anyway */
+#endif
+
+/* Clients may hang up early; that must not raise SIGPIPE */
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void serve_client(cache_stats_server_t *server, int fd)
+{
+    /* Give an HTTP client a moment to send its request line */
+    char req[512];
+    ssize_t n = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 100) > 0) {
+        n = read(fd, req, sizeof(req));
+    }
+    bool http = n >= 4 && memcmp(req, "GET ", 4) == 0;
+
+    cache_stats_gauges_t gauges;
+    memset(&gauges, 0, sizeof(gauges));
+    if (server->gauges != NULL) {
+        server->gauges(server->arg, &gauges);
+    }
+    char *text = NULL;
+    ssize_t len = cache_stats_format(&gauges, &text);
+    if (len < 0) {
+        return;
+    }
+
+    if (http) {
+        char header[160];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zd\r\n\r\n", len);
+        send_all(fd, header, header_len);
+    }
+    send_all(fd, text, len);
+    free(text);
+}
+
+static void *server_main(void *arg)
+{
+    cache_stats_server_t *server = arg;
+    struct pollfd fds[2] = {
+        { server->listen_fd, POLLIN, 0 },
+        { server->stop_pipe[0], POLLIN, 0 },
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(server->listen_fd, NULL, NULL);
+            if (fd != -1) {
+                serve_client(server, fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+cache_stats_server_t *cache_stats_serve(const char *socket_path,
+                                        cache_stats_gauge_fn gauges,
+                                        void *arg)
+{
+    struct sockaddr_un addr;
+    if (socket_path == NULL || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    /* Only a socket left over from an earlier mount is replaced */
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        DPRINTF("cache_stats_serve: %s exists and is not a socket", socket_path);
+        errno = EEXIST;
+        return NULL;
+    }
+    bool bound = false;
+
+    cache_stats_server_t *server = calloc(1, sizeof(cache_stats_server_t));
+    if (server == NULL) {
+        return NULL;
+    }
+    server->gauges = gauges;
+    server->arg = arg;
+    server->listen_fd = -1;
+    server->stop_pipe[0] = server->stop_pipe[1] = -1;
+    server->path = strdup(socket_path);
+    if (server->path == NULL) {
+        goto error;
+    }
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd == -1) {
+        goto error;
+    }
+    fcntl(server->listen_fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        DPRINTF("cache_stats_serve: cannot bind %s: %s", socket_path, strerror(errno));
+        goto error;
+    }
+    bound = true;
+    if (chmod(socket_path, 0600) == -1 || listen(server->listen_fd, 16) == -1) {
+        DPRINTF("cache_stats_serve: cannot listen on %s: %s", socket_path, strerror(errno));
+        goto error;
+    }
+
+    if (pipe(server->stop_pipe) == -1) {
+        goto error;
+    }
+    if (pthread_create(&server->thread, NULL, server_main, server) != 0) {
+        goto error;
+    }
+    return server;
+
+error:
+    if (server->listen_fd != -1) {
+        close(server->listen_fd);
+    }
+    if (bound) {
+        unlink(socket_path);
+    }
+    if (server->stop_pipe[0] != -1) {
+        close(server->stop_pipe[0]);
+        close(server->stop_pipe[1]);
+    }
+    free(server->path);
+    free(server);
+    return NULL;
+}
+
+void cache_stats_server_stop(cache_stats_server_t *server)
+{
+    if (server == NULL) {
+        return;
+    }
+
+    if (write(server->stop_pipe[1], "x", 1) != 1) {
+        DPRINTF("cache_stats_server_stop: %s", strerror(errno));
+    }
+    pthread_join(server->thread, NULL);
+    close(server->stop_pipe[0]);
+    close(server->stop_pipe[1]);
+    close(server->listen_fd);
+    unlink(server->path);
+    free(server->path);
+    free(server);
+}
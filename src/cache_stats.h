@@ -0,0 +1,198 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_STATS_H
+#define CACHE_STATS_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Counters and latency histograms, exported in Prometheus text format.
+ *
+ * Every thread updates its own slab of counters, so recording is a plain
+ * load and store without locks or atomic read-modify-write cycles. A
+ * snapshot adds all slabs up; it may miss updates still in flight but
+ * never sees a torn value. Slabs of exited threads are kept, and reused
+ * by new threads, so their counts are not lost.
+ *
+ * Latencies go into log-linear (HDR-style) histograms in nanoseconds
+ * with 8 sub-buckets per power of two, so every recorded value is known
+ * to within 12.5%.
+ */
+
+/* Timed FUSE operations */
+typedef enum {
+    CACHE_OP_GETATTR,
+    CACHE_OP_READLINK,
+    CACHE_OP_READDIR,
+    CACHE_OP_MKNOD,
+    CACHE_OP_MKDIR,
+    CACHE_OP_SYMLINK,
+    CACHE_OP_UNLINK,
+    CACHE_OP_RMDIR,
+    CACHE_OP_RENAME,
+    CACHE_OP_LINK,
+    CACHE_OP_CHMOD,
+    CACHE_OP_CHOWN,
+    CACHE_OP_TRUNCATE,
+    CACHE_OP_UTIMENS,
+    CACHE_OP_CREATE,
+    CACHE_OP_OPEN,
+    CACHE_OP_READ,
+    CACHE_OP_WRITE,
+    CACHE_OP_LOCK,
+    CACHE_OP_FLOCK,
+    CACHE_OP_FALLOCATE,
+    CACHE_OP_COPY_FILE_RANGE,
+    CACHE_OP_LSEEK,
+    CACHE_OP_IOCTL,
+    CACHE_OP_STATFS,
+    CACHE_OP_RELEASE,
+    CACHE_OP_FSYNC,
+    CACHE_OP_SETXATTR,
+    CACHE_OP_GETXATTR,
+    CACHE_OP_LISTXATTR,
+    CACHE_OP_REMOVEXATTR,
+    /* Cache stages, timed inside the operations above */
+    CACHE_STAGE_META_LOOKUP,    /* Attribute cache lookup */
+    CACHE_STAGE_DIR_LOOKUP,     /* Listing cache lookup */
+    CACHE_STAGE_BLOCK_HIT,      /* Block served from the cache */
+    CACHE_STAGE_BLOCK_MISS,     /* Block fetched and stored */
+    CACHE_STAGE_BACKEND_READ,   /* pread() of the backend */
+    CACHE_STAGE_EVICTION,       /* One eviction pass */
+    CACHE_STAGE_SQLITE_COMMIT,  /* Commit of a batch of cache writes */
+    CACHE_STAGE_LMDB_COMMIT,    /* Same, with --cache-meta-backend=lmdb */
+    CACHE_TIMER_COUNT
+} cache_stats_timer_t;
+
+/* Event counters */
+typedef enum {
+    CACHE_CTR_GETATTR_HITS,
+    CACHE_CTR_GETATTR_MISSES,
+    CACHE_CTR_READDIR_HITS,
+    CACHE_CTR_READDIR_MISSES,
+    CACHE_CTR_BLOCK_HITS,
+    CACHE_CTR_BLOCK_MISSES,
+    CACHE_CTR_CACHE_READ_BYTES,     /* Bytes served from cached blocks */
+    CACHE_CTR_BACKEND_READ_BYTES,   /* Bytes read from the backend */
+    CACHE_CTR_EVICTED_BLOCKS,
+    CACHE_CTR_EVICTED_BYTES,
+    CACHE_CTR_POPULATED_BYTES,      /* Written bytes merged into cached blocks */
+    CACHE_CTR_BYPASSED_BYTES,       /* Backend bytes read for readers and not stored */
+    CACHE_CTR_CORRUPT_BLOCKS,       /* Blocks dropped for not matching their checksum */
+    CACHE_CTR_SCRUBBED_BLOCKS,      /* Blocks checked after an unclean shutdown */
+    CACHE_COUNTER_COUNT
+} cache_stats_counter_t;
+
+/* Point-in-time values supplied when a snapshot is taken */
+typedef struct {
+    size_t cache_bytes;         /* Block cache bytes on disk */
+    size_t max_bytes;           /* Block cache limit (0 = unlimited) */
+    size_t pinned_bytes;        /* Bytes exempt from eviction */
+    size_t pinned_files;
+} cache_stats_gauges_t;
+
+/**
+ * Fill in gauges for a snapshot.
+ * @param arg Callback argument given to cache_stats_serve()
+ * @param gauges Gauges to fill in, zeroed beforehand
+ */
+typedef void (*cache_stats_gauge_fn)(void *arg, cache_stats_gauges_t *gauges);
+
+/**
+ * Current time for timing, in nanoseconds.
+ * @return Monotonic clock reading
+ */
+uint64_t cache_stats_now(void);
+
+/**
+ * Add to a counter.
+ * @param counter Counter
+ * @param n Amount to add
+ */
+void cache_stats_add(cache_stats_counter_t counter, uint64_t n);
+
+/**
+ * Record one duration.
+ * @param timer Histogram to record into
+ * @param start Start time from cache_stats_now()
+ */
+void cache_stats_since(cache_stats_timer_t timer, uint64_t start);
+
+/**
+ * Sum a counter over all threads.
+ * @param counter Counter
+ * @return Current total
+ */
+uint64_t cache_stats_total(cache_stats_counter_t counter);
+
+/**
+ * Format a snapshot in Prometheus text exposition format.
+ * @param gauges Gauges to include (can be NULL)
+ * @param out Set to a malloc'd, NUL-terminated buffer
+ * @return Length of the text, or -1 on error
+ */
+ssize_t cache_stats_format(const cache_stats_gauges_t *gauges, char **out);
+
+/* Opaque stats endpoint handle */
+typedef struct cache_stats_server cache_stats_server_t;
+
+/**
+ * Serve snapshots on a unix socket. Each connection gets one snapshot;
+ * a connection that sends an HTTP GET gets it as an HTTP response, so
+ * both `socat - UNIX-CONNECT:path` and `curl --unix-socket path` work.
+ * @param socket_path Path of the socket, replaced if it is a socket already
+ * @param gauges Gauge callback (can be NULL)
+ * @param arg Argument passed to the gauge callback
+ * @return Server handle or NULL on error; errno is EEXIST if something
+ *         other than a socket is at socket_path
+ */
+cache_stats_server_t *cache_stats_serve(const char *socket_path,
+                                        cache_stats_gauge_fn gauges,
+                                        void *arg);
+
+/**
+ * Stop serving and remove the socket.
+ * @param server Server handle
+ */
+void cache_stats_server_stop(cache_stats_server_t *server);
+
+/* Times the rest of the enclosing block, including every return path */
+#if defined(__GNUC__) || defined(__clang__)
+typedef struct {
+    cache_stats_timer_t timer;
+    uint64_t start;
+} cache_stats_scope_t;
+
+static inline void cache_stats_scope_end(cache_stats_scope_t *scope)
+{
+    cache_stats_since(scope->timer, scope->start);
+}
+
+#define CACHE_STATS_SCOPE(t) \
+    cache_stats_scope_t cache_stats_scope_ __attribute__((cleanup(cache_stats_scope_end))) = \
+        { (t), cache_stats_now() }
+#else
+#define CACHE_STATS_SCOPE(t) ((void)0)
+#endif
+
+#endif /* CACHE_STATS_H */
@@ -0,0 +1,435 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_warm.h"
+#include "cache_io.h"
+#include "cache_stats.h"
+#include "misc.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#define WARM_MAX_BATCH 8        /* Blocks a worker fetches at once */
+
+/* One file or directory to visit */
+struct warm_job {
+    char *path;                 /* FUSE path */
+    char *real_path;            /* Backend path */
+    struct stat st;             /* From the parent's listing */
+    struct warm_job *next;
+};
+
+/* A walk in progress */
+struct warm_run {
+    const cache_warm_opts_t *opts;
+    cache_warm_mode_t mode;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Work queued or walk finished */
+    struct warm_job *head;
+    struct warm_job *tail;
+    size_t pending;             /* Jobs queued or being run */
+    size_t batch;               /* Blocks per backend I/O batch */
+
+    cache_warm_stats_t stats;
+};
+
+/* A worker's buffers for one batch of blocks */
+struct warm_batch {
+    char *bufs;
+    cache_block_fill_t *fills;
+    cache_io_op_t *ops;
+};
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir);
+    bool slash = dir_len > 0 && dir[dir_len - 1] == '/';
+    size_t len = dir_len + (slash ? 0 : 1) + strlen(name) + 1;
+    char *p = malloc(len);
+    if (p != NULL) {
+        snprintf(p, len, "%s%s%s", dir, slash ? "" : "/", name);
+    }
+    return p;
+}
+
+static void job_free(struct warm_job *job)
+{
+    free(job->path);
+    free(job->real_path);
+    free(job);
+}
+
+/* Queues a visit of a file or directory; the strings are copied */
+static void push_job(struct warm_run *run, const char *path, const char *real_path,
+                     const struct stat *st)
+{
+    struct warm_job *job = calloc(1, sizeof(struct warm_job));
+    if (job == NULL) {
+        __sync_fetch_and_add(&run->stats.errors, 1);
+        return;
+    }
+    job->path = strdup(path);
+    job->real_path = strdup(real_path);
+    if (job->path == NULL || job->real_path == NULL) {
+        job_free(job);
+        __sync_fetch_and_add(&run->stats.errors, 1);
+        return;
+    }
+    job->st = *st;
+
+    pthread_mutex_lock(&run->lock);
+    if (run->tail != NULL) {
+        run->tail->next = job;
+    } else {
+        run->head = job;
+    }
+    run->tail = job;
+    run->pending++;
+    pthread_cond_signal(&run->cond);
+    pthread_mutex_unlock(&run->lock);
+}
+
+/* Fetches the blocks of a regular file that are not cached yet */
+static void warm_file(struct warm_run *run, struct warm_job *job, struct warm_batch *wb)
+{
+    const cache_warm_opts_t *opts = run->opts;
+    __sync_fetch_and_add(&run->stats.files, 1);
+    if (opts->blocks == NULL) {
+        return;
+    }
+
+    int fd = open(job->real_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if (fd == -1) {
+        __sync_fetch_and_add(&run->stats.errors, 1);
+        return;
+    }
+    struct stat st;
+    uint64_t key = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        key = opts->file_key(opts->file_key_arg, job->path, fd, &st);
+    }
+    if (key == 0) {
+        close(fd);
+        return;
+    }
+
+    if (run->mode == CACHE_WARM_UNPIN) {
+        cache_block_set_pinned(opts->blocks, key, false);
+        close(fd);
+        return;
+    }
+
+    /* Pin first so the blocks fetched below are never victims */
+    if (run->mode == CACHE_WARM_PIN && cache_block_set_pinned(opts->blocks, key, true) != 0) {
+        __sync_fetch_and_add(&run->stats.errors, 1);
+    }
+
+    size_t bs = opts->block_size;
+    size_t block_count = ((size_t)st.st_size + bs - 1) / bs;
+    size_t b = 0;
+    bool done = false;
+    while (b < block_count && !done) {
+        /* Claim the next missing blocks. Blocks that a reader or
+           readahead is fetching already are theirs to finish. */
+        size_t count = 0;
+        for (; b < block_count && count < run->batch; b++) {
+            if (cache_block_exists(opts->blocks, key, b)) {
+                continue;
+            }
+            if (!cache_block_fill_try(opts->blocks, key, b, &wb->fills[count])) {
+                continue;
+            }
+            wb->ops[count] = (cache_io_op_t){
+                .fd = fd,
+                .write = false,
+                .buf = wb->bufs + count * bs,
+                .len = bs,
+                .offset = (off_t)b * bs,
+            };
+            count++;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        uint64_t start = cache_stats_now();
+        cache_io_run(wb->ops, count);
+        cache_stats_since(CACHE_STAGE_BACKEND_READ, start);
+
+        size_t fetched = 0;
+        for (size_t i = 0; i < count; i++) {
+            ssize_t n = wb->ops[i].res;
+            if (n > 0) {
+                cache_stats_add(CACHE_CTR_BACKEND_READ_BYTES, n);
+                fetched += n;
+            }
+            /* Nothing after the end of the file, or an error, is stored */
+            if (done || n <= 0) {
+                cache_block_fill_end(&wb->fills[i], NULL, 0, false);
+                if (n < 0 && !done) {
+                    __sync_fetch_and_add(&run->stats.errors, 1);
+                }
+                done = true;
+                continue;
+            }
+            bool eof = (size_t)n < bs;
+            if (cache_block_fill_end(&wb->fills[i], wb->ops[i].buf, n, eof) == 0) {
+                __sync_fetch_and_add(&run->stats.blocks, 1);
+                __sync_fetch_and_add(&run->stats.bytes, (size_t)n);
+            }
+            if (eof) {
+                done = true;
+            }
+        }
+        /* Charged for what was read, not for whole blocks */
+        if (opts->limiter) {
+            rate_limiter_wait(opts->limiter, fetched);
+        }
+    }
+
+    close(fd);
+}
+
+/* Lists a directory into the caches and queues everything in it */
+static void warm_dir(struct warm_run *run, struct warm_job *job)
+{
+    const cache_warm_opts_t *opts = run->opts;
+    bool fill = opts->meta != NULL && run->mode != CACHE_WARM_UNPIN;
+
+    DIR *dp = opendir(job->real_path);
+    if (dp == NULL) {
+        __sync_fetch_and_add(&run->stats.errors, 1);
+        return;
+    }
+    __sync_fetch_and_add(&run->stats.dirs, 1);
+
+    /* Packed both ways, since whether every entry can carry its
+       attributes is only known at the end */
+    struct memory_block stat_buf = MEMORY_BLOCK_INITIALIZER;
+    struct memory_block plain_buf = MEMORY_BLOCK_INITIALIZER;
+    size_t entries_count = 0;
+    bool complete = true;       /* Every entry made it into the listing */
+    bool with_stats = true;     /* Every entry has its attributes */
+
+    while (1) {
+        errno = 0;
+        struct dirent *de = readdir(dp);
+        if (de == NULL) {
+            if (errno != 0) {
+                complete = false;
+            }
+            break;
+        }
+
+        bool dot = strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0;
+        char *child_real = join_path(job->real_path, de->d_name);
+        char *child_path = join_path(job->path, de->d_name);
+        struct stat st;
+        if (child_real == NULL || child_path == NULL || lstat(child_real, &st) == -1) {
+            /* Gone already, or unreadable: the listing would be wrong */
+            __sync_fetch_and_add(&run->stats.errors, 1);
+            complete = false;
+            free(child_real);
+            free(child_path);
+            continue;
+        }
+
+        /* A symlink served as its target must not get the link's
+           attributes cached, neither on its own nor in the listing */
+        bool link_attrs = opts->follow_symlinks && S_ISLNK(st.st_mode);
+        if (link_attrs) {
+            with_stats = false;
+        }
+
+        if (fill) {
+            cache_entry_type_t type = (de->d_type == DT_DIR) ? CACHE_ENTRY_DIR : CACHE_ENTRY_FILE;
+            if (with_stats) {
+                cache_dir_pack(&stat_buf, de->d_name, type, &st);
+            }
+            cache_dir_pack(&plain_buf, de->d_name, type, NULL);
+            entries_count++;
+            if (!dot && !link_attrs) {
+                cache_meta_store(opts->meta, child_path, &st);
+            }
+        }
+
+        if (!dot && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            push_job(run, child_path, child_real, &st);
+        }
+        free(child_real);
+        free(child_path);
+    }
+    closedir(dp);
+
+    if (fill && complete && entries_count > 0) {
+        struct memory_block *buf = with_stats ? &stat_buf : &plain_buf;
+        cache_dir_listing_t listing = {
+            .data = buf->ptr,
+            .size = buf->size,
+            .count = entries_count,
+            .dir_mtime = job->st.st_mtime,
+            .with_stats = with_stats,
+        };
+        cache_dir_store(opts->meta, job->path, &listing);
+    }
+    free_memory_block(&stat_buf);
+    free_memory_block(&plain_buf);
+
+    if (opts->debug) {
+        DPRINTF("cache_warm: listed %s (%zu entries)", job->path, entries_count);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct warm_run *run = arg;
+    struct warm_batch wb = {
+        .bufs = malloc(run->batch * (run->opts->block_size > 0 ? run->opts->block_size : 1)),
+        .fills = calloc(run->batch, sizeof(cache_block_fill_t)),
+        .ops = calloc(run->batch, sizeof(cache_io_op_t)),
+    };
+    if (wb.bufs == NULL || wb.fills == NULL || wb.ops == NULL) {
+        free(wb.bufs);
+        free(wb.fills);
+        free(wb.ops);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&run->lock);
+    while (1) {
+        struct warm_job *job = run->head;
+        if (job == NULL) {
+            if (run->pending == 0) {
+                break;
+            }
+            pthread_cond_wait(&run->cond, &run->lock);
+            continue;
+        }
+        run->head = job->next;
+        if (run->head == NULL) {
+            run->tail = NULL;
+        }
+        pthread_mutex_unlock(&run->lock);
+
+        if (S_ISDIR(job->st.st_mode)) {
+            warm_dir(run, job);
+        } else {
+            warm_file(run, job, &wb);
+        }
+        job_free(job);
+
+        pthread_mutex_lock(&run->lock);
+        if (--run->pending == 0) {
+            pthread_cond_broadcast(&run->cond);
+        }
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    free(wb.bufs);
+    free(wb.fills);
+    free(wb.ops);
+    return NULL;
+}
+
+int cache_warm_tree(const cache_warm_opts_t *opts,
+                    cache_warm_mode_t mode,
+                    const char *path,
+                    const char *real_path,
+                    cache_warm_stats_t *stats_out)
+{
+    if (opts == NULL || path == NULL || real_path == NULL || opts->workers <= 0 ||
+        (opts->blocks != NULL && (opts->file_key == NULL || opts->block_size == 0))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct stat st;
+    if (lstat(real_path, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct warm_run run;
+    memset(&run, 0, sizeof(run));
+    run.opts = opts;
+    run.mode = mode;
+    run.batch = cache_io_batch_size();
+    if (run.batch > WARM_MAX_BATCH) {
+        run.batch = WARM_MAX_BATCH;
+    }
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+
+    if (opts->meta != NULL && mode != CACHE_WARM_UNPIN) {
+        cache_meta_store(opts->meta, path, &st);
+    }
+
+    /* Queued before any worker starts, so none finds the walk over */
+    push_job(&run, path, real_path, &st);
+
+    pthread_t *workers = calloc(opts->workers, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; workers != NULL && i < opts->workers; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, &run) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        worker_main(&run);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    /* Only left over if a worker could not get its buffer */
+    while (run.head != NULL) {
+        struct warm_job *job = run.head;
+        run.head = job->next;
+        job_free(job);
+        run.stats.errors++;
+    }
+
+    pthread_cond_destroy(&run.cond);
+    pthread_mutex_destroy(&run.lock);
+
+    if (opts->debug) {
+        DPRINTF("cache_warm_tree: %s %s: %zu dirs, %zu files, %zu blocks (%zu bytes), %zu errors",
+                mode == CACHE_WARM_PIN ? "pinned" : mode == CACHE_WARM_UNPIN ? "unpinned" : "warmed",
+                path, run.stats.dirs, run.stats.files, run.stats.blocks, run.stats.bytes,
+                run.stats.errors);
+    }
+    if (stats_out != NULL) {
+        *stats_out = run.stats;
+    }
+    return 0;
+}
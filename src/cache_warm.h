@@ -0,0 +1,100 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_WARM_H
+#define CACHE_WARM_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cache_block.h"
+#include "cache_meta.h"
+#include "rate_limiter.h"
+
+/*
+ * Cache warming and pinning of a subtree.
+ *
+ * A pool of worker threads walks the backend below a directory and fills
+ * the metadata, directory and block caches straight from it, without a
+ * round trip through the kernel per file. Pinning warms the same way and
+ * also exempts the blocks of every regular file found from eviction;
+ * unpinning walks the tree only to drop the pins again.
+ *
+ * The walk does not follow symlinks and does not cross into other
+ * directories than the ones it lists, so it covers exactly what the
+ * subtree holds at the time.
+ */
+
+typedef enum {
+    CACHE_WARM_FILL,    /* Fill the caches */
+    CACHE_WARM_PIN,     /* Fill the caches and pin the files */
+    CACHE_WARM_UNPIN    /* Drop the pins of the files */
+} cache_warm_mode_t;
+
+/**
+ * Called for each regular file to get its block cache key.
+ * @param arg Callback argument from the options
+ * @param path FUSE path of the file
+ * @param fd Backend fd of the file, open for reading
+ * @param st Attributes of the file
+ * @return Block cache key, or 0 to skip the file
+ */
+typedef uint64_t (*cache_warm_key_fn)(void *arg, const char *path, int fd, const struct stat *st);
+
+/* What to walk with */
+typedef struct {
+    cache_meta_ctx_t *meta;     /* Metadata and listing cache (can be NULL) */
+    cache_block_ctx_t *blocks;  /* Block cache (can be NULL) */
+    size_t block_size;          /* Block size of the block cache */
+    RateLimiter *limiter;       /* Charged for block reads (can be NULL) */
+    cache_warm_key_fn file_key; /* Key of a file (required with blocks) */
+    void *file_key_arg;
+    bool follow_symlinks;       /* Symlinks are served as their targets, so
+                                   their attributes must not be cached */
+    int workers;                /* Worker threads */
+    bool debug;
+} cache_warm_opts_t;
+
+/* What a walk did */
+typedef struct {
+    size_t dirs;                /* Directories listed */
+    size_t files;               /* Regular files visited */
+    size_t blocks;              /* Blocks fetched into the block cache */
+    size_t bytes;               /* Bytes fetched into the block cache */
+    size_t errors;              /* Entries that could not be read */
+} cache_warm_stats_t;
+
+/**
+ * Walk a subtree and return when it has been covered.
+ * @param opts Caches and walk options
+ * @param mode What to do with the files found
+ * @param path FUSE path of the subtree root (file or directory)
+ * @param real_path Backend path of the subtree root
+ * @param stats_out What the walk did (can be NULL)
+ * @return 0 on success, -1 with errno set if the root cannot be read
+ */
+int cache_warm_tree(const cache_warm_opts_t *opts,
+                    cache_warm_mode_t mode,
+                    const char *path,
+                    const char *real_path,
+                    cache_warm_stats_t *stats_out);
+
+#endif /* CACHE_WARM_H */
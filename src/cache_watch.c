@@ -0,0 +1,519 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache_watch.h"
+#include "debug.h"
+
+#include <stdlib.h>
+
+#ifdef __linux__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | \
+                    IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+#define WATCH_INITIAL_BUCKETS 256
+#define WATCH_EVENT_BUF 65536
+
+/* One watched directory, in both hash tables */
+struct watch_node {
+    int wd;
+    uint64_t hash;
+    char *path;
+    struct watch_node *path_next;
+    struct watch_node *wd_next;
+};
+
+struct cache_watch {
+    char *root;
+    cache_watch_fn fn;
+    void *arg;
+    bool debug;
+
+    int ifd;                    /* inotify instance */
+    int stop_pipe[2];           /* Written to stop the thread */
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    struct watch_node **by_path;
+    struct watch_node **by_wd;
+    size_t bucket_count;
+    size_t count;
+    bool limit_logged;
+
+    /* Time when all queued events had last been read, and the span of
+       change times whose events may have been dropped (0 if none) */
+    time_t drained;
+    time_t missed_from;
+    time_t missed_until;
+};
+
+/* FNV-1a */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static struct watch_node **find_path_locked(cache_watch_t *watch, const char *path, uint64_t hash)
+{
+    struct watch_node **pp = &watch->by_path[hash % watch->bucket_count];
+    while (*pp != NULL && ((*pp)->hash != hash || strcmp((*pp)->path, path) != 0)) {
+        pp = &(*pp)->path_next;
+    }
+    return pp;
+}
+
+static struct watch_node **find_wd_locked(cache_watch_t *watch, int wd)
+{
+    struct watch_node **pp = &watch->by_wd[(size_t)wd % watch->bucket_count];
+    while (*pp != NULL && (*pp)->wd != wd) {
+        pp = &(*pp)->wd_next;
+    }
+    return pp;
+}
+
+static void grow_locked(cache_watch_t *watch)
+{
+    size_t new_count = watch->bucket_count * 2;
+    struct watch_node **by_path = calloc(new_count, sizeof(struct watch_node *));
+    struct watch_node **by_wd = calloc(new_count, sizeof(struct watch_node *));
+    if (by_path == NULL || by_wd == NULL) {
+        free(by_path);
+        free(by_wd);
+        return;
+    }
+    for (size_t i = 0; i < watch->bucket_count; i++) {
+        struct watch_node *n = watch->by_path[i];
+        while (n != NULL) {
+            struct watch_node *next = n->path_next;
+            n->path_next = by_path[n->hash % new_count];
+            by_path[n->hash % new_count] = n;
+            n->wd_next = by_wd[(size_t)n->wd % new_count];
+            by_wd[(size_t)n->wd % new_count] = n;
+            n = next;
+        }
+    }
+    free(watch->by_path);
+    free(watch->by_wd);
+    watch->by_path = by_path;
+    watch->by_wd = by_wd;
+    watch->bucket_count = new_count;
+}
+
+static void remove_locked(cache_watch_t *watch, struct watch_node *n)
+{
+    *find_path_locked(watch, n->path, n->hash) = n->path_next;
+    *find_wd_locked(watch, n->wd) = n->wd_next;
+    watch->count--;
+    free(n->path);
+    free(n);
+}
+
+static bool path_at_or_below(const char *path, const char *top)
+{
+    if (strcmp(top, "/") == 0) {
+        return true;
+    }
+    size_t len = strlen(top);
+    return strncmp(path, top, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/* Stop watching a directory that went away, and everything below it,
+   since their paths no longer lead there */
+static void forget_tree(cache_watch_t *watch, const char *top, bool rm_watches)
+{
+    pthread_mutex_lock(&watch->lock);
+    for (size_t i = 0; i < watch->bucket_count; i++) {
+        struct watch_node *n = watch->by_path[i];
+        while (n != NULL) {
+            struct watch_node *next = n->path_next;
+            if (path_at_or_below(n->path, top)) {
+                if (rm_watches) {
+                    inotify_rm_watch(watch->ifd, n->wd);
+                }
+                remove_locked(watch, n);
+            }
+            n = next;
+        }
+    }
+    pthread_mutex_unlock(&watch->lock);
+}
+
+static void handle_event(cache_watch_t *watch, const struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        if (watch->debug) {
+            DPRINTF("cache_watch: event queue overflowed, invalidating everything");
+        }
+        /* Changes since the queue was last empty, up to now when it has
+           room again, may be unreported. Change times have a granularity,
+           so the span is widened by a second on each side. */
+        pthread_mutex_lock(&watch->lock);
+        if (watch->missed_until == 0) {
+            watch->missed_from = watch->drained - 1;
+        }
+        watch->missed_until = time(NULL) + 1;
+        pthread_mutex_unlock(&watch->lock);
+        watch->fn(watch->arg, "/", CACHE_WATCH_TREE | CACHE_WATCH_LOST);
+        return;
+    }
+
+    char path[PATH_MAX];
+    pthread_mutex_lock(&watch->lock);
+    struct watch_node *n = *find_wd_locked(watch, ev->wd);
+    if (n != NULL && (ev->mask & IN_IGNORED)) {
+        remove_locked(watch, n);
+        n = NULL;
+    }
+    bool known = (n != NULL);
+    if (known) {
+        snprintf(path, sizeof(path), "%s", n->path);
+    }
+    pthread_mutex_unlock(&watch->lock);
+    if (!known) {
+        return;
+    }
+
+    if (ev->len == 0) {
+        /* The watched directory itself */
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            forget_tree(watch, path, (ev->mask & IN_MOVE_SELF) != 0);
+            watch->fn(watch->arg, path, CACHE_WATCH_TREE);
+        } else if (ev->mask & IN_ATTRIB) {
+            watch->fn(watch->arg, path, CACHE_WATCH_ATTRIB);
+        }
+        return;
+    }
+
+    char child[PATH_MAX];
+    int len = snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, ev->name);
+    if (len < 0 || (size_t)len >= sizeof(child)) {
+        return;
+    }
+
+    unsigned events = 0;
+    if (ev->mask & IN_ATTRIB) {
+        events |= CACHE_WATCH_ATTRIB;
+    }
+    if (ev->mask & IN_MODIFY) {
+        events |= CACHE_WATCH_CONTENT;
+    }
+    if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        events |= CACHE_WATCH_ENTRY;
+        if (ev->mask & IN_ISDIR) {
+            /* What was cached under the name belongs to another tree now */
+            events |= CACHE_WATCH_TREE;
+            forget_tree(watch, child, (ev->mask & IN_MOVED_FROM) != 0);
+        }
+    }
+    if (events == 0) {
+        return;
+    }
+
+    if (watch->debug) {
+        DPRINTF("cache_watch: %s changed (events 0x%x)", child, events);
+    }
+    watch->fn(watch->arg, child, events);
+}
+
+static void *watch_main(void *arg)
+{
+    cache_watch_t *watch = arg;
+    char *buf = malloc(WATCH_EVENT_BUF);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = watch->ifd, .events = POLLIN },
+        { .fd = watch->stop_pipe[0], .events = POLLIN },
+    };
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+
+        time_t before = time(NULL);
+        ssize_t n = read(watch->ifd, buf, WATCH_EVENT_BUF);
+        if (n <= 0) {
+            if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        if (n <= WATCH_EVENT_BUF - (ssize_t)(sizeof(struct inotify_event) + NAME_MAX + 1)) {
+            /* Room was left for another event, so this took all of them */
+            pthread_mutex_lock(&watch->lock);
+            watch->drained = before;
+            pthread_mutex_unlock(&watch->lock);
+        }
+        /* Records are padded so that each one is aligned */
+        for (ssize_t pos = 0; pos + (ssize_t)sizeof(struct inotify_event) <= n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)(buf + pos);
+            handle_event(watch, ev);
+            pos += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+cache_watch_t *cache_watch_create(const char *root, cache_watch_fn fn, void *arg, bool debug)
+{
+    if (root == NULL || fn == NULL) {
+        return NULL;
+    }
+
+    cache_watch_t *watch = calloc(1, sizeof(cache_watch_t));
+    if (watch == NULL) {
+        return NULL;
+    }
+    watch->fn = fn;
+    watch->arg = arg;
+    watch->debug = debug;
+    watch->ifd = -1;
+    watch->stop_pipe[0] = watch->stop_pipe[1] = -1;
+    watch->bucket_count = WATCH_INITIAL_BUCKETS;
+    watch->root = strdup(root);
+    watch->by_path = calloc(watch->bucket_count, sizeof(struct watch_node *));
+    watch->by_wd = calloc(watch->bucket_count, sizeof(struct watch_node *));
+    if (watch->root == NULL || watch->by_path == NULL || watch->by_wd == NULL) {
+        goto fail;
+    }
+
+    watch->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->ifd == -1) {
+        DPRINTF("cache_watch_create: inotify_init1 failed: %s", strerror(errno));
+        goto fail;
+    }
+    watch->drained = time(NULL);
+    if (pipe(watch->stop_pipe) != 0) {
+        goto fail;
+    }
+    pthread_mutex_init(&watch->lock, NULL);
+    if (pthread_create(&watch->thread, NULL, watch_main, watch) != 0) {
+        pthread_mutex_destroy(&watch->lock);
+        goto fail;
+    }
+
+    if (debug) {
+        DPRINTF("cache_watch_create: watching %s for backend changes", root);
+    }
+    return watch;
+
+fail:
+    if (watch->stop_pipe[0] != -1) {
+        close(watch->stop_pipe[0]);
+        close(watch->stop_pipe[1]);
+    }
+    if (watch->ifd != -1) {
+        close(watch->ifd);
+    }
+    free(watch->by_path);
+    free(watch->by_wd);
+    free(watch->root);
+    free(watch);
+    return NULL;
+}
+
+int cache_watch_add(cache_watch_t *watch, const char *path)
+{
+    if (watch == NULL || path == NULL) {
+        return -1;
+    }
+
+    uint64_t hash = hash_path(path);
+    pthread_mutex_lock(&watch->lock);
+    bool known = (*find_path_locked(watch, path, hash) != NULL);
+    pthread_mutex_unlock(&watch->lock);
+    if (known) {
+        return 0;
+    }
+
+    char real_path[PATH_MAX];
+    int len = snprintf(real_path, sizeof(real_path), "%s%s", watch->root,
+                       strcmp(path, "/") == 0 ? "" : path);
+    if (len < 0 || (size_t)len >= sizeof(real_path)) {
+        return -1;
+    }
+
+    int wd = inotify_add_watch(watch->ifd, real_path, WATCH_MASK);
+    if (wd == -1) {
+        if (errno == ENOSPC) {
+            pthread_mutex_lock(&watch->lock);
+            bool first = !watch->limit_logged;
+            watch->limit_logged = true;
+            pthread_mutex_unlock(&watch->lock);
+            if (first) {
+                DPRINTF("cache_watch_add: inotify watch limit reached, further directories are revalidated instead");
+            }
+        }
+        return -1;
+    }
+
+    struct watch_node *n = malloc(sizeof(struct watch_node));
+    if (n == NULL || (n->path = strdup(path)) == NULL) {
+        free(n);
+        return -1;
+    }
+    n->wd = wd;
+    n->hash = hash;
+
+    int res = 0;
+    pthread_mutex_lock(&watch->lock);
+    if (*find_path_locked(watch, path, hash) != NULL) {
+        /* Added meanwhile */
+        free(n->path);
+        free(n);
+    } else if (*find_wd_locked(watch, wd) != NULL) {
+        /* Same directory under another name; events name the first one */
+        free(n->path);
+        free(n);
+        res = -1;
+    } else {
+        n->path_next = watch->by_path[hash % watch->bucket_count];
+        watch->by_path[hash % watch->bucket_count] = n;
+        n->wd_next = watch->by_wd[(size_t)wd % watch->bucket_count];
+        watch->by_wd[(size_t)wd % watch->bucket_count] = n;
+        if (++watch->count > watch->bucket_count * 2) {
+            grow_locked(watch);
+        }
+    }
+    pthread_mutex_unlock(&watch->lock);
+    return res;
+}
+
+bool cache_watch_covers(cache_watch_t *watch, const char *path)
+{
+    if (watch == NULL || path == NULL) {
+        return false;
+    }
+
+    uint64_t hash = hash_path(path);
+    pthread_mutex_lock(&watch->lock);
+    bool covered = (*find_path_locked(watch, path, hash) != NULL);
+    pthread_mutex_unlock(&watch->lock);
+    return covered;
+}
+
+bool cache_watch_missed(cache_watch_t *watch, time_t ctime)
+{
+    if (watch == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&watch->lock);
+    bool missed = watch->missed_until != 0 &&
+                  ctime >= watch->missed_from && ctime <= watch->missed_until;
+    pthread_mutex_unlock(&watch->lock);
+    return missed;
+}
+
+void cache_watch_destroy(cache_watch_t *watch)
+{
+    if (watch == NULL) {
+        return;
+    }
+
+    ssize_t n = write(watch->stop_pipe[1], "x", 1);
+    (void)n;
+    pthread_join(watch->thread, NULL);
+    close(watch->stop_pipe[0]);
+    close(watch->stop_pipe[1]);
+    close(watch->ifd);  /* Removes all watches */
+
+    for (size_t i = 0; i < watch->bucket_count; i++) {
+        struct watch_node *n = watch->by_path[i];
+        while (n != NULL) {
+            struct watch_node *next = n->path_next;
+            free(n->path);
+            free(n);
+            n = next;
+        }
+    }
+    free(watch->by_path);
+    free(watch->by_wd);
+    pthread_mutex_destroy(&watch->lock);
+    free(watch->root);
+    free(watch);
+}
+
+#else /* !__linux__ */
+
+cache_watch_t *cache_watch_create(const char *root, cache_watch_fn fn, void *arg, bool debug)
+{
+    (void)root;
+    (void)fn;
+    (void)arg;
+    if (debug) {
+        DPRINTF("cache_watch_create: backend change notification needs inotify");
+    }
+    return NULL;
+}
+
+int cache_watch_add(cache_watch_t *watch, const char *path)
+{
+    (void)watch;
+    (void)path;
+    return -1;
+}
+
+bool cache_watch_covers(cache_watch_t *watch, const char *path)
+{
+    (void)watch;
+    (void)path;
+    return false;
+}
+
+bool cache_watch_missed(cache_watch_t *watch, time_t ctime)
+{
+    (void)watch;
+    (void)ctime;
+    return false;
+}
+
+void cache_watch_destroy(cache_watch_t *watch)
+{
+    (void)watch;
+}
+
+#endif /* __linux__ */
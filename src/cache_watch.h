@@ -0,0 +1,101 @@
+/*
+    Copyright 2024 Alex Karasulu <akarasulu@gmail.com>
+
+    This file is part of CacheFS.
+
+    CacheFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CacheFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CacheFS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_WATCH_H
+#define CACHE_WATCH_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Backend change notification.
+ *
+ * Directories whose entries or listings are cached get an inotify watch
+ * on the backend, and a background thread turns the events into cache
+ * invalidations through a callback. That covers changes made to the
+ * backend behind our back, so cached listings of watched directories can
+ * be served without asking the backend whether they are still current.
+ *
+ * Watches are added before the directory is read, so no change between
+ * reading and watching is missed. If the watch limit is reached, the
+ * directory simply stays unwatched. If the kernel's event queue overflows,
+ * events are lost: the callback is told that everything may have changed,
+ * and cache_watch_missed() tells which changes could have gone unreported.
+ * Only available on Linux; elsewhere cache_watch_create() returns NULL.
+ */
+
+/* Events passed to the callback */
+#define CACHE_WATCH_ATTRIB  0x1  /* Attributes of path changed */
+#define CACHE_WATCH_CONTENT 0x2  /* Data of the file at path changed */
+#define CACHE_WATCH_ENTRY   0x4  /* path was created, removed or renamed */
+#define CACHE_WATCH_TREE    0x8  /* Anything at or below path may have changed */
+#define CACHE_WATCH_LOST    0x10 /* With CACHE_WATCH_TREE: events were dropped */
+
+/* Opaque watcher handle */
+typedef struct cache_watch cache_watch_t;
+
+/**
+ * Called on the watcher thread for each change.
+ * @param arg Callback argument given to cache_watch_create()
+ * @param path FUSE path that changed
+ * @param events CACHE_WATCH_* flags
+ */
+typedef void (*cache_watch_fn)(void *arg, const char *path, unsigned events);
+
+/**
+ * Start the watcher thread.
+ * @param root Backend directory that FUSE paths are relative to
+ * @param fn Change callback
+ * @param arg Argument passed to the callback
+ * @param debug Enable debug logging
+ * @return Watcher handle or NULL on error or if unsupported
+ */
+cache_watch_t *cache_watch_create(const char *root, cache_watch_fn fn, void *arg, bool debug);
+
+/**
+ * Watch a backend directory, if not watched already.
+ * @param watch Watcher handle (can be NULL)
+ * @param path FUSE path of the directory
+ * @return 0 if the directory is watched, -1 if not
+ */
+int cache_watch_add(cache_watch_t *watch, const char *path);
+
+/**
+ * Check if changes to a directory's entries are being reported.
+ * @param watch Watcher handle (can be NULL)
+ * @param path FUSE path of the directory
+ * @return true if the directory is watched
+ */
+bool cache_watch_covers(cache_watch_t *watch, const char *path);
+
+/**
+ * Check if a change may have happened while events were being dropped.
+ * @param watch Watcher handle (can be NULL)
+ * @param ctime Backend change time of a file
+ * @return true if a change at that time may not have been reported
+ */
+bool cache_watch_missed(cache_watch_t *watch, time_t ctime);
+
+/**
+ * Stop the watcher thread and remove all watches.
+ * @param watch Watcher handle
+ */
+void cache_watch_destroy(cache_watch_t *watch);
+
+#endif /* CACHE_WATCH_H */
@@ -75,6 +75,8 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <linux/fs.h>  // For BLKGETSIZE64
+#include <linux/falloc.h>
+#include <sys/syscall.h>
 
 #ifndef O_DIRECT
 #define O_DIRECT 00040000 /* direct disk access hint */
@@ -92,10 +94,17 @@
 #include "rate_limiter.h"
 #include "userinfo.h"
 #include "usermap.h"
+#include "cache_stats.h"
 
 #ifdef HAVE_SQLITE3
 #include "cache_meta.h"
 #include "cache_block.h"
+#include "cache_readahead.h"
+#include "cache_io.h"
+#include "cache_admit.h"
+#include "cache_notify.h"
+#include "cache_watch.h"
+#include "cache_warm.h"
 #include "cache_coherency.h"
 #endif
 
@@ -144,6 +153,9 @@ static struct Settings {
 
     RateLimiter *read_limiter;
     RateLimiter *write_limiter;
+    int rate_per_user; /* --rate-per-user: the limiters below replace the above */
+    RateLimiterMap *read_limiters;
+    RateLimiterMap *write_limiters;
 
     enum CreatePolicy {
         CREATE_AS_USER,
@@ -225,26 +237,149 @@ static struct Settings {
     int cache_dir_ttl;
     size_t cache_block_size;
     size_t cache_max_size;
+    size_t cache_mem_size;
+    int cache_readahead;
+    int cache_kernel;
+    int cache_dedup;
+    int cache_write_populate;
+    int cache_odirect;
+    size_t cache_stream_bypass;
+    cache_admit_policy_t cache_admission;
+    int cache_watch;
+    char *cache_stats_socket;
+    char *cache_shared;         /* Directory of a block store shared with other mounts */
+    cache_codec_t cache_codec;
+    int cache_codec_level;
+    cache_meta_backend_t cache_meta_backend;
+    cache_io_engine_t cache_io;
+    unsigned cache_io_depth;
     int cache_debug;
 
 } settings;
 
 static bool bindfs_init_failed = false;
 
+static cache_stats_server_t *cache_stats_server = NULL;
+
+/* Per-open-file state kept in fi->fh */
+struct bindfs_fh {
+    int fd;
+#ifdef HAVE_SQLITE3
+    cache_ra_file_t *ra;    /* Readahead state, NULL if not tracked */
+    uint64_t file_key;      /* Block cache key, 0 if not cached */
+    bool writer;            /* Counted in own_writers */
+    bool uncached;          /* Reads bypass the block cache (O_DIRECT) */
+    off_t stream_end;       /* Where the sequential run of reads ends */
+    size_t stream_bytes;    /* Bytes read in that run */
+#endif
+};
+
+#define FI_FH(fi) ((struct bindfs_fh *)(uintptr_t)(fi)->fh)
+#define FI_FD(fi) (FI_FH(fi)->fd)
+
 #ifdef HAVE_SQLITE3
 /* CacheFS global context */
 static cache_meta_ctx_t *cache_meta_ctx = NULL;
 static cache_block_ctx_t *cache_block_ctx = NULL;
+static cache_readahead_t *cache_readahead_ctx = NULL;
+static cache_admit_t *cache_admit_ctx = NULL;
+static cache_notify_t *cache_notify_ctx = NULL;
+static cache_watch_t *cache_watch_ctx = NULL;
 static pthread_mutex_t cache_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 static bool cache_initialized = false;
 
-/* Cache statistics */
-static struct {
-    unsigned long getattr_hits;
-    unsigned long getattr_misses;
-    unsigned long readdir_hits;
-    unsigned long readdir_misses;
-} cache_stats = {0, 0, 0, 0};
+#define READAHEAD_WORKERS 4
+#define WARM_WORKERS 8          /* Default for the warm and pin attributes */
+
+/* Files open for writing with --cache-write-populate, by file key. Our
+   own writes merge into the cached blocks, so a backend change event that
+   only reflects them must not drop the blocks. Each entry keeps the
+   backend size and mtime our last write left, to tell such events from
+   changes made by others. */
+#define OWN_WRITER_BUCKETS 256
+
+struct own_writer {
+    uint64_t file_key;
+    unsigned count;         /* Open file handles */
+    bool written;           /* The stat below is set */
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    struct own_writer *next;
+};
+
+static struct own_writer *own_writers[OWN_WRITER_BUCKETS];
+static pthread_mutex_t own_writers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct own_writer **own_writer_slot(uint64_t file_key)
+{
+    struct own_writer **slot = &own_writers[file_key % OWN_WRITER_BUCKETS];
+    while (*slot != NULL && (*slot)->file_key != file_key) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/* Returns false if out of memory */
+static bool own_writer_open(uint64_t file_key)
+{
+    pthread_mutex_lock(&own_writers_lock);
+    struct own_writer **slot = own_writer_slot(file_key);
+    if (*slot == NULL) {
+        *slot = calloc(1, sizeof(struct own_writer));
+        if (*slot == NULL) {
+            pthread_mutex_unlock(&own_writers_lock);
+            return false;
+        }
+        (*slot)->file_key = file_key;
+    }
+    (*slot)->count++;
+    pthread_mutex_unlock(&own_writers_lock);
+    return true;
+}
+
+static void own_writer_close(uint64_t file_key)
+{
+    pthread_mutex_lock(&own_writers_lock);
+    struct own_writer **slot = own_writer_slot(file_key);
+    if (*slot != NULL && --(*slot)->count == 0) {
+        struct own_writer *w = *slot;
+        *slot = w->next;
+        free(w);
+    }
+    pthread_mutex_unlock(&own_writers_lock);
+}
+
+/* Records the backend stat after a write merged into the cache */
+static void own_writer_wrote(uint64_t file_key, const struct stat *st)
+{
+    pthread_mutex_lock(&own_writers_lock);
+    struct own_writer *w = *own_writer_slot(file_key);
+    if (w != NULL) {
+        w->written = true;
+        w->size = st->st_size;
+        w->mtime = st->st_mtime;
+#ifdef HAVE_STAT_NANOSEC
+        w->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+    }
+    pthread_mutex_unlock(&own_writers_lock);
+}
+
+/* Checks if the backend file looks the way our last write left it */
+static bool own_writer_matches(uint64_t file_key, const struct stat *st)
+{
+    pthread_mutex_lock(&own_writers_lock);
+    struct own_writer *w = *own_writer_slot(file_key);
+    bool matches = w != NULL && w->written &&
+                   w->size == st->st_size && w->mtime == st->st_mtime
+#ifdef HAVE_STAT_NANOSEC
+                   && w->mtime_nsec == st->st_mtim.tv_nsec
+#endif
+                   ;
+    pthread_mutex_unlock(&own_writers_lock);
+    return matches;
+}
 
 /* Helper to print timestamp */
 static void print_timestamp(FILE *fp) {
@@ -252,11 +387,30 @@ static void print_timestamp(FILE *fp) {
     struct tm *tm = localtime(&now);
     fprintf(fp, "[%02d:%02d:%02d] ", tm->tm_hour, tm->tm_min, tm->tm_sec);
 }
+
+#ifdef HAVE_FUSE_3
+/* Set in bindfs_init, for kernel invalidations */
+static struct fuse *kernel_fuse = NULL;
+
+static void notify_kernel_cb(void *arg, const char *path)
+{
+    /* Fails with ENOENT if the kernel has nothing cached, which is fine */
+    fuse_invalidate_path((struct fuse *)arg, path);
+}
+#endif
+
+/* Drops what the kernel caches for path after we found it stale */
+static void notify_kernel(const char *path)
+{
+    cache_notify_push(cache_notify_ctx, path);
+}
 #endif
 
 
 
 #ifdef HAVE_SQLITE3
+static void watch_event_cb(void *arg, const char *path, unsigned events);
+
 /* Lazy initialization of cache subsystems (called on first use) */
 static void ensure_cache_initialized(void)
 {
@@ -283,6 +437,7 @@ static void ensure_cache_initialized(void)
         cache_meta_ctx = cache_meta_init(settings.cache_root,
                                           settings.cache_meta_ttl,
                                           settings.cache_dir_ttl,
+                                          settings.cache_meta_backend,
                                           settings.cache_debug);
         if (cache_meta_ctx == NULL) {
             fprintf(stderr, "[CACHE_INIT] ERROR: cache_meta_init() returned NULL\n");
@@ -292,15 +447,74 @@ static void ensure_cache_initialized(void)
         
         /* Initialize block cache */
         fprintf(stderr, "[CACHE_INIT] Calling cache_block_init()...\n");
-        cache_block_ctx = cache_block_init(settings.cache_root,
-                                            settings.cache_block_size,
-                                            settings.cache_max_size,
-                                            settings.cache_debug);
+        if (settings.cache_shared != NULL) {
+            cache_block_ctx = cache_block_init_shared(settings.cache_shared,
+                                                      settings.cache_block_size,
+                                                      settings.cache_max_size,
+                                                      settings.cache_mem_size,
+                                                      settings.cache_dedup,
+                                                      settings.cache_codec,
+                                                      settings.cache_codec_level,
+                                                      settings.cache_debug);
+        } else {
+            cache_block_ctx = cache_block_init(settings.cache_root,
+                                                settings.cache_block_size,
+                                                settings.cache_max_size,
+                                                settings.cache_mem_size,
+                                                settings.cache_dedup,
+                                                settings.cache_codec,
+                                                settings.cache_codec_level,
+                                                settings.cache_debug);
+        }
         if (cache_block_ctx == NULL) {
             fprintf(stderr, "[CACHE_INIT] ERROR: cache_block_init() returned NULL\n");
         } else {
             fprintf(stderr, "[CACHE_INIT] cache_block_init() succeeded\n");
         }
+
+        /* Admission only matters once something has to be evicted */
+        if (cache_block_ctx != NULL && settings.cache_admission == CACHE_ADMIT_TINYLFU &&
+            settings.cache_max_size > 0) {
+            cache_admit_ctx = cache_admit_create(settings.cache_max_size / settings.cache_block_size);
+            if (cache_admit_ctx == NULL) {
+                fprintf(stderr, "[CACHE_INIT] ERROR: cache_admit_create() returned NULL\n");
+            }
+        }
+
+        /* Before the readahead workers, which size their batches by it */
+        cache_io_init(settings.cache_io, settings.cache_io_depth, settings.cache_debug);
+
+        /* Start readahead workers */
+        if (cache_block_ctx != NULL && settings.cache_readahead > 0) {
+            cache_readahead_ctx = cache_readahead_create(cache_block_ctx,
+                                                         settings.cache_block_size,
+                                                         READAHEAD_WORKERS,
+                                                         settings.cache_readahead,
+                                                         settings.cache_debug);
+            if (cache_readahead_ctx == NULL) {
+                fprintf(stderr, "[CACHE_INIT] ERROR: cache_readahead_create() returned NULL\n");
+            }
+        }
+
+#ifdef HAVE_FUSE_3
+        /* Push our invalidations to the kernel caches */
+        if (settings.cache_kernel && kernel_fuse != NULL) {
+            cache_notify_ctx = cache_notify_create(notify_kernel_cb, kernel_fuse,
+                                                   settings.cache_debug);
+            if (cache_notify_ctx == NULL) {
+                fprintf(stderr, "[CACHE_INIT] ERROR: cache_notify_create() returned NULL\n");
+            }
+        }
+#endif
+        
+        /* Watch the backend for changes made behind our back */
+        if (settings.cache_watch && cache_meta_ctx != NULL) {
+            cache_watch_ctx = cache_watch_create(settings.mntsrc, watch_event_cb, NULL,
+                                                 settings.cache_debug);
+            if (cache_watch_ctx == NULL) {
+                fprintf(stderr, "[CACHE_INIT] ERROR: cache_watch_create() returned NULL\n");
+            }
+        }
         
         fprintf(stderr, "[CACHE_INIT] Cache initialization complete\n");
     }
@@ -404,11 +618,31 @@ static int bindfs_read(const char *path, char *buf, size_t size, off_t offset,
 static int bindfs_write(const char *path, const char *buf, size_t size,
                         off_t offset, struct fuse_file_info *fi);
 #if defined(HAVE_FUSE_29) || defined(HAVE_FUSE_3)
+static int bindfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                           size_t size, off_t offset, struct fuse_file_info *fi);
+static int bindfs_write_buf(const char *path, struct fuse_bufvec *buf,
+                            off_t offset, struct fuse_file_info *fi);
+#ifdef HAVE_SQLITE3
+static struct read_pins *thread_read_pins(void);
+#endif
 static int bindfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
                        struct flock *lock);
 static int bindfs_flock(const char *path, struct fuse_file_info *fi, int op);
 #endif
 #ifdef HAVE_FUSE_3
+static int bindfs_fallocate(const char *path, int mode, off_t offset,
+                            off_t length, struct fuse_file_info *fi);
+static ssize_t bindfs_copy_file_range(const char *path_in,
+                                      struct fuse_file_info *fi_in,
+                                      off_t offset_in, const char *path_out,
+                                      struct fuse_file_info *fi_out,
+                                      off_t offset_out, size_t size, int flags);
+#ifdef HAVE_FUSE_LSEEK
+static off_t bindfs_lseek(const char *path, off_t off, int whence,
+                          struct fuse_file_info *fi);
+#endif
+#endif
+#ifdef HAVE_FUSE_3
 static int bindfs_ioctl(const char *path, int cmd, void *arg,
                         struct fuse_file_info *fi, unsigned int flags,
                         void *data);
@@ -507,6 +741,222 @@ static char *process_path(const char *path, bool resolve_symlinks)
     }
 }
 
+/* Drops the cached listing of the directory containing path */
+static void invalidate_parent_listing(const char *path)
+{
+#ifdef HAVE_SQLITE3
+    const char *last_slash = strrchr(path, '/');
+    if (cache_meta_ctx == NULL || last_slash == NULL) {
+        return;
+    }
+    /* The root's children have "/" as parent */
+    char *parent = strndup(path, last_slash == path ? 1 : (size_t)(last_slash - path));
+    if (parent != NULL) {
+        cache_dir_invalidate(cache_meta_ctx, parent);
+        free(parent);
+    }
+#else
+    (void)path;
+#endif
+}
+
+/* Drops the cached attributes of path after it was changed */
+static void invalidate_cached_attrs(const char *path)
+{
+#ifdef HAVE_SQLITE3
+    if (cache_meta_ctx != NULL) {
+        cache_meta_invalidate(cache_meta_ctx, path);
+        /* The parent's listing may carry the old attributes too */
+        invalidate_parent_listing(path);
+    }
+#else
+    (void)path;
+#endif
+}
+
+#ifdef HAVE_SQLITE3
+/* Watches the backend directory containing path, before what we are
+   about to cache from it is read */
+static void watch_parent(const char *path)
+{
+    const char *last_slash = strrchr(path, '/');
+    if (cache_watch_ctx == NULL || last_slash == NULL) {
+        return;
+    }
+    char *parent = strndup(path, last_slash == path ? 1 : (size_t)(last_slash - path));
+    if (parent != NULL) {
+        cache_watch_add(cache_watch_ctx, parent);
+        free(parent);
+    }
+}
+
+/* Checks if a reported content change is no more than our own writes,
+   which are in the cached blocks already */
+static bool own_content_change(const char *path, uint64_t file_key)
+{
+    while (*path == '/') {
+        path++;
+    }
+    struct stat st;
+    if (fstatat(settings.mntsrc_fd, *path != '\0' ? path : ".", &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return false;
+    }
+    return own_writer_matches(file_key, &st);
+}
+
+/* Applies a backend change reported by the watcher */
+static void watch_event_cb(void *arg, const char *path, unsigned events)
+{
+    (void)arg;
+    if (cache_meta_ctx == NULL) {
+        return;
+    }
+
+    if (events & CACHE_WATCH_TREE) {
+        if ((events & CACHE_WATCH_LOST) && cache_block_ctx != NULL) {
+            /* Which files changed is unknown, and blocks don't record
+               what they were read from */
+            cache_block_invalidate_all(cache_block_ctx);
+        }
+        cache_meta_invalidate_tree(cache_meta_ctx, path);
+        cache_dir_invalidate(cache_meta_ctx, path);
+        cache_ident_forget(cache_meta_ctx, path);
+        invalidate_parent_listing(path);
+        notify_kernel(path);
+        return;
+    }
+
+    cache_file_id_t id;
+    if ((events & CACHE_WATCH_CONTENT) && cache_ident_lookup(cache_meta_ctx, path, &id) == 0) {
+        uint64_t key = cache_file_key(&id);
+        if (settings.cache_write_populate && own_content_change(path, key)) {
+            return;
+        }
+        if (cache_block_ctx != NULL) {
+            cache_block_invalidate_file(cache_block_ctx, key);
+        }
+    }
+    if (events & CACHE_WATCH_ENTRY) {
+        /* Whatever was known under the name is gone, or replaced */
+        cache_ident_forget(cache_meta_ctx, path);
+    }
+    invalidate_cached_attrs(path);
+    notify_kernel(path);
+}
+#endif
+
+#ifdef HAVE_SQLITE3
+/* Inode generation of an open backend file, or 0 if not reported */
+static uint64_t file_generation(int fd)
+{
+#if defined(__linux__) && defined(FS_IOC_GETVERSION)
+    long gen = 0;  /* Filesystems store an int here */
+    if (ioctl(fd, FS_IOC_GETVERSION, &gen) == 0) {
+        return (uint32_t)gen;
+    }
+#else
+    (void)fd;
+#endif
+    return 0;
+}
+
+/* Identities of files opened lately, by device and inode number, for
+   when a file's generation is needed but it can't be opened. A slot is
+   overwritten by the next inode hashing to it; a file missing here just
+   goes without invalidation, which revalidation on open makes up for. */
+#define KNOWN_IDENT_SLOTS 4096
+
+static cache_file_id_t known_idents[KNOWN_IDENT_SLOTS];
+static pthread_mutex_t known_idents_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t known_ident_slot(uint64_t dev, uint64_t ino)
+{
+    return cache_ident_mix(cache_ident_mix(ino) ^ dev) % KNOWN_IDENT_SLOTS;
+}
+
+static void known_ident_store(const cache_file_id_t *id)
+{
+    pthread_mutex_lock(&known_idents_lock);
+    known_idents[known_ident_slot(id->dev, id->ino)] = *id;
+    pthread_mutex_unlock(&known_idents_lock);
+}
+
+/* Returns 0 if the identity isn't known */
+static uint64_t known_ident_key(uint64_t dev, uint64_t ino)
+{
+    uint64_t key = 0;
+    pthread_mutex_lock(&known_idents_lock);
+    const cache_file_id_t *id = &known_idents[known_ident_slot(dev, ino)];
+    if (id->dev == dev && id->ino == ino && (dev != 0 || ino != 0)) {
+        key = cache_file_key(id);
+    }
+    pthread_mutex_unlock(&known_idents_lock);
+    return key;
+}
+
+/* Block cache key of an open backend file. Also records the identity
+   seen at path, for operations that only have the path. */
+static uint64_t file_key_for_fd(const char *path, int fd, const struct stat *st)
+{
+    struct stat fd_st;
+    if (st == NULL) {
+        if (fstat(fd, &fd_st) == -1) {
+            return 0;
+        }
+        st = &fd_st;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    cache_file_id_t id = { st->st_dev, st->st_ino, file_generation(fd) };
+    cache_ident_store(cache_meta_ctx, path, &id);
+    known_ident_store(&id);
+    return cache_file_key(&id);
+}
+
+/* Block cache key of the file at real_path, or 0 if it isn't a regular
+   file or its generation can't be found. The recorded identity saves
+   opening the file for its generation as long as the inode there is
+   still the same. */
+static uint64_t file_key_for_path(const char *path, const char *real_path, struct stat *st_out)
+{
+    struct stat st;
+    if (lstat(real_path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (st_out != NULL) {
+        *st_out = st;
+    }
+
+    cache_file_id_t id;
+    if (cache_ident_lookup(cache_meta_ctx, path, &id) == 0 &&
+        id.dev == (uint64_t)st.st_dev && id.ino == (uint64_t)st.st_ino) {
+        return cache_file_key(&id);
+    }
+
+    int fd = open(real_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if (fd == -1) {
+        /* A generation of 0 would name other blocks than the file's */
+        return known_ident_key(st.st_dev, st.st_ino);
+    }
+    uint64_t key = file_key_for_fd(path, fd, &st);
+    close(fd);
+    return key;
+}
+
+/* Block cache gauges for a stats snapshot */
+static void stats_gauges(void *arg, cache_stats_gauges_t *gauges)
+{
+    (void)arg;
+    if (cache_block_ctx == NULL) {
+        return;
+    }
+    cache_block_get_stats(cache_block_ctx, &gauges->cache_bytes, &gauges->max_bytes);
+    cache_block_get_pinned(cache_block_ctx, &gauges->pinned_bytes, &gauges->pinned_files);
+}
+#endif
+
 static int getattr_common(const char *procpath, struct stat *stbuf)
 {
     struct fuse_context *fc = fuse_get_context();
@@ -710,24 +1160,26 @@ static int delete_file(const char *path, int (*target_delete_func)(const char *)
         }
     }
 
+    /* Blocks are shared by all links to a file, so drop them only along
+       with the last link */
+    struct stat victim_st;
+    uint64_t victim_key = 0;
+    if (cache_block_ctx != NULL) {
+        victim_key = file_key_for_path(path, real_path, &victim_st);
+    }
+
     res = main_delete_func(real_path);
     
     /* Invalidate cache for deleted file/directory and parent dir (before freeing real_path) */
     if (res == 0 && cache_meta_ctx != NULL) {
-        cache_meta_invalidate(cache_meta_ctx, real_path);
-        /* Invalidate parent directory cache (mtime changed) */
-        char *parent = strdup(real_path);
-        if (parent) {
-            char *last_slash = strrchr(parent, '/');
-            if (last_slash && last_slash != parent) {
-                *last_slash = '\0';
-                cache_dir_invalidate(cache_meta_ctx, parent);
-            }
-            free(parent);
-        }
-        /* Also invalidate blocks for deleted files */
-        if (cache_block_ctx != NULL) {
-            cache_block_invalidate_file(cache_block_ctx, real_path);
+        cache_meta_invalidate(cache_meta_ctx, path);
+        /* Invalidate parent directory cache (mtime changed), and the
+           listing of a removed directory */
+        invalidate_parent_listing(path);
+        cache_dir_invalidate(cache_meta_ctx, path);
+        cache_ident_forget(cache_meta_ctx, path);
+        if (victim_key != 0 && victim_st.st_nlink <= 1) {
+            cache_block_invalidate_file(cache_block_ctx, victim_key);
         }
     }
     
@@ -798,6 +1250,25 @@ static bool bounded_add(int64_t* a, int64_t b, int64_t max) {
     return false;
 }
 
+/* The limiter to charge for the calling user's backend traffic, if any */
+static RateLimiter *caller_limiter(RateLimiter *shared, RateLimiterMap *per_user)
+{
+    if (per_user != NULL) {
+        return rate_limiter_map_get(per_user, fuse_get_context()->uid);
+    }
+    return shared;
+}
+
+static RateLimiter *caller_read_limiter(void)
+{
+    return caller_limiter(settings.read_limiter, settings.read_limiters);
+}
+
+static RateLimiter *caller_write_limiter(void)
+{
+    return caller_limiter(settings.write_limiter, settings.write_limiters);
+}
+
 #ifdef __linux__
 static size_t round_up_buffer_size_for_direct_io(size_t size)
 {
@@ -820,6 +1291,10 @@ static void *bindfs_init(struct fuse_conn_info *conn)
 #endif
 {
     (void) conn;
+#if defined(HAVE_FUSE_29) || defined(HAVE_FUSE_3)
+    /* Let read replies that point at cached block files be spliced */
+    conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+#endif
     #ifdef HAVE_FUSE_3
     cfg->use_ino = 1;
 
@@ -829,6 +1304,16 @@ static void *bindfs_init(struct fuse_conn_info *conn)
     cfg->entry_timeout = 0;
     cfg->attr_timeout = 0;
     cfg->negative_timeout = 0;
+#ifdef HAVE_SQLITE3
+    // With --cache-kernel the kernel may keep what our own cache would
+    // serve anyway, and we tell it when something turns out stale.
+    if (settings.cache_kernel) {
+        cfg->entry_timeout = settings.cache_dir_ttl;
+        cfg->attr_timeout = settings.cache_meta_ttl;
+        // negative_timeout stays 0: we keep no negative entries either.
+        kernel_fuse = fuse_get_context()->fuse;
+    }
+#endif
 #ifdef __linux__
     cfg->direct_io = settings.direct_io;
 #endif
@@ -874,28 +1359,48 @@ static void *bindfs_init(struct fuse_conn_info *conn)
     }
 #endif
 
+    /* Started here rather than in main() so it runs in the daemon */
+    if (settings.cache_stats_socket != NULL) {
+#ifdef HAVE_SQLITE3
+        cache_stats_server = cache_stats_serve(settings.cache_stats_socket, stats_gauges, NULL);
+#else
+        cache_stats_server = cache_stats_serve(settings.cache_stats_socket, NULL, NULL);
+#endif
+        if (cache_stats_server == NULL) {
+            fprintf(stderr, "Could not serve stats on '%s': %s\n",
+                    settings.cache_stats_socket, strerror(errno));
+        }
+    }
+
     return NULL;
 }
 
 static void bindfs_destroy(void *private_data)
 {
     (void)private_data;
+
+    cache_stats_server_stop(cache_stats_server);
+    cache_stats_server = NULL;
     
     /* Print cache statistics */
 #ifdef HAVE_SQLITE3
+    unsigned long getattr_hits = cache_stats_total(CACHE_CTR_GETATTR_HITS);
+    unsigned long getattr_misses = cache_stats_total(CACHE_CTR_GETATTR_MISSES);
+    unsigned long readdir_hits = cache_stats_total(CACHE_CTR_READDIR_HITS);
+    unsigned long readdir_misses = cache_stats_total(CACHE_CTR_READDIR_MISSES);
     fprintf(stderr, "\n=== CacheFS Statistics ===\n");
-    fprintf(stderr, "getattr hits:   %lu\n", cache_stats.getattr_hits);
-    fprintf(stderr, "getattr misses: %lu\n", cache_stats.getattr_misses);
-    if (cache_stats.getattr_hits + cache_stats.getattr_misses > 0) {
-        double hit_rate = (double)cache_stats.getattr_hits / 
-            (cache_stats.getattr_hits + cache_stats.getattr_misses) * 100.0;
+    fprintf(stderr, "getattr hits:   %lu\n", getattr_hits);
+    fprintf(stderr, "getattr misses: %lu\n", getattr_misses);
+    if (getattr_hits + getattr_misses > 0) {
+        double hit_rate = (double)getattr_hits /
+            (getattr_hits + getattr_misses) * 100.0;
         fprintf(stderr, "getattr hit rate: %.1f%%\n", hit_rate);
     }
-    fprintf(stderr, "readdir hits:   %lu\n", cache_stats.readdir_hits);
-    fprintf(stderr, "readdir misses: %lu\n", cache_stats.readdir_misses);
-    if (cache_stats.readdir_hits + cache_stats.readdir_misses > 0) {
-        double hit_rate = (double)cache_stats.readdir_hits / 
-            (cache_stats.readdir_hits + cache_stats.readdir_misses) * 100.0;
+    fprintf(stderr, "readdir hits:   %lu\n", readdir_hits);
+    fprintf(stderr, "readdir misses: %lu\n", readdir_misses);
+    if (readdir_hits + readdir_misses > 0) {
+        double hit_rate = (double)readdir_hits /
+            (readdir_hits + readdir_misses) * 100.0;
         fprintf(stderr, "readdir hit rate: %.1f%%\n", hit_rate);
     }
     fprintf(stderr, "Cache meta ctx: %p\n", (void*)cache_meta_ctx);
@@ -905,14 +1410,34 @@ static void bindfs_destroy(void *private_data)
     
     /* Cleanup CacheFS */
 #ifdef HAVE_SQLITE3
+    /* Its callback uses the other contexts */
+    if (cache_watch_ctx != NULL) {
+        cache_watch_destroy(cache_watch_ctx);
+        cache_watch_ctx = NULL;
+    }
     if (cache_meta_ctx != NULL) {
         cache_meta_destroy(cache_meta_ctx);
         cache_meta_ctx = NULL;
     }
+    if (cache_notify_ctx != NULL) {
+        cache_notify_destroy(cache_notify_ctx);
+        cache_notify_ctx = NULL;
+    }
+    if (cache_readahead_ctx != NULL) {
+        cache_readahead_destroy(cache_readahead_ctx);
+        cache_readahead_ctx = NULL;
+    }
     if (cache_block_ctx != NULL) {
+#if defined(HAVE_FUSE_29) || defined(HAVE_FUSE_3)
+        /* Workers are gone and released theirs on exit; the loop may
+           have run on this thread */
+        thread_read_pins();
+#endif
         cache_block_destroy(cache_block_ctx);
         cache_block_ctx = NULL;
     }
+    cache_admit_destroy(cache_admit_ctx);
+    cache_admit_ctx = NULL;
 #endif
 }
 
@@ -923,6 +1448,7 @@ static int bindfs_getattr(const char *path, struct stat *stbuf,
 static int bindfs_getattr(const char *path, struct stat *stbuf)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_GETATTR);
     int res;
     char *real_path;
 #ifdef HAVE_FUSE_3
@@ -941,36 +1467,24 @@ static int bindfs_getattr(const char *path, struct stat *stbuf)
         cache_meta_entry_t cached;
         bool valid;
         
-        /* Check cache (both positive and negative entries) */
-        if (cache_meta_lookup(cache_meta_ctx, path, &cached, &valid) == 0 && valid) {
-            /* Negative cache hit - file doesn't exist */
-            if (cached.type == CACHE_ENTRY_NEG) {
-                if (settings.cache_debug) {
-                    print_timestamp(stderr);
-                    fprintf(stderr, "getattr negative cache hit: %s\n", path);
-                    fflush(stderr);
-                }
-                return -ENOENT;
-            }
-            
+        /* Only positive entries are served. Missing names are answered
+           by complete listings below, which a change to the directory
+           clears; a negative entry per name would go stale unnoticed. */
+        uint64_t lookup_start = cache_stats_now();
+        int found = cache_meta_lookup(cache_meta_ctx, path, &cached, &valid);
+        cache_stats_since(CACHE_STAGE_META_LOOKUP, lookup_start);
+        if (found == 0 && valid) {
             /* Positive cache hit - use cached metadata including inode */
             if (cached.type == CACHE_ENTRY_FILE || cached.type == CACHE_ENTRY_DIR) {
-                __sync_fetch_and_add(&cache_stats.getattr_hits, 1);
+                cache_stats_add(CACHE_CTR_GETATTR_HITS, 1);
                 if (settings.cache_debug) {
                     print_timestamp(stderr);
                     fprintf(stderr, "getattr HIT: %s\n", path);
                     fflush(stderr);
                 }
                 
-                /* Build stat structure from cached data */
-                memset(stbuf, 0, sizeof(struct stat));
-                stbuf->st_mode = cached.mode;
-                stbuf->st_size = cached.size;
-                stbuf->st_mtime = cached.mtime;
-                stbuf->st_ctime = cached.ctime;
-                stbuf->st_uid = cached.uid;
-                stbuf->st_gid = cached.gid;
-                stbuf->st_ino = cached.ino;  /* Use cached inode - no backend access! */
+                /* Rebuild the full stat from cache - no backend access */
+                cache_meta_entry_to_stat(&cached, stbuf);
                 
                 /* Apply bindfs transformations (UID/GID/permission remapping) */
                 real_path = process_path(path, true);
@@ -984,8 +1498,19 @@ static int bindfs_getattr(const char *path, struct stat *stbuf)
         }
     }
 
+    /* Names missing from a complete cached listing don't exist */
+    if (cache_meta_ctx != NULL && cache_dir_absent(cache_meta_ctx, path)) {
+        cache_stats_add(CACHE_CTR_GETATTR_HITS, 1);
+        if (settings.cache_debug) {
+            print_timestamp(stderr);
+            fprintf(stderr, "getattr listing says absent: %s\n", path);
+            fflush(stderr);
+        }
+        return -ENOENT;
+    }
+
     /* Cache miss - fetch from backend */
-    __sync_fetch_and_add(&cache_stats.getattr_misses, 1);
+    cache_stats_add(CACHE_CTR_GETATTR_MISSES, 1);
     if (settings.cache_debug) {
         print_timestamp(stderr);
         fprintf(stderr, "getattr MISS: %s\n", path);
@@ -995,16 +1520,11 @@ static int bindfs_getattr(const char *path, struct stat *stbuf)
     if (real_path == NULL)
         return -errno;
 
-    if (lstat(real_path, stbuf) == -1) {
-        int err = errno;
-        
-        /* Store negative entry in cache (using real_path) */
 #ifdef HAVE_SQLITE3
-        if (cache_meta_ctx != NULL && err == ENOENT) {
-            cache_meta_store_negative(cache_meta_ctx, real_path);
-        }
+    watch_parent(path);
 #endif
-        
+    if (lstat(real_path, stbuf) == -1) {
+        int err = errno;
         free(real_path);
         return -err;
     }
@@ -1026,6 +1546,7 @@ static int bindfs_getattr(const char *path, struct stat *stbuf)
 static int bindfs_fgetattr(const char *path, struct stat *stbuf,
                            struct fuse_file_info *fi)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_GETATTR);
     int res;
     char *real_path;
 
@@ -1033,7 +1554,7 @@ static int bindfs_fgetattr(const char *path, struct stat *stbuf,
     if (real_path == NULL)
         return -errno;
 
-    if (fstat(fi->fh, stbuf) == -1) {
+    if (fstat(FI_FD(fi), stbuf) == -1) {
         free(real_path);
         return -errno;
     }
@@ -1045,6 +1566,7 @@ static int bindfs_fgetattr(const char *path, struct stat *stbuf,
 
 static int bindfs_readlink(const char *path, char *buf, size_t size)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_READLINK);
     int res;
     char *real_path;
 
@@ -1065,6 +1587,47 @@ static int bindfs_readlink(const char *path, char *buf, size_t size)
     return 0;
 }
 
+/* Feeds a cached listing to filler. For readdirplus the cached backend
+   attributes get the same remapping a fresh lstat would. */
+static int fill_from_listing(const cache_dir_listing_t *listing, const char *real_path,
+                             void *buf, fuse_fill_dir_t filler, bool readdirplus)
+{
+    struct memory_block path_buf = MEMORY_BLOCK_INITIALIZER;
+    if (readdirplus) {
+        int len = strlen(real_path);
+        append_to_memory_block(&path_buf, real_path, len + 1);
+        path_buf.ptr[len] = '/';
+    }
+
+    int result = 0;
+    size_t pos = 0;
+    cache_dir_item_t item;
+    while (cache_dir_unpack(listing, &pos, &item)) {
+        if (readdirplus) {
+            int file_len = strlen(item.name) + 1;
+            append_to_memory_block(&path_buf, item.name, file_len);
+            result = getattr_common(path_buf.ptr, &item.st);
+            path_buf.size -= file_len;
+            if (result < 0) {
+                break;
+            }
+        }
+
+        #ifdef HAVE_FUSE_3
+        if (filler(buf, item.name, readdirplus ? &item.st : NULL, 0,
+                   readdirplus ? FUSE_FILL_DIR_PLUS : 0) != 0) {
+        #else
+        if (filler(buf, item.name, NULL, 0) != 0) {
+        #endif
+            result = errno != 0 ? -errno : -EIO;
+            break;
+        }
+    }
+
+    free_memory_block(&path_buf);
+    return result;
+}
+
 #ifdef HAVE_FUSE_3
 static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
@@ -1073,6 +1636,7 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_READDIR);
     (void)offset;
     (void)fi;
 #ifdef HAVE_FUSE_3
@@ -1086,60 +1650,63 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         return -errno;
     }
 
-    /* Try cache first (only for non-readdirplus) */
-    if (cache_meta_ctx != NULL && !readdirplus) {
-        cache_dir_entry_t *cached_entries = NULL;
-        size_t cached_count = 0;
-        time_t cached_mtime = 0;
+    /* Try cache first. readdirplus needs a listing with attributes. */
+    if (cache_meta_ctx != NULL) {
+        struct arena arena;
+        cache_dir_listing_t listing;
         bool valid = false;
 
-        if (cache_dir_lookup(cache_meta_ctx, real_path, &cached_entries, 
-                           &cached_count, &cached_mtime, &valid) == 0) {
-            /* Check if directory mtime still matches */
+        arena_init(&arena);
+        uint64_t lookup_start = cache_stats_now();
+        int found = cache_dir_lookup(cache_meta_ctx, path, &arena, &listing, &valid);
+        cache_stats_since(CACHE_STAGE_DIR_LOOKUP, lookup_start);
+        if (found == 0 && (listing.with_stats || !readdirplus)) {
+            /* Check if directory mtime still matches, unless the watcher
+               would have told us about changes. A listing cached before
+               the watch existed is checked once more after adding it. */
             struct stat dir_st;
-            if (stat(real_path, &dir_st) == 0 && 
-                dir_st.st_mtime == cached_mtime && valid) {
+            bool watched = cache_watch_covers(cache_watch_ctx, path);
+            if (!watched) {
+                cache_watch_add(cache_watch_ctx, path);
+            }
+            if (valid && (watched ||
+                          (stat(real_path, &dir_st) == 0 &&
+                           dir_st.st_mtime == listing.dir_mtime))) {
                 
-                __sync_fetch_and_add(&cache_stats.readdir_hits, 1);
+                cache_stats_add(CACHE_CTR_READDIR_HITS, 1);
                 if (settings.cache_debug) {
                     print_timestamp(stderr);
-                    fprintf(stderr, "readdir HIT: %s (%zu entries)\n", path, cached_count);
+                    fprintf(stderr, "readdir%s HIT: %s (%zu entries)\n",
+                            readdirplus ? "plus" : "", path, listing.count);
                     fflush(stderr);
                 }
                 
-                /* Return cached entries */
-                int result = 0;
-                for (size_t i = 0; i < cached_count; i++) {
-                    #ifdef HAVE_FUSE_3
-                    if (filler(buf, cached_entries[i].name, NULL, 0, 0) != 0) {
-                    #else
-                    if (filler(buf, cached_entries[i].name, NULL, 0) != 0) {
-                    #endif
-                        result = errno != 0 ? -errno : -EIO;
-                        break;
-                    }
-                }
+                /* Return cached entries straight from the packed listing */
+                int result = fill_from_listing(&listing, real_path, buf, filler, readdirplus);
                 
-                cache_dir_entries_free(cached_entries, cached_count);
+                arena_free(&arena);
                 free(real_path);
                 return result;
             }
-            
-            /* Cache stale - free and continue to backend */
-            cache_dir_entries_free(cached_entries, cached_count);
         }
+        /* Cache miss or stale - continue to backend */
+        arena_free(&arena);
     }
 
-    /* Cache miss or readdirplus - read from backend */
-    if (cache_meta_ctx != NULL && !readdirplus) {
-        __sync_fetch_and_add(&cache_stats.readdir_misses, 1);
+    /* Cache miss - read from backend */
+    if (cache_meta_ctx != NULL) {
+        cache_stats_add(CACHE_CTR_READDIR_MISSES, 1);
     }
-    if (settings.cache_debug && !readdirplus) {
+    if (settings.cache_debug) {
         print_timestamp(stderr);
         fprintf(stderr, "readdir MISS: %s\n", path);
         fflush(stderr);
     }
 
+    if (cache_meta_ctx != NULL) {
+        cache_watch_add(cache_watch_ctx, path);
+    }
+
     DIR *dp = opendir(real_path);
     if (dp == NULL) {
         free(real_path);
@@ -1168,23 +1735,24 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     int result = 0;
     
-    /* For caching: collect entries if not readdirplus */
-    cache_dir_entry_t *entries_to_cache = NULL;
+    /* For caching: pack entries, with their attributes for readdirplus */
+    struct memory_block listing_buf = MEMORY_BLOCK_INITIALIZER;
+    struct memory_block child_buf = MEMORY_BLOCK_INITIALIZER;
     size_t entries_count = 0;
-    size_t entries_capacity = 0;
     struct stat dir_stat_for_cache;
-    bool can_cache = (cache_meta_ctx != NULL && !readdirplus);
+    bool can_cache = (cache_meta_ctx != NULL);
+
+    if (can_cache && readdirplus) {
+        /* FUSE paths of the entries, to fill the getattr cache */
+        size_t len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+        append_to_memory_block(&child_buf, path, len);
+        append_to_memory_block(&child_buf, "/", 1);
+    }
     
     if (can_cache) {
         /* Get directory stat for mtime before reading */
         char *cache_real_path = process_path(path, true);
-        if (cache_real_path && stat(cache_real_path, &dir_stat_for_cache) == 0) {
-            entries_capacity = 64;  /* Initial capacity */
-            entries_to_cache = malloc(entries_capacity * sizeof(cache_dir_entry_t));
-            if (!entries_to_cache) {
-                can_cache = false;
-            }
-        } else {
+        if (!cache_real_path || stat(cache_real_path, &dir_stat_for_cache) != 0) {
             can_cache = false;
         }
         free(cache_real_path);
@@ -1201,6 +1769,7 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         }
 
         struct stat st;
+        struct stat backend_st;
 
         if ((settings.resolve_symlinks && de->d_type == DT_LNK) || readdirplus) {
             int file_len = strlen(de->d_name) + 1;  // (include null terminator)
@@ -1226,6 +1795,7 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             }
 
             if (readdirplus) {
+                backend_st = st;
                 if ((result = getattr_common(path_buf.ptr, &st)) < 0) {
                     break;
                 }
@@ -1250,24 +1820,19 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             break;
         }
         
-        /* Collect entry for caching */
-        if (can_cache && entries_to_cache != NULL) {
-            if (entries_count >= entries_capacity) {
-                entries_capacity *= 2;
-                cache_dir_entry_t *new_entries = realloc(entries_to_cache, 
-                    entries_capacity * sizeof(cache_dir_entry_t));
-                if (new_entries) {
-                    entries_to_cache = new_entries;
-                } else {
-                    can_cache = false;
-                }
-            }
-            
-            if (can_cache) {
-                entries_to_cache[entries_count].name = strdup(de->d_name);
-                entries_to_cache[entries_count].type = (de->d_type == DT_DIR) ? 
-                    CACHE_ENTRY_DIR : CACHE_ENTRY_FILE;
-                entries_count++;
+        /* Collect entry for caching; attributes are kept as the backend
+           reported them, remapping is applied again when served */
+        if (can_cache) {
+            cache_dir_pack(&listing_buf, de->d_name,
+                           (de->d_type == DT_DIR) ? CACHE_ENTRY_DIR : CACHE_ENTRY_FILE,
+                           readdirplus ? &backend_st : NULL);
+            entries_count++;
+
+            if (readdirplus && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+                int name_len = strlen(de->d_name) + 1;
+                append_to_memory_block(&child_buf, de->d_name, name_len);
+                cache_meta_store(cache_meta_ctx, child_buf.ptr, &backend_st);
+                child_buf.size -= name_len;
             }
         }
     }
@@ -1279,12 +1844,17 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     closedir(dp);
     
     /* Store entries in cache if successful read */
-    if (result == 0 && can_cache && entries_to_cache && entries_count > 0) {
+    if (result == 0 && can_cache && entries_count > 0) {
         char *cache_real_path = process_path(path, true);
         if (cache_real_path) {
-            cache_dir_store(cache_meta_ctx, cache_real_path, 
-                          entries_to_cache, entries_count, 
-                          dir_stat_for_cache.st_mtime);
+            cache_dir_listing_t listing = {
+                .data = listing_buf.ptr,
+                .size = listing_buf.size,
+                .count = entries_count,
+                .dir_mtime = dir_stat_for_cache.st_mtime,
+                .with_stats = readdirplus,
+            };
+            cache_dir_store(cache_meta_ctx, path, &listing);
             if (settings.cache_debug) {
                 print_timestamp(stderr);
                 fprintf(stderr, "readdir CACHED: %s (%zu entries)\n", path, entries_count);
@@ -1295,15 +1865,15 @@ static int bindfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     }
     
     /* Clean up cache collection */
-    if (entries_to_cache) {
-        cache_dir_entries_free(entries_to_cache, entries_count);
-    }
+    free_memory_block(&listing_buf);
+    free_memory_block(&child_buf);
     
     return result;
 }
 
 static int bindfs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_MKNOD);
     int res;
     struct fuse_context *fc;
     char *real_path;
@@ -1353,11 +1923,15 @@ static int bindfs_mknod(const char *path, mode_t mode, dev_t rdev)
     res = chown_new_file(real_path, fc, &chown);
     free(real_path);
 
+    /* Drop any cached negative entry */
+    invalidate_cached_attrs(path);
+
     return res;
 }
 
 static int bindfs_mkdir(const char *path, mode_t mode)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_MKDIR);
     int res;
     struct fuse_context *fc;
     char *real_path;
@@ -1380,17 +1954,9 @@ static int bindfs_mkdir(const char *path, mode_t mode)
     
     /* Invalidate parent directory cache (mtime changed) */
     if (cache_meta_ctx != NULL) {
-        char *parent = strdup(real_path);
-        if (parent) {
-            char *last_slash = strrchr(parent, '/');
-            if (last_slash && last_slash != parent) {
-                *last_slash = '\0';
-                cache_dir_invalidate(cache_meta_ctx, parent);
-            }
-            free(parent);
-        }
+        invalidate_parent_listing(path);
         /* Also invalidate any cached negative entry for this path */
-        cache_meta_invalidate(cache_meta_ctx, real_path);
+        cache_meta_invalidate(cache_meta_ctx, path);
     }
     
     free(real_path);
@@ -1400,16 +1966,19 @@ static int bindfs_mkdir(const char *path, mode_t mode)
 
 static int bindfs_unlink(const char *path)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_UNLINK);
     return delete_file(path, &unlink);
 }
 
 static int bindfs_rmdir(const char *path)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_RMDIR);
     return delete_file(path, &rmdir);
 }
 
 static int bindfs_symlink(const char *from, const char *to)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_SYMLINK);
     int res;
     struct fuse_context *fc;
     char *real_to;
@@ -1432,17 +2001,9 @@ static int bindfs_symlink(const char *from, const char *to)
     
     /* Invalidate parent directory cache (mtime changed) */
     if (cache_meta_ctx != NULL) {
-        char *parent = strdup(real_to);
-        if (parent) {
-            char *last_slash = strrchr(parent, '/');
-            if (last_slash && last_slash != parent) {
-                *last_slash = '\0';
-                cache_dir_invalidate(cache_meta_ctx, parent);
-            }
-            free(parent);
-        }
+        invalidate_parent_listing(to);
         /* Also invalidate any cached negative entry for this path */
-        cache_meta_invalidate(cache_meta_ctx, real_to);
+        cache_meta_invalidate(cache_meta_ctx, to);
     }
     
     free(real_to);
@@ -1456,6 +2017,7 @@ static int bindfs_rename(const char *from, const char *to, unsigned int flags)
 static int bindfs_rename(const char *from, const char *to)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_RENAME);
     int res;
     char *real_from, *real_to;
 
@@ -1472,6 +2034,13 @@ static int bindfs_rename(const char *from, const char *to)
         return -errno;
     }
 
+    /* A file replaced by the rename loses its blocks with its last link */
+    struct stat replaced_st;
+    uint64_t replaced_key = 0;
+    if (cache_block_ctx != NULL) {
+        replaced_key = file_key_for_path(to, real_to, &replaced_st);
+    }
+
 #ifdef HAVE_FUSE_3
 
     if (flags == 0) {
@@ -1492,34 +2061,32 @@ static int bindfs_rename(const char *from, const char *to)
 #endif // HAVE_FUSE_3
 
     /* Invalidate cache for both old and new paths and parent dirs (before freeing) */
-    if (cache_meta_ctx != NULL) {
-        cache_meta_invalidate(cache_meta_ctx, real_from);
-        cache_meta_invalidate(cache_meta_ctx, real_to);
-        
-        /* Invalidate parent directory caches (mtime changed) */
-        char *parent_from = strdup(real_from);
-        if (parent_from) {
-            char *last_slash = strrchr(parent_from, '/');
-            if (last_slash && last_slash != parent_from) {
-                *last_slash = '\0';
-                cache_dir_invalidate(cache_meta_ctx, parent_from);
-            }
-            free(parent_from);
-        }
+    if (res == 0 && cache_meta_ctx != NULL) {
+        /* Entries below a renamed directory move with it */
+        cache_meta_invalidate_tree(cache_meta_ctx, from);
+        cache_meta_invalidate_tree(cache_meta_ctx, to);
         
-        char *parent_to = strdup(real_to);
-        if (parent_to) {
-            char *last_slash = strrchr(parent_to, '/');
-            if (last_slash && last_slash != parent_to) {
-                *last_slash = '\0';
-                cache_dir_invalidate(cache_meta_ctx, parent_to);
-            }
-            free(parent_to);
+        /* Invalidate parent directory caches (mtime changed) and the
+           listings cached under either name */
+        invalidate_parent_listing(from);
+        invalidate_parent_listing(to);
+        cache_dir_invalidate(cache_meta_ctx, from);
+        cache_dir_invalidate(cache_meta_ctx, to);
+
+        /* Blocks belong to the file, not its name, so they stay. An
+           exchange swaps the names; let the next opens record them. */
+#if defined(HAVE_FUSE_3) && defined(RENAME_EXCHANGE)
+        if (flags & RENAME_EXCHANGE) {
+            cache_ident_forget(cache_meta_ctx, from);
+            cache_ident_forget(cache_meta_ctx, to);
+            replaced_key = 0;
+        } else
+#endif
+        {
+            cache_ident_rename(cache_meta_ctx, from, to);
         }
-        
-        /* Also invalidate blocks for renamed files */
-        if (cache_block_ctx != NULL) {
-            cache_block_invalidate_file(cache_block_ctx, real_from);
+        if (replaced_key != 0 && replaced_st.st_nlink <= 1) {
+            cache_block_invalidate_file(cache_block_ctx, replaced_key);
         }
     }
 
@@ -1533,6 +2100,7 @@ static int bindfs_rename(const char *from, const char *to)
 
 static int bindfs_link(const char *from, const char *to)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_LINK);
     int res;
     char *real_from, *real_to;
 
@@ -1548,9 +2116,12 @@ static int bindfs_link(const char *from, const char *to)
 
     res = link(real_from, real_to);
     
-    /* Invalidate any cached negative entry for the new link */
+    /* Invalidate any cached negative entry for the new link, and the
+       link count of the source */
     if (cache_meta_ctx != NULL && res == 0) {
-        cache_meta_invalidate(cache_meta_ctx, real_to);
+        cache_meta_invalidate(cache_meta_ctx, to);
+        invalidate_parent_listing(to);
+        invalidate_cached_attrs(from);
     }
     
     free(real_from);
@@ -1567,6 +2138,7 @@ static int bindfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi
 static int bindfs_chmod(const char *path, mode_t mode)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_CHMOD);
     int file_execute_only = 0;
     struct stat st;
     mode_t diff = 0;
@@ -1600,6 +2172,7 @@ static int bindfs_chmod(const char *path, mode_t mode)
             return -errno;
         }
         free(real_path);
+        invalidate_cached_attrs(path);
         return 0;
     case CHMOD_IGNORE:
         if (file_execute_only) {
@@ -1609,6 +2182,7 @@ static int bindfs_chmod(const char *path, mode_t mode)
                 free(real_path);
                 return -errno;
             }
+            invalidate_cached_attrs(path);
         }
         free(real_path);
         return 0;
@@ -1621,6 +2195,7 @@ static int bindfs_chmod(const char *path, mode_t mode)
                     return -errno;
                 }
                 free(real_path);
+                invalidate_cached_attrs(path);
                 return 0;
             }
         }
@@ -1637,6 +2212,7 @@ static int bindfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file
 static int bindfs_chown(const char *path, uid_t uid, gid_t gid)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_CHOWN);
     int res;
     char *real_path;
 #ifdef HAVE_FUSE_3
@@ -1684,6 +2260,7 @@ static int bindfs_chown(const char *path, uid_t uid, gid_t gid)
         free(real_path);
         if (res == -1)
             return -errno;
+        invalidate_cached_attrs(path);
     }
 
     return 0;
@@ -1696,20 +2273,41 @@ static int bindfs_truncate(const char *path, off_t size,
 static int bindfs_truncate(const char *path, off_t size)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_TRUNCATE);
     int res;
     char *real_path;
-#ifdef HAVE_FUSE_3
-    (void)fi;
-#endif
 
     real_path = process_path(path, true);
     if (real_path == NULL)
         return -errno;
 
     res = truncate(real_path, size);
-    free(real_path);
-    if (res == -1)
+    if (res == -1) {
+        free(real_path);
         return -errno;
+    }
+
+#ifdef HAVE_SQLITE3
+    /* Cached blocks past the new size, and the end-of-file mark, are stale */
+    if (cache_block_ctx != NULL) {
+        uint64_t file_key = 0;
+#ifdef HAVE_FUSE_3
+        if (fi != NULL) {
+            file_key = FI_FH(fi)->file_key;
+        } else
+#endif
+        {
+            file_key = file_key_for_path(path, real_path, NULL);
+        }
+        if (file_key != 0) {
+            cache_block_invalidate_file(cache_block_ctx, file_key);
+        }
+    }
+    invalidate_cached_attrs(path);
+#elif defined(HAVE_FUSE_3)
+    (void)fi;
+#endif
+    free(real_path);
 
     return 0;
 }
@@ -1718,13 +2316,20 @@ static int bindfs_truncate(const char *path, off_t size)
 static int bindfs_ftruncate(const char *path, off_t size,
                             struct fuse_file_info *fi)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_TRUNCATE);
     int res;
-    (void) path;
 
-    res = ftruncate(fi->fh, size);
+    res = ftruncate(FI_FD(fi), size);
     if (res == -1)
         return -errno;
 
+#ifdef HAVE_SQLITE3
+    if (cache_block_ctx != NULL && FI_FH(fi)->file_key != 0) {
+        cache_block_invalidate_file(cache_block_ctx, FI_FH(fi)->file_key);
+    }
+    invalidate_cached_attrs(path);
+#endif
+
     return 0;
 }
 #endif
@@ -1735,6 +2340,7 @@ static int bindfs_utimens(const char *path, const struct timespec ts[2], struct
 static int bindfs_utimens(const char *path, const struct timespec ts[2])
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_UTIMENS);
     int res;
     char *real_path;
 #ifdef HAVE_FUSE_3
@@ -1762,11 +2368,60 @@ static int bindfs_utimens(const char *path, const struct timespec ts[2])
     if (res == -1)
         return -errno;
 
+    invalidate_cached_attrs(path);
+    return 0;
+}
+
+/* Wraps a freshly opened backend fd in fi->fh. Closes fd on failure.
+   st is the fd's stat if the caller has it, else NULL. */
+static int set_file_handle(struct fuse_file_info *fi, int fd, const char *path,
+                           const struct stat *st)
+{
+    struct bindfs_fh *fh = malloc(sizeof(struct bindfs_fh));
+    if (fh == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    fh->fd = fd;
+#ifdef HAVE_SQLITE3
+    fh->ra = NULL;
+    fh->file_key = 0;
+    if (settings.cache_root != NULL) {
+        fh->file_key = file_key_for_fd(path, fd, st);
+    }
+    /* O_DIRECT readers want the backend's data, not ours. Writes through
+       the fd still invalidate by file_key. */
+    fh->uncached = false;
+#ifdef __linux__
+    fh->uncached = (fi->flags & O_DIRECT) && !settings.cache_odirect;
+#endif
+    fh->stream_end = 0;
+    fh->stream_bytes = 0;
+    /* Workers read with plain pread, so skip write-only and O_DIRECT fds */
+    int accmode = fi->flags & O_ACCMODE;
+    bool direct = fh->uncached;
+#ifdef __linux__
+    direct = direct || ((fi->flags & O_DIRECT) && settings.forward_odirect);
+#endif
+    if (cache_readahead_ctx != NULL && accmode != O_WRONLY && !direct) {
+        fh->ra = cache_ra_file_open(cache_readahead_ctx, fd, fh->file_key, caller_read_limiter());
+    }
+    fh->writer = (settings.cache_write_populate && fh->file_key != 0 && accmode != O_RDONLY &&
+                  own_writer_open(fh->file_key));
+    if (fh->file_key != 0) {
+        watch_parent(path);
+    }
+#else
+    (void) path;
+    (void) st;
+#endif
+    fi->fh = (uintptr_t)fh;
     return 0;
 }
 
 static int bindfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_CREATE);
     int fd;
     struct fuse_context *fc;
     char *real_path;
@@ -1796,27 +2451,19 @@ static int bindfs_create(const char *path, mode_t mode, struct fuse_file_info *f
     
     /* Invalidate parent directory cache (mtime changed) */
     if (cache_meta_ctx != NULL) {
-        char *parent = strdup(real_path);
-        if (parent) {
-            char *last_slash = strrchr(parent, '/');
-            if (last_slash && last_slash != parent) {
-                *last_slash = '\0';
-                cache_dir_invalidate(cache_meta_ctx, parent);
-            }
-            free(parent);
-        }
+        invalidate_parent_listing(path);
         /* Also invalidate any cached negative entry for this path */
-        cache_meta_invalidate(cache_meta_ctx, real_path);
+        cache_meta_invalidate(cache_meta_ctx, path);
     }
     
     free(real_path);
 
-    fi->fh = fd;
-    return 0;
+    return set_file_handle(fi, fd, path, NULL);
 }
 
 static int bindfs_open(const char *path, struct fuse_file_info *fi)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_OPEN);
     int fd;
     char *real_path;
     struct stat backend_st;
@@ -1842,151 +2489,714 @@ static int bindfs_open(const char *path, struct fuse_file_info *fi)
     }
 
     /* Revalidation on open: check if cached data is still valid */
+    bool have_st = false;
     if (cache_meta_ctx != NULL && fstat(fd, &backend_st) == 0) {
+        have_st = true;
         cache_meta_entry_t cached;
         bool valid;
         
-        if (cache_meta_lookup(cache_meta_ctx, real_path, &cached, &valid) == 0) {
+        if (cache_meta_lookup(cache_meta_ctx, path, &cached, &valid) == 0) {
             /* Compare mtime and size with cached values */
             if (cached.mtime != backend_st.st_mtime || cached.size != backend_st.st_size) {
                 /* Cache is stale - invalidate file blocks and metadata */
-                if (cache_block_ctx != NULL) {
-                    cache_block_invalidate_file(cache_block_ctx, real_path);
+                if (cache_block_ctx != NULL && S_ISREG(backend_st.st_mode)) {
+                    cache_file_id_t id = { backend_st.st_dev, backend_st.st_ino, file_generation(fd) };
+                    cache_block_invalidate_file(cache_block_ctx, cache_file_key(&id));
                 }
-                cache_meta_invalidate(cache_meta_ctx, real_path);
+                invalidate_cached_attrs(path);
+                if (settings.cache_kernel) {
+                    notify_kernel(path);
+                }
+            } else if (settings.cache_kernel && cached.type == CACHE_ENTRY_FILE
+#ifdef HAVE_STAT_NANOSEC
+                       && cached.mtime_nsec == backend_st.st_mtim.tv_nsec
+#endif
+                       && !cache_watch_missed(cache_watch_ctx, backend_st.st_ctime)) {
+                /* Unchanged since we cached it, so the kernel's pages are too.
+                   Unless the change went unreported and the entry was only
+                   cached after it. */
+                fi->keep_cache = 1;
+            }
+        }
+    }
+
+    free(real_path);
+    return set_file_handle(fi, fd, path, have_st ? &backend_st : NULL);
+}
+
+#ifdef HAVE_SQLITE3
+#define READ_MAX_RUN 32         /* Missing blocks a read fetches in one batch */
+#define ADMIT_FULL_PERCENT 90   /* Admission filtering starts at this fill level */
+#define ADMIT_MIN_FETCHES 2     /* Fetches of a block before it is stored */
+
+/* Decides whether a block fetched for a reader is stored. With
+   --cache-admission=tinylfu, a full cache only takes blocks that were
+   fetched before, so a one-pass scan can't displace the working set. */
+static bool admit_block(uint64_t file_key, size_t block_idx)
+{
+    if (cache_admit_ctx == NULL) {
+        return true;
+    }
+    unsigned fetches = cache_admit_record(cache_admit_ctx, file_key, block_idx);
+
+    /* Until the cache fills up, storing a block displaces nothing */
+    size_t current_size = 0;
+    cache_block_get_stats(cache_block_ctx, &current_size, NULL);
+    if (current_size < settings.cache_max_size / 100 * ADMIT_FULL_PERCENT) {
+        return true;
+    }
+    return fetches >= ADMIT_MIN_FETCHES;
+}
+
+/* Counts the bytes a handle has read in one sequential run, and reports
+   whether this read makes it a stream past --cache-stream-bypass. Reads
+   within a block of the previous end count as sequential, like the
+   readahead's detection, since the kernel may reorder concurrent reads.
+   Racy across threads sharing the handle, which only blurs the count. */
+static bool read_is_streaming(struct bindfs_fh *fh, off_t offset, size_t size)
+{
+    if (settings.cache_stream_bypass == 0) {
+        return false;
+    }
+    off_t bs = (off_t)settings.cache_block_size;
+    off_t end = __atomic_load_n(&fh->stream_end, __ATOMIC_RELAXED);
+    size_t bytes = __atomic_load_n(&fh->stream_bytes, __ATOMIC_RELAXED);
+    if (offset >= end - bs && offset <= end + bs) {
+        bytes += size;
+    } else {
+        bytes = size;
+        end = 0;
+    }
+    if (offset + (off_t)size > end) {
+        __atomic_store_n(&fh->stream_end, offset + (off_t)size, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&fh->stream_bytes, bytes, __ATOMIC_RELAXED);
+    return bytes > settings.cache_stream_bypass;
+}
+
+/* Read through the block cache, one block at a time. Missing blocks are
+   fetched whole from the backend, by one thread per block, in runs of
+   consecutive blocks that go to the I/O engine as one batch. With bypass,
+   or if admission turns them down, fetched blocks are not stored. */
+static int read_through_cache(uint64_t file_key, int fd, char *buf, size_t size, off_t offset,
+                              bool bypass)
+{
+    size_t block_size = settings.cache_block_size;
+    char *bounce = NULL;
+    size_t done = 0;
+    int res = 0;
+    bool waited = false;
+
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t block_idx = pos / block_size;
+        size_t block_offset = pos % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        uint64_t start = cache_stats_now();
+        ssize_t bytes_read = cache_block_read(cache_block_ctx, file_key, block_idx,
+                                              buf + done, chunk, block_offset);
+        if (bytes_read >= 0) {
+            cache_stats_since(CACHE_STAGE_BLOCK_HIT, start);
+            cache_stats_add(CACHE_CTR_BLOCK_HITS, 1);
+            cache_stats_add(CACHE_CTR_CACHE_READ_BYTES, bytes_read);
+            done += bytes_read;
+            waited = false;
+            if ((size_t)bytes_read < chunk) {
+                break;  /* End of file */
+            }
+            continue;
+        }
+
+        /* Miss. If another reader is fetching this block, wait for it and
+           retry once; a second miss means its data didn't cover us. */
+        cache_block_fill_t fills[READ_MAX_RUN];
+        bool filling = false;
+        if (!waited) {
+            if (!cache_block_fill_begin(cache_block_ctx, file_key, block_idx, &fills[0])) {
+                waited = true;
+                continue;
+            }
+            filling = true;
+        }
+        waited = false;
+
+        /* Fetch the missing blocks after it in the same batch, up to the
+           end of the request. We hold a claim now, so we must not wait
+           for another's: a block someone else is fetching ends the run. */
+        size_t max_run = cache_io_batch_size();
+        if (max_run > READ_MAX_RUN) {
+            max_run = READ_MAX_RUN;
+        }
+        size_t run = 1;
+        while (run < max_run && (off_t)((block_idx + run) * block_size) < offset + (off_t)size) {
+            size_t idx = block_idx + run;
+            if (cache_block_exists(cache_block_ctx, file_key, idx) ||
+                !cache_block_fill_try(cache_block_ctx, file_key, idx, &fills[run])) {
+                break;
+            }
+            run++;
+        }
+
+        /* Fetch whole blocks, straight into buf where they fit: only the
+           first and last of the run can stick out of the request */
+        cache_io_op_t ops[READ_MAX_RUN];
+        bool bounced[READ_MAX_RUN];
+        for (size_t i = 0; i < run; i++) {
+            off_t block_start = (off_t)(block_idx + i) * block_size;
+            bounced[i] = block_start < offset ||
+                         block_start + (off_t)block_size > offset + (off_t)size;
+            if (bounced[i] && bounce == NULL && (bounce = malloc(2 * block_size)) == NULL) {
+                res = -ENOMEM;
+                break;
+            }
+            ops[i] = (cache_io_op_t){
+                .fd = fd,
+                .write = false,
+                .buf = bounced[i] ? bounce + (i == 0 ? 0 : block_size) : buf + (block_start - offset),
+                .len = block_size,
+                .offset = block_start,
+            };
+        }
+        if (res < 0) {
+            for (size_t i = filling ? 0 : 1; i < run; i++) {
+                cache_block_fill_end(&fills[i], NULL, 0, false);
+            }
+            break;
+        }
+
+        uint64_t read_start = cache_stats_now();
+        cache_io_run(ops, run);
+        cache_stats_since(CACHE_STAGE_BACKEND_READ, read_start);
+
+        bool stop = false;
+        size_t fetched = 0;
+        for (size_t i = 0; i < run; i++) {
+            bool claimed = (i > 0 || filling);
+            ssize_t n = ops[i].res;
+            if (stop || n < 0) {
+                if (!stop) {
+                    res = (int)n;
+                    stop = true;
+                }
+                if (claimed) {
+                    cache_block_fill_end(&fills[i], NULL, 0, false);
+                }
+                continue;
+            }
+            cache_stats_add(CACHE_CTR_BACKEND_READ_BYTES, n);
+            fetched += n;
+            if (claimed) {
+                if (n > 0 && (bypass || !admit_block(file_key, block_idx + i))) {
+                    cache_stats_add(CACHE_CTR_BYPASSED_BYTES, n);
+                    cache_block_fill_end(&fills[i], NULL, 0, false);
+                } else {
+                    cache_block_fill_end(&fills[i], ops[i].buf, n, (size_t)n < block_size);
+                }
+            }
+            cache_stats_since(CACHE_STAGE_BLOCK_MISS, start);
+            cache_stats_add(CACHE_CTR_BLOCK_MISSES, 1);
+
+            size_t skip = (i == 0) ? block_offset : 0;
+            size_t want = block_size - skip;
+            if (want > size - done) {
+                want = size - done;
+            }
+            size_t avail = (size_t)n > skip ? (size_t)n - skip : 0;
+            size_t take = avail < want ? avail : want;
+            if (bounced[i]) {
+                memcpy(buf + done, (char *)ops[i].buf + skip, take);
+            }
+            done += take;
+            if (take < want) {
+                stop = true;  /* End of file */
+            }
+        }
+
+        /* Charged for what the backend returned, not for whole blocks,
+           once the fills are done so other readers of them don't wait */
+        RateLimiter *limiter = caller_read_limiter();
+        if (limiter) {
+            rate_limiter_wait(limiter, fetched);
+        }
+        if (stop) {
+            break;
+        }
+    }
+
+    free(bounce);
+    if (res < 0 && done == 0) {
+        return res;
+    }
+    return done;
+}
+#endif
+
+static int bindfs_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    CACHE_STATS_SCOPE(CACHE_OP_READ);
+    int res;
+
+    char *target_buf = buf;
+
+#ifdef HAVE_SQLITE3
+    /* Lazy init cache on first use */
+    if (settings.cache_root != NULL && !cache_initialized) {
+        fprintf(stderr, "[READ] path=%s - triggering cache init\n", path);
+        ensure_cache_initialized();
+        fprintf(stderr, "[READ] cache init returned\n");
+    }
+#endif
+
+#ifdef __linux__
+    size_t mmap_size = 0;
+    if ((fi->flags & O_DIRECT) && settings.forward_odirect) {
+        mmap_size = round_up_buffer_size_for_direct_io(size);
+        target_buf = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+        if (target_buf == MAP_FAILED) {
+            return -ENOMEM;
+        }
+    }
+#endif
+
+#ifdef HAVE_SQLITE3
+    /* Forwarded O_DIRECT reads go straight to the backend, since block
+       fetches use unaligned buffers */
+    bool streaming = false;
+    if (cache_block_ctx != NULL && FI_FH(fi)->file_key != 0 && !FI_FH(fi)->uncached &&
+        target_buf == buf) {
+        streaming = read_is_streaming(FI_FH(fi), offset, size);
+        res = read_through_cache(FI_FH(fi)->file_key, FI_FD(fi), target_buf, size, offset,
+                                 streaming);
+    } else
+#endif
+    {
+        RateLimiter *limiter = caller_read_limiter();
+        if (limiter) {
+            rate_limiter_wait(limiter, size);
+        }
+        res = pread(FI_FD(fi), target_buf, size, offset);
+        if (res == -1)
+            res = -errno;
+    }
+
+#ifdef HAVE_SQLITE3
+    /* A stream is not stored, so reading ahead of it would be wasted */
+    if (res > 0 && !streaming) {
+        cache_ra_file_access(FI_FH(fi)->ra, offset, res);
+    }
+#endif
+
+#ifdef __linux__
+    if (target_buf != buf) {
+        memcpy(buf, target_buf, size);
+        munmap(target_buf, mmap_size);
+    }
+#endif
+
+    return res;
+}
+
+/* Invalidate affected cache blocks and metadata after a successful write */
+static void invalidate_written(const char *path, struct fuse_file_info *fi,
+                               off_t offset, size_t size)
+{
+    if (cache_block_ctx != NULL && FI_FH(fi)->file_key != 0) {
+        cache_block_invalidate_range(cache_block_ctx, FI_FH(fi)->file_key, offset, size);
+    }
+    invalidate_cached_attrs(path);
+}
+
+/* With --cache-write-populate, claims the blocks a write will change so
+   its data can be merged into them. Returns false if the write should
+   invalidate them instead. */
+static bool populate_begin(struct fuse_file_info *fi, off_t offset, size_t size,
+                           cache_block_update_t *upd)
+{
+    if (!settings.cache_write_populate || cache_block_ctx == NULL || FI_FH(fi)->file_key == 0) {
+        return false;
+    }
+    return cache_block_update_begin(cache_block_ctx, FI_FH(fi)->file_key, offset, size, upd) == 0;
+}
+
+/* Finishes a write claimed by populate_begin(): the data goes into the
+   claimed blocks and the attributes are refreshed from the backend file,
+   so reading it back needs neither a block fetch nor an lstat */
+static void populate_end(const char *path, struct fuse_file_info *fi,
+                         cache_block_update_t *upd, const char *buf, ssize_t res)
+{
+    struct stat st;
+    bool have_st = res > 0 && fstat(FI_FD(fi), &st) == 0;
+    cache_block_update_end(upd, buf, res, have_st ? st.st_size : -1);
+    if (res <= 0) {
+        return;
+    }
+    if (have_st && FI_FH(fi)->writer) {
+        own_writer_wrote(FI_FH(fi)->file_key, &st);
+    }
+    if (have_st && cache_meta_ctx != NULL) {
+        cache_meta_store(cache_meta_ctx, path, &st);
+        /* The parent's listing carries the old size */
+        invalidate_parent_listing(path);
+    } else {
+        invalidate_cached_attrs(path);
+    }
+}
+
+static int bindfs_write(const char *path, const char *buf, size_t size,
+                        off_t offset, struct fuse_file_info *fi)
+{
+    CACHE_STATS_SCOPE(CACHE_OP_WRITE);
+    int res;
+    char *source_buf = (char*)buf;
+
+    RateLimiter *limiter = caller_write_limiter();
+    if (limiter) {
+        rate_limiter_wait(limiter, size);
+    }
+
+#ifdef __linux__
+    size_t mmap_size = 0;
+    if ((fi->flags & O_DIRECT) && settings.forward_odirect) {
+        mmap_size = round_up_buffer_size_for_direct_io(size);
+        source_buf = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+        if (source_buf == MAP_FAILED) {
+            return -ENOMEM;
+        }
+        memcpy(source_buf, buf, size);
+    }
+#endif
+
+    /* Write-through: always write to backend first */
+    cache_block_update_t upd;
+    bool populate = populate_begin(fi, offset, size, &upd);
+    res = pwrite(FI_FD(fi), source_buf, size, offset);
+    if (res == -1)
+        res = -errno;
+    
+    if (populate) {
+        populate_end(path, fi, &upd, buf, res);
+    } else if (res > 0) {
+        invalidate_written(path, fi, offset, size);
+    }
+
+#ifdef __linux__
+    if (source_buf != buf) {
+        munmap(source_buf, mmap_size);
+    }
+#endif
+
+    return res;
+}
+
+#if defined(HAVE_FUSE_29) || defined(HAVE_FUSE_3)
+#ifdef HAVE_SQLITE3
+/* Block files handed to libfuse in a read reply. libfuse reads them only
+   after bindfs_read_buf() returns, so they stay pinned until the same
+   worker thread starts its next read, by which time the reply is out. */
+struct read_pins {
+    cache_block_pin_t *pins;
+    size_t count;
+    size_t capacity;
+};
+
+static pthread_key_t read_pins_key;
+static pthread_once_t read_pins_once = PTHREAD_ONCE_INIT;
+
+static void release_read_pins(struct read_pins *rp)
+{
+    for (size_t i = 0; i < rp->count; i++) {
+        cache_block_unpin(cache_block_ctx, &rp->pins[i]);
+    }
+    rp->count = 0;
+}
+
+static void free_read_pins(void *arg)
+{
+    struct read_pins *rp = arg;
+    release_read_pins(rp);
+    free(rp->pins);
+    free(rp);
+}
+
+static void read_pins_key_init(void)
+{
+    pthread_key_create(&read_pins_key, free_read_pins);
+}
+
+/* This thread's pins, with those of its previous reply released */
+static struct read_pins *thread_read_pins(void)
+{
+    pthread_once(&read_pins_once, read_pins_key_init);
+    struct read_pins *rp = pthread_getspecific(read_pins_key);
+    if (rp == NULL) {
+        rp = calloc(1, sizeof(struct read_pins));
+        if (rp == NULL || pthread_setspecific(read_pins_key, rp) != 0) {
+            free(rp);
+            return NULL;
+        }
+    }
+    release_read_pins(rp);
+    return rp;
+}
+
+/* Room for one more pin */
+static bool reserve_read_pin(struct read_pins *rp)
+{
+    if (rp->count < rp->capacity) {
+        return true;
+    }
+    size_t capacity = rp->capacity > 0 ? rp->capacity * 2 : 8;
+    cache_block_pin_t *pins = realloc(rp->pins, capacity * sizeof(cache_block_pin_t));
+    if (pins == NULL) {
+        return false;
+    }
+    rp->pins = pins;
+    rp->capacity = capacity;
+    return true;
+}
+
+static void free_bufvec(struct fuse_bufvec *vec)
+{
+    for (size_t i = 0; i < vec->count; i++) {
+        if (!(vec->buf[i].flags & FUSE_BUF_IS_FD)) {
+            free(vec->buf[i].mem);
+        }
+    }
+    free(vec);
+}
+
+/* Build a read reply from the block cache. Ranges held in plain block
+   files are returned as fd ranges for libfuse to splice into the reply;
+   the rest is read through the cache into memory. */
+static int read_buf_through_cache(uint64_t file_key, int fd, struct fuse_bufvec **bufp,
+                                  size_t size, off_t offset, bool bypass)
+{
+    size_t block_size = settings.cache_block_size;
+    size_t span = (offset % block_size + size + block_size - 1) / block_size;
+    struct fuse_bufvec *vec = calloc(1, sizeof(struct fuse_bufvec) +
+                                        (span > 1 ? span - 1 : 0) * sizeof(struct fuse_buf));
+    if (vec == NULL) {
+        return -ENOMEM;
+    }
+
+    struct read_pins *rp = thread_read_pins();
+    size_t done = 0;
+    int res = 0;
+
+    while (done < size && vec->count < span) {
+        off_t pos = offset + done;
+        size_t block_idx = pos / block_size;
+        size_t block_offset = pos % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        struct fuse_buf *b = &vec->buf[vec->count];
+        size_t len = chunk;
+        cache_block_pin_t pin;
+        uint64_t start = cache_stats_now();
+        if (rp != NULL && reserve_read_pin(rp) &&
+            cache_block_pin(cache_block_ctx, file_key, block_idx, block_offset, &len, &pin) == 0) {
+            cache_stats_since(CACHE_STAGE_BLOCK_HIT, start);
+            cache_stats_add(CACHE_CTR_BLOCK_HITS, 1);
+            cache_stats_add(CACHE_CTR_CACHE_READ_BYTES, len);
+            rp->pins[rp->count++] = pin;
+            b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            b->fd = pin.fd;
+            b->pos = pin.pos;
+        } else {
+            /* RAM tier hit, compressed block or miss */
+            b->mem = malloc(chunk);
+            if (b->mem == NULL) {
+                res = -ENOMEM;
+                break;
+            }
+            int n = read_through_cache(file_key, fd, b->mem, chunk, pos, bypass);
+            if (n < 0) {
+                free(b->mem);
+                b->mem = NULL;
+                res = n;
+                break;
             }
+            len = n;
+        }
+        b->size = len;
+        vec->count++;
+        done += len;
+        if (len < chunk) {
+            break;  /* End of file */
         }
     }
 
-    free(real_path);
-    fi->fh = fd;
-    return 0;
+    if (res < 0 && done == 0) {
+        free_bufvec(vec);
+        return res;
+    }
+    if (vec->count == 0) {
+        vec->count = 1;  /* Empty reply at end of file */
+    }
+    *bufp = vec;
+    return done;
 }
+#endif
 
-static int bindfs_read(const char *path, char *buf, size_t size, off_t offset,
-                       struct fuse_file_info *fi)
+static int bindfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                           size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int res;
-
-    char *target_buf = buf;
+    CACHE_STATS_SCOPE(CACHE_OP_READ);
+    (void)path;
 
 #ifdef HAVE_SQLITE3
     /* Lazy init cache on first use */
     if (settings.cache_root != NULL && !cache_initialized) {
-        fprintf(stderr, "[READ] path=%s - triggering cache init\n", path);
         ensure_cache_initialized();
-        fprintf(stderr, "[READ] cache init returned\n");
     }
 #endif
 
-    if (settings.read_limiter) {
-        rate_limiter_wait(settings.read_limiter, size);
-    }
+    /* Only backend reads are charged; read_through_cache() charges misses */
+    RateLimiter *limiter = caller_read_limiter();
 
 #ifdef __linux__
-    size_t mmap_size = 0;
+    /* Forwarded O_DIRECT reads need an aligned buffer. It is our own, so
+       libfuse can send it as is instead of copying it into another. */
     if ((fi->flags & O_DIRECT) && settings.forward_odirect) {
-        mmap_size = round_up_buffer_size_for_direct_io(size);
-        target_buf = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-        if (target_buf == MAP_FAILED) {
+        void *mem;
+        if (posix_memalign(&mem, settings.odirect_alignment,
+                           round_up_buffer_size_for_direct_io(size)) != 0) {
             return -ENOMEM;
         }
+        if (limiter) {
+            rate_limiter_wait(limiter, size);
+        }
+        ssize_t res = pread(FI_FD(fi), mem, size, offset);
+        if (res == -1) {
+            int saved_errno = errno;
+            free(mem);
+            return -saved_errno;
+        }
+        struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec));
+        if (vec == NULL) {
+            free(mem);
+            return -ENOMEM;
+        }
+        *vec = FUSE_BUFVEC_INIT(res);
+        vec->buf[0].mem = mem;
+        *bufp = vec;
+        return 0;
     }
 #endif
 
-    /* Try block cache first */
-    if (cache_block_ctx != NULL) {
-        size_t block_idx = offset / settings.cache_block_size;
-        size_t block_offset = offset % settings.cache_block_size;
-        
-        if (cache_block_exists(cache_block_ctx, path, block_idx)) {
-            ssize_t bytes_read = cache_block_read(cache_block_ctx, path, block_idx,
-                                                   target_buf, size, block_offset);
-            if (bytes_read >= 0) {
-#ifdef __linux__
-                if (target_buf != buf) {
-                    memcpy(buf, target_buf, bytes_read);
-                    munmap(target_buf, mmap_size);
-                }
-#endif
-                return bytes_read;
-            }
+#ifdef HAVE_SQLITE3
+    if (cache_block_ctx != NULL && FI_FH(fi)->file_key != 0 && !FI_FH(fi)->uncached) {
+        bool streaming = read_is_streaming(FI_FH(fi), offset, size);
+        int res = read_buf_through_cache(FI_FH(fi)->file_key, FI_FD(fi), bufp, size, offset,
+                                         streaming);
+        if (res > 0 && !streaming) {
+            cache_ra_file_access(FI_FH(fi)->ra, offset, res);
         }
+        return res < 0 ? res : 0;
     }
+#endif
 
-    /* Cache miss - read from backend */
-    res = pread(fi->fh, target_buf, size, offset);
-    if (res == -1)
-        res = -errno;
-    
-    /* Store in block cache on successful read */
-    if (res > 0 && cache_block_ctx != NULL) {
-        size_t block_idx = offset / settings.cache_block_size;
-        cache_block_write(cache_block_ctx, path, block_idx,
-                         target_buf, res);
+    /* Uncached: let libfuse read (or splice) straight from the backend */
+    if (limiter) {
+        rate_limiter_wait(limiter, size);
     }
-
-#ifdef __linux__
-    if (target_buf != buf) {
-        memcpy(buf, target_buf, size);
-        munmap(target_buf, mmap_size);
+    struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec));
+    if (vec == NULL) {
+        return -ENOMEM;
     }
-#endif
-
-    return res;
+    *vec = FUSE_BUFVEC_INIT(size);
+    vec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    vec->buf[0].fd = FI_FD(fi);
+    vec->buf[0].pos = offset;
+    *bufp = vec;
+    return 0;
 }
 
-static int bindfs_write(const char *path, const char *buf, size_t size,
-                        off_t offset, struct fuse_file_info *fi)
+static int bindfs_write_buf(const char *path, struct fuse_bufvec *buf,
+                            off_t offset, struct fuse_file_info *fi)
 {
-    int res;
-    char *source_buf = (char*)buf;
+    CACHE_STATS_SCOPE(CACHE_OP_WRITE);
+    size_t size = fuse_buf_size(buf);
 
-    if (settings.write_limiter) {
-        rate_limiter_wait(settings.write_limiter, size);
+    RateLimiter *limiter = caller_write_limiter();
+    if (limiter) {
+        rate_limiter_wait(limiter, size);
     }
 
+    /* Write-through: always write to backend first */
+    cache_block_update_t upd;
+    bool populate = populate_begin(fi, offset, size, &upd);
+    bool direct = false;
 #ifdef __linux__
-    size_t mmap_size = 0;
-    if ((fi->flags & O_DIRECT) && settings.forward_odirect) {
-        mmap_size = round_up_buffer_size_for_direct_io(size);
-        source_buf = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-        if (source_buf == MAP_FAILED) {
+    direct = (fi->flags & O_DIRECT) && settings.forward_odirect;
+#endif
+    ssize_t res;
+    if (direct || populate) {
+        /* Gathered into one buffer: forwarded O_DIRECT writes need it
+           aligned, and populating the cache needs the data at hand */
+        void *mem = NULL;
+#ifdef __linux__
+        if (direct) {
+            if (posix_memalign(&mem, settings.odirect_alignment,
+                               round_up_buffer_size_for_direct_io(size)) != 0) {
+                mem = NULL;
+            }
+        } else
+#endif
+        {
+            mem = malloc(size);
+        }
+        if (mem == NULL) {
+            if (populate) {
+                cache_block_update_end(&upd, NULL, 0, -1);
+            }
             return -ENOMEM;
         }
-        memcpy(source_buf, buf, size);
-    }
-#endif
-
-    /* Write-through: always write to backend first */
-    res = pwrite(fi->fh, source_buf, size, offset);
-    if (res == -1)
-        res = -errno;
-    
-    /* Invalidate affected cache blocks and metadata on successful write */
-    if (res > 0 && cache_block_ctx != NULL) {
-        cache_block_invalidate_range(cache_block_ctx, path, offset, size);
-    }
-    if (res > 0 && cache_meta_ctx != NULL) {
-        cache_meta_invalidate(cache_meta_ctx, path);
+        struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+        tmp.buf[0].mem = mem;
+        res = fuse_buf_copy(&tmp, buf, 0);
+        if (res > 0) {
+            res = pwrite(FI_FD(fi), mem, res, offset);
+            if (res == -1) {
+                res = -errno;
+            }
+        }
+        if (populate) {
+            populate_end(path, fi, &upd, mem, res);
+        }
+        free(mem);
+    } else {
+        /* Spliced straight from the request pipe when libfuse used one */
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd = FI_FD(fi);
+        dst.buf[0].pos = offset;
+        res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
     }
 
-#ifdef __linux__
-    if (source_buf != buf) {
-        munmap(source_buf, mmap_size);
+    if (res > 0 && !populate) {
+        invalidate_written(path, fi, offset, res);
     }
-#endif
-
     return res;
 }
+#endif
 
 #if defined(HAVE_FUSE_29) || defined(HAVE_FUSE_3)
 /* This callback is only installed if lock forwarding is enabled. */
 static int bindfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
                        struct flock *lock)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_LOCK);
   (void)path;
-  int res = fcntl(fi->fh, cmd, lock);
+  int res = fcntl(FI_FD(fi), cmd, lock);
   if (res == -1) {
     return -errno;
   }
@@ -1996,14 +3206,129 @@ static int bindfs_lock(const char *path, struct fuse_file_info *fi, int cmd,
 /* This callback is only installed if lock forwarding is enabled. */
 static int bindfs_flock(const char *path, struct fuse_file_info *fi, int op)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_FLOCK);
     (void)path;
-    int res = flock(fi->fh, op);
+    int res = flock(FI_FD(fi), op);
+    if (res == -1) {
+        return -errno;
+    }
+    return 0;
+}
+#endif
+
+#ifdef HAVE_FUSE_3
+static int bindfs_fallocate(const char *path, int mode, off_t offset,
+                            off_t length, struct fuse_file_info *fi)
+{
+    CACHE_STATS_SCOPE(CACHE_OP_FALLOCATE);
+    int res;
+#ifdef __NR_fallocate
+    res = syscall(__NR_fallocate, FI_FD(fi), mode, offset, length);
     if (res == -1) {
         return -errno;
     }
+#elif defined(HAVE_POSIX_FALLOCATE)
+    if (mode != 0) {
+        return -EOPNOTSUPP;
+    }
+    res = posix_fallocate(FI_FD(fi), offset, length);
+    if (res != 0) {
+        return -res;
+    }
+#else
+    (void)path;
+    (void)mode;
+    (void)offset;
+    (void)length;
+    (void)fi;
+    return -EOPNOTSUPP;
+#endif
+
+#if defined(__NR_fallocate) || defined(HAVE_POSIX_FALLOCATE)
+#ifdef HAVE_SQLITE3
+#if defined(FALLOC_FL_COLLAPSE_RANGE) && defined(FALLOC_FL_INSERT_RANGE)
+    if (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) {
+        /* Everything after offset moved */
+        if (cache_block_ctx != NULL && FI_FH(fi)->file_key != 0) {
+            cache_block_invalidate_file(cache_block_ctx, FI_FH(fi)->file_key);
+        }
+        invalidate_cached_attrs(path);
+        return 0;
+    }
+#endif
+    /* Punched or zeroed ranges read differently; plain allocation may
+       only have changed the size */
+    invalidate_written(path, fi, offset, length);
+#endif
     return 0;
+#endif
+}
+
+/* Let the backend copy, so the data never passes through FUSE. The
+   destination's cached blocks go stale, but any complete cached block of
+   the source now matches the destination and is cloned to it. */
+static ssize_t bindfs_copy_file_range(const char *path_in,
+                                      struct fuse_file_info *fi_in,
+                                      off_t offset_in, const char *path_out,
+                                      struct fuse_file_info *fi_out,
+                                      off_t offset_out, size_t size, int flags)
+{
+    CACHE_STATS_SCOPE(CACHE_OP_COPY_FILE_RANGE);
+#ifdef __NR_copy_file_range
+    (void)path_in;
+    off_t copy_in = offset_in;
+    off_t copy_out = offset_out;
+
+    ssize_t res = syscall(__NR_copy_file_range, FI_FD(fi_in), &copy_in,
+                          FI_FD(fi_out), &copy_out, size, (unsigned int)flags);
+    if (res == -1) {
+        return -errno;
+    }
+
+#ifdef HAVE_SQLITE3
+    if (res > 0) {
+        invalidate_written(path_out, fi_out, offset_out, res);
+
+        struct stat st;
+        uint64_t src_key = FI_FH(fi_in)->file_key;
+        uint64_t dst_key = FI_FH(fi_out)->file_key;
+        if (cache_block_ctx != NULL && src_key != 0 && dst_key != 0 &&
+            fstat(FI_FD(fi_out), &st) == 0) {
+            cache_block_clone_range(cache_block_ctx, src_key, offset_in,
+                                    dst_key, offset_out, res, st.st_size);
+        }
+    }
+#endif
+    return res;
+#else
+    /* libfuse falls back to read and write */
+    (void)path_in;
+    (void)fi_in;
+    (void)offset_in;
+    (void)path_out;
+    (void)fi_out;
+    (void)offset_out;
+    (void)size;
+    (void)flags;
+    return -EOPNOTSUPP;
+#endif
+}
+
+#ifdef HAVE_FUSE_LSEEK
+/* SEEK_DATA and SEEK_HOLE are answered by the backend */
+static off_t bindfs_lseek(const char *path, off_t off, int whence,
+                          struct fuse_file_info *fi)
+{
+    CACHE_STATS_SCOPE(CACHE_OP_LSEEK);
+    (void)path;
+    off_t res = lseek(FI_FD(fi), off, whence);
+    if (res == -1) {
+        return -errno;
+    }
+    return res;
 }
 #endif
+#endif
 
 #ifdef HAVE_FUSE_3
 static int bindfs_ioctl(const char *path, int cmd, void *arg,
@@ -2015,10 +3340,11 @@ static int bindfs_ioctl(const char *path, int cmd, void *arg,
                         void *data)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_IOCTL);
     (void)path;
     (void)arg;
     (void)flags;
-    int res = ioctl(fi->fh, cmd, data);
+    int res = ioctl(FI_FD(fi), cmd, data);
     if (res == -1) {
       return -errno;
     }
@@ -2027,6 +3353,7 @@ static int bindfs_ioctl(const char *path, int cmd, void *arg,
 
 static int bindfs_statfs(const char *path, struct statvfs *stbuf)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_STATFS);
     int res;
     char *real_path;
 
@@ -2045,6 +3372,7 @@ static int bindfs_statfs(const char *path, struct statvfs *stbuf)
 #ifdef HAVE_FUSE_T
 static int bindfs_statfs_x(const char *path, struct statfs *stbuf)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_STATFS);
     int res;
     char *real_path;
 
@@ -2063,9 +3391,21 @@ static int bindfs_statfs_x(const char *path, struct statfs *stbuf)
 
 static int bindfs_release(const char *path, struct fuse_file_info *fi)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_RELEASE);
     (void) path;
+    struct bindfs_fh *fh = FI_FH(fi);
 
-    close(fi->fh);
+#ifdef HAVE_SQLITE3
+    /* Waits for readahead still using the fd */
+    cache_ra_file_release(fh->ra);
+#endif
+    close(fh->fd);
+#ifdef HAVE_SQLITE3
+    if (fh->writer) {
+        own_writer_close(fh->file_key);
+    }
+#endif
+    free(fh);
 
     return 0;
 }
@@ -2073,6 +3413,7 @@ static int bindfs_release(const char *path, struct fuse_file_info *fi)
 static int bindfs_fsync(const char *path, int isdatasync,
                         struct fuse_file_info *fi)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_FSYNC);
     int res;
     (void) path;
 
@@ -2080,10 +3421,10 @@ static int bindfs_fsync(const char *path, int isdatasync,
     (void) isdatasync;
 #else
     if (isdatasync)
-        res = fdatasync(fi->fh);
+        res = fdatasync(FI_FD(fi));
     else
 #endif
-        res = fsync(fi->fh);
+        res = fsync(FI_FD(fi));
     if (res == -1)
         return -errno;
 
@@ -2091,6 +3432,140 @@ static int bindfs_fsync(const char *path, int isdatasync,
 }
 
 #ifdef HAVE_SETXATTR
+#ifdef HAVE_SQLITE3
+/* Virtual attributes that control the cache instead of reaching the
+   backend. Setting warm, pin or unpin on a path walks the subtree below
+   it; the value, if any, is the number of workers to walk with. Names
+   under the prefix never reach the backend. */
+#define CACHE_XATTR_PREFIX "user.cachefs."
+#define CACHE_XATTR_WARM "user.cachefs.warm"
+#define CACHE_XATTR_PIN "user.cachefs.pin"
+#define CACHE_XATTR_UNPIN "user.cachefs.unpin"
+#define CACHE_XATTR_PINNED "user.cachefs.pinned"
+
+static uint64_t warm_file_key(void *arg, const char *path, int fd, const struct stat *st)
+{
+    (void)arg;
+    return file_key_for_fd(path, fd, st);
+}
+
+static bool is_cache_control(const char *name)
+{
+    return strncmp(name, CACHE_XATTR_PREFIX, sizeof(CACHE_XATTR_PREFIX) - 1) == 0;
+}
+
+static int cache_control_set(const char *path, const char *name, const char *value, size_t size)
+{
+    cache_warm_mode_t mode;
+    if (strcmp(name, CACHE_XATTR_WARM) == 0) {
+        mode = CACHE_WARM_FILL;
+    } else if (strcmp(name, CACHE_XATTR_PIN) == 0) {
+        mode = CACHE_WARM_PIN;
+    } else if (strcmp(name, CACHE_XATTR_UNPIN) == 0) {
+        mode = CACHE_WARM_UNPIN;
+    } else {
+        return -ENOTSUP;
+    }
+
+    /* Warming reads the backend as the mounting user, so only they may */
+    struct fuse_context *fc = fuse_get_context();
+    if (fc->uid != 0 && fc->uid != getuid()) {
+        return -EPERM;
+    }
+
+    if (settings.cache_root != NULL && !cache_initialized) {
+        ensure_cache_initialized();
+    }
+    if (cache_meta_ctx == NULL && cache_block_ctx == NULL) {
+        return -ENOTSUP;
+    }
+    if (mode != CACHE_WARM_FILL && cache_block_ctx == NULL) {
+        return -ENOTSUP;
+    }
+
+    int workers = WARM_WORKERS;
+    if (size > 0) {
+        char num[16];
+        if (size >= sizeof(num)) {
+            return -EINVAL;
+        }
+        memcpy(num, value, size);
+        num[size] = '\0';
+        char *end;
+        long n = strtol(num, &end, 10);
+        if (end == num || (*end != '\0' && *end != '\n') || n <= 0 || n > 256) {
+            return -EINVAL;
+        }
+        workers = (int)n;
+    }
+
+    char *real_path = process_path(path, false);
+    if (real_path == NULL) {
+        return -errno;
+    }
+
+    cache_warm_opts_t opts = {
+        .meta = cache_meta_ctx,
+        .blocks = cache_block_ctx,
+        .block_size = settings.cache_block_size,
+        .limiter = caller_read_limiter(),
+        .file_key = warm_file_key,
+        .follow_symlinks = settings.resolve_symlinks,
+        .workers = workers,
+        .debug = settings.cache_debug,
+    };
+    cache_warm_stats_t stats;
+    int res = cache_warm_tree(&opts, mode, path, real_path, &stats);
+    int err = errno;
+    free(real_path);
+    if (res != 0) {
+        return -err;
+    }
+
+    if (settings.cache_debug) {
+        print_timestamp(stderr);
+        fprintf(stderr, "%s %s: %zu dirs, %zu files, %zu blocks fetched (%zu bytes), %zu errors\n",
+                name + sizeof(CACHE_XATTR_PREFIX) - 1, path, stats.dirs, stats.files,
+                stats.blocks, stats.bytes, stats.errors);
+        fflush(stderr);
+    }
+    return 0;
+}
+
+static int cache_control_get(const char *name, char *value, size_t size)
+{
+    if (strcmp(name, CACHE_XATTR_PINNED) != 0) {
+        return -ENODATA;
+    }
+
+    size_t pinned_size = 0;
+    size_t pinned_files = 0;
+    size_t current_size = 0;
+    size_t max_size = 0;
+    if (settings.cache_root != NULL && !cache_initialized) {
+        ensure_cache_initialized();
+    }
+    if (cache_block_ctx == NULL) {
+        return -ENODATA;
+    }
+    cache_block_get_pinned(cache_block_ctx, &pinned_size, &pinned_files);
+    cache_block_get_stats(cache_block_ctx, &current_size, &max_size);
+
+    char text[160];
+    int len = snprintf(text, sizeof(text),
+                       "pinned_bytes=%zu pinned_files=%zu cache_bytes=%zu max_bytes=%zu\n",
+                       pinned_size, pinned_files, current_size, max_size);
+    if (size == 0) {
+        return len;
+    }
+    if (size < (size_t)len) {
+        return -ERANGE;
+    }
+    memcpy(value, text, len);
+    return len;
+}
+#endif
+
 /* The disgusting __APPLE__ sections below were copied without much
    understanding from the osxfuse example file:
    https://github.com/osxfuse/fuse/blob/master/example/fusexmp_fh.c */
@@ -2103,11 +3578,18 @@ static int bindfs_setxattr(const char *path, const char *name, const char *value
                            size_t size, int flags)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_SETXATTR);
     int res;
     char *real_path;
 
     DPRINTF("setxattr %s %s=%s", path, name, value);
 
+#ifdef HAVE_SQLITE3
+    if (is_cache_control(name)) {
+        return cache_control_set(path, name, value, size);
+    }
+#endif
+
     if (settings.xattr_policy == XATTR_READ_ONLY)
         return -EACCES;
 
@@ -2148,11 +3630,18 @@ static int bindfs_getxattr(const char *path, const char *name, char *value,
                            size_t size)
 #endif
 {
+    CACHE_STATS_SCOPE(CACHE_OP_GETXATTR);
     int res;
     char *real_path;
 
     DPRINTF("getxattr %s %s", path, name);
 
+#ifdef HAVE_SQLITE3
+    if (is_cache_control(name)) {
+        return cache_control_get(name, value, size);
+    }
+#endif
+
     real_path = process_path(path, true);
     if (real_path == NULL)
         return -errno;
@@ -2179,6 +3668,7 @@ static int bindfs_getxattr(const char *path, const char *name, char *value,
 
 static int bindfs_listxattr(const char *path, char* list, size_t size)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_LISTXATTR);
     char *real_path;
 
     DPRINTF("listxattr %s", path);
@@ -2228,6 +3718,7 @@ static int bindfs_listxattr(const char *path, char* list, size_t size)
 
 static int bindfs_removexattr(const char *path, const char *name)
 {
+    CACHE_STATS_SCOPE(CACHE_OP_REMOVEXATTR);
     int res;
     char *real_path;
 
@@ -2292,9 +3783,18 @@ static struct fuse_operations cachefs_oper = {
     .read       = bindfs_read,
     .write      = bindfs_write,
 #if defined(HAVE_FUSE_29) || defined(HAVE_FUSE_3)
+    .read_buf   = bindfs_read_buf,
+    .write_buf  = bindfs_write_buf,
     .lock       = bindfs_lock,
     .flock      = bindfs_flock,
 #endif
+#ifdef HAVE_FUSE_3
+    .fallocate  = bindfs_fallocate,
+    .copy_file_range = bindfs_copy_file_range,
+#ifdef HAVE_FUSE_LSEEK
+    .lseek      = bindfs_lseek,
+#endif
+#endif
 #ifndef __OpenBSD__
     .ioctl      = bindfs_ioctl,
 #endif
@@ -2379,6 +3879,7 @@ static void print_usage(const char *progname)
            "Rate limits:\n"
            "  --read-rate=...           Limit to bytes/sec that can be read.\n"
            "  --write-rate=...          Limit to bytes/sec that can be written.\n"
+           "  --rate-per-user           Apply the limits to each user separately.\n"
            "\n"
            "Miscellaneous:\n"
            "  --no-allow-other          Do not add -o allow_other to fuse options.\n"
@@ -2402,6 +3903,33 @@ static void print_usage(const char *progname)
            "  --cache-block-size=BYTES  Block size in bytes (default: 262144 = 256KB).\n"
            "  --cache-max-size=SIZE     Max cache size (default: 0 = unlimited).\n"
            "                            Supports K, M, G, T suffixes (e.g., 1G, 500M).\n"
+           "  --cache-mem-size=SIZE     In-memory block tier size (default: 0 = disabled).\n"
+           "  --cache-readahead=N       Max blocks read ahead of sequential readers\n"
+           "                            (default: 8, 0 = disabled).\n"
+           "  --cache-kernel            Let the kernel cache entries and attributes for\n"
+           "                            the TTLs, and file data while unchanged.\n"
+           "  --cache-dedup             Store identical cached blocks only once.\n"
+           "  --cache-write-populate    Merge written data into cached blocks instead\n"
+           "                            of invalidating them.\n"
+           "  --cache-admission=POLICY  Which fetched blocks a full cache stores: all\n"
+           "                            (default) or tinylfu, those fetched before.\n"
+           "  --cache-stream-bypass=SIZE\n"
+           "                            Don't store blocks for a file handle that has read\n"
+           "                            more than SIZE sequentially (default: 0 = never).\n"
+           "  --cache-odirect           Serve O_DIRECT opens from the cache too.\n"
+           "  --cache-watch             Watch the backend for changes made outside the\n"
+           "                            mount (inotify).\n"
+           "  --cache-compress=CODEC[:LEVEL]\n"
+           "                            Compress cached blocks with lz4 or zstd.\n"
+           "  --cache-meta-backend=NAME Metadata store: sqlite (default) or lmdb.\n"
+           "  --cache-io=ENGINE[:DEPTH] Backend I/O engine for block fetches: uring\n"
+           "                            (default where available) or sync; DEPTH is\n"
+           "                            the requests in flight per thread (default: 32).\n"
+           "  --cache-stats-socket=PATH Serve counters and latency histograms in\n"
+           "                            Prometheus format on a unix socket.\n"
+           "  --cache-shared=DIR        Keep cached blocks in a store at DIR shared with\n"
+           "                            other mounts of the same user and block size\n"
+           "                            (not with other users).\n"
            "  --cache-debug             Enable cache debug logging.\n"
            "\n"
            "FUSE options:\n"
@@ -2445,6 +3973,7 @@ enum OptionKey {
     OPTKEY_DISABLE_LOCK_FORWARDING,
     OPTKEY_ENABLE_IOCTL,
     OPTKEY_HIDE_HARD_LINKS,
+    OPTKEY_RATE_PER_USER,
     OPTKEY_RESOLVE_SYMLINKS,
     OPTKEY_BLOCK_DEVICES_AS_FILES,
     OPTKEY_DIRECT_IO,
@@ -2454,6 +3983,16 @@ enum OptionKey {
     OPTKEY_CACHE_DIR_TTL,
     OPTKEY_CACHE_BLOCK_SIZE,
     OPTKEY_CACHE_MAX_SIZE,
+    OPTKEY_CACHE_MEM_SIZE,
+    OPTKEY_CACHE_READAHEAD,
+    OPTKEY_CACHE_KERNEL,
+    OPTKEY_CACHE_DEDUP,
+    OPTKEY_CACHE_WRITE_POPULATE,
+    OPTKEY_CACHE_ODIRECT,
+    OPTKEY_CACHE_STREAM_BYPASS,
+    OPTKEY_CACHE_WATCH,
+    OPTKEY_CACHE_STATS_SOCKET,
+    OPTKEY_CACHE_SHARED,
     OPTKEY_CACHE_DEBUG
 };
 
@@ -2592,6 +4131,9 @@ static int process_option(void *data, const char *arg, int key,
     case OPTKEY_HIDE_HARD_LINKS:
         settings.hide_hard_links = 1;
         return 0;
+    case OPTKEY_RATE_PER_USER:
+        settings.rate_per_user = 1;
+        return 0;
     case OPTKEY_RESOLVE_SYMLINKS:
         settings.resolve_symlinks = 1;
         return 0;
@@ -2622,6 +4164,38 @@ static int process_option(void *data, const char *arg, int key,
     case OPTKEY_CACHE_MAX_SIZE:
         settings.cache_max_size = parse_size(strchr(arg, '=') + 1);
         return 0;
+    case OPTKEY_CACHE_MEM_SIZE:
+        settings.cache_mem_size = parse_size(strchr(arg, '=') + 1);
+        return 0;
+    case OPTKEY_CACHE_READAHEAD:
+        settings.cache_readahead = atoi(strchr(arg, '=') + 1);
+        return 0;
+    case OPTKEY_CACHE_KERNEL:
+        settings.cache_kernel = 1;
+        return 0;
+    case OPTKEY_CACHE_DEDUP:
+        settings.cache_dedup = 1;
+        return 0;
+    case OPTKEY_CACHE_WRITE_POPULATE:
+        settings.cache_write_populate = 1;
+        return 0;
+    case OPTKEY_CACHE_ODIRECT:
+        settings.cache_odirect = 1;
+        return 0;
+    case OPTKEY_CACHE_STREAM_BYPASS:
+        settings.cache_stream_bypass = parse_size(strchr(arg, '=') + 1);
+        return 0;
+    case OPTKEY_CACHE_WATCH:
+        settings.cache_watch = 1;
+        return 0;
+    case OPTKEY_CACHE_STATS_SOCKET:
+        free(settings.cache_stats_socket);
+        settings.cache_stats_socket = strdup(strchr(arg, '=') + 1);
+        return 0;
+    case OPTKEY_CACHE_SHARED:
+        free(settings.cache_shared);
+        settings.cache_shared = strdup(strchr(arg, '=') + 1);
+        return 0;
     case OPTKEY_CACHE_DEBUG:
         settings.cache_debug = 1;
         return 0;
@@ -2966,6 +4540,16 @@ static void atexit_func(void)
         free(settings.write_limiter);
         settings.write_limiter = NULL;
     }
+    if (settings.read_limiters) {
+        rate_limiter_map_destroy(settings.read_limiters);
+        free(settings.read_limiters);
+        settings.read_limiters = NULL;
+    }
+    if (settings.write_limiters) {
+        rate_limiter_map_destroy(settings.write_limiters);
+        free(settings.write_limiters);
+        settings.write_limiters = NULL;
+    }
     usermap_destroy(settings.usermap);
     settings.usermap = NULL;
     usermap_destroy(settings.usermap_reverse);
@@ -3048,6 +4632,10 @@ int main(int argc, char *argv[])
         char *map_passwd_rev;
         char *map_group_rev;
         char *read_rate;
+        char *cache_compress;
+        char *cache_meta_backend;
+        char *cache_io;
+        char *cache_admission;
         char *write_rate;
         char *create_for_user;
         char *create_for_group;
@@ -3097,6 +4685,7 @@ int main(int argc, char *argv[])
 
         OPT_OFFSET2("--read-rate=%s", "read-rate=%s", read_rate, -1),
         OPT_OFFSET2("--write-rate=%s", "write-rate=%s", write_rate, -1),
+        OPT2("--rate-per-user", "rate-per-user", OPTKEY_RATE_PER_USER),
 
         OPT2("--create-as-user", "create-as-user", OPTKEY_CREATE_AS_USER),
         OPT2("--create-as-mounter", "create-as-mounter", OPTKEY_CREATE_AS_MOUNTER),
@@ -3147,6 +4736,20 @@ int main(int argc, char *argv[])
         OPT2("--cache-dir-ttl=%s", "cache-dir-ttl=%s", OPTKEY_CACHE_DIR_TTL),
         OPT2("--cache-block-size=%s", "cache-block-size=%s", OPTKEY_CACHE_BLOCK_SIZE),
         OPT2("--cache-max-size=%s", "cache-max-size=%s", OPTKEY_CACHE_MAX_SIZE),
+        OPT2("--cache-mem-size=%s", "cache-mem-size=%s", OPTKEY_CACHE_MEM_SIZE),
+        OPT2("--cache-readahead=%s", "cache-readahead=%s", OPTKEY_CACHE_READAHEAD),
+        OPT2("--cache-kernel", "cache-kernel", OPTKEY_CACHE_KERNEL),
+        OPT2("--cache-dedup", "cache-dedup", OPTKEY_CACHE_DEDUP),
+        OPT2("--cache-write-populate", "cache-write-populate", OPTKEY_CACHE_WRITE_POPULATE),
+        OPT2("--cache-odirect", "cache-odirect", OPTKEY_CACHE_ODIRECT),
+        OPT2("--cache-stream-bypass=%s", "cache-stream-bypass=%s", OPTKEY_CACHE_STREAM_BYPASS),
+        OPT_OFFSET2("--cache-admission=%s", "cache-admission=%s", cache_admission, -1),
+        OPT2("--cache-watch", "cache-watch", OPTKEY_CACHE_WATCH),
+        OPT2("--cache-stats-socket=%s", "cache-stats-socket=%s", OPTKEY_CACHE_STATS_SOCKET),
+        OPT2("--cache-shared=%s", "cache-shared=%s", OPTKEY_CACHE_SHARED),
+        OPT_OFFSET2("--cache-compress=%s", "cache-compress=%s", cache_compress, -1),
+        OPT_OFFSET2("--cache-meta-backend=%s", "cache-meta-backend=%s", cache_meta_backend, -1),
+        OPT_OFFSET2("--cache-io=%s", "cache-io=%s", cache_io, -1),
         OPT2("--cache-debug", "cache-debug", OPTKEY_CACHE_DEBUG),
 
         OPT_OFFSET2("--uid-offset=%s", "uid-offset=%s", uid_offset, -1),
@@ -3167,6 +4770,9 @@ int main(int argc, char *argv[])
     settings.usermap_reverse = usermap_create();
     settings.read_limiter = NULL;
     settings.write_limiter = NULL;
+    settings.rate_per_user = 0;
+    settings.read_limiters = NULL;
+    settings.write_limiters = NULL;
     settings.new_uid = -1;
     settings.new_gid = -1;
     settings.create_for_uid = -1;
@@ -3212,6 +4818,22 @@ int main(int argc, char *argv[])
     settings.cache_dir_ttl = 10;   /* 10 seconds */
     settings.cache_block_size = DEFAULT_BLOCK_SIZE;  /* 256 KiB */
     settings.cache_max_size = 0;   /* unlimited */
+    settings.cache_mem_size = 0;   /* disabled */
+    settings.cache_readahead = 8;  /* blocks */
+    settings.cache_kernel = 0;
+    settings.cache_dedup = 0;
+    settings.cache_write_populate = 0;
+    settings.cache_odirect = 0;
+    settings.cache_stream_bypass = 0;  /* disabled */
+    settings.cache_admission = CACHE_ADMIT_ALL;
+    settings.cache_watch = 0;
+    settings.cache_stats_socket = NULL;
+    settings.cache_shared = NULL;
+    settings.cache_codec = CACHE_CODEC_NONE;
+    settings.cache_codec_level = 0;
+    settings.cache_meta_backend = CACHE_META_SQLITE;
+    settings.cache_io = CACHE_IO_URING;  /* Falls back to sync where unavailable */
+    settings.cache_io_depth = CACHE_IO_DEFAULT_DEPTH;
     settings.cache_debug = 0;
 
     atexit(&atexit_func);
@@ -3260,8 +4882,13 @@ int main(int argc, char *argv[])
     if (od.read_rate) {
         double rate;
         if (parse_byte_count(od.read_rate, &rate) && rate > 0) {
-            settings.read_limiter = malloc(sizeof(RateLimiter));
-            rate_limiter_init(settings.read_limiter, rate, &gettimeofday_clock);
+            if (settings.rate_per_user) {
+                settings.read_limiters = malloc(sizeof(RateLimiterMap));
+                rate_limiter_map_init(settings.read_limiters, rate, &monotonic_clock);
+            } else {
+                settings.read_limiter = malloc(sizeof(RateLimiter));
+                rate_limiter_init(settings.read_limiter, rate, &monotonic_clock);
+            }
         } else {
             fprintf(stderr, "Error: Invalid --read-rate.\n");
             return 1;
@@ -3270,14 +4897,48 @@ int main(int argc, char *argv[])
     if (od.write_rate) {
         double rate;
         if (parse_byte_count(od.write_rate, &rate) && rate > 0) {
-            settings.write_limiter = malloc(sizeof(RateLimiter));
-            rate_limiter_init(settings.write_limiter, rate, &gettimeofday_clock);
+            if (settings.rate_per_user) {
+                settings.write_limiters = malloc(sizeof(RateLimiterMap));
+                rate_limiter_map_init(settings.write_limiters, rate, &monotonic_clock);
+            } else {
+                settings.write_limiter = malloc(sizeof(RateLimiter));
+                rate_limiter_init(settings.write_limiter, rate, &monotonic_clock);
+            }
         } else {
             fprintf(stderr, "Error: Invalid --write-rate.\n");
             return 1;
         }
     }
 
+    if (od.cache_compress) {
+        if (cache_codec_parse(od.cache_compress, &settings.cache_codec,
+                              &settings.cache_codec_level) != 0) {
+            fprintf(stderr, "Error: Invalid or unsupported --cache-compress.\n");
+            return 1;
+        }
+    }
+
+    if (od.cache_meta_backend) {
+        if (cache_meta_backend_parse(od.cache_meta_backend, &settings.cache_meta_backend) != 0) {
+            fprintf(stderr, "Error: Invalid or unsupported --cache-meta-backend.\n");
+            return 1;
+        }
+    }
+
+    if (od.cache_admission) {
+        if (cache_admit_parse(od.cache_admission, &settings.cache_admission) != 0) {
+            fprintf(stderr, "Error: Invalid --cache-admission.\n");
+            return 1;
+        }
+    }
+
+    if (od.cache_io) {
+        if (cache_io_parse(od.cache_io, &settings.cache_io, &settings.cache_io_depth) != 0) {
+            fprintf(stderr, "Error: Invalid or unsupported --cache-io.\n");
+            return 1;
+        }
+    }
+
     /* Parse passwd */
     if (od.map_passwd) {
         if (getuid() != 0) {
@@ -3443,6 +5104,12 @@ int main(int argc, char *argv[])
             return 1;
         }
     }
+    /* The rules are fixed from here on, so turn them into lookup tables */
+    if (permchain_compile(settings.permchain) != 0 ||
+        permchain_compile(settings.create_permchain) != 0 ||
+        permchain_compile(settings.chmod_permchain) != 0) {
+        DPRINTF("Could not compile permission rules, applying them uncompiled");
+    }
 
 
     /* Parse resolved_symlink_deletion */
@@ -3516,6 +5183,12 @@ int main(int argc, char *argv[])
     free(tmp);
 #endif
 
+    /* The kernel caches attributes for all users alike */
+    if (settings.cache_kernel && is_mirroring_enabled()) {
+        fprintf(stderr, "Ignoring --cache-kernel: it can't be combined with mirroring\n");
+        settings.cache_kernel = 0;
+    }
+
     // With FUSE 3, we disable caches in bindfs_init
 #ifndef HAVE_FUSE_3
     /* We need to disable the attribute cache whenever two users
@@ -3587,6 +5260,33 @@ int main(int argc, char *argv[])
     }
 #endif
 
+#ifdef HAVE_SQLITE3
+    /* Made now and named by its real path, so every mount finds the same socket */
+    if (settings.cache_shared != NULL) {
+        mkdir(settings.cache_shared, 0700);
+        char *shared = realpath(settings.cache_shared, NULL);
+        if (shared == NULL) {
+            fprintf(stderr, "Failed to use shared cache '%s': %s\n",
+                    settings.cache_shared, strerror(errno));
+            return 1;
+        }
+        free(settings.cache_shared);
+        settings.cache_shared = shared;
+    }
+#endif
+
+    /* The daemon changes directory, so resolve a relative socket path now */
+    if (settings.cache_stats_socket != NULL && settings.cache_stats_socket[0] != '/') {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            fprintf(stderr, "Failed to get current directory: %s\n", strerror(errno));
+            return 1;
+        }
+        char *abs_socket = sprintf_new("%s/%s", cwd, settings.cache_stats_socket);
+        free(settings.cache_stats_socket);
+        settings.cache_stats_socket = abs_socket;
+    }
+
     /* Remove xattr implementation if the user doesn't want it */
     if (settings.xattr_policy == XATTR_UNIMPLEMENTED) {
         cachefs_oper.setxattr = NULL;
@@ -21,6 +21,8 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "misc.h"
 #include "debug.h"
 
@@ -29,6 +31,11 @@
 #define PC_APPLY_DIRS 2
 #define PC_FLAGS_DEFAULT ((PC_APPLY_FILES) | (PC_APPLY_DIRS))
 
+/* The rules only look at the 12 permission bits and whether the target is a
+   directory, so a compiled chain is a table of 2 * 4096 results. */
+#define PC_TABLE_PERMS 010000
+#define PC_TABLE_INDEX(m) ((S_ISDIR(m) ? PC_TABLE_PERMS : 0) | ((m) & 07777))
+
 struct permchain {
     char op; /* one of '=', '+', '-', 'o' (octal) or '\0' */
     char flags; /* see 'PC_' constants above. */
@@ -38,6 +45,7 @@ struct permchain {
         unsigned int as_octal;
     } mode;
     struct permchain *next;
+    uint16_t *table; /* set on the head by permchain_compile, or NULL */
 };
 
 struct permchain *permchain_create(void)
@@ -48,6 +56,7 @@ struct permchain *permchain_create(void)
     memset(pc->mode.as_operands, '\0', sizeof(pc->mode.as_operands));
     pc->next = NULL;
     pc->flags = PC_FLAGS_DEFAULT;
+    pc->table = NULL;
     return pc;
 }
 
@@ -57,6 +66,7 @@ static int add_chmod_rule_to_permchain(const char *start, const char *end,
 static int add_octal_rule_to_permchain(const char *start, const char *end,
                                        struct permchain *pc);
 static mode_t modebits_to_all(int perms); /* e.g. 5 -> 0555 */
+static mode_t permchain_walk(struct permchain *pc, mode_t tgtmode, bool trace);
 
 
 
@@ -221,6 +231,9 @@ error:
 
 void permchain_cat(struct permchain *left, struct permchain *right)
 {
+    /* The compiled table no longer matches the rules */
+    free(left->table);
+    left->table = NULL;
     while (left->next != NULL)
         left = left->next;
     left->next = right;
@@ -234,7 +247,35 @@ mode_t modebits_to_all(int perms)
     return m;
 }
 
+int permchain_compile(struct permchain *pc)
+{
+    uint16_t *table = malloc(2 * PC_TABLE_PERMS * sizeof(uint16_t));
+    if (table == NULL)
+        return -1;
+
+    free(pc->table);
+    pc->table = NULL;
+    for (mode_t perms = 0; perms < PC_TABLE_PERMS; ++perms) {
+        table[PC_TABLE_INDEX(S_IFREG | perms)] = permchain_walk(pc, S_IFREG | perms, false) & 07777;
+        table[PC_TABLE_INDEX(S_IFDIR | perms)] = permchain_walk(pc, S_IFDIR | perms, false) & 07777;
+    }
+    pc->table = table;
+    return 0;
+}
+
 mode_t permchain_apply(struct permchain *pc, mode_t tgtmode)
+{
+    /* No rule touches the file type bits, so only the permissions are looked up */
+    if (pc->table != NULL) {
+        mode_t mode = (tgtmode & ~07777) | pc->table[PC_TABLE_INDEX(tgtmode)];
+        DPRINTF("STAT MODE: %o =>: %o", tgtmode, mode);
+        return mode;
+    }
+    return permchain_walk(pc, tgtmode, true);
+}
+
+/* Applies the rules one by one. 'trace' logs each step in debug builds. */
+static mode_t permchain_walk(struct permchain *pc, mode_t tgtmode, bool trace)
 {
     mode_t original_mode = tgtmode;
     mode_t mode = 0000;
@@ -242,9 +283,9 @@ mode_t permchain_apply(struct permchain *pc, mode_t tgtmode)
 
     while (pc != NULL) {
         #if CACHEFS_DEBUG
-        if (pc->op == 'o') {
+        if (trace && pc->op == 'o') {
             DPRINTF("STAT MODE: %o, op = %c %o", tgtmode, pc->op, pc->mode.as_octal);
-        } else if (pc->op != '\0') {
+        } else if (trace && pc->op != '\0') {
             DPRINTF("STAT MODE: %o, op = %c%s", tgtmode, pc->op, pc->mode.as_operands);
         }
         #endif
@@ -322,7 +363,9 @@ mode_t permchain_apply(struct permchain *pc, mode_t tgtmode)
             assert(0);
         }
         pc = pc->next;
-        DPRINTF("       =>: %o", tgtmode);
+        if (trace) {
+            DPRINTF("       =>: %o", tgtmode);
+        }
     }
     return tgtmode;
 }
@@ -332,6 +375,7 @@ void permchain_destroy(struct permchain *pc)
     struct permchain *next;
     while (pc) {
         next = pc->next;
+        free(pc->table);
         free(pc);
         pc = next;
     }
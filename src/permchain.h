@@ -45,9 +45,17 @@ struct permchain *permchain_create(void);
    Returns 0 on success. On failure, pc will not be modified. */
 int add_chmod_rules_to_permchain(const char *rule, struct permchain *pc);
 
-/* Links 'right' to the end of 'left'. Don't destroy 'right' after this. */
+/* Links 'right' to the end of 'left'. Don't destroy 'right' after this.
+   Drops the compiled table of 'left', if any. */
 void permchain_cat(struct permchain *left, struct permchain *right);
 
+/* Precomputes the result of every rule in pc for each combination of
+   permission bits, for files and directories, so that permchain_apply is a
+   single table lookup. Must be called again after adding rules to pc.
+   Not thread-safe with concurrent permchain_apply on the same chain.
+   Returns 0 on success. On failure, pc keeps working uncompiled. */
+int permchain_compile(struct permchain *pc);
+
 mode_t permchain_apply(struct permchain *pc, mode_t tgtmode);
 
 void permchain_destroy(struct permchain *pc);
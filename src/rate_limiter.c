@@ -22,7 +22,6 @@
 #include "rate_limiter.h"
 #include <assert.h>
 #include <errno.h>
-#include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -35,6 +34,13 @@ double gettimeofday_clock(void)
     return tv.tv_sec + tv.tv_usec * 0.000001;
 }
 
+double monotonic_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 0.000000001;
+}
+
 static void sleep_seconds(double s)
 {
     struct timespec ts;
@@ -54,16 +60,8 @@ void rate_limiter_init(RateLimiter *limiter, double rate, double (*clock)(void))
 {
     limiter->rate = rate;
     limiter->clock = clock;
-    limiter->last_modified = limiter->clock();
-    limiter->accumulated_sleep_time = rate_limiter_idle_credit;
-
-    pthread_mutexattr_t attr;
-    int status = pthread_mutexattr_init(&attr);
-    assert(status == 0);
-    status = pthread_mutex_init(&limiter->mutex, &attr);
-    assert(status == 0);
-    status = pthread_mutexattr_destroy(&attr);
-    assert(status == 0);
+    limiter->epoch = limiter->clock();
+    atomic_init(&limiter->drained_at, rate_limiter_idle_credit);
 }
 
 void rate_limiter_wait(RateLimiter* limiter, size_t size)
@@ -74,35 +72,62 @@ void rate_limiter_wait(RateLimiter* limiter, size_t size)
 
 double rate_limiter_wait_nosleep(RateLimiter* limiter, size_t size)
 {
-    int status = pthread_mutex_lock(&limiter->mutex);
-    assert(status == 0);
-
     double time_to_add = size / limiter->rate;
+    double now = limiter->clock() - limiter->epoch;
+
+    /* Idle time earns at most rate_limiter_idle_credit towards this request */
+    double drained_at = atomic_load_explicit(&limiter->drained_at, memory_order_relaxed);
+    double next;
+    do {
+        double start = drained_at;
+        if (start < now + rate_limiter_idle_credit) {
+            start = now + rate_limiter_idle_credit;
+        }
+        next = start + time_to_add;
+    } while (!atomic_compare_exchange_weak_explicit(&limiter->drained_at, &drained_at, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    return next - now;
+}
 
-    double now = limiter->clock();
-    double elapsed = now - limiter->last_modified;
-    if (elapsed < 0) {
-        elapsed = 0;
-    }
+void rate_limiter_destroy(RateLimiter *limiter)
+{
+    (void)limiter;
+}
 
-    double time_to_sleep = limiter->accumulated_sleep_time;
-    time_to_sleep -= elapsed;
-    if (time_to_sleep < rate_limiter_idle_credit) {
-        time_to_sleep = rate_limiter_idle_credit;
+void rate_limiter_map_init(RateLimiterMap *map, double rate, double (*clock)(void))
+{
+    for (int i = 0; i < RATE_LIMITER_USERS; i++) {
+        atomic_init(&map->uids[i], 0);
+        rate_limiter_init(&map->limiters[i], rate, clock);
     }
-    time_to_sleep += time_to_add;
-    limiter->accumulated_sleep_time = time_to_sleep;
-
-    limiter->last_modified = now;
-
-    status = pthread_mutex_unlock(&limiter->mutex);
-    assert(status == 0);
+}
 
-    return time_to_sleep;
+RateLimiter *rate_limiter_map_get(RateLimiterMap *map, uid_t uid)
+{
+    uint64_t key = (uint64_t)uid + 1;
+    unsigned start = (unsigned)(key * 0x9E3779B97F4A7C15ULL >> 56) % RATE_LIMITER_USERS;
+
+    /* Linear probing; a slot once claimed keeps its uid */
+    for (int n = 0; n < RATE_LIMITER_USERS; n++) {
+        unsigned i = (start + n) % RATE_LIMITER_USERS;
+        uint64_t seen = atomic_load_explicit(&map->uids[i], memory_order_relaxed);
+        if (seen == 0) {
+            if (atomic_compare_exchange_strong_explicit(&map->uids[i], &seen, key,
+                                                        memory_order_relaxed, memory_order_relaxed)) {
+                return &map->limiters[i];
+            }
+        }
+        if (seen == key) {
+            return &map->limiters[i];
+        }
+    }
+    return &map->limiters[start];
 }
 
-void rate_limiter_destroy(RateLimiter *limiter)
+void rate_limiter_map_destroy(RateLimiterMap *map)
 {
-    int status = pthread_mutex_destroy(&limiter->mutex);
-    assert(status == 0);
+    for (int i = 0; i < RATE_LIMITER_USERS; i++) {
+        rate_limiter_destroy(&map->limiters[i]);
+    }
 }
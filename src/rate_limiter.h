@@ -21,22 +21,28 @@
 #define INC_CACHEFS_RATE_LIMITER_H
 
 #include <string.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
 
 /* When we are idle, we allow some time to be "credited" to the next writer.
  * Otherwise, the short pause between requests would "go to waste", lowering
  * the throughput when there is only one requester. */
 extern const double rate_limiter_idle_credit;
 
+/* The whole state is the time at which everything admitted so far has
+ * drained. Callers advance it with compare-and-swap, so concurrent
+ * requests never wait on each other for a lock. */
 typedef struct RateLimiter {
     double rate;  /* bytes / second */
     double (*clock)(void);
-    double last_modified;
-    double accumulated_sleep_time;
-    pthread_mutex_t mutex;
+    double epoch;  /* Clock at init; times below are relative to it */
+    _Atomic double drained_at;
 } RateLimiter;
 
 double gettimeofday_clock(void);
+/* Unaffected by changes to the system time. */
+double monotonic_clock(void);
 
 /* 0 on success, error number on error. */
 void rate_limiter_init(RateLimiter* limiter, double rate, double (*clock)(void));
@@ -48,4 +54,19 @@ double rate_limiter_wait_nosleep(RateLimiter* limiter, size_t size);
 /* Destroys the rate limiter. No wait_for_permit calls may be active. */
 void rate_limiter_destroy(RateLimiter* limiter);
 
+/* Users with a bucket of their own; once all are taken, later users share
+ * a bucket with whoever hashed to the same slot. */
+#define RATE_LIMITER_USERS 256
+
+/* One rate limiter per user, each with the full rate. */
+typedef struct RateLimiterMap {
+    _Atomic uint64_t uids[RATE_LIMITER_USERS];  /* uid + 1, or 0 while free */
+    RateLimiter limiters[RATE_LIMITER_USERS];
+} RateLimiterMap;
+
+void rate_limiter_map_init(RateLimiterMap* map, double rate, double (*clock)(void));
+/* The limiter of `uid`, claimed on first use without locking. */
+RateLimiter* rate_limiter_map_get(RateLimiterMap* map, uid_t uid);
+void rate_limiter_map_destroy(RateLimiterMap* map);
+
 #endif
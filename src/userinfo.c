@@ -24,41 +24,75 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+#define MEMO_BITS 12
+#define MEMO_SLOTS (1 << MEMO_BITS)
+#define MEMO_EMPTY UINT64_MAX   /* uid -1, gid -1: never memoized */
+
 struct uid_cache_entry {
     uid_t uid;
     gid_t main_gid;
-    int username_offset; /* allocated in cache_memory_block */
+    int username_offset; /* allocated in the snapshot's memory block */
 };
 
 struct gid_cache_entry {
     gid_t gid;
     int uid_count;
-    int uids_offset; /* allocated in cache_memory_block */
+    int uids_offset; /* allocated in the snapshot's memory block */
+};
+
+/* A copy of the user and group databases. Never changed once published,
+   except for the memo tables, so readers take no lock: a rebuild
+   publishes a new snapshot, and each thread moves over to it on its next
+   query. A snapshot is freed when the last thread has let go of it. */
+struct user_snapshot {
+    struct uid_cache_entry *uid_cache;
+    int uid_cache_size;
+    int uid_cache_capacity;
+
+    struct gid_cache_entry *gid_cache;
+    int gid_cache_size;
+    int gid_cache_capacity;
+
+    struct memory_block memory;
+
+    unsigned generation;
+    int refs;                   /* Guarded by snapshot_lock */
+
+    /* Answers of user_belongs_to_group() so far, direct-mapped. A slot
+       holds uid << 32 | gid. Answers never change within a snapshot. */
+    _Atomic uint64_t member_memo[MEMO_SLOTS];
+    _Atomic uint64_t nonmember_memo[MEMO_SLOTS];
 };
 
-static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* Guards current_snapshot and the reference counts */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct user_snapshot *current_snapshot = NULL;
+static atomic_uint current_generation; /* 0 until the first build */
 
-static struct uid_cache_entry *uid_cache = NULL;
-static int uid_cache_size = 0;
-static int uid_cache_capacity = 0;
+/* One rebuild at a time; also gives us mutual exclusion on getpwent and getgrent */
+static pthread_mutex_t rebuild_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static struct gid_cache_entry *gid_cache = NULL;
-static int gid_cache_size = 0;
-static int gid_cache_capacity = 0;
+/* The snapshot each thread is using */
+static pthread_key_t thread_snapshot_key;
+static pthread_once_t thread_snapshot_once = PTHREAD_ONCE_INIT;
 
-static struct memory_block cache_memory_block = MEMORY_BLOCK_INITIALIZER;
+/* The memory block of the snapshot being built, for the comparators */
+static struct memory_block *building_memory = NULL;
 
-static volatile int cache_rebuild_requested = 1;
+/* Lock-free, so safe to set from a signal handler */
+static atomic_int cache_rebuild_requested = 1;
 
-static void rebuild_cache(void);
-static struct uid_cache_entry *uid_cache_lookup(uid_t key);
-static struct gid_cache_entry *gid_cache_lookup(gid_t key);
-static int rebuild_uid_cache(void);
-static int rebuild_gid_cache(void);
-static void clear_uid_cache(void);
-static void clear_gid_cache(void);
+static struct user_snapshot *build_snapshot(void);
+static struct uid_cache_entry *uid_cache_lookup(struct user_snapshot *snap, uid_t key);
+static struct gid_cache_entry *gid_cache_lookup(struct user_snapshot *snap, gid_t key);
+static int rebuild_uid_cache(struct user_snapshot *snap);
+static int rebuild_gid_cache(struct user_snapshot *snap);
+static void clear_uid_cache(struct user_snapshot *snap);
+static void clear_gid_cache(struct user_snapshot *snap);
 static int uid_cache_name_sortcmp(const void *key, const void *entry);
 static int uid_cache_name_searchcmp(const void *key, const void *entry);
 static int uid_cache_uid_sortcmp(const void *key, const void *entry);
@@ -66,46 +100,143 @@ static int uid_cache_uid_searchcmp(const void *key, const void *entry);
 static int gid_cache_gid_sortcmp(const void *key, const void *entry);
 static int gid_cache_gid_searchcmp(const void *key, const void *entry);
 
-static void rebuild_cache(void)
+static void free_snapshot(struct user_snapshot *snap)
+{
+    free(snap->uid_cache);
+    free(snap->gid_cache);
+    free_memory_block(&snap->memory);
+    free(snap);
+}
+
+static void release_snapshot(void *arg)
+{
+    struct user_snapshot *snap = arg;
+    if (snap == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&snapshot_lock);
+    int last = (--snap->refs == 0);
+    pthread_mutex_unlock(&snapshot_lock);
+    if (last) {
+        free_snapshot(snap);
+    }
+}
+
+static void thread_snapshot_init(void)
 {
-    free_memory_block(&cache_memory_block);
-    init_memory_block(&cache_memory_block, 1024);
-    rebuild_uid_cache();
-    rebuild_gid_cache();
-    qsort(uid_cache, uid_cache_size, sizeof(struct uid_cache_entry), uid_cache_uid_sortcmp);
-    qsort(gid_cache, gid_cache_size, sizeof(struct gid_cache_entry), gid_cache_gid_sortcmp);
+    pthread_key_create(&thread_snapshot_key, release_snapshot);
+}
+
+static struct user_snapshot *build_snapshot(void)
+{
+    /* We're holding rebuild_lock */
+    struct user_snapshot *snap = calloc(1, sizeof(struct user_snapshot));
+    if (snap == NULL) {
+        return NULL;
+    }
+    init_memory_block(&snap->memory, 1024);
+    for (int i = 0; i < MEMO_SLOTS; ++i) {
+        atomic_init(&snap->member_memo[i], MEMO_EMPTY);
+        atomic_init(&snap->nonmember_memo[i], MEMO_EMPTY);
+    }
+
+    building_memory = &snap->memory;
+    rebuild_uid_cache(snap);
+    rebuild_gid_cache(snap);
+    qsort(snap->uid_cache, snap->uid_cache_size, sizeof(struct uid_cache_entry), uid_cache_uid_sortcmp);
+    qsort(snap->gid_cache, snap->gid_cache_size, sizeof(struct gid_cache_entry), gid_cache_gid_sortcmp);
+    building_memory = NULL;
+    return snap;
+}
+
+/* Builds a new snapshot if one was requested. While a snapshot exists,
+   readers don't wait for a rebuild another thread is running; before the
+   first, they wait for it to be published. */
+static void maybe_rebuild(void)
+{
+    if (atomic_load_explicit(&current_generation, memory_order_acquire) != 0) {
+        if (pthread_mutex_trylock(&rebuild_lock) != 0) {
+            return;
+        }
+    } else {
+        pthread_mutex_lock(&rebuild_lock);
+    }
+
+    if (atomic_exchange(&cache_rebuild_requested, 0)) {
+        DPRINTF("%s", "Building user/group cache");
+        struct user_snapshot *snap = build_snapshot();
+        if (snap != NULL) {
+            pthread_mutex_lock(&snapshot_lock);
+            struct user_snapshot *old = current_snapshot;
+            snap->refs = 1;
+            snap->generation = (old != NULL ? old->generation : 0) + 1;
+            current_snapshot = snap;
+            atomic_store_explicit(&current_generation, snap->generation, memory_order_release);
+            pthread_mutex_unlock(&snapshot_lock);
+            release_snapshot(old);
+        }
+    }
+
+    pthread_mutex_unlock(&rebuild_lock);
 }
 
-static struct uid_cache_entry *uid_cache_lookup(uid_t key)
+/* The calling thread's snapshot, moved to the current one if it is
+   older. Locks only when it changes. */
+static struct user_snapshot *thread_snapshot(void)
+{
+    pthread_once(&thread_snapshot_once, thread_snapshot_init);
+    if (atomic_load_explicit(&cache_rebuild_requested, memory_order_relaxed) ||
+        atomic_load_explicit(&current_generation, memory_order_acquire) == 0) {
+        maybe_rebuild();
+    }
+
+    struct user_snapshot *snap = pthread_getspecific(thread_snapshot_key);
+    unsigned generation = atomic_load_explicit(&current_generation, memory_order_acquire);
+    if (snap != NULL && snap->generation == generation) {
+        return snap;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    struct user_snapshot *cur = current_snapshot;
+    if (cur != NULL) {
+        cur->refs++;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    release_snapshot(snap);
+    pthread_setspecific(thread_snapshot_key, cur);
+    return cur;
+}
+
+static struct uid_cache_entry *uid_cache_lookup(struct user_snapshot *snap, uid_t key)
 {
     return (struct uid_cache_entry *)bsearch(
         &key,
-        uid_cache,
-        uid_cache_size,
+        snap->uid_cache,
+        snap->uid_cache_size,
         sizeof(struct uid_cache_entry),
         uid_cache_uid_searchcmp
     );
 }
 
-static struct gid_cache_entry *gid_cache_lookup(gid_t key)
+static struct gid_cache_entry *gid_cache_lookup(struct user_snapshot *snap, gid_t key)
 {
     return (struct gid_cache_entry *)bsearch(
         &key,
-        gid_cache,
-        gid_cache_size,
+        snap->gid_cache,
+        snap->gid_cache_size,
         sizeof(struct gid_cache_entry),
         gid_cache_gid_searchcmp
     );
 }
 
-static int rebuild_uid_cache(void)
+static int rebuild_uid_cache(struct user_snapshot *snap)
 {
-    /* We're holding the lock, so we have mutual exclusion on getpwent and getgrent too. */
+    /* We're holding rebuild_lock, so we have mutual exclusion on getpwent and getgrent too. */
     struct passwd *pw;
     struct uid_cache_entry *ent;
     int username_len;
 
-    uid_cache_size = 0;
+    snap->uid_cache_size = 0;
 
     setpwent();
 
@@ -124,37 +255,37 @@ static int rebuild_uid_cache(void)
             }
         }
 
-        if (uid_cache_size == uid_cache_capacity) {
-            grow_array(&uid_cache, &uid_cache_capacity, sizeof(struct uid_cache_entry));
+        if (snap->uid_cache_size == snap->uid_cache_capacity) {
+            grow_array(&snap->uid_cache, &snap->uid_cache_capacity, sizeof(struct uid_cache_entry));
         }
 
-        ent = &uid_cache[uid_cache_size++];
+        ent = &snap->uid_cache[snap->uid_cache_size++];
         ent->uid = pw->pw_uid;
         ent->main_gid = pw->pw_gid;
 
         username_len = strlen(pw->pw_name) + 1;
-        ent->username_offset = append_to_memory_block(&cache_memory_block, pw->pw_name, username_len);
+        ent->username_offset = append_to_memory_block(&snap->memory, pw->pw_name, username_len);
     }
 
     endpwent();
     return 1;
 error:
     endpwent();
-    clear_uid_cache();
+    clear_uid_cache(snap);
     return 0;
 }
 
-static int rebuild_gid_cache(void)
+static int rebuild_gid_cache(struct user_snapshot *snap)
 {
-    /* We're holding the lock, so we have mutual exclusion on getpwent and getgrent too. */
+    /* We're holding rebuild_lock, so we have mutual exclusion on getpwent and getgrent too. */
     struct group *gr;
     struct gid_cache_entry *ent;
     int i;
     struct uid_cache_entry *uid_ent;
 
-    gid_cache_size = 0;
+    snap->gid_cache_size = 0;
 
-    qsort(uid_cache, uid_cache_size, sizeof(struct uid_cache_entry), uid_cache_name_sortcmp);
+    qsort(snap->uid_cache, snap->uid_cache_size, sizeof(struct uid_cache_entry), uid_cache_name_sortcmp);
 
     setgrent();
 
@@ -173,26 +304,26 @@ static int rebuild_gid_cache(void)
             }
         }
 
-        if (gid_cache_size == gid_cache_capacity) {
-            grow_array(&gid_cache, &gid_cache_capacity, sizeof(struct gid_cache_entry));
+        if (snap->gid_cache_size == snap->gid_cache_capacity) {
+            grow_array(&snap->gid_cache, &snap->gid_cache_capacity, sizeof(struct gid_cache_entry));
         }
 
-        ent = &gid_cache[gid_cache_size++];
+        ent = &snap->gid_cache[snap->gid_cache_size++];
         ent->gid = gr->gr_gid;
         ent->uid_count = 0;
-        ent->uids_offset = cache_memory_block.size;
+        ent->uids_offset = snap->memory.size;
 
         for (i = 0; gr->gr_mem[i] != NULL; ++i) {
             uid_ent = (struct uid_cache_entry *)bsearch(
                 gr->gr_mem[i],
-                uid_cache,
-                uid_cache_size,
+                snap->uid_cache,
+                snap->uid_cache_size,
                 sizeof(struct uid_cache_entry),
                 uid_cache_name_searchcmp
             );
             if (uid_ent != NULL) {
-                grow_memory_block(&cache_memory_block, sizeof(uid_t));
-                ((uid_t *)MEMORY_BLOCK_GET(cache_memory_block, ent->uids_offset))[ent->uid_count++] = uid_ent->uid;
+                grow_memory_block(&snap->memory, sizeof(uid_t));
+                ((uid_t *)MEMORY_BLOCK_GET(snap->memory, ent->uids_offset))[ent->uid_count++] = uid_ent->uid;
             }
         }
     }
@@ -201,33 +332,33 @@ static int rebuild_gid_cache(void)
     return 1;
 error:
     endgrent();
-    clear_gid_cache();
+    clear_gid_cache(snap);
     return 0;
 }
 
-static void clear_uid_cache(void)
+static void clear_uid_cache(struct user_snapshot *snap)
 {
-    uid_cache_size = 0;
+    snap->uid_cache_size = 0;
 }
 
-static void clear_gid_cache(void)
+static void clear_gid_cache(struct user_snapshot *snap)
 {
-    gid_cache_size = 0;
+    snap->gid_cache_size = 0;
 }
 
 static int uid_cache_name_sortcmp(const void *a, const void *b)
 {
     int name_a_off = ((struct uid_cache_entry *)a)->username_offset;
     int name_b_off = ((struct uid_cache_entry *)b)->username_offset;
-    const char *name_a = (const char *)MEMORY_BLOCK_GET(cache_memory_block, name_a_off);
-    const char *name_b = (const char *)MEMORY_BLOCK_GET(cache_memory_block, name_b_off);
+    const char *name_a = (const char *)MEMORY_BLOCK_GET(*building_memory, name_a_off);
+    const char *name_b = (const char *)MEMORY_BLOCK_GET(*building_memory, name_b_off);
     return strcmp(name_a, name_b);
 }
 
 static int uid_cache_name_searchcmp(const void *key, const void *entry)
 {
     int name_off = ((struct uid_cache_entry *)entry)->username_offset;
-    const char *name = (const char *)MEMORY_BLOCK_GET(cache_memory_block, name_off);
+    const char *name = (const char *)MEMORY_BLOCK_GET(*building_memory, name_off);
     return strcmp((const char *)key, name);
 }
 
@@ -317,51 +448,55 @@ int group_gid(const char *groupname, gid_t *ret)
     return 1;
 }
 
-int user_belongs_to_group(uid_t uid, gid_t gid)
+/* Looks the answer up in the snapshot's databases */
+static int compute_belongs(struct user_snapshot *snap, uid_t uid, gid_t gid)
 {
-    int ret = 0;
     int i;
     uid_t *uids;
 
-    pthread_rwlock_rdlock(&cache_lock);
-
-    if (cache_rebuild_requested) {
-        pthread_rwlock_unlock(&cache_lock);
-
-        pthread_rwlock_wrlock(&cache_lock);
-        if (cache_rebuild_requested) {
-            DPRINTF("%s", "Building user/group cache");
-            cache_rebuild_requested = 0;
-            rebuild_cache();
-        }
-        pthread_rwlock_unlock(&cache_lock);
-
-        pthread_rwlock_rdlock(&cache_lock);
-    }
-
-    struct uid_cache_entry *uent = uid_cache_lookup(uid);
+    struct uid_cache_entry *uent = uid_cache_lookup(snap, uid);
     if (uent && uent->main_gid == gid) {
-        ret = 1;
-        goto done;
+        return 1;
     }
 
-    struct gid_cache_entry *gent = gid_cache_lookup(gid);
+    struct gid_cache_entry *gent = gid_cache_lookup(snap, gid);
     if (gent) {
-        uids = (uid_t*)MEMORY_BLOCK_GET(cache_memory_block, gent->uids_offset);
+        uids = (uid_t*)MEMORY_BLOCK_GET(snap->memory, gent->uids_offset);
         for (i = 0; i < gent->uid_count; ++i) {
             if (uids[i] == uid) {
-                ret = 1;
-                goto done;
+                return 1;
             }
         }
     }
+    return 0;
+}
+
+int user_belongs_to_group(uid_t uid, gid_t gid)
+{
+    struct user_snapshot *snap = thread_snapshot();
+    if (snap == NULL) {
+        return 0;
+    }
+
+    uint64_t key = ((uint64_t)(uint32_t)uid << 32) | (uint32_t)gid;
+    if (key == MEMO_EMPTY) {
+        return compute_belongs(snap, uid, gid);
+    }
+    size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - MEMO_BITS));
+    if (atomic_load_explicit(&snap->member_memo[slot], memory_order_relaxed) == key) {
+        return 1;
+    }
+    if (atomic_load_explicit(&snap->nonmember_memo[slot], memory_order_relaxed) == key) {
+        return 0;
+    }
 
-done:
-    pthread_rwlock_unlock(&cache_lock);
+    int ret = compute_belongs(snap, uid, gid);
+    atomic_store_explicit(ret ? &snap->member_memo[slot] : &snap->nonmember_memo[slot], key,
+                          memory_order_relaxed);
     return ret;
 }
 
 void invalidate_user_cache(void)
 {
-    cache_rebuild_requested = 1;
+    atomic_store(&cache_rebuild_requested, 1);
 }
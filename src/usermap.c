@@ -2,89 +2,111 @@
 #include "usermap.h"
 #include "userinfo.h"
 #include <stdlib.h>
+#include <stdint.h>
+
+/* Open-addressing hash table of id pairs with linear probing, kept at
+   most half full. Lookups run on every getattr, and maps generated from
+   a directory service can have thousands of entries. */
+struct id_pair {
+    unsigned long from;
+    unsigned long to;
+    int used;
+};
+
+struct id_table {
+    struct id_pair *slots;
+    size_t capacity;            /* A power of two, or 0 */
+    size_t size;
+};
 
 struct UserMap {
-    uid_t *user_from;
-    uid_t *user_to;
-    gid_t *group_from;
-    gid_t *group_to;
-    int user_capacity;
-    int group_capacity;
-    int user_size;
-    int group_size;
+    struct id_table users;
+    struct id_table groups;
 };
 
+static size_t id_hash(unsigned long id, size_t capacity)
+{
+    /* Fibonacci hashing: consecutive ids spread over the table */
+    return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+static struct id_pair *id_table_find(const struct id_table *t, unsigned long from)
+{
+    if (t->size == 0) {
+        return NULL;
+    }
+    size_t i = id_hash(from, t->capacity);
+    while (t->slots[i].used) {
+        if (t->slots[i].from == from) {
+            return &t->slots[i];
+        }
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return NULL;
+}
+
+static void id_table_put(struct id_table *t, unsigned long from, unsigned long to)
+{
+    size_t i = id_hash(from, t->capacity);
+    while (t->slots[i].used) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    t->slots[i].from = from;
+    t->slots[i].to = to;
+    t->slots[i].used = 1;
+    t->size++;
+}
+
+static UsermapStatus id_table_add(struct id_table *t, unsigned long from, unsigned long to)
+{
+    if (id_table_find(t, from) != NULL) {
+        return usermap_status_duplicate_key;
+    }
+    if ((t->size + 1) * 2 > t->capacity) {
+        struct id_table grown;
+        grown.capacity = t->capacity == 0 ? 16 : t->capacity * 2;
+        grown.size = 0;
+        grown.slots = (struct id_pair*)calloc(grown.capacity, sizeof(struct id_pair));
+        size_t i;
+        for (i = 0; i < t->capacity; ++i) {
+            if (t->slots[i].used) {
+                id_table_put(&grown, t->slots[i].from, t->slots[i].to);
+            }
+        }
+        free(t->slots);
+        *t = grown;
+    }
+    id_table_put(t, from, to);
+    return usermap_status_ok;
+}
+
 UserMap *usermap_create(void)
 {
-    UserMap* map = (UserMap*)malloc(sizeof(UserMap));
-    map->user_from = NULL;
-    map->user_to = NULL;
-    map->group_from = NULL;
-    map->group_to = NULL;
-    map->user_capacity = 0;
-    map->group_capacity = 0;
-    map->user_size = 0;
-    map->group_size = 0;
+    UserMap* map = (UserMap*)calloc(1, sizeof(UserMap));
     return map;
 }
 
 void usermap_destroy(UserMap *map)
 {
-    free(map->user_from);
-    free(map->user_to);
-    free(map->group_from);
-    free(map->group_to);
+    free(map->users.slots);
+    free(map->groups.slots);
     free(map);
 }
 
 UsermapStatus usermap_add_uid(UserMap *map, uid_t from, uid_t to)
 {
-    int i;
     if (from == to) {
         return usermap_status_ok;
     }
-    if (map->user_size == map->user_capacity) {
-        if (map->user_capacity == 0) {
-            map->user_capacity = 8;
-        } else {
-            map->user_capacity *= 2;
-        }
-        map->user_from = (uid_t*)realloc(map->user_from, map->user_capacity * sizeof(uid_t));
-        map->user_to = (uid_t*)realloc(map->user_to, map->user_capacity * sizeof(uid_t));
-    }
-    if (usermap_get_uid_or_default(map, from, -1) != (uid_t)-1) {
-        return usermap_status_duplicate_key;
-    }
-    i = map->user_size;
-    map->user_from[i] = from;
-    map->user_to[i] = to;
-    map->user_size += 1;
-    return usermap_status_ok;
+    return id_table_add(&map->users, from, to);
 }
 
 UsermapStatus usermap_add_gid(UserMap *map, gid_t from, gid_t to)
 {
-    int i;
     if (from == to) {
         return usermap_status_ok;
     }
-    if (map->group_size == map->group_capacity) {
-        if (map->group_capacity == 0) {
-            map->group_capacity = 8;
-        } else {
-            map->group_capacity *= 2;
-        }
-        map->group_from = (gid_t*)realloc(map->group_from, map->group_capacity * sizeof(gid_t));
-        map->group_to = (gid_t*)realloc(map->group_to, map->group_capacity * sizeof(gid_t));
-    }
-    if (usermap_get_gid_or_default(map, from, -1) != (gid_t)-1) {
-        return usermap_status_duplicate_key;
-    }
-    i = map->group_size;
-    map->group_from[i] = from;
-    map->group_to[i] = to;
-    map->group_size += 1;
-    return usermap_status_ok;
+    return id_table_add(&map->groups, from, to);
 }
 
 const char* usermap_errorstr(UsermapStatus status)
@@ -98,22 +120,12 @@ const char* usermap_errorstr(UsermapStatus status)
 
 uid_t usermap_get_uid_or_default(UserMap *map, uid_t u, uid_t deflt)
 {
-    int i;
-    for (i = 0; i < map->user_size; ++i) {
-        if (map->user_from[i] == u) {
-            return map->user_to[i];
-        }
-    }
-    return deflt;
+    struct id_pair *p = id_table_find(&map->users, u);
+    return p != NULL ? (uid_t)p->to : deflt;
 }
 
 gid_t usermap_get_gid_or_default(UserMap *map, gid_t g, gid_t deflt)
 {
-    int i;
-    for (i = 0; i < map->group_size; ++i) {
-        if (map->group_from[i] == g) {
-            return map->group_to[i];
-        }
-    }
-    return deflt;
+    struct id_pair *p = id_table_find(&map->groups, g);
+    return p != NULL ? (gid_t)p->to : deflt;
 }
@@ -0,0 +1,61 @@
+#!/usr/bin/env ruby
+
+# Compares two sets of benchmark results written by bench_mount.rb or
+# internals/bench_cache (one JSON object per line) and prints the change of
+# each throughput and latency figure. Exits with 1 if any throughput
+# dropped, or any latency grew, by more than the threshold.
+
+require 'json'
+require 'optparse'
+
+threshold = 10.0
+parser = OptionParser.new do |opts|
+  opts.banner = "Usage: bench_compare.rb [--threshold PERCENT] baseline.json current.json"
+  opts.on('-t', '--threshold PERCENT', Float, 'Regression threshold (default: 10)') { |v| threshold = v }
+end
+parser.parse!
+
+if ARGV.length != 2
+  puts parser.help
+  exit!(1)
+end
+
+HIGHER_IS_BETTER = ['ops_per_sec', 'mb_per_sec']
+LOWER_IS_BETTER = ['p50_us', 'p90_us', 'p99_us', 'p999_us', 'seconds']
+KEY_FIELDS = ['bench', 'workload', 'phase', 'backend', 'threads', 'items', 'cachefs_args']
+
+# Results keyed by what was measured; later lines replace earlier ones
+def load(file)
+  results = {}
+  File.readlines(file).each do |line|
+    next if line.strip.empty?
+    row = JSON.parse(line)
+    key = KEY_FIELDS.map { |f| row[f] }.compact.join(' ')
+    results[key] = row
+  end
+  results
+end
+
+baseline = load(ARGV[0])
+current = load(ARGV[1])
+
+regressed = false
+current.keys.sort.each do |key|
+  old = baseline[key]
+  next unless old
+  new = current[key]
+  changes = []
+  (HIGHER_IS_BETTER + LOWER_IS_BETTER).each do |metric|
+    next unless old[metric].is_a?(Numeric) && new[metric].is_a?(Numeric) && old[metric] > 0
+    pct = (new[metric] - old[metric]) * 100.0 / old[metric]
+    worse = HIGHER_IS_BETTER.include?(metric) ? -pct : pct
+    mark = worse > threshold ? ' !' : ''
+    regressed ||= worse > threshold
+    changes << format('%s %.4g -> %.4g (%+.1f%%)%s', metric, old[metric], new[metric], pct, mark)
+  end
+  puts "#{key}: #{changes.join(', ')}" unless changes.empty?
+end
+
+(baseline.keys - current.keys).sort.each { |key| puts "#{key}: missing from #{ARGV[1]}" }
+
+exit(regressed ? 1 : 0)
@@ -0,0 +1,199 @@
+/*
+ * LD_PRELOAD shim that makes a local directory behave like a slow remote
+ * backend, for tests/bench_mount.rb.
+ *
+ * cachefs changes into the source directory and reaches the backend
+ * through relative paths, while its own cache files use absolute paths.
+ * So every call below that takes a path relative to the working
+ * directory, and every read or write on an fd opened that way, first
+ * sleeps CACHEFS_BENCH_DELAY_US microseconds.
+ *
+ * Build: cc -shared -fPIC -o bench_delay.so bench_delay.c -ldl
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_TRACKED_FDS 65536
+
+static unsigned char backend_fds[MAX_TRACKED_FDS / 8];
+
+static long delay_us(void)
+{
+    static long cached = -1;
+    if (cached < 0) {
+        const char *env = getenv("CACHEFS_BENCH_DELAY_US");
+        cached = env != NULL ? atol(env) : 0;
+    }
+    return cached;
+}
+
+static void delay(void)
+{
+    long us = delay_us();
+    if (us > 0) {
+        struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static bool is_backend_path(const char *path)
+{
+    return path != NULL && path[0] != '/';
+}
+
+static bool is_backend_fd(int fd)
+{
+    return fd >= 0 && fd < MAX_TRACKED_FDS
+        && (__atomic_load_n(&backend_fds[fd / 8], __ATOMIC_RELAXED) & (1u << (fd % 8)));
+}
+
+static void track_fd(int fd, bool backend)
+{
+    if (fd < 0 || fd >= MAX_TRACKED_FDS) {
+        return;
+    }
+    if (backend) {
+        __atomic_fetch_or(&backend_fds[fd / 8], (unsigned char)(1u << (fd % 8)), __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&backend_fds[fd / 8], (unsigned char)~(1u << (fd % 8)), __ATOMIC_RELAXED);
+    }
+}
+
+#define REAL(name, ret, ...) \
+    static ret (*real_fn)(__VA_ARGS__); \
+    if (real_fn == NULL) { \
+        real_fn = (ret (*)(__VA_ARGS__))dlsym(RTLD_NEXT, name); \
+    }
+
+static int open_common(const char *sym, bool at, int dirfd, const char *path, int flags, mode_t mode)
+{
+    bool backend = is_backend_path(path) && (!at || dirfd == AT_FDCWD || is_backend_fd(dirfd));
+    if (backend) {
+        delay();
+    }
+    int fd;
+    if (at) {
+        REAL(sym, int, int, const char *, int, ...);
+        fd = real_fn(dirfd, path, flags, mode);
+    } else {
+        REAL(sym, int, const char *, int, ...);
+        fd = real_fn(path, flags, mode);
+    }
+    track_fd(fd, backend);
+    return fd;
+}
+
+#define OPEN_MODE(flags, mode) \
+    mode_t mode = 0; \
+    if ((flags) & (O_CREAT | O_TMPFILE)) { \
+        va_list ap; \
+        va_start(ap, flags); \
+        mode = va_arg(ap, int); \
+        va_end(ap); \
+    }
+
+int open(const char *path, int flags, ...)
+{
+    OPEN_MODE(flags, mode);
+    return open_common("open", false, AT_FDCWD, path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    OPEN_MODE(flags, mode);
+    return open_common("open64", false, AT_FDCWD, path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    OPEN_MODE(flags, mode);
+    return open_common("openat", true, dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+    OPEN_MODE(flags, mode);
+    return open_common("openat64", true, dirfd, path, flags, mode);
+}
+
+int close(int fd)
+{
+    REAL("close", int, int);
+    track_fd(fd, false);
+    return real_fn(fd);
+}
+
+#define PATH_CALL(name, ret, params, args) \
+    ret name params \
+    { \
+        REAL(#name, ret, PARAMS_##name); \
+        if (is_backend_path(path)) { \
+            delay(); \
+        } \
+        return real_fn args; \
+    }
+
+#define PARAMS_stat const char *, struct stat *
+#define PARAMS_lstat const char *, struct stat *
+#define PARAMS_stat64 const char *, struct stat64 *
+#define PARAMS_lstat64 const char *, struct stat64 *
+#define PARAMS_readlink const char *, char *, size_t
+#define PARAMS_opendir const char *
+
+PATH_CALL(stat, int, (const char *path, struct stat *st), (path, st))
+PATH_CALL(lstat, int, (const char *path, struct stat *st), (path, st))
+PATH_CALL(stat64, int, (const char *path, struct stat64 *st), (path, st))
+PATH_CALL(lstat64, int, (const char *path, struct stat64 *st), (path, st))
+PATH_CALL(readlink, ssize_t, (const char *path, char *buf, size_t size), (path, buf, size))
+PATH_CALL(opendir, DIR *, (const char *path), (path))
+
+#define AT_CALL(name, ret, params, args) \
+    ret name params \
+    { \
+        REAL(#name, ret, PARAMS_##name); \
+        if (is_backend_path(path) && (dirfd == AT_FDCWD || is_backend_fd(dirfd))) { \
+            delay(); \
+        } \
+        return real_fn args; \
+    }
+
+#define PARAMS_fstatat int, const char *, struct stat *, int
+#define PARAMS_fstatat64 int, const char *, struct stat64 *, int
+
+AT_CALL(fstatat, int, (int dirfd, const char *path, struct stat *st, int flags), (dirfd, path, st, flags))
+AT_CALL(fstatat64, int, (int dirfd, const char *path, struct stat64 *st, int flags), (dirfd, path, st, flags))
+
+#define FD_CALL(name, ret, params, args) \
+    ret name params \
+    { \
+        REAL(#name, ret, PARAMS_##name); \
+        if (is_backend_fd(fd)) { \
+            delay(); \
+        } \
+        return real_fn args; \
+    }
+
+#define PARAMS_read int, void *, size_t
+#define PARAMS_write int, const void *, size_t
+#define PARAMS_pread int, void *, size_t, off_t
+#define PARAMS_pwrite int, const void *, size_t, off_t
+#define PARAMS_pread64 int, void *, size_t, off64_t
+#define PARAMS_pwrite64 int, const void *, size_t, off64_t
+
+FD_CALL(read, ssize_t, (int fd, void *buf, size_t size), (fd, buf, size))
+FD_CALL(write, ssize_t, (int fd, const void *buf, size_t size), (fd, buf, size))
+FD_CALL(pread, ssize_t, (int fd, void *buf, size_t size, off_t offset), (fd, buf, size, offset))
+FD_CALL(pwrite, ssize_t, (int fd, const void *buf, size_t size, off_t offset), (fd, buf, size, offset))
+FD_CALL(pread64, ssize_t, (int fd, void *buf, size_t size, off64_t offset), (fd, buf, size, offset))
+FD_CALL(pwrite64, ssize_t, (int fd, const void *buf, size_t size, off64_t offset), (fd, buf, size, offset))
@@ -0,0 +1,243 @@
+#!/usr/bin/env ruby
+
+# Run from the tests build directory, like stress_test.rb.
+#
+# Replays workloads against a cachefs mount and prints one JSON object per
+# measurement, for comparing runs with bench_compare.rb.
+#
+# Each workload runs on a fresh cache twice, cold and then warm, once
+# against the plain local source directory and once with every backend
+# call delayed (see bench_delay.c) to look like a remote filesystem.
+
+# if we are being run by make check it will set srcdir and we should use it
+$LOAD_PATH << (ENV['srcdir'] || '.')
+require 'common.rb'
+require 'json'
+require 'optparse'
+require 'shellwords'
+require 'socket'
+
+TESTS_DIR = File.expand_path(ENV['srcdir'] || File.dirname(__FILE__))
+WORKLOADS = ['seq', 'rand4k', 'metastorm', 'lsr']
+
+$options = {
+  :workloads => WORKLOADS,
+  :delays => [0, 2000],
+  :file_size => 256 * 1024 * 1024,
+  :rand_ops => 20000,
+  :files => 20000,
+  :dirs => 100,
+  :cachefs_args => '',
+  :output => nil
+}
+
+parser = OptionParser.new do |opts|
+  opts.banner = "Usage: bench_mount.rb [options] workdir"
+  opts.on('-w', '--workloads LIST', "Comma-separated workloads (#{WORKLOADS.join(',')})") do |v|
+    $options[:workloads] = v.split(',')
+  end
+  opts.on('-d', '--delays LIST', 'Comma-separated backend delays in microseconds (default: 0,2000)') do |v|
+    $options[:delays] = v.split(',').map(&:to_i)
+  end
+  opts.on('-s', '--file-size BYTES', Integer, 'File size for seq and rand4k (default: 256M)') do |v|
+    $options[:file_size] = v
+  end
+  opts.on('-n', '--rand-ops N', Integer, 'Random 4K reads per rand4k run (default: 20000)') do |v|
+    $options[:rand_ops] = v
+  end
+  opts.on('-f', '--files N', Integer, 'Files in the metastorm and lsr tree (default: 20000)') do |v|
+    $options[:files] = v
+  end
+  opts.on('-a', '--cachefs-args ARGS', 'Extra cachefs arguments') do |v|
+    $options[:cachefs_args] = v
+  end
+  opts.on('-o', '--output FILE', 'Append results to FILE as well as stdout') do |v|
+    $options[:output] = v
+  end
+end
+parser.parse!
+
+if ARGV.length != 1
+  puts parser.help
+  exit!(1)
+end
+
+WORK_DIR = File.expand_path(ARGV[0])
+SRC_DIR = "#{WORK_DIR}/src"
+MNT_DIR = "#{WORK_DIR}/mnt"
+CACHE_DIR = "#{WORK_DIR}/cache"
+STATS_SOCKET = "#{WORK_DIR}/stats.sock"
+DELAY_LIB = "#{WORK_DIR}/bench_delay.so"
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def percentile(sorted, q)
+  return 0.0 if sorted.empty?
+  sorted[[(q * sorted.size).floor, sorted.size - 1].min]
+end
+
+def emit(result)
+  line = JSON.generate(result)
+  puts line
+  File.open($options[:output], 'a') { |f| f.puts line } if $options[:output]
+end
+
+# Counters from the stats socket, e.g. {"block_hits" => 123}
+def read_counters
+  return {} unless File.socket?(STATS_SOCKET)
+  sock = UNIXSocket.new(STATS_SOCKET)
+  sock.write("")
+  text = sock.read
+  sock.close
+  counters = {}
+  text.each_line do |line|
+    if line =~ /^cachefs_(\w+)_total (\d+)/
+      counters[$1] = $2.to_i
+    end
+  end
+  counters
+rescue SystemCallError
+  {}
+end
+
+def mount(delay_us)
+  FileUtils.rm_rf CACHE_DIR
+  FileUtils.mkdir_p MNT_DIR
+  cmd = [File.expand_path(EXECUTABLE_PATH), '-f', "--cache-root=#{CACHE_DIR}",
+         "--cache-stats-socket=#{STATS_SOCKET}"]
+  cmd << '--no-allow-other' if Process.uid != 0
+  cmd += Shellwords.split($options[:cachefs_args]) + [SRC_DIR, MNT_DIR]
+  env = {}
+  if delay_us > 0
+    env['LD_PRELOAD'] = DELAY_LIB
+    env['CACHEFS_BENCH_DELAY_US'] = delay_us.to_s
+  end
+  pid = Process.spawn(env, *cmd, [:out, :err] => "#{WORK_DIR}/cachefs.log")
+  deadline = now + 10
+  until `mount`.include?(MNT_DIR)
+    raise "cachefs did not mount, see #{WORK_DIR}/cachefs.log" if now > deadline
+    sleep 0.05
+  end
+  pid
+end
+
+def umount(pid)
+  sh!("#{umount_cmd} #{Shellwords.escape(MNT_DIR)}")
+  Process.wait pid
+end
+
+def prepare_source(workloads)
+  if (workloads & ['seq', 'rand4k']).any? && !File.exist?("#{SRC_DIR}/big")
+    puts "Creating #{$options[:file_size]} byte file"
+    File.open("#{SRC_DIR}/big", 'wb') do |f|
+      chunk = Random.new(1).bytes(1024 * 1024)
+      written = 0
+      while written < $options[:file_size]
+        n = [chunk.size, $options[:file_size] - written].min
+        f.write(chunk[0, n])
+        written += n
+      end
+    end
+  end
+  if (workloads & ['metastorm', 'lsr']).any? && !File.exist?("#{SRC_DIR}/tree")
+    puts "Creating tree of #{$options[:files]} files"
+    $options[:dirs].times { |d| FileUtils.mkdir_p("#{SRC_DIR}/tree/d#{d}") }
+    $options[:files].times do |i|
+      File.write("#{SRC_DIR}/tree/d#{i % $options[:dirs]}/f#{i}", 'x' * (i % 4096))
+    end
+  end
+end
+
+# Each workload returns a result hash; latencies are in microseconds
+def run_seq
+  bytes = 0
+  start = now
+  File.open("#{MNT_DIR}/big", 'rb') do |f|
+    while (data = f.read(1024 * 1024))
+      bytes += data.size
+    end
+  end
+  seconds = now - start
+  { :ops => (bytes / (1024 * 1024.0)).ceil, :bytes => bytes, :seconds => seconds,
+    :mb_per_sec => bytes / seconds / 1e6 }
+end
+
+def run_rand4k
+  rng = Random.new(42)
+  blocks = $options[:file_size] / 4096
+  latencies = []
+  start = now
+  File.open("#{MNT_DIR}/big", 'rb') do |f|
+    $options[:rand_ops].times do
+      t = now
+      f.sysseek(rng.rand(blocks) * 4096)
+      f.sysread(4096)
+      latencies << (now - t) * 1e6
+    end
+  end
+  seconds = now - start
+  latencies.sort!
+  { :ops => latencies.size, :seconds => seconds, :ops_per_sec => latencies.size / seconds,
+    :p50_us => percentile(latencies, 0.5), :p99_us => percentile(latencies, 0.99),
+    :max_us => latencies.last }
+end
+
+def run_metastorm
+  paths = (0...$options[:files]).map { |i| "#{MNT_DIR}/tree/d#{i % $options[:dirs]}/f#{i}" }
+  paths.shuffle!(:random => Random.new(7))
+  latencies = []
+  start = now
+  paths.each do |path|
+    t = now
+    File.lstat(path)
+    latencies << (now - t) * 1e6
+  end
+  seconds = now - start
+  latencies.sort!
+  { :ops => latencies.size, :seconds => seconds, :ops_per_sec => latencies.size / seconds,
+    :p50_us => percentile(latencies, 0.5), :p99_us => percentile(latencies, 0.99),
+    :max_us => latencies.last }
+end
+
+def run_lsr
+  start = now
+  sh!("ls -lR #{Shellwords.escape("#{MNT_DIR}/tree")} > /dev/null")
+  seconds = now - start
+  { :ops => $options[:files], :seconds => seconds, :ops_per_sec => $options[:files] / seconds }
+end
+
+unknown = $options[:workloads] - WORKLOADS
+fail!("Unknown workloads: #{unknown.join(', ')}") unless unknown.empty?
+
+FileUtils.mkdir_p SRC_DIR
+prepare_source($options[:workloads])
+
+if $options[:delays].any? { |d| d > 0 }
+  cc = ENV['CC'] || 'cc'
+  sh!("#{cc} -shared -fPIC -o #{Shellwords.escape(DELAY_LIB)} #{Shellwords.escape("#{TESTS_DIR}/bench_delay.c")} -ldl")
+end
+
+run_id = Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ')
+$options[:delays].each do |delay_us|
+  $options[:workloads].each do |workload|
+    pid = mount(delay_us)
+    begin
+      ['cold', 'warm'].each do |phase|
+        before = read_counters
+        result = send("run_#{workload}")
+        after = read_counters
+        hits = after.fetch('block_hits', 0) - before.fetch('block_hits', 0)
+        misses = after.fetch('block_misses', 0) - before.fetch('block_misses', 0)
+        emit({ :run => run_id, :workload => workload, :phase => phase,
+               :backend => delay_us > 0 ? "delay#{delay_us}us" : 'local',
+               :cachefs_args => $options[:cachefs_args],
+               :block_hit_ratio => hits + misses > 0 ? hits.to_f / (hits + misses) : nil
+             }.merge(result))
+      end
+    ensure
+      umount(pid)
+    end
+  end
+end
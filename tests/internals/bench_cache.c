@@ -0,0 +1,583 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include "arena.h"
+#include "misc.h"
+#include "cache_block.h"
+#include "cache_meta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+/*
+ * Microbenchmarks of the block and metadata caches, run directly against
+ * the library code without a mount. Every benchmark prints one JSON
+ * object per line so runs can be compared by scripts (see
+ * tests/bench_compare.rb).
+ */
+
+#define BLOCKS_PER_FILE 256
+#define ENTRIES_PER_DIR 1000
+
+/* Log-linear latency histogram: 8 sub-buckets per power of two of ns */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t max;
+};
+
+struct options {
+    size_t blocks;
+    size_t block_size;
+    size_t mem_size;
+    size_t meta_entries;
+    size_t dir_entries;
+    size_t ops;
+    int threads;
+    const char *root;
+    cache_meta_backend_t meta_backend;
+};
+
+struct bench;
+
+struct worker {
+    struct bench *bench;
+    int id;
+    size_t first;       /* Items [first, end) */
+    size_t end;
+    size_t ops;         /* Random operations for lookup benchmarks */
+    uint64_t rng;
+    struct hist hist;
+    uint64_t failed;
+};
+
+struct bench {
+    const char *name;
+    const struct options *opts;
+    cache_block_ctx_t *blocks;
+    cache_meta_ctx_t *meta;
+    const cache_dir_listing_t *listing;
+    void (*op)(struct worker *w, size_t item, char *buf);
+    bool random;        /* Pick items at random instead of walking the slice */
+    size_t items;
+    size_t bytes_per_op;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    /* xorshift64* */
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static size_t hist_bucket(uint64_t ns)
+{
+    if (ns < (1u << HIST_SUB_BITS)) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    size_t sub = (ns >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+    return ((size_t)(msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/* Upper bound in ns of a bucket */
+static uint64_t hist_bucket_end(size_t bucket)
+{
+    if (bucket < (1u << HIST_SUB_BITS)) {
+        return bucket + 1;
+    }
+    int msb = (int)(bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1u << HIST_SUB_BITS) - 1);
+    return ((1ULL << HIST_SUB_BITS) + sub + 1) << (msb - HIST_SUB_BITS);
+}
+
+static void hist_record(struct hist *h, uint64_t ns)
+{
+    h->counts[hist_bucket(ns)]++;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+static void hist_merge(struct hist *into, const struct hist *from)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static double hist_quantile_us(const struct hist *h, uint64_t total, double q)
+{
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            uint64_t end = hist_bucket_end(i);
+            return (end < h->max ? end : h->max) / 1000.0;
+        }
+    }
+    return h->max / 1000.0;
+}
+
+static uint64_t block_file_key(size_t item)
+{
+    cache_file_id_t id = { 1, item / BLOCKS_PER_FILE + 1, 0 };
+    return cache_file_key(&id);
+}
+
+static void meta_path(char *buf, size_t size, size_t item)
+{
+    snprintf(buf, size, "/bench/d%zu/f%zu", item / ENTRIES_PER_DIR, item);
+}
+
+static void fake_stat(struct stat *st, size_t item)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0644;
+    st->st_ino = item + 2;
+    st->st_dev = 1;
+    st->st_nlink = 1;
+    st->st_size = (off_t)item * 17;
+    st->st_blksize = 4096;
+    st->st_mtime = 1700000000 + item;
+    st->st_ctime = st->st_mtime;
+    st->st_atime = st->st_mtime;
+}
+
+static void op_block_write(struct worker *w, size_t item, char *buf)
+{
+    const struct options *o = w->bench->opts;
+    memset(buf, (int)(item & 0xff), o->block_size);
+    if (cache_block_write(w->bench->blocks, block_file_key(item), item % BLOCKS_PER_FILE,
+                          buf, o->block_size, 0, false) != 0) {
+        w->failed++;
+    }
+}
+
+static void op_block_read(struct worker *w, size_t item, char *buf)
+{
+    const struct options *o = w->bench->opts;
+    if (cache_block_read(w->bench->blocks, block_file_key(item), item % BLOCKS_PER_FILE,
+                         buf, o->block_size, 0) != (ssize_t)o->block_size) {
+        w->failed++;
+    }
+}
+
+static void op_block_invalidate(struct worker *w, size_t item, char *buf)
+{
+    const struct options *o = w->bench->opts;
+    (void)buf;
+    off_t offset = (off_t)(item % BLOCKS_PER_FILE) * o->block_size;
+    if (cache_block_invalidate_range(w->bench->blocks, block_file_key(item), offset, 1) != 0) {
+        w->failed++;
+    }
+}
+
+static void op_meta_store(struct worker *w, size_t item, char *buf)
+{
+    struct stat st;
+    (void)buf;
+    char path[64];
+    meta_path(path, sizeof(path), item);
+    fake_stat(&st, item);
+    if (cache_meta_store(w->bench->meta, path, &st) != 0) {
+        w->failed++;
+    }
+}
+
+static void op_meta_lookup(struct worker *w, size_t item, char *buf)
+{
+    cache_meta_entry_t entry;
+    bool valid;
+    (void)buf;
+    char path[64];
+    meta_path(path, sizeof(path), item);
+    if (cache_meta_lookup(w->bench->meta, path, &entry, &valid) != 0 || !valid) {
+        w->failed++;
+    }
+}
+
+static void op_dir_store(struct worker *w, size_t item, char *buf)
+{
+    char path[64];
+    (void)buf;
+    snprintf(path, sizeof(path), "/bench/list%zu", item);
+    if (cache_dir_store(w->bench->meta, path, w->bench->listing) != 0) {
+        w->failed++;
+    }
+}
+
+static void op_dir_lookup(struct worker *w, size_t item, char *buf)
+{
+    struct arena arena;
+    cache_dir_listing_t listing;
+    bool valid;
+    (void)buf;
+    char path[64];
+    snprintf(path, sizeof(path), "/bench/list%zu", item);
+
+    arena_init(&arena);
+    if (cache_dir_lookup(w->bench->meta, path, &arena, &listing, &valid) != 0 || !valid
+        || listing.count != w->bench->opts->dir_entries) {
+        w->failed++;
+    } else {
+        /* Walk it as readdir would */
+        cache_dir_item_t entry;
+        size_t pos = 0;
+        while (cache_dir_unpack(&listing, &pos, &entry)) {
+        }
+    }
+    arena_free(&arena);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->bench;
+    char *buf = malloc(b->opts->block_size);
+    if (buf == NULL) {
+        w->failed++;
+        return NULL;
+    }
+
+    if (b->random) {
+        for (size_t i = 0; i < w->ops; i++) {
+            size_t item = next_random(&w->rng) % b->items;
+            uint64_t start = now_ns();
+            b->op(w, item, buf);
+            hist_record(&w->hist, now_ns() - start);
+        }
+    } else {
+        for (size_t item = w->first; item < w->end; item++) {
+            uint64_t start = now_ns();
+            b->op(w, item, buf);
+            hist_record(&w->hist, now_ns() - start);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int run_bench(struct bench *b)
+{
+    const struct options *o = b->opts;
+    struct worker *workers = calloc(o->threads, sizeof(struct worker));
+    pthread_t *threads = calloc(o->threads, sizeof(pthread_t));
+    if (workers == NULL || threads == NULL) {
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    size_t ops = o->ops != 0 ? o->ops : b->items;
+    for (int i = 0; i < o->threads; i++) {
+        workers[i].bench = b;
+        workers[i].id = i;
+        workers[i].first = b->items * i / o->threads;
+        workers[i].end = b->items * (i + 1) / o->threads;
+        workers[i].ops = ops * (i + 1) / o->threads - ops * i / o->threads;
+        workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+
+    uint64_t start = now_ns();
+    int started = 0;
+    for (; started < o->threads; started++) {
+        if (pthread_create(&threads[started], NULL, worker_main, &workers[started]) != 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    struct hist *total = calloc(1, sizeof(struct hist));
+    uint64_t failed = 0;
+    for (int i = 0; i < started && total != NULL; i++) {
+        hist_merge(total, &workers[i].hist);
+        failed += workers[i].failed;
+    }
+    uint64_t done = 0;
+    for (size_t i = 0; total != NULL && i < HIST_BUCKETS; i++) {
+        done += total->counts[i];
+    }
+
+    if (total != NULL && started == o->threads) {
+        printf("{\"bench\":\"%s\",\"threads\":%d,\"items\":%zu,\"ops\":%" PRIu64 ",\"failed\":%" PRIu64
+               ",\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f"
+               ",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+               b->name, o->threads, b->items, done, failed,
+               seconds, done / seconds, done * (double)b->bytes_per_op / seconds / 1e6,
+               hist_quantile_us(total, done, 0.5), hist_quantile_us(total, done, 0.9),
+               hist_quantile_us(total, done, 0.99), hist_quantile_us(total, done, 0.999),
+               total->max / 1000.0);
+        fflush(stdout);
+    }
+
+    int result = (total != NULL && started == o->threads) ? 0 : -1;
+    free(total);
+    free(workers);
+    free(threads);
+    return result;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static bool wanted(char **names, int count, const char *name)
+{
+    if (count == 0) {
+        return true;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int run_block_benches(const struct options *o, char **names, int count)
+{
+    if (!wanted(names, count, "block_write") && !wanted(names, count, "block_read")
+        && !wanted(names, count, "block_invalidate")) {
+        return 0;
+    }
+
+    cache_block_ctx_t *blocks = cache_block_init(o->root, o->block_size, 0, o->mem_size,
+                                                 false, CACHE_CODEC_NONE, 0, false);
+    if (blocks == NULL) {
+        fprintf(stderr, "bench_cache: cache_block_init failed\n");
+        return -1;
+    }
+
+    struct bench b = { .opts = o, .blocks = blocks, .items = o->blocks,
+                       .bytes_per_op = o->block_size };
+    int result = 0;
+
+    /* Reads and invalidations need the blocks written first */
+    b.name = "block_write";
+    b.op = op_block_write;
+    result |= run_bench(&b);
+
+    if (wanted(names, count, "block_read")) {
+        b.name = "block_read";
+        b.op = op_block_read;
+        b.random = true;
+        result |= run_bench(&b);
+    }
+    if (wanted(names, count, "block_invalidate")) {
+        b.name = "block_invalidate";
+        b.op = op_block_invalidate;
+        b.random = false;
+        b.bytes_per_op = 0;
+        result |= run_bench(&b);
+    }
+
+    cache_block_destroy(blocks);
+    return result;
+}
+
+static int run_meta_benches(const struct options *o, char **names, int count)
+{
+    if (!wanted(names, count, "meta_store") && !wanted(names, count, "meta_lookup")
+        && !wanted(names, count, "meta_cold_lookup") && !wanted(names, count, "dir_store") && !wanted(names, count, "dir_lookup")) {
+        return 0;
+    }
+
+    /* Long TTLs so nothing expires during a run */
+    cache_meta_ctx_t *meta = cache_meta_init(o->root, 3600, 3600, o->meta_backend, false);
+    if (meta == NULL) {
+        fprintf(stderr, "bench_cache: cache_meta_init failed\n");
+        return -1;
+    }
+
+    struct bench b = { .opts = o, .meta = meta, .items = o->meta_entries };
+    int result = 0;
+
+    if (wanted(names, count, "meta_store") || wanted(names, count, "meta_lookup")
+        || wanted(names, count, "meta_cold_lookup")) {
+        b.name = "meta_store";
+        b.op = op_meta_store;
+        result |= run_bench(&b);
+    }
+    if (wanted(names, count, "meta_lookup")) {
+        b.name = "meta_lookup";
+        b.op = op_meta_lookup;
+        b.random = true;
+        result |= run_bench(&b);
+    }
+    if (wanted(names, count, "meta_cold_lookup")) {
+        /* Reopen, so that every lookup misses memory and reads the store */
+        cache_meta_destroy(meta);
+        meta = cache_meta_init(o->root, 3600, 3600, o->meta_backend, false);
+        if (meta == NULL) {
+            fprintf(stderr, "bench_cache: cache_meta_init failed\n");
+            return -1;
+        }
+        b.meta = meta;
+        b.name = "meta_cold_lookup";
+        b.op = op_meta_lookup;
+        b.random = false;
+        result |= run_bench(&b);
+    }
+
+    if (wanted(names, count, "dir_store") || wanted(names, count, "dir_lookup")) {
+        /* One packed listing with attributes, stored under a few names */
+        struct memory_block packed;
+        init_memory_block(&packed, 0);
+        for (size_t i = 0; i < o->dir_entries; i++) {
+            char name[32];
+            struct stat st;
+            snprintf(name, sizeof(name), "entry-%zu", i);
+            fake_stat(&st, i);
+            cache_dir_pack(&packed, name, CACHE_ENTRY_FILE, &st);
+        }
+        cache_dir_listing_t listing = { packed.ptr, packed.size, o->dir_entries, 1700000000, true };
+
+        b.listing = &listing;
+        b.items = 16;
+        b.random = false;
+        b.bytes_per_op = packed.size;
+        b.name = "dir_store";
+        b.op = op_dir_store;
+        result |= run_bench(&b);
+
+        if (wanted(names, count, "dir_lookup")) {
+            b.name = "dir_lookup";
+            b.op = op_dir_lookup;
+            b.random = true;
+            struct options lookup_opts = *o;
+            if (lookup_opts.ops == 0) {
+                lookup_opts.ops = 1000;
+            }
+            b.opts = &lookup_opts;
+            result |= run_bench(&b);
+            b.opts = o;
+        }
+        free_memory_block(&packed);
+    }
+
+    cache_meta_destroy(meta);
+    return result;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: bench_cache [options] [benchmark...]\n"
+            "\n"
+            "Benchmarks: block_write block_read block_invalidate\n"
+            "            meta_store meta_lookup meta_cold_lookup dir_store dir_lookup\n"
+            "            (default: all)\n"
+            "\n"
+            "Options:\n"
+            "  -b N      Blocks to write and read (default: 10000)\n"
+            "  -s BYTES  Block size (default: 4096)\n"
+            "  -m BYTES  In-memory block tier size (default: 0 = disabled)\n"
+            "  -e N      Metadata entries (default: 100000)\n"
+            "  -d N      Entries per directory listing (default: 100000)\n"
+            "  -o N      Operations for the random lookup benchmarks (default: one per item)\n"
+            "  -t N      Threads (default: 1)\n"
+            "  -M NAME   Metadata store, sqlite or lmdb (default: sqlite)\n"
+            "  -r DIR    Cache root (default: a fresh directory in $TMPDIR, removed afterwards)\n");
+}
+
+static size_t parse_size(const char *arg)
+{
+    double value;
+    if (parse_byte_count(arg, &value) == 0 || value < 0) {
+        fprintf(stderr, "bench_cache: bad number: %s\n", arg);
+        exit(1);
+    }
+    return (size_t)value;
+}
+
+int main(int argc, char *argv[])
+{
+    struct options o = {
+        .blocks = 10000,
+        .block_size = 4096,
+        .meta_entries = 100000,
+        .dir_entries = 100000,
+        .threads = 1,
+    };
+
+    int c;
+    while ((c = getopt(argc, argv, "b:s:m:e:d:o:t:r:M:h")) != -1) {
+        switch (c) {
+        case 'b': o.blocks = parse_size(optarg); break;
+        case 's': o.block_size = parse_size(optarg); break;
+        case 'm': o.mem_size = parse_size(optarg); break;
+        case 'e': o.meta_entries = parse_size(optarg); break;
+        case 'd': o.dir_entries = parse_size(optarg); break;
+        case 'o': o.ops = parse_size(optarg); break;
+        case 't': o.threads = atoi(optarg); break;
+        case 'r': o.root = optarg; break;
+        case 'M':
+            if (cache_meta_backend_parse(optarg, &o.meta_backend) != 0) {
+                fprintf(stderr, "bench_cache: unknown or unsupported metadata store: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default: usage(); return c == 'h' ? 0 : 1;
+        }
+    }
+    if (o.threads <= 0 || o.block_size == 0 || o.blocks == 0 || o.meta_entries == 0) {
+        usage();
+        return 1;
+    }
+
+    char tmp_root[4096];
+    bool remove_root = false;
+    if (o.root == NULL) {
+        const char *tmpdir = getenv("TMPDIR");
+        snprintf(tmp_root, sizeof(tmp_root), "%s/bench_cache.XXXXXX", tmpdir ? tmpdir : "/tmp");
+        if (mkdtemp(tmp_root) == NULL) {
+            perror("bench_cache: mkdtemp");
+            return 1;
+        }
+        o.root = tmp_root;
+        remove_root = true;
+    }
+
+    int result = run_block_benches(&o, argv + optind, argc - optind);
+    result |= run_meta_benches(&o, argv + optind, argc - optind);
+
+    if (remove_root) {
+        nftw(o.root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return result == 0 ? 0 : 1;
+}
@@ -3,6 +3,8 @@
 
 #include "test_common.h"
 #include "misc.h"
+#include "usermap.h"
+#include "permchain.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -299,12 +301,81 @@ static void filter_o_opts_suite(void) {
     }
 }
 
+static void usermap_suite(void)
+{
+    UserMap *map = usermap_create();
+    TEST_ASSERT(usermap_get_uid_or_default(map, 1000, 7) == 7);
+
+    /* Enough entries to grow the table several times */
+    for (uid_t i = 0; i < 3000; ++i) {
+        TEST_ASSERT(usermap_add_uid(map, 1000 + 3 * i, 50000 + i) == usermap_status_ok);
+    }
+    for (uid_t i = 0; i < 3000; ++i) {
+        TEST_ASSERT(usermap_get_uid_or_default(map, 1000 + 3 * i, 0) == 50000 + i);
+        TEST_ASSERT(usermap_get_uid_or_default(map, 1001 + 3 * i, 7) == 7);
+    }
+    TEST_ASSERT(usermap_add_uid(map, 1000, 1) == usermap_status_duplicate_key);
+    TEST_ASSERT(usermap_get_uid_or_default(map, 1000, 0) == 50000);
+
+    /* Identity mappings are not stored; groups are separate */
+    TEST_ASSERT(usermap_add_uid(map, 5, 5) == usermap_status_ok);
+    TEST_ASSERT(usermap_get_uid_or_default(map, 5, 9) == 9);
+    TEST_ASSERT(usermap_get_gid_or_default(map, 1000, 9) == 9);
+    TEST_ASSERT(usermap_add_gid(map, 1000, 2000) == usermap_status_ok);
+    TEST_ASSERT(usermap_get_gid_or_default(map, 1000, 9) == 2000);
+
+    usermap_destroy(map);
+}
+
+static void permchain_compile_test(const char *rules)
+{
+    struct permchain *walked = permchain_create();
+    struct permchain *compiled = permchain_create();
+    TEST_ASSERT(add_chmod_rules_to_permchain(rules, walked) == 0);
+    TEST_ASSERT(add_chmod_rules_to_permchain(rules, compiled) == 0);
+    TEST_ASSERT(permchain_compile(compiled) == 0);
+
+    for (mode_t perms = 0; perms <= 07777; ++perms) {
+        TEST_ASSERT(permchain_apply(compiled, S_IFREG | perms) == permchain_apply(walked, S_IFREG | perms));
+        TEST_ASSERT(permchain_apply(compiled, S_IFDIR | perms) == permchain_apply(walked, S_IFDIR | perms));
+        TEST_ASSERT(permchain_apply(compiled, S_IFIFO | perms) == permchain_apply(walked, S_IFIFO | perms));
+    }
+
+    permchain_destroy(walked);
+    permchain_destroy(compiled);
+}
+
+static void permchain_suite(void)
+{
+    permchain_compile_test("0644");
+    permchain_compile_test("a=rX");
+    permchain_compile_test("og-rwx,u+x");
+    permchain_compile_test("g=u:o=g");
+    permchain_compile_test("f-w,d+D");
+    permchain_compile_test("ug=rwX,o-s,0750,a+t");
+
+    struct permchain *pc = permchain_create();
+    TEST_ASSERT(add_chmod_rules_to_permchain("a=rX", pc) == 0);
+    TEST_ASSERT(permchain_compile(pc) == 0);
+    TEST_ASSERT(permchain_apply(pc, S_IFDIR | 04700) == (S_IFDIR | 04555));
+    TEST_ASSERT(permchain_apply(pc, S_IFREG | 0600) == (S_IFREG | 0444));
+
+    /* Adding rules drops the table until it is compiled again */
+    TEST_ASSERT(add_chmod_rules_to_permchain("u+w", pc) == 0);
+    TEST_ASSERT(permchain_apply(pc, S_IFREG | 0600) == (S_IFREG | 0644));
+    TEST_ASSERT(permchain_compile(pc) == 0);
+    TEST_ASSERT(permchain_apply(pc, S_IFREG | 0600) == (S_IFREG | 0644));
+    permchain_destroy(pc);
+}
+
 static void test_internal_suite(void) {
     arena_suite();
     my_dirname_suite();
     path_starts_with_suite();
     sprintf_new_suite();
     filter_o_opts_suite();
+    usermap_suite();
+    permchain_suite();
 }
 
 TEST_MAIN(test_internal_suite)
@@ -58,11 +58,40 @@ void sleeps_correct_amount(void)
     rate_limiter_destroy(&limiter);
 }
 
+void users_have_separate_buckets(void)
+{
+    time_now = 123123.0;
+    RateLimiterMap map;
+    rate_limiter_map_init(&map, 10, &test_clock);
+
+    RateLimiter *alice = rate_limiter_map_get(&map, 1000);
+    RateLimiter *bob = rate_limiter_map_get(&map, 1001);
+    TEST_ASSERT(alice != bob);
+    TEST_ASSERT(rate_limiter_map_get(&map, 1000) == alice);
+    TEST_ASSERT(rate_limiter_map_get(&map, 0) != alice);
+
+    double sleep_time = rate_limiter_wait_nosleep(alice, 100);
+    TEST_ASSERT(NEAR(10.0 + rate_limiter_idle_credit, sleep_time, epsilon));
+    sleep_time = rate_limiter_wait_nosleep(bob, 30);
+    TEST_ASSERT(NEAR(3.0 + rate_limiter_idle_credit, sleep_time, epsilon));
+    sleep_time = rate_limiter_wait_nosleep(rate_limiter_map_get(&map, 1000), 10);
+    TEST_ASSERT(NEAR(11.0 + rate_limiter_idle_credit, sleep_time, epsilon));
+
+    /* Users beyond the capacity still get a limiter */
+    for (uid_t uid = 2000; uid < 2000 + 2 * RATE_LIMITER_USERS; uid++) {
+        TEST_ASSERT(rate_limiter_map_get(&map, uid) != NULL);
+    }
+    TEST_ASSERT(rate_limiter_map_get(&map, 1001) == bob);
+
+    rate_limiter_map_destroy(&map);
+}
+
 void rate_limiter_suite(void)
 {
     computes_correct_sleep_times();
     works_after_being_idle();
     sleeps_correct_amount();
+    users_have_separate_buckets();
 }
 
 TEST_MAIN(rate_limiter_suite)
@@ -47,6 +47,19 @@ $have_fuse_29 = !$have_fuse_3 && !$fuse_t && Proc.new do
   v[0] > 2 || (v[0] == 2 && v[1] >= 9)
 end.call
 
+$have_lz4 = Proc.new do
+  system("pkg-config --exists liblz4")
+  $?.success?
+end.call
+
+$have_lmdb = Proc.new do
+  system("pkg-config --exists lmdb")
+  $?.success?
+end.call
+
+# What configure checks for the io_uring engine
+$have_io_uring = `uname`.strip == 'Linux' && File.exist?('/usr/include/linux/io_uring.h')
+
 # FileUtils.chown turned out to be quite buggy in Ruby 1.8.7,
 # so we'll use File.chown instead.
 def chown(user, group, list)
@@ -1098,17 +1111,608 @@ end
 
 testenv("--cache-root=/tmp/cachefs-test-negative --cache-debug",
         :title => "negative cache test") do
-  # Try to stat non-existent file - should cache negative result
+  # Try to stat non-existent file - no negative entry is kept for it
   assert_exception(ENOENT) { File.stat('mnt/nonexistent') }
-  
-  # Second attempt - should hit negative cache
   assert_exception(ENOENT) { File.stat('mnt/nonexistent') }
   
-  # Now create the file
+  # Now create the file outside the mount
   touch('src/nonexistent')
   
-  # Should eventually see it (after TTL or invalidation)
-  sleep 3
+  # Seen at once, well within the metadata TTL
   st = File.stat('mnt/nonexistent')
   assert { st.file? }
 end
+
+testenv("--cache-root=/tmp/cachefs-test-index --cache-block-size=4096 --cache-max-size=16K",
+        :title => "block index eviction test") do
+  # Read more data than the cache may hold
+  test_data = "y" * 40000
+  File.write('src/bigfile', test_data)
+  assert { File.read('mnt/bigfile') == test_data }
+
+  # Index lives in the cache root and keeps the block tree bounded
+  assert { File.exist?('/tmp/cachefs-test-index/blocks.db') }
+  cached = Dir.glob('/tmp/cachefs-test-index/blocks/*/*/*').map { |f| File.size(f) }.sum
+  assert { cached <= 16 * 1024 }
+
+  # Evicted blocks are refetched transparently
+  assert { File.read('mnt/bigfile') == test_data }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-mem --cache-block-size=4096 --cache-mem-size=1M",
+        :title => "memory tier test") do
+  test_data = "z" * 10000
+  File.write('src/memfile', test_data)
+
+  # Fill goes to memory, second read is served from it
+  assert { File.read('mnt/memfile') == test_data }
+  assert { File.read('mnt/memfile') == test_data }
+
+  # Writes purge the memory copy as well
+  File.write('mnt/memfile', "changed")
+  assert { File.read('mnt/memfile') == "changed" }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-ranges --cache-block-size=4096",
+        :title => "block-aligned partial read test") do
+  test_data = (0...20000).map { |i| (i % 251).chr }.join
+  File.write('src/rangefile', test_data)
+
+  # Unaligned first read must not poison the blocks it touches
+  assert { File.read('mnt/rangefile', 100, 3000) == test_data[3000, 100] }
+
+  # Reads crossing block boundaries return everything asked for
+  assert { File.read('mnt/rangefile', 9000, 2500) == test_data[2500, 9000] }
+  assert { File.read('mnt/rangefile') == test_data }
+  assert { File.read('mnt/rangefile', 5000, 3000) == test_data[3000, 5000] }
+
+  # Reads near end of file stop at end of file
+  assert { File.read('mnt/rangefile', 4096, 18000) == test_data[18000..-1] }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-readahead --cache-block-size=4096 --cache-readahead=4",
+        :title => "sequential readahead test") do
+  test_data = (0...100000).map { |i| (i % 253).chr }.join
+  File.write('src/streamfile', test_data)
+
+  # Stream through the file in small chunks so readahead kicks in
+  streamed = ''
+  File.open('mnt/streamfile') do |f|
+    while (chunk = f.read(4096))
+      streamed << chunk
+    end
+  end
+  assert { streamed == test_data }
+
+  # Blocks prefetched ahead of the reader hold the right data
+  assert { File.read('mnt/streamfile') == test_data }
+
+  # Rewrites drop prefetched blocks
+  File.write('mnt/streamfile', "short")
+  assert { File.read('mnt/streamfile') == "short" }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-flight --cache-block-size=4096 --multithreaded",
+        :title => "concurrent miss coalescing test") do
+  test_data = (0...50000).map { |i| (i % 241).chr }.join
+  File.write('src/sharedfile', test_data)
+
+  # Many readers missing on the same blocks all see the full contents
+  results = (1..8).map { Thread.new { File.read('mnt/sharedfile') } }.map(&:value)
+  assert { results.all? { |r| r == test_data } }
+
+  # And the blocks they filled serve later reads
+  assert { File.read('mnt/sharedfile', 1000, 20000) == test_data[20000, 1000] }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-attrs --cache-meta-ttl=60",
+        :title => "positive attribute cache test") do
+  File.write('src/attrfile', 'hello')
+  Dir.mkdir('src/attrdir')
+  File.write('src/attrdir/inner', 'x')
+
+  # Cached stats carry the full backend stat
+  first = File.stat('mnt/attrfile')
+  second = File.stat('mnt/attrfile')
+  assert { second.ino == File.stat('src/attrfile').ino }
+  assert { second.mtime == first.mtime }
+  assert { second.nlink == 1 }
+
+  # Changes made through the mount are seen despite the long TTL
+  File.chmod(0640, 'mnt/attrfile')
+  assert { (File.stat('mnt/attrfile').mode & 0777) == 0640 }
+  File.utime(Time.at(1000000), Time.at(1000000), 'mnt/attrfile')
+  assert { File.stat('mnt/attrfile').mtime.to_i == 1000000 }
+  File.link('mnt/attrfile', 'mnt/attrlink')
+  assert { File.stat('mnt/attrfile').nlink == 2 }
+
+  # Renaming a directory drops cached children under the old name
+  assert { File.exist?('mnt/attrdir/inner') }
+  File.rename('mnt/attrdir', 'mnt/attrdir2')
+  assert { !File.exist?('mnt/attrdir/inner') }
+  assert { File.exist?('mnt/attrdir2/inner') }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-writebehind --cache-dir-ttl=60",
+        :title => "write-behind metadata test") do
+  Dir.mkdir('src/bigdir')
+  names = (0...5000).map { |i| "f#{i}" }
+  names.each { |n| File.write("src/bigdir/#{n}", '') }
+
+  # Listings stored moments ago are served before they reach SQLite
+  assert { Dir.entries('mnt/bigdir').sort == (['.', '..'] + names).sort }
+  assert { Dir.entries('mnt/bigdir').sort == (['.', '..'] + names).sort }
+
+  # Queued invalidations are honoured as well
+  File.write('mnt/bigdir/extra', '')
+  assert { Dir.entries('mnt/bigdir').include?('extra') }
+  File.unlink('mnt/bigdir/f0')
+  assert { !File.exist?('mnt/bigdir/f0') }
+  assert { !Dir.entries('mnt/bigdir').include?('f0') }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-packeddir --cache-dir-ttl=60",
+        :title => "packed directory listing test") do
+  Dir.mkdir('src/pdir')
+  Dir.mkdir('src/pdir/sub')
+  names = ['a', 'b' * 200, "sp ace", 'sub'] + (0...300).map { |i| "n#{i}" }
+  names.each { |n| File.write("src/pdir/#{n}", '') unless n == 'sub' }
+
+  # Names of any length and type come back intact from the packed listing
+  expected = (['.', '..'] + names).sort
+  assert { Dir.entries('mnt/pdir').sort == expected }
+  assert { Dir.entries('mnt/pdir').sort == expected }
+  assert { File.directory?('mnt/pdir/sub') }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-dirplus --cache-dir-ttl=60 --cache-meta-ttl=60",
+        :title => "cached readdirplus attributes test") do
+  Dir.mkdir('src/plus')
+  (0...20).each { |i| File.write("src/plus/f#{i}", 'x' * i) }
+
+  # ls -l twice: the second listing and its attributes come from cache
+  2.times do
+    assert { `ls -l mnt/plus | grep -c ' f'`.to_i == 20 }
+    assert { File.size('mnt/plus/f7') == 7 }
+  end
+
+  # Changes through the mount show up in the next listing
+  File.chmod(0600, 'mnt/plus/f3')
+  File.write('mnt/plus/f4', 'longer content')
+  listing = `ls -l mnt/plus`
+  assert { listing.lines.any? { |l| l.start_with?('-rw-------') && l.end_with?(" f3\n") } }
+  assert { File.size('mnt/plus/f4') == 14 }
+  assert { (File.stat('mnt/plus/f3').mode & 0777) == 0600 }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-kernel --cache-kernel --cache-meta-ttl=1",
+        :title => "kernel cache test") do
+  File.write('src/kfile', 'first version')
+
+  2.times { assert { File.read('mnt/kfile') == 'first version' } }
+
+  # Change the source behind our back; once the TTL runs out the next
+  # open sees the new mtime and drops the kernel's copy
+  sleep 1.1
+  File.write('src/kfile', 'second version, longer')
+  sleep 1.5
+  assert { File.read('mnt/kfile') == 'second version, longer' }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-ident --cache-meta-ttl=60",
+        :title => "file identity keys test") do
+  Dir.mkdir('src/data')
+  File.write('src/data/file', 'a' * 100000)
+  assert { File.read('mnt/data/file') == 'a' * 100000 }
+
+  # Renamed files and directories keep serving the same content
+  File.rename('mnt/data', 'mnt/moved')
+  assert { File.read('mnt/moved/file') == 'a' * 100000 }
+  File.rename('mnt/moved/file', 'mnt/moved/renamed')
+  assert { File.read('mnt/moved/renamed') == 'a' * 100000 }
+
+  # Hard links share blocks, and writes through one show in the other
+  File.link('mnt/moved/renamed', 'mnt/moved/link')
+  assert { File.read('mnt/moved/link') == 'a' * 100000 }
+  File.open('mnt/moved/link', 'r+') { |f| f.write('b' * 10) }
+  assert { File.read('mnt/moved/renamed') == 'b' * 10 + 'a' * 99990 }
+  File.unlink('mnt/moved/link')
+  assert { File.read('mnt/moved/renamed') == 'b' * 10 + 'a' * 99990 }
+
+  # A file renamed over another replaces its content
+  File.write('src/moved/other', 'other content')
+  assert { File.read('mnt/moved/other') == 'other content' }
+  File.rename('mnt/moved/renamed', 'mnt/moved/other')
+  assert { File.read('mnt/moved/other') == 'b' * 10 + 'a' * 99990 }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-dedup --cache-dedup --cache-block-size=4096",
+        :title => "block dedup test") do
+  content = ('x' * 4096) * 8 + 'tail'
+  File.write('src/one', content)
+  File.write('src/two', content)
+
+  # Both files share stored blocks and still read back in full
+  assert { File.read('mnt/one') == content }
+  assert { File.read('mnt/two') == content }
+  assert { File.exist?('/tmp/cachefs-test-dedup/dedup.key') }
+
+  # Changing one copy leaves the other intact
+  File.open('mnt/one', 'r+') { |f| f.seek(4096); f.write('y' * 4096) }
+  assert { File.read('mnt/one') == ('x' * 4096) + ('y' * 4096) + ('x' * 4096) * 6 + 'tail' }
+  assert { File.read('mnt/two') == content }
+end
+
+if $have_lz4
+  testenv("--cache-root=/tmp/cachefs-test-compress --cache-compress=lz4 --cache-block-size=65536",
+          :title => "block compression test") do
+    text = 'compressible text ' * 20000
+    noise = Random.new(42).bytes(200000)
+    File.write('src/text', text)
+    File.write('src/noise', noise)
+
+    2.times do
+      assert { File.read('mnt/text') == text }
+      assert { File.binread('mnt/noise') == noise }
+    end
+
+    # Compressed blocks are complete; a write replaces them
+    File.open('mnt/text', 'r+') { |f| f.seek(70000); f.write('changed') }
+    text[70000, 7] = 'changed'
+    assert { File.read('mnt/text') == text }
+  end
+end
+
+testenv("--cache-root=/tmp/cachefs-test-readbuf --cache-block-size=4096",
+        :title => "spliced cache reads test") do
+  data = (0...50000).map { |i| (i * 7 % 256).chr }.join
+  File.binwrite('src/file', data)
+
+  # The second pass is served from block files; reads straddle blocks
+  2.times do
+    File.open('mnt/file', 'rb') do |f|
+      [[0, 50000], [4000, 200], [4095, 8194], [49990, 100]].each do |off, len|
+        f.seek(off)
+        assert { f.read(len) == data[off, len] }
+      end
+    end
+  end
+
+  File.open('mnt/file', 'r+b') { |f| f.seek(4090); f.write('z' * 20) }
+  data[4090, 20] = 'z' * 20
+  assert { File.binread('mnt/file') == data }
+end
+
+if $have_fuse_3
+  testenv("--cache-root=/tmp/cachefs-test-copyrange --cache-block-size=4096",
+          :title => "copy_file_range and fallocate test") do
+    data = (0...20000).map { |i| (i * 13 % 256).chr }.join
+    File.binwrite('src/file', data)
+    assert { File.binread('mnt/file') == data }
+
+    # Copied by the backend; cached source blocks are cloned to the copy
+    File.open('mnt/file', 'rb') do |src|
+      File.open('mnt/copy', 'wb') { |dst| IO.copy_stream(src, dst) }
+    end
+    assert { File.binread('mnt/copy') == data }
+    assert { File.binread('src/copy') == data }
+
+    # Writing the copy leaves the original alone
+    File.open('mnt/copy', 'r+b') { |f| f.seek(5000); f.write('q' * 10) }
+    copy = data.dup
+    copy[5000, 10] = 'q' * 10
+    assert { File.binread('mnt/copy') == copy }
+    assert { File.binread('mnt/file') == data }
+
+    # A punched hole reads back as zeros
+    if system("fallocate --help >/dev/null 2>&1")
+      system("fallocate -p -o 4096 -l 4096 mnt/copy")
+      copy[4096, 4096] = "\0" * 4096
+      assert { File.binread('mnt/copy') == copy }
+    end
+  end
+end
+
+if `uname`.strip == 'Linux'
+  testenv("--cache-root=/tmp/cachefs-test-watch --cache-watch --cache-dir-ttl=3600 --cache-meta-ttl=3600",
+          :title => "backend change notification test") do
+    Dir.mkdir('src/dir')
+    File.write('src/dir/file', 'before')
+    assert { Dir.entries('mnt/dir').sort == ['.', '..', 'file'] }
+    assert { File.read('mnt/dir/file') == 'before' }
+
+    # Changed behind the mount's back; the TTLs alone would hide it
+    File.write('src/dir/new', 'x')
+    File.write('src/dir/file', 'after!')
+    sleep 0.5
+    assert { Dir.entries('mnt/dir').sort == ['.', '..', 'file', 'new'] }
+    assert { File.size('mnt/dir/file') == 6 }
+    assert { File.read('mnt/dir/file') == 'after!' }
+
+    File.unlink('src/dir/new')
+    sleep 0.5
+    assert { !File.exist?('mnt/dir/new') }
+  end
+end
+
+  testenv("--cache-root=/tmp/cachefs-test-watch-own --cache-watch --cache-write-populate --cache-dir-ttl=3600 --cache-meta-ttl=3600",
+          :title => "backend change to a file open for writing test") do
+    File.write('src/file', 'a' * 8192)
+    File.open('mnt/file', 'r+') do |f|
+      f.write('b' * 100)
+      f.flush
+      sleep 0.5
+      assert { File.read('mnt/file', 100) == 'b' * 100 }
+
+      # Someone else's write to the open file still invalidates
+      File.write('src/file', 'c' * 8192)
+      sleep 0.5
+      assert { File.read('mnt/file') == 'c' * 8192 }
+    end
+  end
+
+  # A one-event queue overflows at once, dropping the change to the file
+  queued_events = '/proc/sys/fs/inotify/max_queued_events'
+  if Process.uid == 0 && File.writable?(queued_events)
+    old_limit = File.read(queued_events).strip
+    File.write(queued_events, '1')
+    begin
+      testenv("--cache-root=/tmp/cachefs-test-overflow --cache-watch --cache-kernel --cache-dir-ttl=3600 --cache-meta-ttl=3600",
+              :title => "watcher queue overflow test") do
+        Dir.mkdir('src/dir')
+        File.write('src/dir/file', 'before')
+        assert { File.read('mnt/dir/file') == 'before' }
+        assert { File.read('mnt/dir/file') == 'before' }
+        # A complete listing, which answers lookups of missing names
+        assert { Dir.entries('mnt/dir').sort == ['.', '..', 'file'] }
+
+        # Same size, so only the dropped event could tell
+        100.times { |i| File.write("src/dir/burst#{i}", 'x') }
+        File.write('src/dir/file', 'AFTER!')
+        File.write('src/dir/fresh', 'new')
+        sleep 0.5
+        assert { File.read('mnt/dir/file') == 'AFTER!' }
+        assert { File.read('mnt/dir/fresh') == 'new' }
+        assert { Dir.entries('mnt/dir').include?('fresh') }
+      end
+    ensure
+      File.write(queued_events, old_limit)
+    end
+  end
+
+testenv("--cache-root=/tmp/cachefs-test-absent --cache-dir-ttl=1 --cache-meta-ttl=1",
+        :title => "complete listing lookups test") do
+  Dir.mkdir('src/dir')
+  File.write('src/dir/a', 'a')
+  assert { Dir.entries('mnt/dir').sort == ['.', '..', 'a'] }
+
+  # Answered from the listing, and cleared by creating through the mount
+  assert { !File.exist?('mnt/dir/b') }
+  File.write('mnt/dir/b', 'b')
+  assert { File.read('mnt/dir/b') == 'b' }
+  File.rename('mnt/dir/b', 'mnt/dir/c')
+  assert { !File.exist?('mnt/dir/b') }
+  assert { File.exist?('mnt/dir/c') }
+
+  # Created outside the mount: visible once the listing expires
+  assert { Dir.entries('mnt/dir').sort == ['.', '..', 'a', 'c'] }
+  File.write('src/dir/d', 'd')
+  sleep 1.5
+  assert { File.read('mnt/dir/d') == 'd' }
+end
+
+if `which setfattr getfattr 2>/dev/null`.split("\n").size == 2
+  testenv("--cache-root=/tmp/cachefs-test-pin --cache-max-size=4M --cache-block-size=65536",
+          :title => "cache warming and pinning test") do
+    Dir.mkdir('src/keep')
+    Dir.mkdir('src/keep/sub')
+    File.write('src/keep/a', 'a' * 300000)
+    File.write('src/keep/sub/b', 'b' * 1000)
+    File.write('src/other', 'o' * (6 * 1024 * 1024))
+
+    `setfattr -n user.cachefs.pin mnt/keep 2>&1`
+    assert { $?.success? }
+    stats = `getfattr --only-values -n user.cachefs.pinned mnt 2>/dev/null`
+    assert { stats.include?('pinned_bytes=301000 pinned_files=2') }
+
+    # Scanning more than the cache holds leaves the pinned data alone
+    assert { File.read('mnt/other').size == 6 * 1024 * 1024 }
+    assert { File.read('mnt/keep/a') == 'a' * 300000 }
+    assert { File.read('mnt/keep/sub/b') == 'b' * 1000 }
+    assert { `getfattr --only-values -n user.cachefs.pinned mnt 2>/dev/null`.include?('pinned_bytes=301000') }
+
+    `setfattr -n user.cachefs.unpin mnt/keep 2>&1`
+    assert { $?.success? }
+    assert { `getfattr --only-values -n user.cachefs.pinned mnt 2>/dev/null`.include?('pinned_bytes=0 pinned_files=0') }
+
+    # Control attributes never reach the backend
+    `setfattr -n user.cachefs.warm mnt/keep 2>&1`
+    assert { $?.success? }
+    assert { !`getfattr -d src/keep 2>/dev/null`.include?('cachefs') }
+  end
+end
+
+testenv("--cache-root=/tmp/cachefs-test-stats --cache-stats-socket=/tmp/cachefs-test-stats.sock",
+        :title => "cache stats socket test") do
+  File.write('src/file', 'x' * 100000)
+  assert { File.read('mnt/file') == 'x' * 100000 }
+  assert { File.read('mnt/file') == 'x' * 100000 }
+
+  fetch = lambda do |request|
+    sock = UNIXSocket.new('/tmp/cachefs-test-stats.sock')
+    sock.write(request)
+    text = sock.read
+    sock.close
+    text
+  end
+
+  text = fetch.call("")
+  assert { text.include?('cachefs_op_duration_seconds_count{op="read"}') }
+  assert { text.include?('cachefs_block_hits_total') }
+  assert { text =~ /^cachefs_backend_read_bytes_total [1-9]/ }
+  assert { (File.stat('/tmp/cachefs-test-stats.sock').mode & 0777) == 0600 }
+
+  http = fetch.call("GET /metrics HTTP/1.0\r\n\r\n")
+  assert { http.start_with?('HTTP/1.0 200 OK') }
+  assert { http.include?('cachefs_stage_duration_seconds_bucket') }
+end
+
+File.write('/tmp/cachefs-test-stats-file', 'keep')
+testenv("--cache-root=/tmp/cachefs-test-stats --cache-stats-socket=/tmp/cachefs-test-stats-file",
+        :title => "cache stats socket spares other files") do
+  # Only a leftover socket is replaced; the mount serves without stats
+  assert { File.read('/tmp/cachefs-test-stats-file') == 'keep' }
+end
+File.unlink('/tmp/cachefs-test-stats-file')
+
+if $have_lmdb
+  testenv("--cache-root=/tmp/cachefs-test-lmdb --cache-meta-backend=lmdb",
+          :title => "lmdb metadata backend test") do
+    Dir.mkdir('src/dir')
+    File.write('src/dir/a', 'aaa')
+    File.write('src/dir/b', 'bb')
+
+    2.times do
+      assert { Dir.entries('mnt/dir').sort == ['.', '..', 'a', 'b'] }
+      assert { File.size('mnt/dir/a') == 3 }
+      assert { File.read('mnt/dir/b') == 'bb' }
+    end
+
+    # Renames and writes through the mount keep the store consistent
+    File.rename('mnt/dir', 'mnt/moved')
+    File.write('mnt/moved/a', 'changed')
+    assert { !File.exist?('mnt/dir/a') }
+    assert { File.read('mnt/moved/a') == 'changed' }
+    assert { File.size('mnt/moved/b') == 2 }
+
+    assert { File.exist?('/tmp/cachefs-test-lmdb/metadata.mdb') }
+    assert { !File.exist?('/tmp/cachefs-test-lmdb/metadata.db') }
+  end
+end
+
+testenv("--cache-root=/tmp/cachefs-test-rate --cache-block-size=4096 --read-rate=32k --rate-per-user",
+        :title => "read rate limit charges only backend reads") do
+  data = Random.new(5).bytes(64 * 1024)
+  File.binwrite('src/file', data)
+
+  start = Time.now
+  assert { File.binread('mnt/file') == data }
+  assert { Time.now - start >= 1.0 }
+
+  # Cached blocks are not throttled
+  start = Time.now
+  assert { File.binread('mnt/file') == data }
+  assert { Time.now - start < 0.5 }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-populate --cache-block-size=4096 --cache-write-populate " +
+        "--cache-stats-socket=/tmp/cachefs-test-populate.sock",
+        :title => "write-populate keeps written data cached") do
+  File.write('src/log', 'a' * 6000)
+  assert { File.read('mnt/log') == 'a' * 6000 }
+
+  # Appends and overwrites go to the backend and into the cached blocks
+  File.open('mnt/log', 'a') { |f| f.write('b' * 5000) }
+  File.open('mnt/log', 'r+') { |f| f.seek(100); f.write('c' * 10) }
+  expected = 'a' * 100 + 'c' * 10 + 'a' * 5890 + 'b' * 5000
+  assert { File.read('src/log') == expected }
+  assert { File.read('mnt/log') == expected }
+  assert { File.size('mnt/log') == 11000 }
+
+  sock = UNIXSocket.new('/tmp/cachefs-test-populate.sock')
+  sock.write('')
+  text = sock.read
+  sock.close
+  assert { text =~ /^cachefs_populated_bytes_total [1-9]/ }
+end
+
+if $have_io_uring
+  testenv("--cache-root=/tmp/cachefs-test-io --cache-block-size=4096 --cache-io=uring:8",
+          :title => "batched backend reads return the right blocks") do
+    data = Random.new(6).bytes(100 * 4096 + 123)
+    File.binwrite('src/file', data)
+
+    2.times do
+      assert { File.binread('mnt/file') == data }
+    end
+    # Runs that start and end inside a block
+    File.open('mnt/file', 'rb') do |f|
+      f.seek(4096 * 50 + 7)
+      assert { f.read(4096 * 20) == data[4096 * 50 + 7, 4096 * 20] }
+    end
+  end
+end
+
+testenv("--cache-root=/tmp/cachefs-test-stream --cache-block-size=4096 --cache-stream-bypass=64k " +
+        "--cache-stats-socket=/tmp/cachefs-test-stream.sock",
+        :title => "long sequential reads bypass the block cache") do
+  data = Random.new(7).bytes(512 * 1024)
+  File.binwrite('src/big', data)
+  File.binwrite('src/small', data[0, 16 * 1024])
+
+  2.times do
+    assert { File.binread('mnt/big') == data }
+    assert { File.binread('mnt/small') == data[0, 16 * 1024] }
+  end
+
+  sock = UNIXSocket.new('/tmp/cachefs-test-stream.sock')
+  sock.write('')
+  text = sock.read
+  sock.close
+  assert { text =~ /^cachefs_bypassed_bytes_total [1-9]/ }
+  assert { text =~ /^cachefs_block_hits_total [1-9]/ }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-crc --cache-block-size=4096 " +
+        "--cache-stats-socket=/tmp/cachefs-test-crc.sock",
+        :title => "damaged block files are dropped instead of served") do
+  data = Random.new(8).bytes(16 * 4096)
+  File.binwrite('src/file', data)
+  assert { File.binread('mnt/file') == data }
+
+  Dir.glob('/tmp/cachefs-test-crc/blocks/*/*/*').each do |f|
+    File.truncate(f, 100)
+  end
+  2.times do
+    assert { File.binread('mnt/file') == data }
+  end
+
+  sock = UNIXSocket.new('/tmp/cachefs-test-crc.sock')
+  sock.write('')
+  text = sock.read
+  sock.close
+  assert { text =~ /^cachefs_corrupt_blocks_total \d+/ }
+end
+
+testenv("--cache-root=/tmp/cachefs-test-shared-a --cache-block-size=4096 " +
+        "--cache-shared=/tmp/cachefs-test-shared",
+        :title => "mounts attached to one shared store read each other's blocks") do
+  data = Random.new(9).bytes(64 * 4096)
+  File.binwrite('src/file', data)
+  assert { File.binread('mnt/file') == data }
+
+  # A second mount of the same source, with a cache root of its own
+  FileUtils.mkdir_p 'mnt2'
+  cmd = ["../#{EXECUTABLE_PATH}", '-f', '--cache-root=/tmp/cachefs-test-shared-b',
+         '--cache-block-size=4096', '--cache-shared=/tmp/cachefs-test-shared',
+         '--cache-stats-socket=/tmp/cachefs-test-shared-b.sock']
+  cmd << '--no-allow-other' if Process.uid != 0
+  pid = Process.spawn(*cmd, 'src', 'mnt2')
+  begin
+    assert { wait_for { `mount`.include?("#{Dir.pwd}/mnt2") } }
+    assert { File.binread('mnt2/file') == data }
+
+    sock = UNIXSocket.new('/tmp/cachefs-test-shared-b.sock')
+    sock.write('')
+    text = sock.read
+    sock.close
+    assert { text =~ /^cachefs_block_hits_total [1-9]/ }
+
+    # Writes through the second mount invalidate the blocks in the store
+    File.binwrite('mnt2/file', 'x' * 4096)
+    assert { File.binread('mnt2/file') == 'x' * 4096 }
+  ensure
+    system("#{umount_cmd} mnt2")
+    Process.wait pid
+  end
+end